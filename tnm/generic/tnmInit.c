@@ -450,7 +450,8 @@ TnmInit(Tcl_Interp *interp, int safe)
         return TCL_ERROR;
     }
 
-    if (Tcl_PkgProvide(interp, "tnm", TNM_VERSION) != TCL_OK) {
+    if (Tcl_PkgProvideEx(interp, "tnm", TNM_VERSION,
+			 (ClientData) &tnmSnmpStubs) != TCL_OK) {
         return TCL_ERROR;
     }
 
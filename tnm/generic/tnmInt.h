@@ -229,6 +229,13 @@ TnmSetIpAddressObj	(Tcl_Obj *objPtr, struct in_addr *ipaddr);
 TNM_EXTERN struct in_addr*
 TnmgetIpAddressFromObj	(Tcl_Interp *interp, Tcl_Obj *objPtr);
 
+/*
+ * The table of SNMP agent functions which is passed as the client
+ * data of the tnm package (see tnmSnmp.h).
+ */
+
+TNM_EXTERN struct TnmSnmpStubs tnmSnmpStubs;
+
 /*
  *----------------------------------------------------------------
  * The following structure describes simple vector to hold 
@@ -471,6 +478,17 @@ TNM_EXTERN int
 TnmSocketRecvFrom	(int s, unsigned char *buf, size_t len, int flags,
 				     struct sockaddr *from, socklen_t *fromlen);
 TNM_EXTERN int
+TnmSocketConnect	(int s, struct sockaddr *name,
+				     socklen_t namelen);
+TNM_EXTERN int
+TnmSocketSend		(int s, unsigned char *buf, size_t len, int flags);
+TNM_EXTERN int
+TnmSocketRecv		(int s, unsigned char *buf, size_t len, int flags);
+TNM_EXTERN int
+TnmSocketSetNonBlocking	(int s);
+TNM_EXTERN int
+TnmSocketError		(int s);
+TNM_EXTERN int
 TnmSocketClose		(int s);
 
 typedef void (TnmSocketProc) (ClientData clientData, int mask);
@@ -0,0 +1,350 @@
+/*
+ * tnmAES.c --
+ *
+ *	This file implements the AES block cipher (FIPS-197) and the
+ *	128 bit cipher feedback mode (CFB128) as required by the AES
+ *	privacy protocol of the SNMPv3 user based security model
+ *	(RFC 3826). Only the encryption direction of the block cipher
+ *	is needed since CFB uses it for both directions.
+ *
+ *	The portable implementation uses the usual 32 bit lookup tables
+ *	which are computed once at runtime. On x86 processors which
+ *	support the AES instructions, blocks are encrypted with AES-NI.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#include "tnmInt.h"
+#include "tnmAES.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TNM_AES_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+#define GETU32(p) (((unsigned int) (p)[0] << 24) | ((unsigned int) (p)[1] << 16) \
+		   | ((unsigned int) (p)[2] << 8) | ((unsigned int) (p)[3]))
+#define PUTU32(p, v) { (p)[0] = (unsigned char) ((v) >> 24); \
+		       (p)[1] = (unsigned char) ((v) >> 16); \
+		       (p)[2] = (unsigned char) ((v) >> 8); \
+		       (p)[3] = (unsigned char) (v); }
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static unsigned char sbox[256];
+static unsigned int Te0[256], Te1[256], Te2[256], Te3[256];
+static int tablesInitialized = 0;
+
+#ifdef TNM_AES_NI
+static int aesni = -1;
+#endif
+
+static void
+InitTables		(void);
+
+static void
+EncryptBlock		(AES_CTX *ctx, unsigned char *in,
+			 unsigned char *out);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitTables --
+ *
+ *	This procedure computes the S-box and the combined SubBytes,
+ *	ShiftRows and MixColumns lookup tables.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The static tables are initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitTables(void)
+{
+    unsigned char p = 1, q = 1, x;
+    unsigned int s, s2, s3;
+    int i;
+
+    /*
+     * Walk through the multiplicative group using the generator 3
+     * and its inverse and apply the affine transformation.
+     */
+
+    do {
+	p = p ^ (p << 1) ^ ((p & 0x80) ? 0x1b : 0);
+	q ^= q << 1;
+	q ^= q << 2;
+	q ^= q << 4;
+	if (q & 0x80) {
+	    q ^= 0x09;
+	}
+	x = q ^ (unsigned char) ((q << 1) | (q >> 7))
+	      ^ (unsigned char) ((q << 2) | (q >> 6))
+	      ^ (unsigned char) ((q << 3) | (q >> 5))
+	      ^ (unsigned char) ((q << 4) | (q >> 4));
+	sbox[p] = x ^ 0x63;
+    } while (p != 1);
+    sbox[0] = 0x63;
+
+    for (i = 0; i < 256; i++) {
+	s = sbox[i];
+	s2 = ((s << 1) ^ ((s & 0x80) ? 0x1b : 0)) & 0xff;
+	s3 = s2 ^ s;
+	Te0[i] = (s2 << 24) | (s << 16) | (s << 8) | s3;
+	Te1[i] = ROTR(Te0[i], 8);
+	Te2[i] = ROTR(Te0[i], 16);
+	Te3[i] = ROTR(Te0[i], 24);
+    }
+
+#ifdef TNM_AES_NI
+    {
+	unsigned int eax, ebx, ecx, edx;
+	aesni = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES);
+    }
+#endif
+
+    tablesInitialized = 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmAESInit --
+ *
+ *	This procedure expands a 128, 192 or 256 bit key into the
+ *	encryption key schedule.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The context is initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmAESInit(AES_CTX *ctx, unsigned char *key, int keyLength)
+{
+    static const unsigned int rcon[] = {
+	0x01000000, 0x02000000, 0x04000000, 0x08000000, 0x10000000,
+	0x20000000, 0x40000000, 0x80000000, 0x1b000000, 0x36000000
+    };
+    unsigned int temp, *rk = ctx->rk;
+    int i, nk = keyLength / 4, total;
+
+    if (! tablesInitialized) {
+	InitTables();
+    }
+
+    ctx->rounds = nk + 6;
+    total = 4 * (ctx->rounds + 1);
+
+    for (i = 0; i < nk; i++) {
+	rk[i] = GETU32(key + 4 * i);
+    }
+    for (i = nk; i < total; i++) {
+	temp = rk[i - 1];
+	if (i % nk == 0) {
+	    temp = ((unsigned int) sbox[(temp >> 16) & 0xff] << 24)
+		 ^ ((unsigned int) sbox[(temp >> 8) & 0xff] << 16)
+		 ^ ((unsigned int) sbox[temp & 0xff] << 8)
+		 ^ ((unsigned int) sbox[temp >> 24])
+		 ^ rcon[i / nk - 1];
+	} else if (nk > 6 && i % nk == 4) {
+	    temp = ((unsigned int) sbox[temp >> 24] << 24)
+		 ^ ((unsigned int) sbox[(temp >> 16) & 0xff] << 16)
+		 ^ ((unsigned int) sbox[(temp >> 8) & 0xff] << 8)
+		 ^ ((unsigned int) sbox[temp & 0xff]);
+	}
+	rk[i] = rk[i - nk] ^ temp;
+    }
+
+    for (i = 0; i < total; i++) {
+	PUTU32(ctx->rkb + 4 * i, rk[i]);
+    }
+}
+
+#ifdef TNM_AES_NI
+/*
+ *----------------------------------------------------------------------
+ *
+ * EncryptBlockNI --
+ *
+ *	This procedure encrypts a single block using the AES-NI
+ *	instructions. It must only be called if the processor
+ *	supports them.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+__attribute__((target("aes,sse2")))
+static void
+EncryptBlockNI(AES_CTX *ctx, unsigned char *in, unsigned char *out)
+{
+    const __m128i *rk = (const __m128i *) ctx->rkb;
+    __m128i s;
+    int i;
+
+    s = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+		      _mm_loadu_si128(rk));
+    for (i = 1; i < ctx->rounds; i++) {
+	s = _mm_aesenc_si128(s, _mm_loadu_si128(rk + i));
+    }
+    s = _mm_aesenclast_si128(s, _mm_loadu_si128(rk + ctx->rounds));
+    _mm_storeu_si128((__m128i *) out, s);
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EncryptBlock --
+ *
+ *	This procedure encrypts a single 16 byte block.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EncryptBlock(AES_CTX *ctx, unsigned char *in, unsigned char *out)
+{
+    unsigned int s0, s1, s2, s3, t0, t1, t2, t3, *rk = ctx->rk;
+    int r;
+
+#ifdef TNM_AES_NI
+    if (aesni) {
+	EncryptBlockNI(ctx, in, out);
+	return;
+    }
+#endif
+
+    s0 = GETU32(in) ^ rk[0];
+    s1 = GETU32(in + 4) ^ rk[1];
+    s2 = GETU32(in + 8) ^ rk[2];
+    s3 = GETU32(in + 12) ^ rk[3];
+
+    for (r = 1; r < ctx->rounds; r++) {
+	rk += 4;
+	t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff]
+	   ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ rk[0];
+	t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff]
+	   ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ rk[1];
+	t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff]
+	   ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ rk[2];
+	t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff]
+	   ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ rk[3];
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+
+    rk += 4;
+    t0 = ((unsigned int) sbox[s0 >> 24] << 24)
+       ^ ((unsigned int) sbox[(s1 >> 16) & 0xff] << 16)
+       ^ ((unsigned int) sbox[(s2 >> 8) & 0xff] << 8)
+       ^ ((unsigned int) sbox[s3 & 0xff]) ^ rk[0];
+    t1 = ((unsigned int) sbox[s1 >> 24] << 24)
+       ^ ((unsigned int) sbox[(s2 >> 16) & 0xff] << 16)
+       ^ ((unsigned int) sbox[(s3 >> 8) & 0xff] << 8)
+       ^ ((unsigned int) sbox[s0 & 0xff]) ^ rk[1];
+    t2 = ((unsigned int) sbox[s2 >> 24] << 24)
+       ^ ((unsigned int) sbox[(s3 >> 16) & 0xff] << 16)
+       ^ ((unsigned int) sbox[(s0 >> 8) & 0xff] << 8)
+       ^ ((unsigned int) sbox[s1 & 0xff]) ^ rk[2];
+    t3 = ((unsigned int) sbox[s3 >> 24] << 24)
+       ^ ((unsigned int) sbox[(s0 >> 16) & 0xff] << 16)
+       ^ ((unsigned int) sbox[(s1 >> 8) & 0xff] << 8)
+       ^ ((unsigned int) sbox[s2 & 0xff]) ^ rk[3];
+
+    PUTU32(out, t0);
+    PUTU32(out + 4, t1);
+    PUTU32(out + 8, t2);
+    PUTU32(out + 12, t3);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmAESCfbEncrypt --
+ *
+ *	This procedure encrypts length bytes in CFB128 mode. The last
+ *	block may be shorter than 16 bytes. The input and the output
+ *	buffer may be the same.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The initialization vector is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmAESCfbEncrypt(AES_CTX *ctx, unsigned char iv[16], unsigned char *in, unsigned char *out, int length)
+{
+    unsigned char block[AES_BLOCKSIZE];
+    int i, n;
+
+    while (length > 0) {
+	EncryptBlock(ctx, iv, block);
+	n = length < AES_BLOCKSIZE ? length : AES_BLOCKSIZE;
+	for (i = 0; i < n; i++) {
+	    out[i] = in[i] ^ block[i];
+	    iv[i] = out[i];
+	}
+	in += n, out += n, length -= n;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmAESCfbDecrypt --
+ *
+ *	This procedure decrypts length bytes in CFB128 mode. The input
+ *	and the output buffer may be the same.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The initialization vector is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmAESCfbDecrypt(AES_CTX *ctx, unsigned char iv[16], unsigned char *in, unsigned char *out, int length)
+{
+    unsigned char block[AES_BLOCKSIZE], c;
+    int i, n;
+
+    while (length > 0) {
+	EncryptBlock(ctx, iv, block);
+	n = length < AES_BLOCKSIZE ? length : AES_BLOCKSIZE;
+	for (i = 0; i < n; i++) {
+	    c = in[i];
+	    out[i] = c ^ block[i];
+	    iv[i] = c;
+	}
+	in += n, out += n, length -= n;
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * tnmAES.h --
+ *
+ *	Definitions for the AES block cipher (FIPS-197) used in CFB128
+ *	mode by the SNMPv3 user based security model (RFC 3826).
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef _TNMAES
+#define _TNMAES
+
+#define AES_BLOCKSIZE		16
+#define AES_MAXROUNDS		14
+
+/*
+ * The AES context keeps the expanded encryption key schedule as
+ * 32 bit words (for the portable implementation) and as a byte
+ * array (for the AES-NI implementation).
+ */
+
+typedef struct {
+    int rounds;					/* 10, 12 or 14 */
+    unsigned int rk[4 * (AES_MAXROUNDS + 1)];	/* round key words */
+    unsigned char rkb[16 * (AES_MAXROUNDS + 1)];/* round key bytes */
+} AES_CTX;
+
+void TnmAESInit(AES_CTX *, unsigned char *, int);
+void TnmAESCfbEncrypt(AES_CTX *, unsigned char [16],
+		      unsigned char *, unsigned char *, int);
+void TnmAESCfbDecrypt(AES_CTX *, unsigned char [16],
+		      unsigned char *, unsigned char *, int);
+
+#endif /* _TNMAES */
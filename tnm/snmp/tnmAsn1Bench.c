@@ -0,0 +1,411 @@
+/*
+ * tnmAsn1Bench.c --
+ *
+ *	Microbenchmarks for the ASN.1/BER encoder and decoder. This
+ *	program is linked with tnmAsn1.c only and does not need the
+ *	Tcl library. The few Tcl functions used by the codec (memory
+ *	allocation and panic) are provided below. Every test case is
+ *	encoded, decoded and encoded again to make sure that the codec
+ *	still produces identical messages before the timings are taken.
+ *
+ *	Usage: asn1bench ?iterations?
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "tnmSnmp.h"
+
+#include <stdarg.h>
+
+/*
+ * The size of the message buffers used by the test cases.
+ */
+
+#define BENCH_MAXSIZE	TNM_SNMP_MAXSIZE
+
+/*
+ * The value types used by the test cases. A mixed test case cycles
+ * through the basic types found in typical responses.
+ */
+
+enum benchValues {
+    valueNull, valueMixed, valueCounter64
+};
+
+typedef struct BenchCase {
+    char *name;			/* The name printed in the report. */
+    int type;			/* The PDU type. */
+    int varbinds;		/* Number of varbinds. */
+    int values;			/* The kind of values (see above). */
+    int oidLength;		/* Length of the varbind names. */
+} BenchCase;
+
+static Tnm_Oid mib2[] = { 1, 3, 6, 1, 2, 1 };
+
+static BenchCase benchCases[] = {
+    { "get, 1 varbind",		ASN1_SNMP_GET,      1, valueNull,      10 },
+    { "get, 10 varbinds",	ASN1_SNMP_GET,     10, valueNull,      10 },
+    { "response, 1 varbind",	ASN1_SNMP_RESPONSE, 1, valueMixed,     10 },
+    { "response, 10 varbinds",	ASN1_SNMP_RESPONSE, 10, valueMixed,    10 },
+    { "response, 50 varbinds",	ASN1_SNMP_RESPONSE, 50, valueMixed,    12 },
+    { "response, 10 Counter64",	ASN1_SNMP_RESPONSE, 10, valueCounter64, 12 },
+    { "response, 10 long oids",	ASN1_SNMP_RESPONSE, 10, valueMixed,   100 },
+    { NULL, 0, 0, 0, 0 }
+};
+
+/*
+ * Forward declarations for procedures defined later in this file:
+ */
+
+static int
+EncodeMessage	(BenchCase *casePtr, u_char *packet, int size);
+static int
+DecodeMessage	(u_char *packet, int packetlen);
+static double
+Now		(void);
+
+/*
+ * The codec allocates memory and panics through the Tcl library.
+ * The following procedures replace the Tcl functions so that we do
+ * not depend on the Tcl library. A stubs enabled build calls them
+ * through a minimal stub table.
+ */
+
+#if TCL_MAJOR_VERSION > 8
+#define BENCH_ALLOC_SIZE size_t
+#define BENCH_ALLOC_TYPE void
+#else
+#define BENCH_ALLOC_SIZE unsigned int
+#define BENCH_ALLOC_TYPE char
+#endif
+
+static BENCH_ALLOC_TYPE *
+BenchAlloc(BENCH_ALLOC_SIZE size)
+{
+    BENCH_ALLOC_TYPE *ptr = malloc(size ? size : 1);
+
+    if (! ptr) {
+	fprintf(stderr, "asn1bench: out of memory\n");
+	exit(2);
+    }
+    return ptr;
+}
+
+static void
+BenchFree(BENCH_ALLOC_TYPE *ptr)
+{
+    free(ptr);
+}
+
+static void
+BenchPanic(const char *format, ...)
+{
+    va_list argList;
+
+    va_start(argList, format);
+    vfprintf(stderr, format, argList);
+    va_end(argList);
+    fprintf(stderr, "\n");
+    abort();
+}
+
+#ifdef USE_TCL_STUBS
+static TclStubs benchStubs;
+const TclStubs *tclStubsPtr = &benchStubs;
+#else
+BENCH_ALLOC_TYPE *Tcl_Alloc(BENCH_ALLOC_SIZE size) { return BenchAlloc(size); }
+void Tcl_Free(BENCH_ALLOC_TYPE *ptr) { BenchFree(ptr); }
+void Tcl_Panic(const char *format, ...)
+{
+    va_list argList;
+
+    va_start(argList, format);
+    vfprintf(stderr, format, argList);
+    va_end(argList);
+    abort();
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EncodeMessage --
+ *
+ *	This procedure encodes an SNMPv2c message for a test case
+ *	in the same way as TnmSnmpEncode does.
+ *
+ * Results:
+ *	The length of the encoded message or -1 on errors.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EncodeMessage(BenchCase *casePtr, u_char *packet, int size)
+{
+    TnmBer *stream, *ber;
+    Tnm_Oid oid[TNM_OID_MAX_SIZE];
+    u_char *msgToken, *pduToken, *vblToken, *vbToken;
+    int i, j, len = -1;
+
+    ber = stream = TnmBerCreate(packet, size);
+    ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &msgToken);
+    ber = TnmBerEncInt(ber, ASN1_INTEGER, TNM_SNMPv2C - 1);
+    ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, "public", 6);
+    ber = TnmBerEncSequenceStart(ber, (u_char) casePtr->type, &pduToken);
+    ber = TnmBerEncInt(ber, ASN1_INTEGER, 1234567);
+    ber = TnmBerEncInt(ber, ASN1_INTEGER, 0);
+    ber = TnmBerEncInt(ber, ASN1_INTEGER, 0);
+    ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &vblToken);
+
+    for (i = 0; i < casePtr->varbinds; i++) {
+	for (j = 0; j < casePtr->oidLength; j++) {
+	    oid[j] = (j < 6) ? mib2[j] : 1000 + 37 * (i + j);
+	}
+	oid[casePtr->oidLength - 1] = i;
+	ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &vbToken);
+	ber = TnmBerEncOID(ber, oid, casePtr->oidLength);
+	switch (casePtr->values) {
+	case valueNull:
+	    ber = TnmBerEncNull(ber, ASN1_NULL);
+	    break;
+	case valueCounter64:
+	    ber = TnmBerEncUnsigned64(ber, 18446744073709000000.0 - i);
+	    break;
+	case valueMixed:
+	    switch (i % 5) {
+	    case 0:
+		ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING,
+		   "Tnm SNMP agent version 3.1 (x86_64-Linux)", 41);
+		break;
+	    case 1:
+		ber = TnmBerEncInt(ber, ASN1_INTEGER, -4711 * i);
+		break;
+	    case 2:
+		ber = TnmBerEncInt(ber, ASN1_COUNTER32, 0x7ffffff0 + i);
+		break;
+	    case 3:
+		ber = TnmBerEncInt(ber, ASN1_TIMETICKS, 123456789);
+		break;
+	    case 4:
+		ber = TnmBerEncOID(ber, oid, 9);
+		break;
+	    }
+	    break;
+	}
+	ber = TnmBerEncSequenceEnd(ber, vbToken);
+    }
+
+    ber = TnmBerEncSequenceEnd(ber, vblToken);
+    ber = TnmBerEncSequenceEnd(ber, pduToken);
+    ber = TnmBerEncSequenceEnd(ber, msgToken);
+    if (ber) {
+	len = TnmBerSize(ber);
+    }
+    TnmBerDelete(stream);
+    return len;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecodeMessage --
+ *
+ *	This procedure decodes an SNMPv1/v2c message. The varbind
+ *	names are converted to strings as done by TnmSnmpDecode.
+ *
+ * Results:
+ *	The number of varbinds or -1 on errors.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DecodeMessage(u_char *packet, int packetlen)
+{
+    TnmBer *stream, *ber;
+    Tnm_Oid oid[TNM_OID_MAX_SIZE];
+    TnmUnsigned64 u;
+    u_char *msgToken, *pduToken, *vblToken, *vbToken, tag;
+    int msgLen, pduLen, vblLen, vbLen, oidLen, value, length, count = 0;
+    char *octets;
+
+    ber = stream = TnmBerCreate(packet, packetlen);
+    ber = TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &msgToken, &msgLen);
+    ber = TnmBerDecInt(ber, ASN1_INTEGER, &value);
+    ber = TnmBerDecOctetString(ber, ASN1_OCTET_STRING, &octets, &length);
+    if (! TnmBerDecPeek(ber, &tag)) {
+	goto error;
+    }
+    ber = TnmBerDecSequenceStart(ber, tag, &pduToken, &pduLen);
+    ber = TnmBerDecInt(ber, ASN1_INTEGER, &value);
+    ber = TnmBerDecInt(ber, ASN1_INTEGER, &value);
+    ber = TnmBerDecInt(ber, ASN1_INTEGER, &value);
+    ber = TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &vblToken, &vblLen);
+    if (! ber) {
+	goto error;
+    }
+
+    while (! TnmBerDecDone(ber)) {
+	ber = TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &vbToken, &vbLen);
+	ber = TnmBerDecOID(ber, oid, &oidLen);
+	if (! ber) {
+	    goto error;
+	}
+	(void) TnmOidToStr(oid, oidLen);
+	if (! TnmBerDecPeek(ber, &tag)) {
+	    goto error;
+	}
+	switch (tag) {
+	case ASN1_INTEGER:
+	case ASN1_COUNTER32:
+	case ASN1_GAUGE32:
+	case ASN1_TIMETICKS:
+	    ber = TnmBerDecInt(ber, tag, &value);
+	    break;
+	case ASN1_COUNTER64:
+	    ber = TnmBerDecUnsigned64(ber, &u);
+	    break;
+	case ASN1_OBJECT_IDENTIFIER:
+	    ber = TnmBerDecOID(ber, oid, &oidLen);
+	    if (ber) {
+		(void) TnmOidToStr(oid, oidLen);
+	    }
+	    break;
+	case ASN1_OCTET_STRING:
+	case ASN1_IPADDRESS:
+	case ASN1_OPAQUE:
+	    ber = TnmBerDecOctetString(ber, tag, &octets, &length);
+	    break;
+	default:
+	    ber = TnmBerDecNull(ber, tag);
+	    break;
+	}
+	ber = TnmBerDecSequenceEnd(ber, vbToken, vbLen);
+	if (! ber) {
+	    goto error;
+	}
+	count++;
+    }
+
+    ber = TnmBerDecSequenceEnd(ber, vblToken, vblLen);
+    ber = TnmBerDecSequenceEnd(ber, pduToken, pduLen);
+    ber = TnmBerDecSequenceEnd(ber, msgToken, msgLen);
+    if (! ber) {
+	goto error;
+    }
+    TnmBerDelete(stream);
+    return count;
+
+  error:
+    TnmBerDelete(stream);
+    return -1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Now --
+ *
+ *	This procedure returns the current time in microseconds.
+ *
+ * Results:
+ *	The current time.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static double
+Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * main --
+ *
+ *	This procedure checks and times all test cases.
+ *
+ * Results:
+ *	The exit code is 1 if a test case failed the round trip.
+ *
+ * Side effects:
+ *	The timings are written to stdout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+main(int argc, char *argv[])
+{
+    BenchCase *casePtr;
+    u_char packet[BENCH_MAXSIZE], check[BENCH_MAXSIZE];
+    int i, len, iterations = 100000, failed = 0;
+    double start, encode, decode;
+
+#ifdef USE_TCL_STUBS
+    benchStubs.tcl_Alloc = BenchAlloc;
+    benchStubs.tcl_Free = BenchFree;
+    benchStubs.tcl_Panic = BenchPanic;
+#endif
+
+    if (argc > 2 || (argc == 2 && (iterations = atoi(argv[1])) <= 0)) {
+	fprintf(stderr, "usage: %s ?iterations?\n", argv[0]);
+	return 2;
+    }
+
+    printf("%-24s %6s %12s %12s\n",
+	   "case", "bytes", "encode ns", "decode ns");
+
+    for (casePtr = benchCases; casePtr->name; casePtr++) {
+
+	/*
+	 * Check that the message survives a round trip unchanged.
+	 */
+
+	len = EncodeMessage(casePtr, packet, sizeof(packet));
+	if (len < 0 || DecodeMessage(packet, len) != casePtr->varbinds
+	    || EncodeMessage(casePtr, check, sizeof(check)) != len
+	    || memcmp(packet, check, (size_t) len) != 0) {
+	    printf("%-24s FAILED\n", casePtr->name);
+	    failed++;
+	    continue;
+	}
+
+	start = Now();
+	for (i = 0; i < iterations; i++) {
+	    EncodeMessage(casePtr, packet, sizeof(packet));
+	}
+	encode = (Now() - start) * 1000.0 / iterations;
+
+	start = Now();
+	for (i = 0; i < iterations; i++) {
+	    DecodeMessage(packet, len);
+	}
+	decode = (Now() - start) * 1000.0 / iterations;
+
+	printf("%-24s %6d %12.1f %12.1f\n",
+	       casePtr->name, len, encode, decode);
+    }
+
+    return failed ? 1 : 0;
+}
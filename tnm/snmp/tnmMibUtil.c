@@ -844,7 +844,6 @@ ScanIntTC(Tcl_Obj *val, char *fmt)
     switch (fmt[0]) {
     case 'd':
 	if (! fmt[1]) {
-	    Tcl_InvalidateStringRep(val);
 	    return NULL;
 	}
 	if (fmt[1] != '-') break;		/* invalid format string */
@@ -1478,7 +1477,7 @@ TnmMibGetValue(int syntax, Tcl_Obj *objPtr, TnmMibType *typePtr, Tcl_Obj **newPt
 	result = Tcl_GetIntFromObj(NULL, objPtr, &dummy);
 	if (result != TCL_OK && typePtr && newPtr) {
 	    *newPtr = TnmMibScanValue(typePtr, syntax, objPtr);
-	    if (newPtr) {
+	    if (*newPtr) {
 		result = Tcl_GetIntFromObj(NULL, *newPtr, &dummy);
 		if (result != TCL_OK) {
 		    Tcl_DecrRefCount(*newPtr);
@@ -0,0 +1,691 @@
+/*
+ * tnmSHA2.c --
+ *
+ *	This file implements the SHA-224, SHA-256, SHA-384 and SHA-512
+ *	hash functions as defined in FIPS 180-4. They are needed by the
+ *	HMAC-SHA-2 authentication protocols of the SNMPv3 user based
+ *	security model (RFC 7860).
+ *
+ *	On x86 processors which support the SHA extensions, the SHA-256
+ *	compression function is computed with the SHA-NI instructions.
+ *	SHA-224 and SHA-256 are then faster than the SHA-1 implementation
+ *	in tnmSHA.c.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#include "tnmInt.h"
+#include "tnmSHA2.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TNM_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define WIDE(x) ((Tcl_WideUInt) (x ## ULL))
+
+#define GETU32(p) (((unsigned int) (p)[0] << 24) | ((unsigned int) (p)[1] << 16) \
+		   | ((unsigned int) (p)[2] << 8) | ((unsigned int) (p)[3]))
+#define GETU64(p) (((Tcl_WideUInt) GETU32(p) << 32) | GETU32((p) + 4))
+#define PUTU32(p, v) { (p)[0] = (unsigned char) ((v) >> 24); \
+		       (p)[1] = (unsigned char) ((v) >> 16); \
+		       (p)[2] = (unsigned char) ((v) >> 8); \
+		       (p)[3] = (unsigned char) (v); }
+#define PUTU64(p, v) { PUTU32((p), (unsigned int) ((v) >> 32)); \
+		       PUTU32((p) + 4, (unsigned int) (v)); }
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+static const unsigned int K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const Tcl_WideUInt K512[80] = {
+    WIDE(0x428a2f98d728ae22), WIDE(0x7137449123ef65cd),
+    WIDE(0xb5c0fbcfec4d3b2f), WIDE(0xe9b5dba58189dbbc),
+    WIDE(0x3956c25bf348b538), WIDE(0x59f111f1b605d019),
+    WIDE(0x923f82a4af194f9b), WIDE(0xab1c5ed5da6d8118),
+    WIDE(0xd807aa98a3030242), WIDE(0x12835b0145706fbe),
+    WIDE(0x243185be4ee4b28c), WIDE(0x550c7dc3d5ffb4e2),
+    WIDE(0x72be5d74f27b896f), WIDE(0x80deb1fe3b1696b1),
+    WIDE(0x9bdc06a725c71235), WIDE(0xc19bf174cf692694),
+    WIDE(0xe49b69c19ef14ad2), WIDE(0xefbe4786384f25e3),
+    WIDE(0x0fc19dc68b8cd5b5), WIDE(0x240ca1cc77ac9c65),
+    WIDE(0x2de92c6f592b0275), WIDE(0x4a7484aa6ea6e483),
+    WIDE(0x5cb0a9dcbd41fbd4), WIDE(0x76f988da831153b5),
+    WIDE(0x983e5152ee66dfab), WIDE(0xa831c66d2db43210),
+    WIDE(0xb00327c898fb213f), WIDE(0xbf597fc7beef0ee4),
+    WIDE(0xc6e00bf33da88fc2), WIDE(0xd5a79147930aa725),
+    WIDE(0x06ca6351e003826f), WIDE(0x142929670a0e6e70),
+    WIDE(0x27b70a8546d22ffc), WIDE(0x2e1b21385c26c926),
+    WIDE(0x4d2c6dfc5ac42aed), WIDE(0x53380d139d95b3df),
+    WIDE(0x650a73548baf63de), WIDE(0x766a0abb3c77b2a8),
+    WIDE(0x81c2c92e47edaee6), WIDE(0x92722c851482353b),
+    WIDE(0xa2bfe8a14cf10364), WIDE(0xa81a664bbc423001),
+    WIDE(0xc24b8b70d0f89791), WIDE(0xc76c51a30654be30),
+    WIDE(0xd192e819d6ef5218), WIDE(0xd69906245565a910),
+    WIDE(0xf40e35855771202a), WIDE(0x106aa07032bbd1b8),
+    WIDE(0x19a4c116b8d2d0c8), WIDE(0x1e376c085141ab53),
+    WIDE(0x2748774cdf8eeb99), WIDE(0x34b0bcb5e19b48a8),
+    WIDE(0x391c0cb3c5c95a63), WIDE(0x4ed8aa4ae3418acb),
+    WIDE(0x5b9cca4f7763e373), WIDE(0x682e6ff3d6b2b8a3),
+    WIDE(0x748f82ee5defb2fc), WIDE(0x78a5636f43172f60),
+    WIDE(0x84c87814a1f0ab72), WIDE(0x8cc702081a6439ec),
+    WIDE(0x90befffa23631e28), WIDE(0xa4506cebde82bde9),
+    WIDE(0xbef9a3f7b2c67915), WIDE(0xc67178f2e372532b),
+    WIDE(0xca273eceea26619c), WIDE(0xd186b8c721c0c207),
+    WIDE(0xeada7dd6cde0eb1e), WIDE(0xf57d4f7fee6ed178),
+    WIDE(0x06f067aa72176fba), WIDE(0x0a637dc5a2c898a6),
+    WIDE(0x113f9804bef90dae), WIDE(0x1b710b35131c471b),
+    WIDE(0x28db77f523047d84), WIDE(0x32caab7b40c72493),
+    WIDE(0x3c9ebe0a15c9bebc), WIDE(0x431d67c49c100d4c),
+    WIDE(0x4cc5d4becb3e42b6), WIDE(0x597f299cfc657e2a),
+    WIDE(0x5fcb6fab3ad6faec), WIDE(0x6c44198c4a475817)
+};
+
+/*
+ * The procedure used to process SHA-256 blocks. It is selected
+ * when the first SHA-224 or SHA-256 context is initialized.
+ */
+
+typedef void (Sha256BlocksProc) (unsigned int *state,
+				 unsigned char *data, int blocks);
+
+static Sha256BlocksProc *sha256Blocks = NULL;
+
+/*
+ * Forward declarations for procedures defined later in this file:
+ */
+
+static void
+Sha256Blocks		(unsigned int *state, unsigned char *data,
+			 int blocks);
+static void
+Sha512Blocks		(Tcl_WideUInt *state, unsigned char *data,
+			 int blocks);
+static void
+Sha256Select		(void);
+static void
+Sha256Pad		(SHA256_CTX *ctx);
+static void
+Sha512Pad		(SHA512_CTX *ctx);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha256Blocks --
+ *
+ *	This procedure applies the SHA-256 compression function to
+ *	a number of 64 byte blocks.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash state is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha256Blocks(unsigned int *state, unsigned char *data, int blocks)
+{
+    unsigned int a, b, c, d, e, f, g, h, t1, t2, w[64];
+    int i;
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCKSIZE) {
+	for (i = 0; i < 16; i++) {
+	    w[i] = GETU32(data + 4 * i);
+	}
+	for (i = 16; i < 64; i++) {
+	    t1 = w[i - 2];
+	    t2 = w[i - 15];
+	    w[i] = (ROTR32(t1, 17) ^ ROTR32(t1, 19) ^ (t1 >> 10)) + w[i - 7]
+		 + (ROTR32(t2, 7) ^ ROTR32(t2, 18) ^ (t2 >> 3)) + w[i - 16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+	    t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25))
+		+ CH(e, f, g) + K256[i] + w[i];
+	    t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22))
+		+ MAJ(a, b, c);
+	    h = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef TNM_SHA_NI
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha256BlocksNI --
+ *
+ *	This procedure applies the SHA-256 compression function to
+ *	a number of 64 byte blocks using the SHA-NI instructions. It
+ *	must only be called if the processor supports them. The hash
+ *	state is kept in the ABEF/CDGH layout of the instructions
+ *	while the blocks are processed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash state is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define SHA_NI_ROUNDS(m, k) \
+    msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *) (K256 + (k)))); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    msg = _mm_shuffle_epi32(msg, 0x0e); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg)
+
+#define SHA_NI_SCHEDULE(m0, m1, m2, m3) \
+    m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), \
+			      _mm_alignr_epi8(m3, m2, 4)), m3)
+
+__attribute__((target("sha,sse4.1")))
+static void
+Sha256BlocksNI(unsigned int *state, unsigned char *data, int blocks)
+{
+    __m128i state0, state1, save0, save1, msg, tmp, m0, m1, m2, m3;
+    const __m128i mask = _mm_set_epi64x(WIDE(0x0c0d0e0f08090a0b),
+					WIDE(0x0405060700010203));
+    int i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) state), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) (state + 4)), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCKSIZE) {
+	save0 = state0;
+	save1 = state1;
+
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) data), mask);
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 16)), mask);
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 32)), mask);
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (data + 48)), mask);
+
+	SHA_NI_ROUNDS(m0, 0);
+	SHA_NI_ROUNDS(m1, 4);
+	SHA_NI_ROUNDS(m2, 8);
+	SHA_NI_ROUNDS(m3, 12);
+	for (i = 16; i < 64; i += 16) {
+	    SHA_NI_SCHEDULE(m0, m1, m2, m3);
+	    SHA_NI_ROUNDS(m0, i);
+	    SHA_NI_SCHEDULE(m1, m2, m3, m0);
+	    SHA_NI_ROUNDS(m1, i + 4);
+	    SHA_NI_SCHEDULE(m2, m3, m0, m1);
+	    SHA_NI_ROUNDS(m2, i + 8);
+	    SHA_NI_SCHEDULE(m3, m0, m1, m2);
+	    SHA_NI_ROUNDS(m3, i + 12);
+	}
+
+	state0 = _mm_add_epi32(state0, save0);
+	state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *) state, state0);
+    _mm_storeu_si128((__m128i *) (state + 4), state1);
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha256Select --
+ *
+ *	This procedure selects the SHA-NI implementation of the SHA-256
+ *	compression function if the processor supports it and the
+ *	portable implementation otherwise.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The sha256Blocks procedure pointer is initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha256Select(void)
+{
+    sha256Blocks = Sha256Blocks;
+
+#ifdef TNM_SHA_NI
+    {
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1)
+	    && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+	    && (ebx & bit_SHA)) {
+	    sha256Blocks = Sha256BlocksNI;
+	}
+    }
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA224Init, TnmSHA256Init --
+ *
+ *	These procedures initialize a SHA-224 or SHA-256 context.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The context is initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA224Init(SHA256_CTX *ctx)
+{
+    static const unsigned int iv[8] = {
+	0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939,
+	0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4
+    };
+
+    if (! sha256Blocks) {
+	Sha256Select();
+    }
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->count = 0;
+    ctx->local = 0;
+}
+
+void
+TnmSHA256Init(SHA256_CTX *ctx)
+{
+    static const unsigned int iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    if (! sha256Blocks) {
+	Sha256Select();
+    }
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->count = 0;
+    ctx->local = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA256Update --
+ *
+ *	This procedure adds data to a SHA-224 or SHA-256 hash. Complete
+ *	blocks are processed directly from the input buffer.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The context is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA256Update(SHA256_CTX *ctx, unsigned char *data, int length)
+{
+    int n;
+
+    ctx->count += (Tcl_WideUInt) length;
+
+    if (ctx->local) {
+	n = SHA256_BLOCKSIZE - ctx->local;
+	if (n > length) {
+	    n = length;
+	}
+	memcpy(ctx->data + ctx->local, data, (size_t) n);
+	ctx->local += n;
+	data += n, length -= n;
+	if (ctx->local < SHA256_BLOCKSIZE) {
+	    return;
+	}
+	sha256Blocks(ctx->state, ctx->data, 1);
+	ctx->local = 0;
+    }
+
+    n = length / SHA256_BLOCKSIZE;
+    if (n > 0) {
+	sha256Blocks(ctx->state, data, n);
+	data += n * SHA256_BLOCKSIZE;
+	length -= n * SHA256_BLOCKSIZE;
+    }
+
+    memcpy(ctx->data, data, (size_t) length);
+    ctx->local = length;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha256Pad --
+ *
+ *	This procedure appends the padding and the 64 bit message
+ *	length and processes the final block(s).
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash state holds the final hash value.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha256Pad(SHA256_CTX *ctx)
+{
+    Tcl_WideUInt bits = ctx->count << 3;
+
+    ctx->data[ctx->local++] = 0x80;
+    if (ctx->local > SHA256_BLOCKSIZE - 8) {
+	memset(ctx->data + ctx->local, 0,
+	       (size_t) (SHA256_BLOCKSIZE - ctx->local));
+	sha256Blocks(ctx->state, ctx->data, 1);
+	ctx->local = 0;
+    }
+    memset(ctx->data + ctx->local, 0,
+	   (size_t) (SHA256_BLOCKSIZE - 8 - ctx->local));
+    PUTU64(ctx->data + SHA256_BLOCKSIZE - 8, bits);
+    sha256Blocks(ctx->state, ctx->data, 1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA224Final, TnmSHA256Final --
+ *
+ *	These procedures pad the message and return the SHA-224 or
+ *	SHA-256 digest.
+ *
+ * Results:
+ *	The digest is written to digest.
+ *
+ * Side effects:
+ *	The context is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA224Final(unsigned char digest[28], SHA256_CTX *ctx)
+{
+    int i;
+
+    Sha256Pad(ctx);
+    for (i = 0; i < 7; i++) {
+	PUTU32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+void
+TnmSHA256Final(unsigned char digest[32], SHA256_CTX *ctx)
+{
+    int i;
+
+    Sha256Pad(ctx);
+    for (i = 0; i < 8; i++) {
+	PUTU32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha512Blocks --
+ *
+ *	This procedure applies the SHA-512 compression function to
+ *	a number of 128 byte blocks.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash state is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha512Blocks(Tcl_WideUInt *state, unsigned char *data, int blocks)
+{
+    Tcl_WideUInt a, b, c, d, e, f, g, h, t1, t2, w[80];
+    int i;
+
+    for (; blocks > 0; blocks--, data += SHA512_BLOCKSIZE) {
+	for (i = 0; i < 16; i++) {
+	    w[i] = GETU64(data + 8 * i);
+	}
+	for (i = 16; i < 80; i++) {
+	    t1 = w[i - 2];
+	    t2 = w[i - 15];
+	    w[i] = (ROTR64(t1, 19) ^ ROTR64(t1, 61) ^ (t1 >> 6)) + w[i - 7]
+		 + (ROTR64(t2, 1) ^ ROTR64(t2, 8) ^ (t2 >> 7)) + w[i - 16];
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 80; i++) {
+	    t1 = h + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41))
+		+ CH(e, f, g) + K512[i] + w[i];
+	    t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39))
+		+ MAJ(a, b, c);
+	    h = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA384Init, TnmSHA512Init --
+ *
+ *	These procedures initialize a SHA-384 or SHA-512 context.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The context is initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA384Init(SHA512_CTX *ctx)
+{
+    static const Tcl_WideUInt iv[8] = {
+	WIDE(0xcbbb9d5dc1059ed8), WIDE(0x629a292a367cd507),
+	WIDE(0x9159015a3070dd17), WIDE(0x152fecd8f70e5939),
+	WIDE(0x67332667ffc00b31), WIDE(0x8eb44a8768581511),
+	WIDE(0xdb0c2e0d64f98fa7), WIDE(0x47b5481dbefa4fa4)
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->count = 0;
+    ctx->local = 0;
+}
+
+void
+TnmSHA512Init(SHA512_CTX *ctx)
+{
+    static const Tcl_WideUInt iv[8] = {
+	WIDE(0x6a09e667f3bcc908), WIDE(0xbb67ae8584caa73b),
+	WIDE(0x3c6ef372fe94f82b), WIDE(0xa54ff53a5f1d36f1),
+	WIDE(0x510e527fade682d1), WIDE(0x9b05688c2b3e6c1f),
+	WIDE(0x1f83d9abfb41bd6b), WIDE(0x5be0cd19137e2179)
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->count = 0;
+    ctx->local = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA512Update --
+ *
+ *	This procedure adds data to a SHA-384 or SHA-512 hash. Complete
+ *	blocks are processed directly from the input buffer.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The context is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA512Update(SHA512_CTX *ctx, unsigned char *data, int length)
+{
+    int n;
+
+    ctx->count += (Tcl_WideUInt) length;
+
+    if (ctx->local) {
+	n = SHA512_BLOCKSIZE - ctx->local;
+	if (n > length) {
+	    n = length;
+	}
+	memcpy(ctx->data + ctx->local, data, (size_t) n);
+	ctx->local += n;
+	data += n, length -= n;
+	if (ctx->local < SHA512_BLOCKSIZE) {
+	    return;
+	}
+	Sha512Blocks(ctx->state, ctx->data, 1);
+	ctx->local = 0;
+    }
+
+    n = length / SHA512_BLOCKSIZE;
+    if (n > 0) {
+	Sha512Blocks(ctx->state, data, n);
+	data += n * SHA512_BLOCKSIZE;
+	length -= n * SHA512_BLOCKSIZE;
+    }
+
+    memcpy(ctx->data, data, (size_t) length);
+    ctx->local = length;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Sha512Pad --
+ *
+ *	This procedure appends the padding and the 128 bit message
+ *	length and processes the final block(s).
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash state holds the final hash value.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Sha512Pad(SHA512_CTX *ctx)
+{
+    ctx->data[ctx->local++] = 0x80;
+    if (ctx->local > SHA512_BLOCKSIZE - 16) {
+	memset(ctx->data + ctx->local, 0,
+	       (size_t) (SHA512_BLOCKSIZE - ctx->local));
+	Sha512Blocks(ctx->state, ctx->data, 1);
+	ctx->local = 0;
+    }
+    memset(ctx->data + ctx->local, 0,
+	   (size_t) (SHA512_BLOCKSIZE - 16 - ctx->local));
+    PUTU64(ctx->data + SHA512_BLOCKSIZE - 16, ctx->count >> 61);
+    PUTU64(ctx->data + SHA512_BLOCKSIZE - 8, ctx->count << 3);
+    Sha512Blocks(ctx->state, ctx->data, 1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSHA384Final, TnmSHA512Final --
+ *
+ *	These procedures pad the message and return the SHA-384 or
+ *	SHA-512 digest.
+ *
+ * Results:
+ *	The digest is written to digest.
+ *
+ * Side effects:
+ *	The context is destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSHA384Final(unsigned char digest[48], SHA512_CTX *ctx)
+{
+    int i;
+
+    Sha512Pad(ctx);
+    for (i = 0; i < 6; i++) {
+	PUTU64(digest + 8 * i, ctx->state[i]);
+    }
+}
+
+void
+TnmSHA512Final(unsigned char digest[64], SHA512_CTX *ctx)
+{
+    int i;
+
+    Sha512Pad(ctx);
+    for (i = 0; i < 8; i++) {
+	PUTU64(digest + 8 * i, ctx->state[i]);
+    }
+}
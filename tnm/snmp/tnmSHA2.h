@@ -0,0 +1,55 @@
+/*
+ * tnmSHA2.h --
+ *
+ *	Definitions for the SHA-224, SHA-256, SHA-384 and SHA-512 hash
+ *	functions (FIPS 180-4) used by the HMAC-SHA-2 authentication
+ *	protocols of the SNMPv3 user based security model (RFC 7860).
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifndef _TNMSHA2
+#define _TNMSHA2
+
+#define SHA256_BLOCKSIZE	64
+#define SHA224_DIGESTSIZE	28
+#define SHA256_DIGESTSIZE	32
+
+#define SHA512_BLOCKSIZE	128
+#define SHA384_DIGESTSIZE	48
+#define SHA512_DIGESTSIZE	64
+
+/*
+ * SHA-224 uses the SHA-256 context and SHA-384 uses the SHA-512
+ * context. They only differ in the initial hash value and in the
+ * length of the digest.
+ */
+
+typedef struct {
+    unsigned int state[8];			/* intermediate hash value */
+    Tcl_WideUInt count;				/* number of bytes hashed */
+    unsigned char data[SHA256_BLOCKSIZE];	/* unprocessed data */
+    int local;					/* unprocessed amount */
+} SHA256_CTX;
+
+typedef struct {
+    Tcl_WideUInt state[8];			/* intermediate hash value */
+    Tcl_WideUInt count;				/* number of bytes hashed */
+    unsigned char data[SHA512_BLOCKSIZE];	/* unprocessed data */
+    int local;					/* unprocessed amount */
+} SHA512_CTX;
+
+void TnmSHA224Init(SHA256_CTX *);
+void TnmSHA256Init(SHA256_CTX *);
+void TnmSHA256Update(SHA256_CTX *, unsigned char *, int);
+void TnmSHA224Final(unsigned char [28], SHA256_CTX *);
+void TnmSHA256Final(unsigned char [32], SHA256_CTX *);
+
+void TnmSHA384Init(SHA512_CTX *);
+void TnmSHA512Init(SHA512_CTX *);
+void TnmSHA512Update(SHA512_CTX *, unsigned char *, int);
+void TnmSHA384Final(unsigned char [48], SHA512_CTX *);
+void TnmSHA512Final(unsigned char [64], SHA512_CTX *);
+
+#endif /* _TNMSHA2 */
@@ -97,6 +97,9 @@ TNM_EXTERN TnmTable tnmSnmpErrorTable[];
 #define TNM_SNMP_TIMEOUT	5
 #define TNM_SNMP_WINDOW		10
 #define TNM_SNMP_DELAY		0
+#define TNM_SNMP_COALESCE	0
+#define TNM_SNMP_CACHESIZE	64
+#define TNM_SNMP_RATELIMIT	0
 
 /*
  *----------------------------------------------------------------
@@ -125,6 +128,42 @@ typedef struct TnmSnmpMark {
 TNM_EXTERN TnmSnmpMark tnmSnmpBenchMark;
 #endif
 
+/*
+ *----------------------------------------------------------------
+ * Histograms to keep track of the response times, the queue wait
+ * times and the number of retransmissions of requests. Values
+ * below 8 are counted exactly. Larger values are counted in 8
+ * buckets per power of two so that the relative error stays below
+ * 12.5%. Values are clamped to TNM_SNMP_HIST_MAX, which allows
+ * microsecond values of about one minute. A latency structure is
+ * kept for every session and for every destination address.
+ *----------------------------------------------------------------
+ */
+
+#define TNM_SNMP_HIST_BUCKETS	192
+#define TNM_SNMP_HIST_MAX	((1 << 26) - 1)
+#define TNM_SNMP_RETRY_BUCKETS	16
+
+typedef struct TnmSnmpHist {
+    u_int count;			/* Number of recorded values. */
+    u_int min;				/* The smallest recorded value. */
+    u_int max;				/* The largest recorded value. */
+    Tcl_WideUInt sum;			/* The sum of all values. */
+    u_int buckets[TNM_SNMP_HIST_BUCKETS];
+} TnmSnmpHist;
+
+typedef struct TnmSnmpLatency {
+    TnmSnmpHist rtt;			/* Response times (us). */
+    TnmSnmpHist wait;			/* Time spent in the queue (us). */
+    u_int retries[TNM_SNMP_RETRY_BUCKETS]; /* Retransmissions. */
+    u_int timeouts;			/* Requests without response. */
+} TnmSnmpLatency;
+
+#define TNM_SNMP_LATENCY_RTT	1
+#define TNM_SNMP_LATENCY_WAIT	2
+#define TNM_SNMP_LATENCY_RETRY	3
+#define TNM_SNMP_LATENCY_TIMEOUT 4
+
 /*
  *----------------------------------------------------------------
  * Definitions for the user based security model (USEC). See 
@@ -162,10 +201,17 @@ TNM_EXTERN TnmSnmpMark tnmSnmpBenchMark;
 #define TNM_SNMP_AUTH_NONE	0x00
 #define TNM_SNMP_AUTH_MD5	0x01
 #define TNM_SNMP_AUTH_SHA	0x02
+#define TNM_SNMP_AUTH_SHA224	0x03
+#define TNM_SNMP_AUTH_SHA256	0x04
+#define TNM_SNMP_AUTH_SHA384	0x05
+#define TNM_SNMP_AUTH_SHA512	0x06
 #define TNM_SNMP_AUTH_MASK	0x0f
 
 #define TNM_SNMP_PRIV_NONE	0x00
 #define TNM_SNMP_PRIV_DES	0x10
+#define TNM_SNMP_PRIV_AES	0x20
+#define TNM_SNMP_PRIV_AES192	0x30
+#define TNM_SNMP_PRIV_AES256	0x40
 #define TNM_SNMP_PRIV_MASK	0xf0
 
 extern TnmTable tnmSnmpSecurityLevelTable[];
@@ -183,6 +229,15 @@ extern TnmTable tnmSnmpSecurityLevelTable[];
 #define TNM_SNMP_UDP_DOMAIN	0x01
 #define TNM_SNMP_TCP_DOMAIN	0x02
 
+/*
+ * Generators and notifiers configured for the TCP domain send their
+ * messages over persistent TCP connections (RFC 3430). Responders
+ * and listeners always use UDP.
+ */
+
+#define TNM_SNMP_TCP(s) ((s)->domain == TNM_SNMP_TCP_DOMAIN \
+	&& ((s)->type == TNM_SNMP_GENERATOR || (s)->type == TNM_SNMP_NOTIFIER))
+
 extern TnmTable tnmSnmpDomainTable[];
 
 typedef struct TnmSnmpSocket {
@@ -192,11 +247,22 @@ typedef struct TnmSnmpSocket {
     struct sockaddr *peername;		/* peer name (if any) */
     int flags;				/* special flags (if any) */
     int refCount;			/* reference count */
+    u_int drops;			/* datagrams dropped by the kernel */
+    struct TnmSnmp *session;		/* responder session (if any) */
     struct TnmSnmpSocket *nextPtr;	/* pointer to next socket */
 } TnmSnmpSocket;
 
 TNM_EXTERN TnmSnmpSocket *tnmSnmpSocketList;
 
+/*
+ * The port (in network byte order) of the agent socket which received
+ * the request currently decoded or 0 if the request was not received
+ * on an agent socket. Requests are only passed to responders bound
+ * to this port.
+ */
+
+TNM_EXTERN unsigned short tnmSnmpAgentPort;
+
 TnmSnmpSocket*
 TnmSnmpOpen		(Tcl_Interp *interp, 
 				     struct sockaddr_in *addr);
@@ -237,11 +303,14 @@ typedef struct TnmSnmp {
     Tcl_Obj *engineID;		  /* The engine ID used by this session. */
     int engineBoots;		  /* The number of boots for this engine. */
     int engineTime;		  /* Time since last boot of this engine. */
+    int discoverId;		  /* Request id of an engine discovery. */
     int maxSize;		  /* The maximum message size. */
     Tcl_Obj *authPassWord;	  /* The password to compute the authKey. */
     Tcl_Obj *privPassWord;	  /* The password to compute the privKey. */
     Tcl_Obj *usmAuthKey;	  /* The USM authentication key. */
     Tcl_Obj *usmPrivKey;	  /* The USM privacy key. */
+    ClientData usmAuthCtx;	  /* The HMAC contexts of the usmAuthKey. */
+    ClientData usmPrivCtx;	  /* The AES key schedule of the usmPrivKey. */
     char securityLevel;		  /* The security level. */
 #ifdef TNM_SNMPv2U
     u_char qos;
@@ -257,16 +326,37 @@ typedef struct TnmSnmp {
     int timeout;                  /* Milliseconds before we timeout. */
     int window;                   /* Max. number of active async. requests. */
     int delay;                    /* Minimum delay between requests. */
+    int coalesce;                 /* Window to merge async get requests. */
+    struct Coalesce *coalescePtr; /* Get requests waiting to be merged. */
+    struct ResponseCache *cachePtr; /* Cached get responses (if any). */
+    u_int cacheHits;              /* Varbinds answered from the cache. */
+    u_int cacheMisses;            /* Varbinds requested from the agent. */
+    struct AgentCache *agentCachePtr; /* Answered requests (responders). */
+    int cacheSize;                /* Max. number of answered requests. */
     int active;                   /* Number of active async. requests. */
     int waiting;                  /* Number of waiting async. requests. */
+    u_int completed;              /* Number of completed async. requests. */
+    int cachePending;             /* Cache hits not yet delivered. */
+    u_int retransmits;            /* Number of retransmitted requests. */
+    TnmSnmpLatency *latencyPtr;   /* Latency histograms (if any). */
     Tcl_Obj *tagList;		  /* The tags associated with this session. */
     struct TnmSnmpBinding *bindPtr; /* Commands bound to this session. */
     Tcl_Interp *interp;		  /* Tcl interpreter owning this session. */
     Tcl_Command token;		  /* The command token used by Tcl. */
     TnmConfig *config;		  /* Option description for this session. */
     TnmSnmpSocket *socket;	  /* */
+    int reusePort;		  /* Bind the responder with SO_REUSEPORT. */
+    int rateLimit;		  /* Requests per second per manager. */
+    struct RateTable *rateTable;  /* Token buckets of the managers. */
+    u_int rateDrops;		  /* Requests dropped by the rate limit. */
+    Tcl_Obj *proxy;		  /* The upstream session of a proxy. */
+    int proxyMaxAge;		  /* Max. age of proxied varbinds (ms). */
+    Tcl_HashTable *proxyCache;	  /* Varbinds received from upstream. */
+    Tcl_HashTable *proxyPending;  /* Requests forwarded upstream. */
+    struct TnmSnmpSim *simPtr;	  /* The simulated agent (if any). */
     struct TnmSnmpNode *instPtr;  /* Root of the tree of MIB instances. */
     struct TnmSnmp *nextPtr;	  /* Pointer to next session. */
+    struct TnmSnmp *prevPtr;	  /* Pointer to previous session. */
 #ifdef TNM_SNMP_BENCH
     TnmSnmpMark stats;		  /* Statistics for the last SNMP operation. */
 #endif
@@ -274,12 +364,27 @@ typedef struct TnmSnmp {
 
 /*
  *----------------------------------------------------------------
- * This global variable points to a list of all sessions.
+ * This global variable points to a list of all sessions. The
+ * sessions are also indexed by their address so that the lookup
+ * of a session by handle or by command name does not need to
+ * scan the list.
  *----------------------------------------------------------------
  */
 
 TNM_EXTERN TnmSnmp *tnmSnmpList;
 
+TNM_EXTERN void
+TnmSnmpRegisterSession	(TnmSnmp *session);
+
+TNM_EXTERN void
+TnmSnmpUnregisterSession (TnmSnmp *session);
+
+TNM_EXTERN int
+TnmSnmpSessionValid	(TnmSnmp *session);
+
+TNM_EXTERN TnmSnmp*
+TnmSnmpFindSession	(Tcl_Interp *interp, const char *name);
+
 /*
  *----------------------------------------------------------------
  * The following function is used to normalize the Tcl 
@@ -333,6 +438,7 @@ typedef struct TnmSnmpPdu {
     int requestId;		/* A unique request id for this PDU.   */
     int errorStatus;		/* The SNMP error status field.        */
     int errorIndex;		/* The SNMP error index field.         */
+    int maxSize;		/* The msgMaxSize of the sender or 0.  */
     char *trapOID;		/* Trap object identifier.             */
 #ifdef TNM_SNMPv3
     int contextLength;
@@ -340,9 +446,7 @@ typedef struct TnmSnmpPdu {
     int engineIDLength;
     char *engineID;
 #endif
-#if 1
-    Tcl_Obj *vbList;		/* The list of varbinds as a Tcl_Obj.  */
-#endif
+    Tcl_Obj *vbList;		/* Decoded list of varbinds or NULL.   */
     Tcl_DString varbind;	/* The list of varbinds as Tcl string. */
 } TnmSnmpPdu;
 
@@ -365,6 +469,11 @@ typedef struct TnmSnmpRequest {
     TnmSnmpRequestProc *proc;        /* The callback functions. */
     ClientData clientData;           /* The argument of the callback. */
     struct TnmSnmpRequest *nextPtr;  /* Pointer to next pending request. */
+    struct TnmSnmpRequest *prevPtr;  /* Pointer to previous request. */
+    struct TnmSnmpRequest *idNextPtr; /* Next request with the same id. */
+    Tcl_Time queued;		     /* Time when the request was queued. */
+    Tcl_Time sent;		     /* Time of the first send operation. */
+    struct TcpConn *connPtr;	     /* The TCP connection (if any). */
 #ifdef TNM_SNMP_BENCH
     TnmSnmpMark stats;              /* Statistics for this SNMP operation. */
 #endif
@@ -385,9 +494,27 @@ TnmSnmpQueueRequest	(TnmSnmp *session,
 TNM_EXTERN void
 TnmSnmpDeleteRequest	(TnmSnmpRequest *request);
 
+TNM_EXTERN void
+TnmSnmpExpireRequests	(struct TcpConn *connPtr);
+
+TNM_EXTERN int
+TnmSnmpQueueLength	(void);
+
 TNM_EXTERN int
 TnmSnmpGetRequestId	(void);
 
+TNM_EXTERN u_int
+TnmSnmpElapsed		(Tcl_Time *start);
+
+TNM_EXTERN void
+TnmSnmpLatencyRecord	(TnmSnmp *session, int what, u_int value);
+
+TNM_EXTERN Tcl_Obj*
+TnmSnmpLatencyGet	(TnmSnmp *session);
+
+TNM_EXTERN void
+TnmSnmpLatencyReset	(TnmSnmp *session);
+
 /*
  *----------------------------------------------------------------
  * The event types currently supported for SNMP bindings.
@@ -438,12 +565,44 @@ TNM_EXTERN int
 TnmSnmpEvalBinding	(Tcl_Interp *interp, TnmSnmp *session,
                                      TnmSnmpPdu *pdu, int event);
 
+/*
+ *----------------------------------------------------------------
+ * A value provider supplies the value of an instance without a
+ * Tcl variable. The get procedure returns a string which must stay
+ * valid until the next call and may use the buffer passed in,
+ * which has room for TNM_SNMP_VALUESIZE bytes. The set procedure
+ * is NULL for read-only providers. The free procedure is called
+ * with the provider data when the instance is removed.
+ *----------------------------------------------------------------
+ */
+
+#define TNM_SNMP_VALUESIZE	64
+
+struct TnmSnmpNode;
+struct TnmSnmpTable;
+
+typedef const char* (TnmSnmpGetValueProc)	(struct TnmSnmpNode *inst,
+						 char *buffer);
+typedef int (TnmSnmpSetValueProc)	(Tcl_Interp *interp,
+					 struct TnmSnmpNode *inst,
+					 const char *value);
+typedef void (TnmSnmpFreeValueProc)	(ClientData clientData);
+
+typedef struct TnmSnmpProvider {
+    char *name;				/* Name of the provider.    */
+    TnmSnmpGetValueProc *getProc;	/* Reads the value.	    */
+    TnmSnmpSetValueProc *setProc;	/* Writes the value.	    */
+    TnmSnmpFreeValueProc *freeProc;	/* Frees the provider data. */
+} TnmSnmpProvider;
+
 /*
  *----------------------------------------------------------------
  * Structure to describe a MIB node known by a session handle.
  * MIB nodes are either used to keep information about session 
  * bindings or to store data needed to process incoming SNMP 
- * requests in the agent role.
+ * requests in the agent role. The children of a node are kept
+ * in an array sorted by sub identifier so that every tree level
+ * is searched with a binary search.
  *----------------------------------------------------------------
  */
 
@@ -455,8 +614,14 @@ typedef struct TnmSnmpNode {
     char *tclVarName;			/* Tcl variable name.	    */
     TnmSnmpBinding *bindings;		/* List of bindings.        */ 
     u_int subid;			/* Sub identifier in Tree.  */
-    struct TnmSnmpNode *childPtr;       /* List of child nodes.	    */
-    struct TnmSnmpNode *nextPtr;	/* List of peer node.	    */
+    struct TnmSnmpNode *parentPtr;	/* Parent node in the tree. */
+    struct TnmSnmpNode **childv;	/* Children sorted by subid. */
+    int numChildren;			/* Number of child nodes.   */
+    int maxChildren;			/* Size of the childv array. */
+    struct TnmSnmpNode *varNextPtr;	/* Next node of same var.   */
+    TnmSnmpProvider *providerPtr;	/* Value provider or NULL.  */
+    ClientData providerData;		/* Data of the provider.    */
+    struct TnmSnmpTable *tablePtr;	/* Table served below node. */
 } TnmSnmpNode;
 
 TNM_EXTERN int
@@ -468,6 +633,94 @@ TnmSnmpFindNode		(TnmSnmp *session, TnmOid *oidPtr);
 TNM_EXTERN TnmSnmpNode*
 TnmSnmpFindNextNode	(TnmSnmp *session, TnmOid *oidPtr);
 
+TNM_EXTERN TnmSnmpNode*
+TnmSnmpNextNode		(TnmSnmp *session, TnmSnmpNode *inst);
+
+TNM_EXTERN unsigned long tnmSnmpInstEpoch;
+
+TNM_EXTERN TnmSnmpNode*
+TnmSnmpCreateProviderNode (Tcl_Interp *interp, char *label,
+				     TnmSnmpProvider *providerPtr,
+				     ClientData clientData);
+TNM_EXTERN void
+TnmSnmpDeleteProviderNode (TnmSnmpNode *inst);
+
+TNM_EXTERN const char*
+TnmSnmpGetNodeValue	(Tcl_Interp *interp, TnmSnmpNode *inst,
+				     char *buffer);
+TNM_EXTERN int
+TnmSnmpSetNodeValue	(Tcl_Interp *interp, TnmSnmpNode *inst,
+				     const char *value);
+
+/*
+ *----------------------------------------------------------------
+ * Conceptual tables can be served from a Tcl array, a Tcl dict or
+ * a row command without creating instances for every cell. The
+ * cells of a table are represented by temporary nodes which live
+ * until the agent releases them at the end of a request. The rows
+ * of a row command are listed again after TNM_SNMP_TABLE_MAXAGE
+ * milliseconds unless another age is given.
+ *----------------------------------------------------------------
+ */
+
+#define TNM_SNMP_TABLE_MAXAGE	1000
+
+TNM_EXTERN int
+TnmSnmpCreateTable	(Tcl_Interp *interp, char *label,
+				     char *varName, Tcl_Obj *cmdObj,
+				     int maxAge);
+TNM_EXTERN int
+TnmSnmpDeleteTable	(Tcl_Interp *interp, char *label);
+
+TNM_EXTERN int
+TnmSnmpGetTable		(Tcl_Interp *interp, char *label);
+
+TNM_EXTERN TnmSnmpNode*
+TnmSnmpMarkCells	(void);
+
+TNM_EXTERN void
+TnmSnmpReleaseCells	(TnmSnmpNode *markPtr);
+
+TNM_EXTERN TnmSnmpProvider tnmSnmpUnsigned32Provider;
+TNM_EXTERN TnmSnmpProvider tnmSnmpUnsigned64Provider;
+TNM_EXTERN TnmSnmpProvider tnmSnmpObjProvider;
+
+/*
+ *----------------------------------------------------------------
+ * The table of provider functions is passed as the client data of
+ * the tnm package so that other extensions can register instances
+ * without linking against the Tnm library:
+ *
+ *	TnmSnmpStubs *stubsPtr;
+ *	if (Tcl_PkgRequireEx(interp, "tnm", "3.0", 0, 
+ *			     (void *) &stubsPtr) == NULL
+ *	    || stubsPtr->magic != TNM_SNMP_STUBS_MAGIC) ...
+ *
+ * The unsigned providers expect a pointer to the counter (which
+ * may live in shared memory). The object provider expects a
+ * Tcl_Obj and takes over one reference to it.
+ *----------------------------------------------------------------
+ */
+
+#define TNM_SNMP_STUBS_MAGIC	0x546e6d50
+
+typedef struct TnmSnmpStubs {
+    int magic;
+    TnmSnmpNode* (*createProviderNode) (Tcl_Interp *interp, char *label,
+				TnmSnmpProvider *providerPtr,
+				ClientData clientData);
+    void (*deleteProviderNode) (TnmSnmpNode *inst);
+    const char* (*getNodeValue) (Tcl_Interp *interp, TnmSnmpNode *inst,
+				 char *buffer);
+    int (*setNodeValue) (Tcl_Interp *interp, TnmSnmpNode *inst,
+			 const char *value);
+    TnmSnmpProvider *unsigned32Provider;
+    TnmSnmpProvider *unsigned64Provider;
+    TnmSnmpProvider *objProvider;
+} TnmSnmpStubs;
+
+TNM_EXTERN TnmSnmpStubs tnmSnmpStubs;
+
 TNM_EXTERN int
 TnmSnmpSetNodeBinding	(TnmSnmp *session, TnmOid *oidPtr,
 				     int event, char *command);
@@ -533,6 +786,18 @@ typedef struct TnmSnmpStats {
     u_int snmpStatsSilentDrops;
     /* snmpV1BadCommunityNames is the same as snmpInBadCommunityNames */
     /* snmpV1BadCommunityUses  is the same as snmpInBadCommunityUses  */
+    /* RFC 3414 */
+    u_int usmStatsUnknownEngineIDs;
+    u_int usmStatsWrongDigests;
+    u_int usmStatsDecryptionErrors;
+    /* Tnm engine counters */
+    u_int tnmRetransmits;
+    u_int tnmTimeouts;
+    u_int tnmRateDrops;
+    u_int tnmConnects;
+    u_int tnmConnectErrors;
+    u_int tnmSocketOverflows;
+    u_int tnmLateResponses;
 #ifdef TNM_SNMPv2U
     u_int usecStatsUnsupportedQoS;
     u_int usecStatsNotInWindows;
@@ -552,6 +817,15 @@ typedef struct TnmSnmpStats {
 
 TNM_EXTERN TnmSnmpStats tnmSnmpStats;
 
+TNM_EXTERN Tcl_Obj*
+TnmSnmpStatsGet		(const char *pattern);
+
+TNM_EXTERN void
+TnmSnmpStatsReset	(void);
+
+TNM_EXTERN Tcl_Obj*
+TnmSnmpQueueGet		(Tcl_Interp *interp, const char *pattern);
+
 /*
  *----------------------------------------------------------------
  * Exported SNMP procedures:
@@ -569,11 +843,19 @@ TnmSnmpEncode		(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *pdu, TnmSnmpRequestProc *proc,
 				     ClientData clientData);
 TNM_EXTERN int
+TnmSnmpMessageSize	(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *pdu);
+TNM_EXTERN int
+TnmSnmpVarBindSize	(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *pdu, const char *varbinds);
+TNM_EXTERN int
 TnmSnmpDecode		(Tcl_Interp *interp, 
 				     u_char *packet, int packetlen,
 				     struct sockaddr_in *from,
 				     TnmSnmp *session, int *reqid,
 				     int *status, int *index);
+TNM_EXTERN int
+TnmSnmpPeekResponse	(u_char *packet, int packetlen, int *id);
 TNM_EXTERN void
 TnmSnmpTimeoutProc	(ClientData clientData);
 
@@ -583,11 +865,31 @@ TnmSnmpAgentInit	(Tcl_Interp *interp,
 TNM_EXTERN int
 TnmSnmpAgentRequest	(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *pdu);
+TNM_EXTERN void
+TnmSnmpAgentCacheFlush	(TnmSnmp *session);
+
+TNM_EXTERN int
+TnmSnmpAgentCacheEntries	(TnmSnmp *session);
+
+TNM_EXTERN TnmSnmp*
+TnmSnmpProxySession	(Tcl_Interp *interp, Tcl_Obj *nameObj);
+
+TNM_EXTERN int
+TnmSnmpSimulate		(Tcl_Interp *interp, TnmSnmp *session,
+				     int objc, Tcl_Obj *const objv[]);
+TNM_EXTERN void
+TnmSnmpSimFree		(TnmSnmp *session);
+
 TNM_EXTERN int
 TnmSnmpEvalCallback	(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *pdu,
 				     char *cmd, char *instance, char *oid, 
 				     char *value, char* oldValue);
+TNM_EXTERN int
+TnmSnmpEvalCommand	(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *pdu, Tcl_Obj *cmdPrefix);
+TNM_EXTERN Tcl_Obj*
+TnmSnmpPduVarbinds	(TnmSnmpPdu *pdu);
 
 /*
  *----------------------------------------------------------------
@@ -604,6 +906,19 @@ TnmSnmpManagerOpen	(Tcl_Interp	*interp);
 TNM_EXTERN void
 TnmSnmpManagerClose	(void);
 
+/*
+ *----------------------------------------------------------------
+ * The kernel buffer sizes of the manager sockets and the number
+ * of sockets used for asynchronous requests are configurable.
+ *----------------------------------------------------------------
+ */
+
+TNM_EXTERN int
+TnmSnmpManagerConfig	(Tcl_Interp *interp, int rcvbuf, int sndbuf,
+			     int sockets);
+TNM_EXTERN void
+TnmSnmpManagerGetConfig	(int *rcvbuf, int *sndbuf, int *sockets);
+
 /*
  *----------------------------------------------------------------
  * Create and close a socket used for notification listener
@@ -667,11 +982,14 @@ TnmSnmpSend		(Tcl_Interp *interp,
 				     u_char *packet, int packetlen,
 				     struct sockaddr_in *to, int flags);
 TNM_EXTERN int
-TnmSnmpRecv		(Tcl_Interp *interp, 
+TnmSnmpRecv		(Tcl_Interp *interp, TnmSnmp *session,
 				     u_char *packet, int *packetlen,
 				     struct sockaddr_in *from, int flags);
 TNM_EXTERN int 
-TnmSnmpWait		(int ms, int flags);
+TnmSnmpWait		(TnmSnmp *session, int ms, int flags);
+
+TNM_EXTERN void
+TnmSnmpReleaseConn	(TnmSnmpRequest *request);
 
 TNM_EXTERN void
 TnmSnmpDelay		(TnmSnmp *session);
@@ -693,13 +1011,46 @@ TnmSnmpMD5Digest	(u_char *packet, int packetlen,
 TNM_EXTERN void
 TnmSnmpComputeKeys	(TnmSnmp *session);
 
+TNM_EXTERN void
+TnmSnmpEngineUpdate	(struct sockaddr_in *addr, 
+				     char *engineID, int engineIDLength,
+				     int engineBoots, int engineTime);
+TNM_EXTERN int
+TnmSnmpEngineLookup	(TnmSnmp *session);
+
+TNM_EXTERN Tcl_Obj*
+TnmSnmpEngineGet	(void);
+
+TNM_EXTERN int
+TnmSnmpEngineSet	(Tcl_Interp *interp, Tcl_Obj *listPtr);
+
 TNM_EXTERN void
 TnmSnmpComputeDigest	();
 
+TNM_EXTERN int
+TnmSnmpAuthLength	(int algorithm);
+
 TNM_EXTERN void
-TnmSnmpAuthOutMsg	(int algorithm, Tcl_Obj *authKey,
+TnmSnmpAuthOutMsg	(TnmSnmp *session, int algorithm,
 				     u_char *msg, int msgLen,
 				     u_char *msgAuthenticationParameters);
+
+TNM_EXTERN int
+TnmSnmpAuthInMsg	(TnmSnmp *session, int algorithm,
+				     u_char *msg, int msgLen,
+				     u_char *msgAuthenticationParameters);
+
+TNM_EXTERN void
+TnmSnmpPrivSalt		(u_char *salt);
+
+TNM_EXTERN int
+TnmSnmpPrivOutMsg	(TnmSnmp *session, int algorithm,
+				     int engineBoots, int engineTime,
+				     u_char *salt, u_char *data, int length);
+TNM_EXTERN int
+TnmSnmpPrivInMsg	(TnmSnmp *session, int algorithm,
+				     int engineBoots, int engineTime,
+				     u_char *salt, u_char *data, int length);
 #endif
 
 #ifdef TNM_SNMPv2U
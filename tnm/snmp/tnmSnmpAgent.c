@@ -21,21 +21,38 @@
 #include "tnmMib.h"
 
 /*
- * The following structure is used to implement a cache that
- * is used to remember queries so that we can respond to
+ * The following structures are used to implement a cache that
+ * is used to remember answered requests so that we can respond to
  * retries quickly. This is needed because side effects can
- * break the agent down if we do them for each retry.
+ * break the agent down if we do them for each retry. Every responder
+ * session has a hash table keyed by the source address and the
+ * request id. A digest of the request varbinds makes sure that a
+ * reused request id does not hit a different request. The elements
+ * are kept in FIFO order to limit the cache to cacheSize elements.
  */
 
+typedef struct CacheKey {
+    unsigned int addr;		/* The IPv4 address of the manager. */
+    unsigned int port;		/* The port number of the manager. */
+    int requestId;		/* The request id of the request. */
+} CacheKey;
+
 typedef struct CacheElement {
-    TnmSnmp *session;
-    TnmSnmpPdu request;
-    TnmSnmpPdu response;
-    time_t timestamp;
+    Tcl_HashEntry *entryPtr;	/* The entry in the hash table. */
+    unsigned int digest;	/* The digest of the request varbinds. */
+    int length;			/* The length of the request varbinds. */
+    TnmSnmpPdu response;	/* The response sent to the manager. */
+    time_t timestamp;		/* The time when the request arrived. */
+    struct CacheElement *nextPtr; /* The next younger element. */
 } CacheElement;
 
-#define CACHE_SIZE 64
-static CacheElement cache[CACHE_SIZE];
+typedef struct AgentCache {
+    Tcl_HashTable table;	/* The elements indexed by CacheKey. */
+    CacheElement *firstPtr;	/* The oldest element. */
+    CacheElement *lastPtr;	/* The youngest element. */
+} AgentCache;
+
+#define CACHE_LIFETIME 5
 
 /*
  * Flags used by the SNMP set processing code to keep state information
@@ -44,19 +61,127 @@ static CacheElement cache[CACHE_SIZE];
 
 #define NODE_CREATED 0x01
 
+/*
+ * The number of bytes reserved for the growth of the length fields
+ * of the enclosing sequences when getbulk responses are filled up
+ * to the maximum message size.
+ */
+
+#define BULK_HEADROOM 16
+
+/*
+ * The following structures are used by responders which forward
+ * requests to an upstream generator session. Identical requests
+ * which arrive while a request is forwarded are queued on the
+ * pending request instead of being forwarded again. The varbinds
+ * received from upstream are kept in a cache keyed by the request
+ * type and the requested object identifier (or the whole request
+ * for getbulk requests) for proxyMaxAge milliseconds.
+ */
+
+typedef struct ProxyWaiter {
+    struct sockaddr_in addr;	/* The address of the manager. */
+    int requestId;		/* The request id used by the manager. */
+    struct ProxyWaiter *nextPtr; /* The next waiting manager. */
+} ProxyWaiter;
+
+typedef struct ProxyPending {
+    TnmSnmp *session;		/* The responder session. */
+    Tcl_HashEntry *entryPtr;	/* The entry in the pending table. */
+    int type;			/* The type of the forwarded request. */
+    Tcl_DString key;		/* The key of the request. */
+    Tcl_DString varbind;	/* The varbinds of the request. */
+    time_t timestamp;		/* The time the request was forwarded. */
+    ProxyWaiter *waitPtr;	/* The managers waiting for the answer. */
+} ProxyPending;
+
+typedef struct ProxyEntry {
+    Tcl_Obj *vbObj;		/* The varbind(s) received from upstream. */
+    Tcl_Time stamp;		/* The time the varbinds were received. */
+} ProxyEntry;
+
+#define PROXY_CACHESIZE 4096
+
+/*
+ * The following structures are used by responders which simulate
+ * an agent with the varbinds of a recorded walk. The varbinds are
+ * kept in an array sorted by object identifier which is shared by
+ * all responders that loaded the same file. Rules attached to
+ * subtrees define the latency and the loss of requests and how
+ * fast counters increase.
+ */
+
+typedef struct SimEntry {
+    TnmOid oid;			/* The object identifier. */
+    char *soid;			/* The object identifier as a string. */
+    int syntax;			/* The ASN.1 base type of the value. */
+    char *value;		/* The recorded value. */
+} SimEntry;
+
+typedef struct SimData {
+    Tcl_HashEntry *entryPtr;	/* The entry in the table of loaded files. */
+    Tcl_WideInt mtime;		/* The modification time of the file. */
+    int refCount;		/* The number of responders using the data. */
+    int size;			/* The number of entries. */
+    int space;			/* The number of allocated entries. */
+    SimEntry **entries;		/* The entries sorted by object identifier. */
+} SimData;
+
+typedef struct SimRule {
+    TnmOid oid;			/* The root of the subtree. */
+    int delay;			/* The latency of responses in ms. */
+    int loss;			/* The percentage of lost requests. */
+    double increment;		/* The counter increment per second. */
+    struct SimRule *nextPtr;	/* The next rule. */
+} SimRule;
+
+typedef struct SimReply {
+    TnmSnmp *session;		/* The responder sending the reply. */
+    Tcl_TimerToken token;	/* The timer which sends the reply. */
+    TnmSnmpPdu pdu;		/* The reply. */
+    struct SimReply *nextPtr;	/* The next delayed reply. */
+} SimReply;
+
+typedef struct TnmSnmpSim {
+    SimData *dataPtr;		/* The recorded varbinds (if any). */
+    SimRule *ruleList;		/* The rules of the simulation. */
+    SimReply *replyList;	/* The delayed replies. */
+    Tcl_Time start;		/* The time the varbinds were loaded. */
+    u_int drops;		/* The number of requests lost on purpose. */
+} TnmSnmpSim;
+
+static Tcl_HashTable simDataTable;
+static int simDataTableInit = 0;
+
+#define SIM_FORMAT_AUTO		0
+#define SIM_FORMAT_WALK		1
+#define SIM_FORMAT_VARBINDS	2
+
+static TnmTable simFormatTable[] = {
+    { SIM_FORMAT_WALK,		"walk" },
+    { SIM_FORMAT_VARBINDS,	"varbinds" },
+    { 0, NULL }
+};
+
 /*
  * Forward declarations for procedures defined later in this file:
  */
 
-static void
-CacheInit		(void);
+static unsigned int
+CacheDigest		(TnmSnmpPdu *pdu);
 
-static TnmSnmpPdu*
+static CacheElement*
 CacheGet		(TnmSnmp *session, TnmSnmpPdu *pdu);
 
 static TnmSnmpPdu*
 CacheHit		(TnmSnmp *session, TnmSnmpPdu *pdu);
 
+static void
+CacheClear		(TnmSnmp *session);
+
+static void
+CacheFree		(void *memPtr);
+
 static char*
 TraceSysUpTime		(ClientData clientData,
 				     Tcl_Interp *interp,
@@ -72,19 +197,100 @@ static char*
 TraceUnsignedInt	(ClientData clientData,
 				     Tcl_Interp *interp,
 				     char *name1, char *name2, int flags);
+static const char*
+GetSysUpTime		(TnmSnmpNode *inst, char *buffer);
 static TnmSnmpNode*
 FindInstance		(TnmSnmp *session, TnmOid *oidPtr);
 
 static TnmSnmpNode*
 FindNextInstance	(TnmSnmp *session, TnmOid *oidPtr);
 
+static void
+AppendException		(TnmSnmpPdu *response, char *soid,
+				     char *exception);
+static int
+GetInstance		(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *request, TnmSnmpPdu *response,
+				     TnmSnmpNode *inst, char *value);
 static int
 GetRequest		(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *request, TnmSnmpPdu *response);
 static int
+BulkRequest		(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *request, TnmSnmpPdu *response);
+static int
+BulkLimit		(TnmSnmp *session, TnmSnmpPdu *request);
+static int
 SetRequest		(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *request, TnmSnmpPdu *response);
+static void
+ProxyKey		(Tcl_DString *dsPtr, int type, TnmSnmpPdu *pdu,
+				     Tcl_Obj *vbObj);
+static Tcl_Obj*
+ProxyLookup		(TnmSnmp *session, TnmSnmpPdu *pdu);
+
+static void
+ProxyStore		(TnmSnmp *session, ProxyPending *ppPtr,
+				     TnmSnmpPdu *pdu);
+static void
+ProxyClear		(TnmSnmp *session, int pending);
+
+static void
+ProxyReply		(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *request, TnmSnmpPdu *response);
+static int
+ProxyRequest		(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *pdu);
+static void
+ProxyProc		(TnmSnmp *upstream, TnmSnmpPdu *pdu,
+				     ClientData clientData);
+static void
+ProxyFree		(ProxyPending *ppPtr);
+static SimData*
+SimLoad			(Tcl_Interp *interp, Tcl_Obj *fileObj,
+				     int format);
+static int
+SimParseWalk		(Tcl_Interp *interp, SimData *dataPtr,
+				     char *text);
+static void
+SimWalkVarbind		(SimData *dataPtr, Tcl_DString *vbPtr);
+static int
+SimParseVarbinds	(Tcl_Interp *interp, SimData *dataPtr,
+				     Tcl_Obj *listObj);
+static const char*
+SimScanValue		(const char *name, int syntax,
+				     const char *value, char *buffer);
+static int
+SimAddEntry		(SimData *dataPtr, const char *name,
+				     int syntax, const char *value);
+static int
+SimCompare		(const void *a, const void *b);
+static void
+SimDataFree		(SimData *dataPtr);
+static int
+SimFind			(SimData *dataPtr, TnmOid *oidPtr, int next);
+static SimRule*
+SimFindRule		(TnmSnmpSim *simPtr, TnmOid *oidPtr);
+static void
+SimAppend		(TnmSnmpSim *simPtr, TnmSnmpPdu *response,
+				     SimEntry *entryPtr);
+static int
+SimRuleCmd		(Tcl_Interp *interp, TnmSnmpSim *simPtr,
+				     int objc, Tcl_Obj *const objv[]);
+static int
+SimRequest		(Tcl_Interp *interp, TnmSnmp *session,
+				     TnmSnmpPdu *pdu);
+static void
+SimReplyProc		(ClientData clientData);
+
+
+/*
+ * The value provider used to answer requests for sysUpTime.0.
+ */
 
+static TnmSnmpProvider sysUpTimeProvider = {
+    "sysUpTime", GetSysUpTime, NULL, NULL
+};
 
 /*
  * The global variable to keep the snmp statistics is defined here.
@@ -143,6 +349,9 @@ static struct StatReg statTable[] = {
     { "snmpStatsSilentDrops.0",	      &tnmSnmpStats.snmpStatsSilentDrops },
     { "snmpV1BadCommunityNames.0",    &tnmSnmpStats.snmpInBadCommunityNames },
     { "snmpV1BadCommunityUses.0",     &tnmSnmpStats.snmpInBadCommunityUses },
+    { "usmStatsUnknownEngineIDs.0",   &tnmSnmpStats.usmStatsUnknownEngineIDs },
+    { "usmStatsWrongDigests.0",	      &tnmSnmpStats.usmStatsWrongDigests },
+    { "usmStatsDecryptionErrors.0",   &tnmSnmpStats.usmStatsDecryptionErrors },
 #ifdef TNM_SNMPv2U
     { "usecStatsUnsupportedQoS.0",
       &tnmSnmpStats.usecStatsUnsupportedQoS },
@@ -162,17 +371,33 @@ static struct StatReg statTable[] = {
     { 0, 0 }
 };
 
+/*
+ * Counters of the engine that are not registered as instances.
+ */
+
+static struct StatReg engineStatTable[] = {
+    { "retransmits",		      &tnmSnmpStats.tnmRetransmits },
+    { "timeouts",		      &tnmSnmpStats.tnmTimeouts },
+    { "rateDrops",		      &tnmSnmpStats.tnmRateDrops },
+    { "connects",		      &tnmSnmpStats.tnmConnects },
+    { "connectErrors",		      &tnmSnmpStats.tnmConnectErrors },
+    { "socketOverflows",	      &tnmSnmpStats.tnmSocketOverflows },
+    { "lateResponses",		      &tnmSnmpStats.tnmLateResponses },
+    { 0, 0 }
+};
+
 
 /*
  *----------------------------------------------------------------------
  *
- * CacheInit --
+ * CacheDigest --
  *
- *	This procedure initializes the cache of answered requests.
- *	This procedure is only called once when we become an agent.
+ *	This procedure computes a digest of the varbinds of a request
+ *	(32 bit FNV-1a) so that we do not need to keep and compare the
+ *	varbinds of all cached requests.
  *
  * Results:
- *	None.
+ *	The digest of the varbinds.
  *
  * Side effects:
  *	None.
@@ -180,67 +405,116 @@ static struct StatReg statTable[] = {
  *----------------------------------------------------------------------
  */
 
-static void
-CacheInit()
+static unsigned int
+CacheDigest(TnmSnmpPdu *pdu)
 {
-    int i;
-    memset((char *) cache, 0, sizeof(cache));
-    for (i = 0; i < CACHE_SIZE; i++) {
-	Tcl_DStringInit(&cache[i].request.varbind);
-	Tcl_DStringInit(&cache[i].response.varbind);
+    unsigned char *p = (unsigned char *) Tcl_DStringValue(&pdu->varbind);
+    unsigned char *end = p + Tcl_DStringLength(&pdu->varbind);
+    unsigned int digest = 2166136261U;
+
+    while (p < end) {
+	digest = (digest ^ *p++) * 16777619U;
     }
+    return digest;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
  * CacheGet --
  *
- *	This procedure gets a free cache element. The cache is a
- *	simple FIFO ring buffer, so we just return the next element.
+ *	This procedure creates a cache element for a request. The
+ *	oldest elements are removed if the cache of the session is
+ *	full. A cache of size 0 still keeps the current element so
+ *	that the response can be assembled in it.
  *
  * Results:
- *	A pointer to a free cache element.
+ *	A pointer to the new cache element.
  *
  * Side effects:
- *	None.
+ *	The cache of the session is updated.
  *
  *----------------------------------------------------------------------
  */
 
-static TnmSnmpPdu*
+static CacheElement*
 CacheGet(TnmSnmp *session, TnmSnmpPdu *pdu)
 {
-    static int last = 0;
-    last = (last + 1 ) % CACHE_SIZE;
-    Tcl_DStringFree(&cache[last].request.varbind);
-    Tcl_DStringFree(&cache[last].response.varbind);
-    cache[last].session = session;
-    cache[last].response.requestId = 0;
-    cache[last].response.errorStatus = TNM_SNMP_NOERROR;
-    cache[last].response.errorIndex = 0;
-    cache[last].response.addr = pdu->addr;
-    Tcl_DStringAppend(&cache[last].request.varbind, 
-		      Tcl_DStringValue(&pdu->varbind), 
-		      Tcl_DStringLength(&pdu->varbind));
-    cache[last].timestamp = time((time_t *) NULL);
-    return &(cache[last].response);
+    AgentCache *cachePtr = session->agentCachePtr;
+    CacheElement *elemPtr;
+    CacheKey key;
+    int isNew;
+
+    if (! cachePtr) {
+	cachePtr = (AgentCache *) ckalloc(sizeof(AgentCache));
+	Tcl_InitHashTable(&cachePtr->table, sizeof(CacheKey) / sizeof(int));
+	cachePtr->firstPtr = cachePtr->lastPtr = NULL;
+	session->agentCachePtr = cachePtr;
+    }
+
+    while (cachePtr->firstPtr
+	   && cachePtr->table.numEntries >= 
+	      (session->cacheSize > 0 ? session->cacheSize : 1)) {
+	elemPtr = cachePtr->firstPtr;
+	cachePtr->firstPtr = elemPtr->nextPtr;
+	if (elemPtr->entryPtr) {
+	    Tcl_DeleteHashEntry(elemPtr->entryPtr);
+	}
+	Tcl_EventuallyFree((ClientData) elemPtr, (Tcl_FreeProc *) CacheFree);
+    }
+    if (! cachePtr->firstPtr) {
+	cachePtr->lastPtr = NULL;
+    }
+
+    elemPtr = (CacheElement *) ckalloc(sizeof(CacheElement));
+    memset((char *) elemPtr, 0, sizeof(CacheElement));
+    Tcl_DStringInit(&elemPtr->response.varbind);
+    elemPtr->response.vbList = NULL;
+    elemPtr->response.errorStatus = TNM_SNMP_NOERROR;
+    elemPtr->response.addr = pdu->addr;
+    elemPtr->digest = CacheDigest(pdu);
+    elemPtr->length = Tcl_DStringLength(&pdu->varbind);
+    elemPtr->timestamp = time((time_t *) NULL);
+
+    memset((char *) &key, 0, sizeof(key));
+    key.addr = pdu->addr.sin_addr.s_addr;
+    key.port = pdu->addr.sin_port;
+    key.requestId = pdu->requestId;
+    elemPtr->entryPtr = Tcl_CreateHashEntry(&cachePtr->table,
+					    (char *) &key, &isNew);
+    if (! isNew) {
+	CacheElement *oldPtr = (CacheElement *) Tcl_GetHashValue(elemPtr->entryPtr);
+	oldPtr->entryPtr = NULL;
+    }
+    Tcl_SetHashValue(elemPtr->entryPtr, (ClientData) elemPtr);
+
+    if (cachePtr->lastPtr) {
+	cachePtr->lastPtr->nextPtr = elemPtr;
+    } else {
+	cachePtr->firstPtr = elemPtr;
+    }
+    cachePtr->lastPtr = elemPtr;
+
+    session->cacheMisses++;
+    return elemPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
  * CacheHit --
  *
- *	This procedure checks if the request identified by session and
- *	request id is in the cache so we can send the answer without
- *	further processing.
+ *	This procedure checks if the request identified by the source
+ *	address and the request id is in the cache of the session so
+ *	we can send the answer without further processing. The varbinds
+ *	must match as well and the request must not be older than
+ *	CACHE_LIFETIME seconds.
  *
  * Results:
  *      A pointer to the PDU or NULL if the lookup failed.
  *
  * Side effects:
- *	None.
+ *	The hit counter of the session is updated.
  *
  *----------------------------------------------------------------------
  */
@@ -248,52 +522,56 @@ CacheGet(TnmSnmp *session, TnmSnmpPdu *pdu)
 static TnmSnmpPdu*
 CacheHit(TnmSnmp *session, TnmSnmpPdu *pdu)
 {
-    int i;
-    time_t now = time((time_t *) NULL);
+    Tcl_HashEntry *entryPtr;
+    CacheElement *elemPtr;
+    CacheKey key;
 
     /*
      * Never try to lookup request id 0 because there are some
      * management applications that always use the request id 0.
      */
 
-    if (pdu->requestId == 0) {
+    if (pdu->requestId == 0 || session->cacheSize == 0
+	|| ! session->agentCachePtr) {
 	return NULL;
     }
 
-    for (i = 0; i < CACHE_SIZE; i++) {
-	if (cache[i].response.requestId != pdu->requestId
-            || cache[i].session != session) {
-	    continue;
-	}
-	if (!cache[i].timestamp || now - cache[i].timestamp > 5) {
-	    continue;
-	}
-	if (cache[i].response.requestId == pdu->requestId
-	    && cache[i].session == session
-	    && Tcl_DStringLength(&pdu->varbind) 
-	       == Tcl_DStringLength(&cache[i].request.varbind)
-	    && strcmp(Tcl_DStringValue(&pdu->varbind), 
-		      Tcl_DStringValue(&cache[i].request.varbind)) == 0
-	    ) {
-	    cache[i].response.addr = pdu->addr;
-	    return &cache[i].response;
-	}
+    memset((char *) &key, 0, sizeof(key));
+    key.addr = pdu->addr.sin_addr.s_addr;
+    key.port = pdu->addr.sin_port;
+    key.requestId = pdu->requestId;
+    entryPtr = Tcl_FindHashEntry(&session->agentCachePtr->table,
+				 (char *) &key);
+    if (! entryPtr) {
+	return NULL;
     }
-    return NULL;
+
+    elemPtr = (CacheElement *) Tcl_GetHashValue(entryPtr);
+    if (elemPtr->response.requestId != pdu->requestId
+	|| elemPtr->length != Tcl_DStringLength(&pdu->varbind)
+	|| elemPtr->digest != CacheDigest(pdu)
+	|| time((time_t *) NULL) - elemPtr->timestamp > CACHE_LIFETIME) {
+	return NULL;
+    }
+
+    elemPtr->response.addr = pdu->addr;
+    session->cacheHits++;
+    return &elemPtr->response;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
  * CacheClear --
  *
- *	This procedure clears the cache for a given session.
+ *	This procedure removes all elements from the cache of a
+ *	given session.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *	None.
+ *	The cache elements are freed once they are not used anymore.
  *
  *----------------------------------------------------------------------
  */
@@ -301,15 +579,99 @@ CacheHit(TnmSnmp *session, TnmSnmpPdu *pdu)
 static void
 CacheClear(TnmSnmp *session)
 {
-    int i;
+    AgentCache *cachePtr = session->agentCachePtr;
+    CacheElement *elemPtr;
 
-    for (i = 0; i < CACHE_SIZE; i++) {
-	if (cache[i].session == session) {
-	    cache[i].timestamp = 0;
-	}
+    if (! cachePtr) {
+	return;
     }
+
+    while (cachePtr->firstPtr) {
+	elemPtr = cachePtr->firstPtr;
+	cachePtr->firstPtr = elemPtr->nextPtr;
+	Tcl_EventuallyFree((ClientData) elemPtr, (Tcl_FreeProc *) CacheFree);
+    }
+    Tcl_DeleteHashTable(&cachePtr->table);
+    ckfree((char *) cachePtr);
+    session->agentCachePtr = NULL;
 }
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheFree --
+ *
+ *	This procedure is invoked by Tcl_EventuallyFree or Tcl_Release
+ *	to free a cache element when no-one is using it anymore.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *	The memory of the cache element is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheFree(void *memPtr)
+{
+    CacheElement *elemPtr = (CacheElement *) memPtr;
+
+    Tcl_DStringFree(&elemPtr->response.varbind);
+    ckfree((char *) elemPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpAgentCacheFlush --
+ *
+ *	This procedure removes all elements from the cache of answered
+ *	requests and the proxy cache of a responder session and resets
+ *	the counters.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *	The cache of the session is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpAgentCacheFlush(TnmSnmp *session)
+{
+    CacheClear(session);
+    ProxyClear(session, 1);
+    session->cacheHits = session->cacheMisses = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpAgentCacheEntries --
+ *
+ *	This procedure returns the number of answered requests in
+ *	the cache of a responder session.
+ *
+ * Results:
+ *      The number of cache elements.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpAgentCacheEntries(TnmSnmp *session)
+{
+    return session->agentCachePtr
+	? session->agentCachePtr->table.numEntries : 0;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -406,6 +768,30 @@ TraceUnsignedInt(clientData, interp, name1, name2, flags)
     return NULL;    
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetSysUpTime --
+ *
+ *	This procedure is the get procedure of the value provider
+ *	used for sysUpTime.0.
+ *
+ * Results:
+ *      A pointer to the value in the buffer.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+GetSysUpTime(TnmSnmpNode *inst, char *buffer)
+{
+    sprintf(buffer, "%u", TnmSnmpSysUpTime());
+    return buffer;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -427,7 +813,7 @@ int
 TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
 {
     static int done = 0;
-    char tclvar[80], buffer[255];
+    char buffer[255];
     const char *value;
     struct StatReg *p;
 
@@ -445,7 +831,6 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
     }
 
     done = 1;
-    CacheInit();
 
     /*
      * Here we build up our engineID value. This roughly conformes to
@@ -453,9 +838,8 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
      * thing.
      */
     
-    Tcl_SetObjLength(session->engineID, 12);
-    {
-        u_char *p = (unsigned char *) Tcl_GetStringFromObj(session->engineID, NULL);
+    if (Tcl_GetCharLength(session->engineID) == 0) {
+        u_char engineID[12], *p = engineID;
 	int id = 1575;
 	*p++ = (id >> 24) & 0xff;
 	*p++ = (id >> 16) & 0xff;
@@ -463,6 +847,9 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
 	*p++ = id & 0xff;
 	*p++ = 0x04;
 	memcpy(p, "smile:)", 7);
+	Tcl_DecrRefCount(session->engineID);
+	session->engineID = TnmNewOctetStringObj((char *) engineID, 12);
+	Tcl_IncrRefCount(session->engineID);
     }
     session->engineTime = time((time_t *) NULL);
     session->engineBoots = session->engineTime - 849394800;
@@ -516,8 +903,9 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
 		       "tnm_system(sysDescr)", buffer);
     TnmSnmpCreateNode(interp, "sysObjectID.0", 
 		       "tnm_system(sysObjectID)", "1.3.6.1.4.1.1575.1.1");
-    TnmSnmpCreateNode(interp, "sysUpTime.0", 
-		       "tnm_system(sysUpTime)", "0");
+    TnmSnmpCreateProviderNode(interp, "sysUpTime.0", 
+			      &sysUpTimeProvider, NULL);
+    Tcl_SetVar2(interp, "tnm_system", "sysUpTime", "0", TCL_GLOBAL_ONLY);
     Tcl_TraceVar2(interp, "tnm_system", "sysUpTime", 
 		  TCL_TRACE_READS | TCL_GLOBAL_ONLY, 
 		  (Tcl_VarTraceProc *) TraceSysUpTime, (ClientData) NULL);
@@ -530,11 +918,15 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
     TnmSnmpCreateNode(interp, "sysServices.0", 
 		       "tnm_system(sysServices)", "72");
 
+    /*
+     * The statistics are answered from the counters directly. The
+     * Tcl variables are kept for scripts that read the counters.
+     */
+
     for (p = statTable; p->name; p++) {
-	strcpy(tclvar, "tnm_snmp(");
-	strcat(tclvar, p->name);
-	strcat(tclvar, ")");
-	TnmSnmpCreateNode(interp, p->name, tclvar, "0");
+	TnmSnmpCreateProviderNode(interp, p->name,
+			&tnmSnmpUnsigned32Provider, (ClientData) p->value);
+	Tcl_SetVar2(interp, "tnm_snmp", p->name, "0", TCL_GLOBAL_ONLY);
 	Tcl_TraceVar2(interp, "tnm_snmp", p->name, 
 		      TCL_TRACE_READS | TCL_GLOBAL_ONLY,
 		      (Tcl_VarTraceProc *) TraceUnsignedInt, (ClientData) p->value);
@@ -559,6 +951,83 @@ TnmSnmpAgentInit(Tcl_Interp *interp, TnmSnmp *session)
     return TCL_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpStatsGet --
+ *
+ *	This procedure returns the SNMP statistics of the protocol
+ *	stack and the counters of the engine. The names of the MIB
+ *	counters are used without the instance identifier.
+ *
+ * Results:
+ *	A list of names and values for all counters whose name
+ *	matches the pattern (if not NULL).
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj*
+TnmSnmpStatsGet(const char *pattern)
+{
+    struct StatReg *tables[] = { statTable, engineStatTable, NULL };
+    struct StatReg *p;
+    Tcl_Obj *listPtr;
+    char *dot;
+    int i, len;
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    for (i = 0; tables[i]; i++) {
+	for (p = tables[i]; p->name; p++) {
+	    dot = strchr(p->name, '.');
+	    len = dot ? (int) (dot - p->name) : -1;
+	    if (pattern) {
+		char name[80];
+		strncpy(name, p->name, sizeof(name) - 1);
+		name[(len < 0) ? sizeof(name) - 1 : len] = '\0';
+		if (! Tcl_StringMatch(name, pattern)) continue;
+	    }
+	    Tcl_ListObjAppendElement(NULL, listPtr,
+				     Tcl_NewStringObj(p->name, len));
+	    Tcl_ListObjAppendElement(NULL, listPtr,
+				     Tcl_NewWideIntObj(*p->value));
+	}
+    }
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpStatsReset --
+ *
+ *	This procedure clears the SNMP statistics and the counters
+ *	of retransmissions and rate limited requests of all sessions.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The counters are reset to 0.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpStatsReset(void)
+{
+    TnmSnmp *session;
+
+    memset((char *) &tnmSnmpStats, 0, sizeof(TnmSnmpStats));
+    for (session = tnmSnmpList; session; session = session->nextPtr) {
+	session->retransmits = 0;
+	session->rateDrops = 0;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -612,13 +1081,13 @@ FindNextInstance(TnmSnmp *session, TnmOid *oidPtr)
 /*
  *----------------------------------------------------------------------
  *
- * GetRequest --
+ * AppendException --
  *
- *	This procedure is called to process get, getnext and getbulk
- *	requests.
+ *	This procedure appends a varbind with an SNMPv2 exception to
+ *	the varbind list of a response.
  *
  * Results:
- *      A standard Tcl result.
+ *      None.
  *
  * Side effects:
  *	None.
@@ -626,28 +1095,118 @@ FindNextInstance(TnmSnmp *session, TnmOid *oidPtr)
  *----------------------------------------------------------------------
  */
 
+static void
+AppendException(TnmSnmpPdu *response, char *soid, char *exception)
+{
+    Tcl_DStringStartSublist(&response->varbind);
+    Tcl_DStringAppendElement(&response->varbind, soid);
+    Tcl_DStringAppendElement(&response->varbind, exception);
+    Tcl_DStringAppendElement(&response->varbind, "");
+    Tcl_DStringEndSublist(&response->varbind);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetInstance --
+ *
+ *	This procedure appends the varbind for an instance to the
+ *	varbind list of a response. The get binding is evaluated
+ *	before the value is read from the value provider or the
+ *	Tcl variable of the instance.
+ *
+ * Results:
+ *      A standard Tcl result. The error status of the response is
+ *	set if the value could not be retrieved.
+ *
+ * Side effects:
+ *	The instance may have been removed by the get binding or by
+ *	a trace on the Tcl variable once this procedure returns.
+ *
+ *----------------------------------------------------------------------
+ */
+
 static int
-GetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu *response)
+GetInstance(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu *response, TnmSnmpNode *inst, char *value)
 {
-    Tcl_Size i, vbListLen;
+    char *syntax, buffer[TNM_SNMP_VALUESIZE];
+    const char *varValue;
     int code;
-    TnmSnmpNode *inst;
-    Tcl_Obj *vbList, **vbListElems;
 
-    vbList = Tcl_NewStringObj(Tcl_DStringValue(&request->varbind), -1);
-    code = Tcl_ListObjGetElements((Tcl_Interp *) NULL, vbList,
-				  &vbListLen, &vbListElems);
-    if (code != TCL_OK) {
-	Tcl_DecrRefCount(vbList);
+    Tcl_DStringStartSublist(&response->varbind);
+    Tcl_DStringAppendElement(&response->varbind, inst->label);
+    syntax = TnmGetTableValue(tnmSnmpTypeTable, (unsigned) inst->syntax);
+    Tcl_DStringAppendElement(&response->varbind, syntax ? syntax : "");
+
+    code = TnmSnmpEvalNodeBinding(session, request, inst, 
+				  TNM_SNMP_GET_EVENT, value, (char *) NULL);
+    if (code == TCL_ERROR) {
+	response->errorStatus = TnmGetTableKey(tnmSnmpErrorTable, 
+					       Tcl_GetStringResult(interp));
+	if (response->errorStatus < 0) {
+	    response->errorStatus = TNM_SNMP_GENERR;
+	}
+	tnmSnmpStats.snmpOutGenErrs += 
+	    (response->errorStatus == TNM_SNMP_GENERR);
 	return TCL_ERROR;
     }
+    varValue = TnmSnmpGetNodeValue(interp, inst, buffer);
+    if (!varValue) {
+	response->errorStatus = TNM_SNMP_GENERR;
+	tnmSnmpStats.snmpOutGenErrs++;
+	return TCL_ERROR;
+    }
+    Tcl_DStringAppendElement(&response->varbind, varValue);
+    Tcl_ResetResult(interp);
 
-    for (i = 0; i < vbListLen; i++) {
-
-	char *syntax;
-	const char *value;
-	Tcl_Obj *objPtr;
-	TnmOid *oidPtr;
+    tnmSnmpStats.snmpInTotalReqVars++;
+
+    Tcl_DStringEndSublist(&response->varbind);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetRequest --
+ *
+ *	This procedure is called to process get and getnext requests.
+ *	Getbulk requests are passed on to BulkRequest().
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu *response)
+{
+    Tcl_Size i, vbListLen;
+    int code;
+    TnmSnmpNode *inst;
+    Tcl_Obj *vbList, **vbListElems;
+
+    if (request->type == ASN1_SNMP_GETBULK) {
+	return BulkRequest(interp, session, request, response);
+    }
+
+    vbList = TnmSnmpPduVarbinds(request);
+    Tcl_IncrRefCount(vbList);
+    code = Tcl_ListObjGetElements((Tcl_Interp *) NULL, vbList,
+				  &vbListLen, &vbListElems);
+    if (code != TCL_OK) {
+	Tcl_DecrRefCount(vbList);
+	return TCL_ERROR;
+    }
+
+    for (i = 0; i < vbListLen; i++) {
+
+	Tcl_Obj *objPtr;
+	TnmOid *oidPtr;
 
 	(void) Tcl_ListObjIndex(interp, vbListElems[i], 0, &objPtr);
 	oidPtr = TnmGetOidFromObj(interp, objPtr);
@@ -656,8 +1215,7 @@ GetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 	    tnmSnmpStats.snmpOutGenErrs++;
 	    goto varBindError;
 	}
-	if (request->type == ASN1_SNMP_GETNEXT 
-	    || request->type == ASN1_SNMP_GETBULK) {
+	if (request->type == ASN1_SNMP_GETNEXT) {
 	    inst = FindNextInstance(session, oidPtr);
 	} else {
 	    inst = FindInstance(session, oidPtr);
@@ -680,63 +1238,23 @@ GetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 	    }
 
 	    soid = TnmOidToString(oidPtr);
-	    Tcl_DStringStartSublist(&response->varbind);
-	    Tcl_DStringAppendElement(&response->varbind, soid);
 	    if (request->type == ASN1_SNMP_GET) {
 		TnmMibNode *nodePtr = TnmMibFindNode(soid, NULL, 0);
-		if (!nodePtr || nodePtr->childPtr) {
-		    Tcl_DStringAppendElement(&response->varbind,
-					     "noSuchObject");
-		} else {
-		    Tcl_DStringAppendElement(&response->varbind, 
-					     "noSuchInstance");
-		}
+		AppendException(response, soid, 
+				(!nodePtr || nodePtr->childPtr)
+				? "noSuchObject" : "noSuchInstance");
 	    } else {
-		Tcl_DStringAppendElement(&response->varbind, "endOfMibView");
+		AppendException(response, soid, "endOfMibView");
 	    }
-	    Tcl_DStringAppendElement(&response->varbind, "");
-	    Tcl_DStringEndSublist(&response->varbind);
 	    continue;
 	}
 
-	Tcl_DStringStartSublist(&response->varbind);
-	Tcl_DStringAppendElement(&response->varbind, inst->label);
-	syntax = TnmGetTableValue(tnmSnmpTypeTable, (unsigned) inst->syntax);
-	Tcl_DStringAppendElement(&response->varbind, syntax ? syntax : "");
-
 	(void) Tcl_ListObjIndex(interp, vbListElems[i], 2, &objPtr);
-	code = TnmSnmpEvalNodeBinding(session, request, inst, 
-				      TNM_SNMP_GET_EVENT, 
-				      Tcl_GetStringFromObj(objPtr, NULL),
-				      (char *) NULL);
-	if (code == TCL_ERROR) {
-	    goto varBindTclError;
-	}
-	value = Tcl_GetVar(interp, inst->tclVarName, 
-			   TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
-	if (!value) {
-	    response->errorStatus = TNM_SNMP_GENERR;
-	    tnmSnmpStats.snmpOutGenErrs++;
-	    goto varBindError;
+	if (GetInstance(interp, session, request, response, inst,
+			Tcl_GetStringFromObj(objPtr, NULL)) == TCL_OK) {
+	    continue;
 	}
-	Tcl_DStringAppendElement(&response->varbind, value);
-	Tcl_ResetResult(interp);
-
-	tnmSnmpStats.snmpInTotalReqVars++;
-
-	Tcl_DStringEndSublist(&response->varbind);
-	
-	continue;
 
-      varBindTclError:
-	response->errorStatus = TnmGetTableKey(tnmSnmpErrorTable, 
-						Tcl_GetStringResult (interp));
-	if (response->errorStatus < 0) {
-	    response->errorStatus = TNM_SNMP_GENERR;
-	}
-	tnmSnmpStats.snmpOutGenErrs += 
-	    (response->errorStatus == TNM_SNMP_GENERR);
-       
       varBindError:
 	response->errorIndex = i+1;
 	break;
@@ -756,7 +1274,206 @@ GetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
     Tcl_DecrRefCount(vbList);
     return TCL_OK;
 }
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BulkLimit --
+ *
+ *	This procedure computes the number of bytes a getbulk response
+ *	may use. The response must fit into the maximum message size
+ *	of the session and into the msgMaxSize of the requester.
+ *
+ * Results:
+ *	The maximum length of the encoded response.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BulkLimit(TnmSnmp *session, TnmSnmpPdu *request)
+{
+    int limit = session->maxSize;
+
+    if (request->maxSize > 0 && request->maxSize < limit) {
+	limit = request->maxSize;
+    }
+    return limit - BULK_HEADROOM;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BulkRequest --
+ *
+ *	This procedure is called to process getbulk requests as
+ *	defined in RFC 3416, section 4.2.3. The non-repeaters and
+ *	max-repetitions are carried in the error status and error
+ *	index fields of the request. The repeaters are followed
+ *	through the instance tree from node to node. The response
+ *	is filled until it would exceed the maximum message size.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BulkRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu *response)
+{
+    Tcl_Size i, vbListLen;
+    int code, r, nonRepeaters, maxRepetitions, repeaters, active;
+    int length, size, n, limit = BulkLimit(session, request);
+    unsigned long epoch;
+    TnmSnmpNode *inst, **cursor = NULL, **last = NULL;
+    Tcl_Obj *vbList, **vbListElems, *objPtr;
+    TnmOid *oidPtr;
+
+    vbList = TnmSnmpPduVarbinds(request);
+    Tcl_IncrRefCount(vbList);
+    code = Tcl_ListObjGetElements((Tcl_Interp *) NULL, vbList,
+				  &vbListLen, &vbListElems);
+    if (code != TCL_OK) {
+	Tcl_DecrRefCount(vbList);
+	return TCL_ERROR;
+    }
+
+    nonRepeaters = request->errorStatus;
+    if (nonRepeaters < 0) {
+	nonRepeaters = 0;
+    } else if (nonRepeaters > vbListLen) {
+	nonRepeaters = (int) vbListLen;
+    }
+    maxRepetitions = request->errorIndex < 0 ? 0 : request->errorIndex;
+    repeaters = (int) vbListLen - nonRepeaters;
+    if (repeaters > 0) {
+	cursor = (TnmSnmpNode **) ckalloc(2 * repeaters 
+					  * sizeof(TnmSnmpNode *));
+	last = cursor + repeaters;
+    }
+
+    /*
+     * Process the non-repeaters and locate the first instance of
+     * every repeater. A repeater without a next instance is marked
+     * with a NULL cursor.
+     */
+
+    for (i = 0; i < vbListLen; i++) {
+	(void) Tcl_ListObjIndex(interp, vbListElems[i], 0, &objPtr);
+	oidPtr = TnmGetOidFromObj(interp, objPtr);
+	if (! oidPtr) {
+	    response->errorStatus = TNM_SNMP_GENERR;
+	    response->errorIndex = i+1;
+	    tnmSnmpStats.snmpOutGenErrs++;
+	    goto done;
+	}
+	inst = FindNextInstance(session, oidPtr);
+	if (i >= nonRepeaters) {
+	    cursor[i - nonRepeaters] = inst;
+	    last[i - nonRepeaters] = NULL;
+	    continue;
+	}
+	if (! inst) {
+	    AppendException(response, TnmOidToString(oidPtr), "endOfMibView");
+	    continue;
+	}
+	(void) Tcl_ListObjIndex(interp, vbListElems[i], 2, &objPtr);
+	if (GetInstance(interp, session, request, response, inst,
+			Tcl_GetStringFromObj(objPtr, NULL)) != TCL_OK) {
+	    response->errorIndex = i+1;
+	    goto done;
+	}
+    }
+
+    response->type = ASN1_SNMP_RESPONSE;
+    response->requestId = request->requestId;
+    size = TnmSnmpMessageSize(interp, session, response);
+    if (size < 0) {
+	response->errorStatus = TNM_SNMP_GENERR;
+	response->errorIndex = 0;
+	tnmSnmpStats.snmpOutGenErrs++;
+	goto done;
+    }
+    if (size > limit) {
+	response->errorStatus = TNM_SNMP_TOOBIG;
+	response->errorIndex = 0;
+	goto done;
+    }
+
+    /*
+     * Process the repetitions. A repeater which reached the end of
+     * the MIB view returns the last name with an endOfMibView
+     * exception. We stop early if all repeaters reached the end of
+     * the MIB view, if the response would get too big or if a
+     * binding removed instances, which makes the node pointers kept
+     * in the cursor array invalid.
+     */
+
+    for (r = 0; r < maxRepetitions; r++) {
+	for (i = 0, active = 0; i < repeaters; i++) {
+	    active += (cursor[i] != NULL);
+	}
+	if (r > 0 && ! active) {
+	    break;
+	}
+	for (i = 0; i < repeaters; i++) {
+	    length = Tcl_DStringLength(&response->varbind);
+	    inst = cursor[i];
+	    if (! inst) {
+		if (last[i]) {
+		    AppendException(response, last[i]->label, "endOfMibView");
+		} else {
+		    (void) Tcl_ListObjIndex(interp, 
+					    vbListElems[nonRepeaters + i], 0,
+					    &objPtr);
+		    oidPtr = TnmGetOidFromObj(interp, objPtr);
+		    AppendException(response, TnmOidToString(oidPtr),
+				    "endOfMibView");
+		}
+	    } else {
+		epoch = tnmSnmpInstEpoch;
+		if (GetInstance(interp, session, request, response, inst,
+				"") != TCL_OK) {
+		    response->errorIndex = nonRepeaters + i + 1;
+		    goto done;
+		}
+		if (epoch != tnmSnmpInstEpoch) {
+		    goto done;
+		}
+		last[i] = inst;
+		cursor[i] = TnmSnmpNextNode(session, inst);
+	    }
+	    n = TnmSnmpVarBindSize(interp, session, response,
+				   Tcl_DStringValue(&response->varbind) + length);
+	    if (n < 0) {
+		response->errorStatus = TNM_SNMP_GENERR;
+		response->errorIndex = nonRepeaters + i + 1;
+		tnmSnmpStats.snmpOutGenErrs++;
+		goto done;
+	    }
+	    if (size + n > limit) {
+		Tcl_DStringSetLength(&response->varbind, length);
+		goto done;
+	    }
+	    size += n;
+	}
+    }
+
+  done:
+    if (cursor) {
+	ckfree((char *) cursor);
+    }
+    Tcl_DecrRefCount(vbList);
+    return TCL_OK;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -795,7 +1512,7 @@ SetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
     for (i = 0; i < inVarBindSize; i++) {
 
 	const char *value;
-	char *syntax;
+	char *syntax, buffer[TNM_SNMP_VALUESIZE];
 	int setAlreadyDone = 0;
 	varsToRollback = i;
 
@@ -868,8 +1585,7 @@ SetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 		goto varBindError;
 	    }
 
-	    value = Tcl_GetVar(interp, inst->tclVarName, 
-			       TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
+	    value = TnmSnmpGetNodeValue(interp, inst, buffer);
 	    if (value == NULL) {
 		inVarBindPtr[i].clientData = (ClientData) NULL;
 	    } else {
@@ -882,9 +1598,8 @@ SetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 		goto varBindTclError;
 	    }
 	    if (code != TCL_BREAK) {
-	        if (Tcl_SetVar(interp, inst->tclVarName, 
-			       inVarBindPtr[i].value, 
-			       TCL_GLOBAL_ONLY) == NULL) {
+	        if (TnmSnmpSetNodeValue(interp, inst, 
+					inVarBindPtr[i].value) != TCL_OK) {
 		    goto varBindTclError;
 		}
 	    }
@@ -895,8 +1610,7 @@ SetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 	Tcl_DStringAppendElement(&response->varbind, inst->label);
 	syntax = TnmGetTableValue(tnmSnmpTypeTable, (unsigned) inst->syntax);
 	Tcl_DStringAppendElement(&response->varbind, syntax ? syntax : "");
-	value = Tcl_GetVar(interp, inst->tclVarName, 
-			   TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
+	value = TnmSnmpGetNodeValue(interp, inst, buffer);
 	if (!value) {
 	    response->errorStatus = TNM_SNMP_GENERR;
 	    goto varBindError;
@@ -1017,9 +1731,8 @@ SetRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu
 		if (inVarBindPtr[i].flags & NODE_CREATED) {
 		    Tcl_UnsetVar(interp, inst->tclVarName, TCL_GLOBAL_ONLY);
 		} else if (inVarBindPtr[i].clientData) {
-		    Tcl_SetVar(interp, inst->tclVarName,
-			       (char *) inVarBindPtr[i].clientData,
-			       TCL_GLOBAL_ONLY);
+		    TnmSnmpSetNodeValue(interp, inst,
+				(char *) inVarBindPtr[i].clientData);
 		}
 		if (inVarBindPtr[i].clientData) {
 		    ckfree((char *) inVarBindPtr[i].clientData);
@@ -1055,7 +1768,9 @@ int
 TnmSnmpAgentRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
 {
     int rc;
+    CacheElement *elemPtr;
     TnmSnmpPdu *reply;
+    TnmSnmpNode *markPtr;
 
     switch (pdu->type) {
       case ASN1_SNMP_GET:
@@ -1074,26 +1789,49 @@ TnmSnmpAgentRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
 
     }
 
-    if (pdu->type == ASN1_SNMP_SET) {
-	CacheClear(session);
-    }
-
     reply = CacheHit(session, pdu);
     if (reply != NULL) {
 	rc = TnmSnmpEncode(interp, session, reply, NULL, NULL);
 	return rc;
     }
 
+    if (session->simPtr && session->simPtr->dataPtr) {
+	return SimRequest(interp, session, pdu);
+    }
+
+    if (session->proxy) {
+	return ProxyRequest(interp, session, pdu);
+    }
+
+    /*
+     * A new set request invalidates the answers to all previous
+     * requests. Retransmitted set requests were answered above.
+     */
+
+    if (pdu->type == ASN1_SNMP_SET) {
+	CacheClear(session);
+    }
+
     TnmSnmpEvalBinding(interp, session, pdu, TNM_SNMP_BEGIN_EVENT);
 
-    reply = CacheGet(session, pdu);
+    elemPtr = CacheGet(session, pdu);
+    reply = &elemPtr->response;
+    Tcl_Preserve((ClientData) elemPtr);
+
+    /*
+     * The cells of tables found while processing the request are
+     * released once the response has been assembled.
+     */
 
+    markPtr = TnmSnmpMarkCells();
     if (pdu->type == ASN1_SNMP_SET) {
 	rc = SetRequest(interp, session, pdu, reply);
     } else {
 	rc = GetRequest(interp, session, pdu, reply);
     }
+    TnmSnmpReleaseCells(markPtr);
     if (rc != TCL_OK) {
+	Tcl_Release((ClientData) elemPtr);
 	return TCL_ERROR;
     }
 
@@ -1114,7 +1852,8 @@ TnmSnmpAgentRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
 
     TnmSnmpEvalBinding(interp, session, reply, TNM_SNMP_END_EVENT);
 
-    if (TnmSnmpEncode(interp, session, reply, NULL, NULL) != TCL_OK) {
+    rc = TnmSnmpEncode(interp, session, reply, NULL, NULL);
+    if (rc != TCL_OK) {
 	Tcl_AddErrorInfo(interp, "\n    (snmp send reply)");
 	Tcl_BackgroundError(interp);
 	Tcl_ResetResult(interp);
@@ -1123,9 +1862,1968 @@ TnmSnmpAgentRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
         Tcl_DStringAppend(&reply->varbind,
 			  Tcl_DStringValue(&pdu->varbind),
 			  Tcl_DStringLength(&pdu->varbind));
-	return TnmSnmpEncode(interp, session, reply, NULL, NULL);
-    } else {
-	return TCL_OK;
+	rc = TnmSnmpEncode(interp, session, reply, NULL, NULL);
+    }
+    Tcl_Release((ClientData) elemPtr);
+    return rc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpProxySession --
+ *
+ *	This procedure locates the generator session identified by
+ *	the command name in nameObj. We have to check the list of
+ *	sessions to make sure that we do not use the clientData of
+ *	another Tcl command as a pointer to a session.
+ *
+ * Results:
+ *	A pointer to the session or NULL if there is no generator
+ *	session with the given name. An error message is left in
+ *	the interpreter if interp is not NULL.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TnmSnmp*
+TnmSnmpProxySession(Tcl_Interp *interp, Tcl_Obj *nameObj)
+{
+    Tcl_CmdInfo info;
+    TnmSnmp *session = NULL;
+    char *name = Tcl_GetStringFromObj(nameObj, NULL);
+
+    if (Tcl_GetCommandInfo(interp, name, &info)
+	&& TnmSnmpSessionValid((TnmSnmp *) info.objClientData)) {
+	session = (TnmSnmp *) info.objClientData;
+	if (session->type != TNM_SNMP_GENERATOR) {
+	    session = NULL;
+	}
+    }
+    if (! session && interp) {
+	Tcl_AppendResult(interp, "unknown generator session \"", name, "\"",
+			 (char *) NULL);
+    }
+    return session;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyKey --
+ *
+ *	This procedure assembles the key of a varbind (or of a whole
+ *	request if vbObj is NULL) used to locate pending requests and
+ *	cached varbinds.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The key is appended to the dynamic string.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyKey(Tcl_DString *dsPtr, int type, TnmSnmpPdu *pdu, Tcl_Obj *vbObj)
+{
+    Tcl_Obj *oidObj;
+    char buf[40];
+
+    if (vbObj) {
+	sprintf(buf, "%d ", type);
+	Tcl_DStringAppend(dsPtr, buf, -1);
+	if (Tcl_ListObjIndex(NULL, vbObj, 0, &oidObj) == TCL_OK && oidObj) {
+	    Tcl_DStringAppend(dsPtr, Tcl_GetString(oidObj), -1);
+	}
+	return;
+    }
+
+    sprintf(buf, "%d %d %d ", type, pdu->errorStatus, pdu->errorIndex);
+    Tcl_DStringAppend(dsPtr, buf, -1);
+    Tcl_DStringAppend(dsPtr, Tcl_DStringValue(&pdu->varbind),
+		      Tcl_DStringLength(&pdu->varbind));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyLookup --
+ *
+ *	This procedure tries to answer a get, getnext or getbulk
+ *	request from the proxy cache of a responder. Get and getnext
+ *	requests are answered if all varbinds are found in the cache.
+ *
+ * Results:
+ *	The varbind list of the response or NULL if the request can
+ *	not be answered from the cache.
+ *
+ * Side effects:
+ *	Expired cache entries are removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+ProxyLookup(TnmSnmp *session, TnmSnmpPdu *pdu)
+{
+    Tcl_Obj *listObj, *resultObj = NULL, **vbv;
+    Tcl_Size i, vbc;
+    Tcl_HashEntry *entryPtr;
+    ProxyEntry *pePtr;
+    Tcl_DString key;
+    Tcl_Time now;
+    long age;
+
+    if (! session->proxyCache || pdu->type == ASN1_SNMP_SET) {
+	return NULL;
+    }
+
+    listObj = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(listObj);
+    if (Tcl_ListObjGetElements(NULL, listObj, &vbc, &vbv) != TCL_OK) {
+	Tcl_DecrRefCount(listObj);
+	return NULL;
+    }
+    if (pdu->type == ASN1_SNMP_GETBULK) {
+	vbc = 1;
+    }
+
+    Tcl_GetTime(&now);
+    Tcl_DStringInit(&key);
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < vbc; i++) {
+	Tcl_DStringSetLength(&key, 0);
+	ProxyKey(&key, pdu->type, pdu,
+		 pdu->type == ASN1_SNMP_GETBULK ? NULL : vbv[i]);
+	entryPtr = Tcl_FindHashEntry(session->proxyCache,
+				     Tcl_DStringValue(&key));
+	if (! entryPtr) {
+	    break;
+	}
+	pePtr = (ProxyEntry *) Tcl_GetHashValue(entryPtr);
+	age = (now.sec - pePtr->stamp.sec) * 1000
+	    + (now.usec - pePtr->stamp.usec) / 1000;
+	if (age > session->proxyMaxAge) {
+	    Tcl_DecrRefCount(pePtr->vbObj);
+	    ckfree((char *) pePtr);
+	    Tcl_DeleteHashEntry(entryPtr);
+	    break;
+	}
+	if (pdu->type == ASN1_SNMP_GETBULK) {
+	    Tcl_DecrRefCount(resultObj);
+	    resultObj = pePtr->vbObj;
+	} else {
+	    Tcl_ListObjAppendElement(NULL, resultObj, pePtr->vbObj);
+	}
     }
+    Tcl_DStringFree(&key);
+    Tcl_DecrRefCount(listObj);
+
+    if (i < vbc) {
+	Tcl_DecrRefCount(resultObj);
+	return NULL;
+    }
+    return resultObj;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyStore --
+ *
+ *	This procedure saves the varbinds of a response received from
+ *	upstream in the proxy cache. The varbinds of get and getnext
+ *	requests are saved individually so that they can be combined
+ *	into answers for other requests.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The proxy cache is updated. Expired entries are removed if
+ *	the cache grows too large.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyStore(TnmSnmp *session, ProxyPending *ppPtr, TnmSnmpPdu *pdu)
+{
+    Tcl_Obj *reqObj, *respObj, **reqv, **respv;
+    Tcl_Size i, reqc, respc;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    ProxyEntry *pePtr;
+    Tcl_DString key;
+    Tcl_Time now;
+    int isNew;
+
+    if (session->proxyMaxAge <= 0 || ppPtr->type == ASN1_SNMP_SET
+	|| pdu->errorStatus != TNM_SNMP_NOERROR) {
+	return;
+    }
+
+    if (! session->proxyCache) {
+	session->proxyCache = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(session->proxyCache, TCL_STRING_KEYS);
+    }
+
+    Tcl_GetTime(&now);
+    if (session->proxyCache->numEntries >= PROXY_CACHESIZE) {
+	entryPtr = Tcl_FirstHashEntry(session->proxyCache, &search);
+	while (entryPtr) {
+	    pePtr = (ProxyEntry *) Tcl_GetHashValue(entryPtr);
+	    if ((now.sec - pePtr->stamp.sec) * 1000
+		+ (now.usec - pePtr->stamp.usec) / 1000
+		> session->proxyMaxAge) {
+		Tcl_DecrRefCount(pePtr->vbObj);
+		ckfree((char *) pePtr);
+		Tcl_DeleteHashEntry(entryPtr);
+	    }
+	    entryPtr = Tcl_NextHashEntry(&search);
+	}
+    }
+
+    reqObj = Tcl_NewStringObj(Tcl_DStringValue(&ppPtr->varbind),
+			      Tcl_DStringLength(&ppPtr->varbind));
+    Tcl_IncrRefCount(reqObj);
+    respObj = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(respObj);
+    if (Tcl_ListObjGetElements(NULL, reqObj, &reqc, &reqv) != TCL_OK
+	|| Tcl_ListObjGetElements(NULL, respObj, &respc, &respv) != TCL_OK
+	|| (ppPtr->type != ASN1_SNMP_GETBULK && reqc != respc)) {
+	goto done;
+    }
+
+    Tcl_DStringInit(&key);
+    for (i = 0; i < (ppPtr->type == ASN1_SNMP_GETBULK ? 1 : reqc); i++) {
+	Tcl_DStringSetLength(&key, 0);
+	if (ppPtr->type == ASN1_SNMP_GETBULK) {
+	    Tcl_DStringAppend(&key, Tcl_DStringValue(&ppPtr->key),
+			      Tcl_DStringLength(&ppPtr->key));
+	} else {
+	    ProxyKey(&key, ppPtr->type, NULL, reqv[i]);
+	}
+	entryPtr = Tcl_CreateHashEntry(session->proxyCache,
+				       Tcl_DStringValue(&key), &isNew);
+	if (isNew) {
+	    pePtr = (ProxyEntry *) ckalloc(sizeof(ProxyEntry));
+	    Tcl_SetHashValue(entryPtr, (ClientData) pePtr);
+	} else {
+	    pePtr = (ProxyEntry *) Tcl_GetHashValue(entryPtr);
+	    Tcl_DecrRefCount(pePtr->vbObj);
+	}
+	pePtr->vbObj = (ppPtr->type == ASN1_SNMP_GETBULK) ? respObj : respv[i];
+	Tcl_IncrRefCount(pePtr->vbObj);
+	pePtr->stamp = now;
+    }
+    Tcl_DStringFree(&key);
+
+ done:
+    Tcl_DecrRefCount(reqObj);
+    Tcl_DecrRefCount(respObj);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyClear --
+ *
+ *	This procedure removes all varbinds from the proxy cache of
+ *	a responder. Pending requests are forgotten as well if pending
+ *	is set. They are freed once the upstream session answers.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The proxy cache is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyClear(TnmSnmp *session, int pending)
+{
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    ProxyEntry *pePtr;
+    ProxyPending *ppPtr;
+
+    if (session->proxyCache) {
+	entryPtr = Tcl_FirstHashEntry(session->proxyCache, &search);
+	while (entryPtr) {
+	    pePtr = (ProxyEntry *) Tcl_GetHashValue(entryPtr);
+	    Tcl_DecrRefCount(pePtr->vbObj);
+	    ckfree((char *) pePtr);
+	    entryPtr = Tcl_NextHashEntry(&search);
+	}
+	Tcl_DeleteHashTable(session->proxyCache);
+	ckfree((char *) session->proxyCache);
+	session->proxyCache = NULL;
+    }
+
+    if (pending && session->proxyPending) {
+	entryPtr = Tcl_FirstHashEntry(session->proxyPending, &search);
+	while (entryPtr) {
+	    ppPtr = (ProxyPending *) Tcl_GetHashValue(entryPtr);
+	    ppPtr->entryPtr = NULL;
+	    entryPtr = Tcl_NextHashEntry(&search);
+	}
+	Tcl_DeleteHashTable(session->proxyPending);
+	ckfree((char *) session->proxyPending);
+	session->proxyPending = NULL;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyReply --
+ *
+ *	This procedure sends the answer to a proxied request to the
+ *	manager. The answer is remembered in the cache of answered
+ *	requests so that retransmissions are not forwarded again.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A response is sent to the manager.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyReply(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *request, TnmSnmpPdu *response)
+{
+    CacheElement *elemPtr;
+    TnmSnmpPdu *reply;
+    Tcl_Obj *vbList;
+
+    elemPtr = CacheGet(session, request);
+    reply = &elemPtr->response;
+    Tcl_Preserve((ClientData) elemPtr);
+
+    reply->type = ASN1_SNMP_RESPONSE;
+    reply->requestId = request->requestId;
+    reply->errorStatus = response->errorStatus;
+    reply->errorIndex = response->errorIndex;
+    vbList = TnmSnmpPduVarbinds((response->errorStatus == TNM_SNMP_NOERROR)
+				? response : request);
+    Tcl_IncrRefCount(vbList);
+    Tcl_DStringFree(&reply->varbind);
+    Tcl_DStringAppend(&reply->varbind, Tcl_GetString(vbList), -1);
+    Tcl_DecrRefCount(vbList);
+
+    if (TnmSnmpEncode(interp, session, reply, NULL, NULL) != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (snmp send reply)");
+	Tcl_BackgroundError(interp);
+	Tcl_ResetResult(interp);
+    }
+    Tcl_Release((ClientData) elemPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyRequest --
+ *
+ *	This procedure processes a request received by a responder
+ *	that acts as a proxy. The request is answered from the proxy
+ *	cache if possible. Otherwise it is forwarded to the upstream
+ *	session unless an identical request is already on its way.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	A request might be sent to the upstream session.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ProxyRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
+{
+    TnmSnmp *upstream;
+    TnmSnmpPdu response, forward;
+    ProxyPending *ppPtr = NULL;
+    ProxyWaiter *wPtr;
+    Tcl_HashEntry *entryPtr;
+    Tcl_Obj *vbListObj;
+    Tcl_DString key;
+    int isNew, code;
+
+    if (pdu->type != ASN1_SNMP_GET && pdu->type != ASN1_SNMP_GETNEXT
+	&& pdu->type != ASN1_SNMP_GETBULK && pdu->type != ASN1_SNMP_SET) {
+	return TCL_OK;
+    }
+
+    upstream = TnmSnmpProxySession(interp, session->proxy);
+    if (! upstream) {
+	return TCL_ERROR;
+    }
+
+    vbListObj = ProxyLookup(session, pdu);
+    if (vbListObj) {
+	memset((char *) &response, 0, sizeof(response));
+	response.errorStatus = TNM_SNMP_NOERROR;
+	Tcl_DStringInit(&response.varbind);
+	response.vbList = NULL;
+	Tcl_DStringAppend(&response.varbind, Tcl_GetString(vbListObj), -1);
+	ProxyReply(interp, session, pdu, &response);
+	Tcl_DStringFree(&response.varbind);
+	Tcl_DecrRefCount(vbListObj);
+	return TCL_OK;
+    }
+
+    if (! session->proxyPending) {
+	session->proxyPending = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(session->proxyPending, TCL_STRING_KEYS);
+    }
+
+    Tcl_DStringInit(&key);
+    ProxyKey(&key, pdu->type, pdu, NULL);
+    entryPtr = Tcl_CreateHashEntry(session->proxyPending,
+				   Tcl_DStringValue(&key), &isNew);
+
+    /*
+     * Queue the manager on a pending request unless the request
+     * should have timed out upstream, including the time spent
+     * on retransmissions.
+     */
+
+    if (! isNew) {
+	ppPtr = (ProxyPending *) Tcl_GetHashValue(entryPtr);
+	if (time((time_t *) NULL) - ppPtr->timestamp
+	    > upstream->timeout * (upstream->retries + 1) + 1) {
+	    ppPtr->entryPtr = NULL;
+	    ppPtr = NULL;
+	}
+    }
+
+    if (ppPtr) {
+	for (wPtr = ppPtr->waitPtr; wPtr; wPtr = wPtr->nextPtr) {
+	    if (wPtr->requestId == pdu->requestId
+		&& wPtr->addr.sin_addr.s_addr == pdu->addr.sin_addr.s_addr
+		&& wPtr->addr.sin_port == pdu->addr.sin_port) {
+		break;
+	    }
+	}
+	if (! wPtr) {
+	    wPtr = (ProxyWaiter *) ckalloc(sizeof(ProxyWaiter));
+	    wPtr->addr = pdu->addr;
+	    wPtr->requestId = pdu->requestId;
+	    wPtr->nextPtr = ppPtr->waitPtr;
+	    ppPtr->waitPtr = wPtr;
+	}
+	Tcl_DStringFree(&key);
+	return TCL_OK;
+    }
+
+    ppPtr = (ProxyPending *) ckalloc(sizeof(ProxyPending));
+    memset((char *) ppPtr, 0, sizeof(ProxyPending));
+    ppPtr->session = session;
+    ppPtr->entryPtr = entryPtr;
+    ppPtr->type = pdu->type;
+    ppPtr->timestamp = time((time_t *) NULL);
+    Tcl_DStringInit(&ppPtr->key);
+    Tcl_DStringAppend(&ppPtr->key, Tcl_DStringValue(&key),
+		      Tcl_DStringLength(&key));
+    Tcl_DStringInit(&ppPtr->varbind);
+    Tcl_DStringAppend(&ppPtr->varbind, Tcl_DStringValue(&pdu->varbind),
+		      Tcl_DStringLength(&pdu->varbind));
+    ppPtr->waitPtr = (ProxyWaiter *) ckalloc(sizeof(ProxyWaiter));
+    ppPtr->waitPtr->addr = pdu->addr;
+    ppPtr->waitPtr->requestId = pdu->requestId;
+    ppPtr->waitPtr->nextPtr = NULL;
+    Tcl_SetHashValue(entryPtr, (ClientData) ppPtr);
+    Tcl_Preserve((ClientData) session);
+    Tcl_DStringFree(&key);
+
+    memset((char *) &forward, 0, sizeof(forward));
+    forward.addr = upstream->maddr;
+    forward.type = pdu->type;
+    forward.requestId = TnmSnmpGetRequestId();
+    if (pdu->type == ASN1_SNMP_GETBULK) {
+	forward.errorStatus = pdu->errorStatus;
+	forward.errorIndex = pdu->errorIndex;
+    }
+    Tcl_DStringInit(&forward.varbind);
+    forward.vbList = NULL;
+    Tcl_DStringAppend(&forward.varbind, Tcl_DStringValue(&pdu->varbind),
+		      Tcl_DStringLength(&pdu->varbind));
+    code = TnmSnmpEncode(upstream->interp, upstream, &forward,
+			 ProxyProc, (ClientData) ppPtr);
+    Tcl_DStringFree(&forward.varbind);
+    if (code != TCL_OK) {
+	if (upstream->interp != interp) {
+	    Tcl_SetObjResult(interp, Tcl_GetObjResult(upstream->interp));
+	    Tcl_ResetResult(upstream->interp);
+	}
+	ProxyFree(ppPtr);
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyProc --
+ *
+ *	This procedure is called when the upstream session answers
+ *	a forwarded request or when the request times out. The answer
+ *	is saved in the proxy cache and sent to all waiting managers.
+ *	Nothing is sent if the upstream session did not respond.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Responses are sent to the managers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyProc(TnmSnmp *upstream, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    ProxyPending *ppPtr = (ProxyPending *) clientData;
+    TnmSnmp *session;
+    ProxyWaiter *wPtr;
+    TnmSnmpPdu request;
+
+    session = TnmSnmpSessionValid(ppPtr->session) ? ppPtr->session : NULL;
+
+    if (session && session->interp
+	&& pdu->errorStatus != TNM_SNMP_NORESPONSE) {
+	ProxyStore(session, ppPtr, pdu);
+	if (ppPtr->type == ASN1_SNMP_SET
+	    && pdu->errorStatus == TNM_SNMP_NOERROR) {
+	    ProxyClear(session, 0);
+	}
+	for (wPtr = ppPtr->waitPtr; wPtr; wPtr = wPtr->nextPtr) {
+	    memset((char *) &request, 0, sizeof(request));
+	    request.addr = wPtr->addr;
+	    request.type = ppPtr->type;
+	    request.requestId = wPtr->requestId;
+	    Tcl_DStringInit(&request.varbind);
+	    request.vbList = NULL;
+	    Tcl_DStringAppend(&request.varbind,
+			      Tcl_DStringValue(&ppPtr->varbind),
+			      Tcl_DStringLength(&ppPtr->varbind));
+	    ProxyReply(session->interp, session, &request, pdu);
+	    Tcl_DStringFree(&request.varbind);
+	}
+    }
+
+    ProxyFree(ppPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProxyFree --
+ *
+ *	This procedure frees a pending request of a proxy.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProxyFree(ProxyPending *ppPtr)
+{
+    ProxyWaiter *wPtr;
+
+    if (ppPtr->entryPtr) {
+	Tcl_DeleteHashEntry(ppPtr->entryPtr);
+    }
+    while (ppPtr->waitPtr) {
+	wPtr = ppPtr->waitPtr;
+	ppPtr->waitPtr = wPtr->nextPtr;
+	ckfree((char *) wPtr);
+    }
+    Tcl_DStringFree(&ppPtr->key);
+    Tcl_DStringFree(&ppPtr->varbind);
+    Tcl_Release((ClientData) ppPtr->session);
+    ckfree((char *) ppPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpSimulate --
+ *
+ *	This procedure implements the simulate command of responder
+ *	sessions. It loads the varbinds of a recorded walk which are
+ *	used to answer requests, defines the rules of the simulation
+ *	or returns some statistics.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The simulated agent of the session is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpSimulate(Tcl_Interp *interp, TnmSnmp *session, int objc, Tcl_Obj *const objv[])
+{
+    TnmSnmpSim *simPtr = session->simPtr;
+    SimData *dataPtr;
+    SimReply *replyPtr;
+    Tcl_Obj *listPtr;
+    int format = SIM_FORMAT_AUTO, delayed = 0;
+
+    enum commands { cmdClear, cmdLoad, cmdRule } cmd;
+
+    static const char *cmdTable[] = {
+	"clear", "load", "rule", (char *) NULL
+    };
+
+    if (objc == 2) {
+	if (simPtr) {
+	    for (replyPtr = simPtr->replyList; replyPtr;
+		 replyPtr = replyPtr->nextPtr) {
+		delayed++;
+	    }
+	}
+	listPtr = Tcl_GetObjResult(interp);
+	Tcl_ListObjAppendElement(interp, listPtr,
+				 Tcl_NewStringObj("objects", -1));
+	Tcl_ListObjAppendElement(interp, listPtr,
+		 Tcl_NewIntObj((simPtr && simPtr->dataPtr)
+			       ? simPtr->dataPtr->size : 0));
+	Tcl_ListObjAppendElement(interp, listPtr,
+				 Tcl_NewStringObj("drops", -1));
+	Tcl_ListObjAppendElement(interp, listPtr,
+		 Tcl_NewWideIntObj(simPtr ? simPtr->drops : 0));
+	Tcl_ListObjAppendElement(interp, listPtr,
+				 Tcl_NewStringObj("delayed", -1));
+	Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewIntObj(delayed));
+	return TCL_OK;
+    }
+
+    if (Tcl_GetIndexFromObj(interp, objv[2], cmdTable, "option",
+			    TCL_EXACT, (int *) &cmd) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    switch (cmd) {
+    case cmdClear:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 3, objv, (char *) NULL);
+	    return TCL_ERROR;
+	}
+	TnmSnmpSimFree(session);
+	break;
+
+    case cmdLoad:
+	if (objc != 4 && objc != 6) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "fileName ?-format format?");
+	    return TCL_ERROR;
+	}
+	if (objc == 6) {
+	    static const char *optTable[] = { "-format", (char *) NULL };
+	    int opt;
+	    if (Tcl_GetIndexFromObj(interp, objv[4], optTable, "option",
+				    TCL_EXACT, &opt) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    format = TnmGetTableKeyFromObj(interp, simFormatTable,
+					   objv[5], "format");
+	    if (format < 0) {
+		return TCL_ERROR;
+	    }
+	}
+	dataPtr = SimLoad(interp, objv[3], format);
+	if (! dataPtr) {
+	    return TCL_ERROR;
+	}
+	if (! simPtr) {
+	    simPtr = (TnmSnmpSim *) ckalloc(sizeof(TnmSnmpSim));
+	    memset((char *) simPtr, 0, sizeof(TnmSnmpSim));
+	    session->simPtr = simPtr;
+	}
+	if (simPtr->dataPtr) {
+	    SimDataFree(simPtr->dataPtr);
+	}
+	simPtr->dataPtr = dataPtr;
+	Tcl_GetTime(&simPtr->start);
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(dataPtr->size));
+	break;
+
+    case cmdRule:
+	if (objc < 4 || objc % 2) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "oid ?option value ...?");
+	    return TCL_ERROR;
+	}
+	if (! simPtr) {
+	    simPtr = (TnmSnmpSim *) ckalloc(sizeof(TnmSnmpSim));
+	    memset((char *) simPtr, 0, sizeof(TnmSnmpSim));
+	    session->simPtr = simPtr;
+	}
+	return SimRuleCmd(interp, simPtr, objc, objv);
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpSimFree --
+ *
+ *	This procedure frees the simulated agent of a responder. 
+ *	Delayed replies are discarded.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpSimFree(TnmSnmp *session)
+{
+    TnmSnmpSim *simPtr = session->simPtr;
+    SimReply *replyPtr;
+    SimRule *rulePtr;
+
+    if (! simPtr) {
+	return;
+    }
+
+    while (simPtr->replyList) {
+	replyPtr = simPtr->replyList;
+	simPtr->replyList = replyPtr->nextPtr;
+	Tcl_DeleteTimerHandler(replyPtr->token);
+	Tcl_DStringFree(&replyPtr->pdu.varbind);
+	ckfree((char *) replyPtr);
+    }
+    while (simPtr->ruleList) {
+	rulePtr = simPtr->ruleList;
+	simPtr->ruleList = rulePtr->nextPtr;
+	TnmOidFree(&rulePtr->oid);
+	ckfree((char *) rulePtr);
+    }
+    if (simPtr->dataPtr) {
+	SimDataFree(simPtr->dataPtr);
+    }
+    ckfree((char *) simPtr);
+    session->simPtr = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimLoad --
+ *
+ *	This procedure loads the varbinds of a recorded walk. The file
+ *	contains either the output of the snmpwalk program or a list
+ *	of varbinds in the format used by Tnm. The varbinds are shared
+ *	by all responders which load the same file as long as the file
+ *	is not modified.
+ *
+ * Results:
+ *	A pointer to the varbinds or NULL if the file could not be
+ *	loaded. An error message is left in the interpreter.
+ *
+ * Side effects:
+ *	The reference count of the varbinds is incremented.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SimData*
+SimLoad(Tcl_Interp *interp, Tcl_Obj *fileObj, int format)
+{
+    Tcl_Obj *pathObj, *contentObj, *listObj;
+    Tcl_StatBuf *statBufPtr;
+    Tcl_HashEntry *entryPtr;
+    Tcl_Channel channel;
+    Tcl_DString text;
+    SimData *dataPtr;
+    Tcl_WideInt mtime;
+    unsigned char *bytes;
+    char *p, *line;
+    Tcl_Size length;
+    int i, j, code, isNew;
+
+    pathObj = Tcl_FSGetNormalizedPath(interp, fileObj);
+    if (! pathObj) {
+	return NULL;
+    }
+
+    statBufPtr = Tcl_AllocStatBuf();
+    if (Tcl_FSStat(pathObj, statBufPtr) != 0) {
+	ckfree((char *) statBufPtr);
+	Tcl_AppendResult(interp, "couldn't read file \"",
+			 Tcl_GetString(fileObj), "\": ",
+			 Tcl_PosixError(interp), (char *) NULL);
+	return NULL;
+    }
+    mtime = Tcl_GetModificationTimeFromStat(statBufPtr);
+    ckfree((char *) statBufPtr);
+
+    if (! simDataTableInit) {
+	Tcl_InitHashTable(&simDataTable, TCL_STRING_KEYS);
+	simDataTableInit = 1;
+    }
+
+    entryPtr = Tcl_FindHashEntry(&simDataTable, Tcl_GetString(pathObj));
+    if (entryPtr) {
+	dataPtr = (SimData *) Tcl_GetHashValue(entryPtr);
+	if (dataPtr->mtime == mtime) {
+	    dataPtr->refCount++;
+	    return dataPtr;
+	}
+	Tcl_DeleteHashEntry(entryPtr);
+	dataPtr->entryPtr = NULL;
+    }
+
+    channel = Tcl_FSOpenFileChannel(interp, pathObj, "r", 0);
+    if (! channel) {
+	return NULL;
+    }
+    Tcl_SetChannelOption((Tcl_Interp *) NULL, channel,
+			 "-translation", "binary");
+    contentObj = Tcl_NewObj();
+    Tcl_IncrRefCount(contentObj);
+    if (Tcl_ReadChars(channel, contentObj, -1, 0) < 0) {
+	Tcl_AppendResult(interp, "error reading \"", Tcl_GetString(fileObj),
+			 "\": ", Tcl_PosixError(interp), (char *) NULL);
+	Tcl_Close((Tcl_Interp *) NULL, channel);
+	Tcl_DecrRefCount(contentObj);
+	return NULL;
+    }
+    Tcl_Close((Tcl_Interp *) NULL, channel);
+    bytes = Tcl_GetByteArrayFromObj(contentObj, &length);
+    Tcl_DStringInit(&text);
+    Tcl_DStringAppend(&text, (char *) bytes, length);
+
+    /*
+     * The output of snmpwalk is recognized by the equal sign which
+     * separates the name from the value in the first line.
+     */
+
+    if (format == SIM_FORMAT_AUTO) {
+	format = SIM_FORMAT_VARBINDS;
+	for (line = Tcl_DStringValue(&text); *line; line = p + 1) {
+	    p = strchr(line, '\n');
+	    if (! p) p = line + strlen(line);
+	    while (line < p && isspace((unsigned char) *line)) line++;
+	    if (line == p || *line == '#') {
+		if (! *p) break;
+		continue;
+	    }
+	    for (; line < p; line++) {
+		if (strncmp(line, " = ", 3) == 0) {
+		    format = SIM_FORMAT_WALK;
+		    break;
+		}
+	    }
+	    break;
+	}
+    }
+
+    dataPtr = (SimData *) ckalloc(sizeof(SimData));
+    memset((char *) dataPtr, 0, sizeof(SimData));
+    dataPtr->refCount = 1;
+    dataPtr->mtime = mtime;
+
+    if (format == SIM_FORMAT_WALK) {
+	code = SimParseWalk(interp, dataPtr, Tcl_DStringValue(&text));
+    } else {
+	Tcl_DString utf;
+	Tcl_ExternalToUtfDString((Tcl_Encoding) NULL, (char *) bytes,
+				 length, &utf);
+	listObj = Tcl_NewStringObj(Tcl_DStringValue(&utf),
+				   Tcl_DStringLength(&utf));
+	Tcl_IncrRefCount(listObj);
+	Tcl_DStringFree(&utf);
+	code = SimParseVarbinds(interp, dataPtr, listObj);
+	Tcl_DecrRefCount(listObj);
+    }
+    Tcl_DStringFree(&text);
+    Tcl_DecrRefCount(contentObj);
+
+    if (code != TCL_OK) {
+	SimDataFree(dataPtr);
+	return NULL;
+    }
+
+    /*
+     * Sort the varbinds and remove duplicates so that requests can
+     * be answered by a binary search.
+     */
+
+    if (dataPtr->size > 1) {
+	qsort((void *) dataPtr->entries, (size_t) dataPtr->size,
+	      sizeof(SimEntry *), SimCompare);
+    }
+    for (i = 1, j = 0; i < dataPtr->size; i++) {
+	SimEntry *entryPtr = dataPtr->entries[i];
+	if (TnmOidCompare(&dataPtr->entries[j]->oid, &entryPtr->oid) == 0) {
+	    TnmOidFree(&entryPtr->oid);
+	    ckfree(entryPtr->soid);
+	    ckfree(entryPtr->value);
+	    ckfree((char *) entryPtr);
+	} else {
+	    dataPtr->entries[++j] = entryPtr;
+	}
+    }
+    if (dataPtr->size > 0) {
+	dataPtr->size = j + 1;
+    }
+
+    entryPtr = Tcl_CreateHashEntry(&simDataTable, Tcl_GetString(pathObj),
+				   &isNew);
+    Tcl_SetHashValue(entryPtr, (ClientData) dataPtr);
+    dataPtr->entryPtr = entryPtr;
+    return dataPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimParseWalk --
+ *
+ *	This procedure parses the output of the snmpwalk program. Each
+ *	varbind starts with a line of the form "name = type: value".
+ *	Lines without an equal sign continue the value of the previous
+ *	line, which happens for long hex strings and for strings with
+ *	embedded newlines.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The varbinds are added to the simulation data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimParseWalk(Tcl_Interp *interp, SimData *dataPtr, char *text)
+{
+    char *line, *end, *p;
+    Tcl_DString vb;
+    int more, quoted;
+
+    Tcl_DStringInit(&vb);
+
+    for (line = text, more = 1; more; line = end + 1) {
+	end = strchr(line, '\n');
+	if (! end) {
+	    end = line + strlen(line);
+	    more = 0;
+	}
+	*end = '\0';
+	if (end > line && end[-1] == '\r') {
+	    end[-1] = '\0';
+	}
+
+	/*
+	 * Check whether the string value of the previous line is
+	 * still waiting for its closing quote.
+	 */
+
+	quoted = 0;
+	p = strstr(Tcl_DStringValue(&vb), " = STRING: \"");
+	if (p) {
+	    for (p += 12; *p && *p != '"'; p++) {
+		if (*p == '\\' && p[1]) p++;
+	    }
+	    quoted = (*p != '"');
+	}
+
+	if (Tcl_DStringLength(&vb) && (quoted || ! strstr(line, " = "))) {
+	    if (*line || quoted) {
+		Tcl_DStringAppend(&vb, "\n", 1);
+		Tcl_DStringAppend(&vb, line, -1);
+	    }
+	    continue;
+	}
+
+	SimWalkVarbind(dataPtr, &vb);
+	Tcl_DStringSetLength(&vb, 0);
+	if (strstr(line, " = ")) {
+	    Tcl_DStringAppend(&vb, line, -1);
+	}
+    }
+
+    SimWalkVarbind(dataPtr, &vb);
+    Tcl_DStringFree(&vb);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimWalkVarbind --
+ *
+ *	This procedure converts a varbind written by the snmpwalk
+ *	program into the representation used by Tnm. Varbinds with
+ *	types that can not be represented (or exceptions like "No Such
+ *	Object") are ignored. Octet strings are formatted with the
+ *	display hints of the MIB definitions, like received values.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The varbind is added to the simulation data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SimWalkVarbind(SimData *dataPtr, Tcl_DString *vbPtr)
+{
+    char *name, *type, *value = NULL, *p, *q, *hex, buffer[40];
+    Tcl_DString bin;
+    Tcl_Obj *fmtObj;
+    Tcl_WideUInt wide;
+    unsigned long ul;
+    int syntax = 0, n;
+
+    name = Tcl_DStringValue(vbPtr);
+    p = strstr(name, " = ");
+    if (! p) {
+	return;
+    }
+    *p = '\0';
+    type = p + 3;
+    while (*name == '.' || isspace((unsigned char) *name)) name++;
+
+    if (strcmp(type, "\"\"") == 0) {
+	(void) SimAddEntry(dataPtr, name, ASN1_OCTET_STRING, "");
+	return;
+    }
+    p = strstr(type, ": ");
+    if (! p) {
+	return;
+    }
+    *p = '\0';
+    value = p + 2;
+
+    Tcl_DStringInit(&bin);
+    if (strcmp(type, "STRING") == 0) {
+	syntax = ASN1_OCTET_STRING;
+	if (*value == '"') {
+	    for (p = value + 1; *p && *p != '"'; p++) {
+		if (*p == '\\' && p[1]) p++;
+		Tcl_DStringAppend(&bin, p, 1);
+	    }
+	} else {
+	    Tcl_DStringAppend(&bin, value, -1);
+	}
+    } else if (strcmp(type, "Hex-STRING") == 0
+	       || strcmp(type, "Network Address") == 0) {
+	for (p = value; *p; ) {
+	    if (! isxdigit((unsigned char) *p)) {
+		p++;
+		continue;
+	    }
+	    buffer[0] = (char) strtol(p, &q, 16);
+	    Tcl_DStringAppend(&bin, buffer, 1);
+	    p = q;
+	}
+	q = Tcl_DStringValue(&bin);
+	if (*type == 'H') {
+	    syntax = ASN1_OCTET_STRING;
+	} else if (Tcl_DStringLength(&bin) == 4) {
+	    syntax = ASN1_IPADDRESS;
+	    sprintf(buffer, "%u.%u.%u.%u",
+		    (unsigned char) q[0], (unsigned char) q[1],
+		    (unsigned char) q[2], (unsigned char) q[3]);
+	    value = buffer;
+	}
+    } else if (strcmp(type, "INTEGER") == 0
+	       || strcmp(type, "Integer32") == 0) {
+	p = strchr(value, '(');
+	p = p ? p + 1 : value;
+	n = (int) strtol(p, &q, 10);
+	if (q != p) {
+	    syntax = ASN1_INTEGER;
+	    sprintf(buffer, "%d", n);
+	    value = buffer;
+	}
+    } else if (strcmp(type, "Counter32") == 0
+	       || strcmp(type, "Gauge32") == 0
+	       || strcmp(type, "Unsigned32") == 0
+	       || strcmp(type, "Timeticks") == 0) {
+	p = value;
+	if (*type == 'T') {
+	    p = strchr(value, '(');
+	    p = p ? p + 1 : value;
+	}
+	ul = strtoul(p, &q, 10);
+	if (q != p) {
+	    syntax = (*type == 'C') ? ASN1_COUNTER32
+		: (*type == 'T') ? ASN1_TIMETICKS : ASN1_GAUGE32;
+	    sprintf(buffer, "%lu", ul & 0xffffffffUL);
+	    value = buffer;
+	}
+    } else if (strcmp(type, "Counter64") == 0) {
+	if (sscanf(value, "%" TCL_LL_MODIFIER "u", &wide) == 1) {
+	    syntax = ASN1_COUNTER64;
+	    sprintf(buffer, "%" TCL_LL_MODIFIER "u", wide);
+	    value = buffer;
+	}
+    } else if (strcmp(type, "OID") == 0) {
+	while (*value == '.') value++;
+	value = TnmIsOid(value) ? value : TnmMibGetOid(value);
+	syntax = value ? ASN1_OBJECT_IDENTIFIER : 0;
+    } else if (strcmp(type, "IpAddress") == 0) {
+	syntax = ASN1_IPADDRESS;
+    }
+
+    if (syntax == ASN1_OCTET_STRING) {
+	n = Tcl_DStringLength(&bin);
+	hex = ckalloc(n * 3 + 1);
+	TnmHexEnc(Tcl_DStringValue(&bin), n, hex);
+	fmtObj = n ? TnmMibFormat(name, 0, hex) : NULL;
+	if (fmtObj) {
+	    Tcl_IncrRefCount(fmtObj);
+	    (void) SimAddEntry(dataPtr, name, syntax, Tcl_GetString(fmtObj));
+	    Tcl_DecrRefCount(fmtObj);
+	} else {
+	    (void) SimAddEntry(dataPtr, name, syntax, hex);
+	}
+	ckfree(hex);
+    } else if (syntax) {
+	(void) SimAddEntry(dataPtr, name, syntax, value);
+    }
+    Tcl_DStringFree(&bin);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimParseVarbinds --
+ *
+ *	This procedure parses a list of varbinds in the format used
+ *	by Tnm, e.g. the result of a walk saved into a file. Formatted
+ *	values are converted into their raw representation.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The varbinds are added to the simulation data.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimParseVarbinds(Tcl_Interp *interp, SimData *dataPtr, Tcl_Obj *listObj)
+{
+    Tcl_Obj **objv, **vbv;
+    Tcl_Size i, objc, vbc;
+    TnmMibType *typePtr;
+    const char *value;
+    char *type, buffer[40];
+    int syntax;
+
+    if (Tcl_ListObjGetElements(interp, listObj, &objc, &objv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    for (i = 0; i < objc; i++) {
+	if (Tcl_ListObjGetElements(interp, objv[i], &vbc, &vbv) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (vbc != 3) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "illegal varbind \"",
+			     Tcl_GetString(objv[i]), "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	type = Tcl_GetString(vbv[1]);
+	if (TnmGetTableKey(tnmSnmpExceptionTable, type) >= 0) {
+	    continue;
+	}
+	syntax = TnmGetTableKey(tnmSnmpTypeTable, type);
+	if (syntax < 0) {
+	    typePtr = TnmMibFindType(type);
+	    syntax = typePtr ? typePtr->syntax : -1;
+	}
+	if (syntax < 0) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "unknown type \"", type, "\"",
+			     (char *) NULL);
+	    return TCL_ERROR;
+	}
+	value = SimScanValue(Tcl_GetString(vbv[0]), syntax,
+			     Tcl_GetString(vbv[2]), buffer);
+	if (SimAddEntry(dataPtr, Tcl_GetString(vbv[0]), syntax,
+			value) != TCL_OK) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "illegal object identifier \"",
+			     Tcl_GetString(vbv[0]), "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimScanValue --
+ *
+ *	This procedure converts a formatted numeric value into the
+ *	raw value used to answer requests. Enumerations and display
+ *	hints are scanned using the MIB definition of the object. Time
+ *	ticks may be written as "1d 00:00:00.00" or "00:00:00.00".
+ *
+ * Results:
+ *	The raw value, which may be stored in buffer, or the value
+ *	itself if no conversion applies.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+SimScanValue(const char *name, int syntax, const char *value, char *buffer)
+{
+    unsigned int d = 0, h, m, s, c = 0;
+    const char *raw;
+    char *end;
+    int n = 0;
+
+    switch (syntax) {
+    case ASN1_INTEGER:
+    case ASN1_COUNTER32:
+    case ASN1_GAUGE32:
+    case ASN1_TIMETICKS:
+    case ASN1_COUNTER64:
+	(void) strtoul(value, &end, 10);
+	if (end != value && *end == '\0') {
+	    return value;
+	}
+	break;
+    default:
+	return value;
+    }
+
+    if (syntax == ASN1_TIMETICKS) {
+	if (sscanf(value, "%ud %u:%u:%u.%u%n", &d, &h, &m, &s, &c, &n) != 5
+	    || value[n] != '\0') {
+	    d = 0;
+	    n = 0;
+	    if (sscanf(value, "%u:%u:%u.%u%n", &h, &m, &s, &c, &n) != 4) {
+		n = 0;
+	    }
+	}
+	if (n > 0 && value[n] == '\0') {
+	    sprintf(buffer, "%lu", (((((unsigned long) d * 24 + h) * 60
+				      + m) * 60 + s) * 100 + c) & 0xffffffffUL);
+	    return buffer;
+	}
+    }
+
+    raw = TnmMibScan(name, 0, value);
+    if (raw && strlen(raw) < 40) {
+	(void) strtoul(raw, &end, 10);
+	if (end != raw && *end == '\0') {
+	    strcpy(buffer, raw);
+	    return buffer;
+	}
+    }
+    return value;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimAddEntry --
+ *
+ *	This procedure adds a varbind to the simulation data. The name
+ *	is converted into an object identifier.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The array of entries may grow.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimAddEntry(SimData *dataPtr, const char *name, int syntax, const char *value)
+{
+    SimEntry *entryPtr;
+    const char *oid;
+
+    oid = TnmIsOid(name) ? name : TnmMibGetOid(name);
+    if (! oid) {
+	return TCL_ERROR;
+    }
+
+    entryPtr = (SimEntry *) ckalloc(sizeof(SimEntry));
+    TnmOidInit(&entryPtr->oid);
+    if (TnmOidFromString(&entryPtr->oid, oid) != TCL_OK
+	|| TnmOidGetLength(&entryPtr->oid) == 0) {
+	TnmOidFree(&entryPtr->oid);
+	ckfree((char *) entryPtr);
+	return TCL_ERROR;
+    }
+    entryPtr->soid = ckalloc(strlen(TnmOidToString(&entryPtr->oid)) + 1);
+    strcpy(entryPtr->soid, TnmOidToString(&entryPtr->oid));
+    entryPtr->syntax = syntax;
+    entryPtr->value = ckalloc(strlen(value) + 1);
+    strcpy(entryPtr->value, value);
+
+    if (dataPtr->size == dataPtr->space) {
+	dataPtr->space = dataPtr->space ? 2 * dataPtr->space : 256;
+	dataPtr->entries = (SimEntry **) ckrealloc((char *) dataPtr->entries,
+				   dataPtr->space * sizeof(SimEntry *));
+    }
+    dataPtr->entries[dataPtr->size++] = entryPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimCompare --
+ *
+ *	This procedure compares two entries by their object identifier.
+ *	It is used to sort the entries with qsort().
+ *
+ * Results:
+ *	Negative, zero or positive as required by qsort().
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimCompare(const void *a, const void *b)
+{
+    SimEntry *entryPtr1 = *(SimEntry **) a;
+    SimEntry *entryPtr2 = *(SimEntry **) b;
+
+    return TnmOidCompare(&entryPtr1->oid, &entryPtr2->oid);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimDataFree --
+ *
+ *	This procedure releases the simulation data. The data is freed
+ *	when it is no longer used by any responder.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SimDataFree(SimData *dataPtr)
+{
+    int i;
+
+    if (--dataPtr->refCount > 0) {
+	return;
+    }
+
+    if (dataPtr->entryPtr) {
+	Tcl_DeleteHashEntry(dataPtr->entryPtr);
+    }
+    for (i = 0; i < dataPtr->size; i++) {
+	TnmOidFree(&dataPtr->entries[i]->oid);
+	ckfree(dataPtr->entries[i]->soid);
+	ckfree(dataPtr->entries[i]->value);
+	ckfree((char *) dataPtr->entries[i]);
+    }
+    if (dataPtr->entries) {
+	ckfree((char *) dataPtr->entries);
+    }
+    ckfree((char *) dataPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimFind --
+ *
+ *	This procedure searches the entry with the given object
+ *	identifier or the next entry in lexicographic order.
+ *
+ * Results:
+ *	The index of the entry or -1 if there is no such entry.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimFind(SimData *dataPtr, TnmOid *oidPtr, int next)
+{
+    int lo = 0, hi = dataPtr->size, mid, cmp = 1;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (TnmOidCompare(&dataPtr->entries[mid]->oid, oidPtr) < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+
+    if (lo < dataPtr->size) {
+	cmp = TnmOidCompare(&dataPtr->entries[lo]->oid, oidPtr);
+    }
+    if (! next) {
+	return (cmp == 0) ? lo : -1;
+    }
+    if (cmp == 0) {
+	lo++;
+    }
+    return (lo < dataPtr->size) ? lo : -1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimFindRule --
+ *
+ *	This procedure locates the rule with the longest object
+ *	identifier that contains the given object identifier.
+ *
+ * Results:
+ *	A pointer to the rule or NULL if no rule applies.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static SimRule*
+SimFindRule(TnmSnmpSim *simPtr, TnmOid *oidPtr)
+{
+    SimRule *rulePtr, *bestPtr = NULL;
+
+    for (rulePtr = simPtr->ruleList; rulePtr; rulePtr = rulePtr->nextPtr) {
+	if (TnmOidInTree(&rulePtr->oid, oidPtr)
+	    && (! bestPtr || TnmOidGetLength(&rulePtr->oid)
+		> TnmOidGetLength(&bestPtr->oid))) {
+	    bestPtr = rulePtr;
+	}
+    }
+    return bestPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimRuleCmd --
+ *
+ *	This procedure implements the simulate rule command. A rule
+ *	applies to all objects in the subtree of an object identifier.
+ *	It defines the delay of responses, the percentage of lost
+ *	requests and the increment per second of counters. A rule
+ *	with all values 0 is removed.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The rules of the simulation are modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimRuleCmd(Tcl_Interp *interp, TnmSnmpSim *simPtr, int objc, Tcl_Obj *const objv[])
+{
+    SimRule *rulePtr, **rulePtrPtr;
+    Tcl_Obj *listPtr;
+    TnmOid *oidPtr;
+    double increment;
+    int i, delay, loss;
+
+    enum options { optDelay, optIncrement, optLoss } opt;
+
+    static const char *optTable[] = {
+	"-delay", "-increment", "-loss", (char *) NULL
+    };
+
+    oidPtr = TnmGetOidFromObj(interp, objv[3]);
+    if (! oidPtr) {
+	return TCL_ERROR;
+    }
+
+    for (rulePtrPtr = &simPtr->ruleList; *rulePtrPtr;
+	 rulePtrPtr = &(*rulePtrPtr)->nextPtr) {
+	if (TnmOidCompare(&(*rulePtrPtr)->oid, oidPtr) == 0) break;
+    }
+    rulePtr = *rulePtrPtr;
+
+    delay = rulePtr ? rulePtr->delay : 0;
+    loss = rulePtr ? rulePtr->loss : 0;
+    increment = rulePtr ? rulePtr->increment : 0;
+
+    for (i = 4; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObj(interp, objv[i], optTable, "option",
+				TCL_EXACT, (int *) &opt) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch (opt) {
+	case optDelay:
+	    if (TnmGetUnsignedFromObj(interp, objv[i+1], &delay) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case optIncrement:
+	    if (Tcl_GetDoubleFromObj(interp, objv[i+1], &increment) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (increment < 0) {
+		Tcl_SetResult(interp, "negative increment", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case optLoss:
+	    if (TnmGetIntRangeFromObj(interp, objv[i+1], 0, 100,
+				      &loss) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+    }
+
+    if (objc > 4) {
+	if (! delay && ! loss && increment == 0) {
+	    if (rulePtr) {
+		*rulePtrPtr = rulePtr->nextPtr;
+		TnmOidFree(&rulePtr->oid);
+		ckfree((char *) rulePtr);
+	    }
+	    return TCL_OK;
+	}
+	if (! rulePtr) {
+	    rulePtr = (SimRule *) ckalloc(sizeof(SimRule));
+	    TnmOidInit(&rulePtr->oid);
+	    TnmOidCopy(&rulePtr->oid, oidPtr);
+	    rulePtr->nextPtr = NULL;
+	    *rulePtrPtr = rulePtr;
+	}
+	rulePtr->delay = delay;
+	rulePtr->loss = loss;
+	rulePtr->increment = increment;
+	return TCL_OK;
+    }
+
+    listPtr = Tcl_GetObjResult(interp);
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewStringObj("-delay", -1));
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewIntObj(delay));
+    Tcl_ListObjAppendElement(interp, listPtr,
+			     Tcl_NewStringObj("-increment", -1));
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewDoubleObj(increment));
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewStringObj("-loss", -1));
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewIntObj(loss));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimAppend --
+ *
+ *	This procedure appends the varbind of an entry to a response.
+ *	Counters and time ticks covered by a rule with an increment
+ *	are advanced by the time elapsed since the varbinds were
+ *	loaded.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SimAppend(TnmSnmpSim *simPtr, TnmSnmpPdu *response, SimEntry *entryPtr)
+{
+    SimRule *rulePtr;
+    Tcl_WideUInt value;
+    Tcl_Time now;
+    double elapsed;
+    char *syntax, *valuePtr = entryPtr->value, buffer[40];
+
+    if (entryPtr->syntax == ASN1_COUNTER32
+	|| entryPtr->syntax == ASN1_COUNTER64
+	|| entryPtr->syntax == ASN1_TIMETICKS) {
+	rulePtr = SimFindRule(simPtr, &entryPtr->oid);
+	if (rulePtr && rulePtr->increment > 0
+	    && sscanf(valuePtr, "%" TCL_LL_MODIFIER "u", &value) == 1) {
+	    Tcl_GetTime(&now);
+	    elapsed = (now.sec - simPtr->start.sec)
+		+ (now.usec - simPtr->start.usec) / 1000000.0;
+	    value += (Tcl_WideUInt) (rulePtr->increment * elapsed);
+	    if (entryPtr->syntax != ASN1_COUNTER64) {
+		value &= 0xffffffff;
+	    }
+	    sprintf(buffer, "%" TCL_LL_MODIFIER "u", value);
+	    valuePtr = buffer;
+	}
+    }
+
+    Tcl_DStringStartSublist(&response->varbind);
+    Tcl_DStringAppendElement(&response->varbind, entryPtr->soid);
+    syntax = TnmGetTableValue(tnmSnmpTypeTable, (unsigned) entryPtr->syntax);
+    Tcl_DStringAppendElement(&response->varbind, syntax ? syntax : "");
+    Tcl_DStringAppendElement(&response->varbind, valuePtr);
+    Tcl_DStringEndSublist(&response->varbind);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimRequest --
+ *
+ *	This procedure answers a request received by a simulated agent
+ *	from the recorded varbinds. The rules which apply to the
+ *	requested objects decide whether the request is lost and how
+ *	long the response is delayed. Set requests are rejected since
+ *	the recorded varbinds are read-only.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	A response is sent or scheduled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SimRequest(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
+{
+    TnmSnmpSim *simPtr = session->simPtr;
+    SimData *dataPtr = simPtr->dataPtr;
+    SimRule *rulePtr;
+    SimReply *replyPtr;
+    TnmSnmpPdu *reply;
+    TnmOid *oidPtr;
+    Tcl_Obj *vbList, **vbListElems, *objPtr;
+    Tcl_Size i, vbListLen;
+    int code, idx, r, active, length, delay = 0, loss = 0;
+    int nonRepeaters, maxRepetitions, repeaters, *cursor = NULL;
+    int size, n, limit = BulkLimit(session, pdu);
+    char *soid;
+
+    if (pdu->type != ASN1_SNMP_GET && pdu->type != ASN1_SNMP_GETNEXT
+	&& pdu->type != ASN1_SNMP_GETBULK && pdu->type != ASN1_SNMP_SET) {
+	return TCL_OK;
+    }
+
+    vbList = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(vbList);
+    code = Tcl_ListObjGetElements((Tcl_Interp *) NULL, vbList,
+				  &vbListLen, &vbListElems);
+    if (code != TCL_OK) {
+	Tcl_DecrRefCount(vbList);
+	return TCL_ERROR;
+    }
+
+    for (i = 0; i < vbListLen; i++) {
+	(void) Tcl_ListObjIndex(NULL, vbListElems[i], 0, &objPtr);
+	oidPtr = objPtr ? TnmGetOidFromObj(NULL, objPtr) : NULL;
+	rulePtr = oidPtr ? SimFindRule(simPtr, oidPtr) : NULL;
+	if (rulePtr) {
+	    delay = (rulePtr->delay > delay) ? rulePtr->delay : delay;
+	    loss = (rulePtr->loss > loss) ? rulePtr->loss : loss;
+	}
+    }
+
+    if (loss > 0 && rand() % 100 < loss) {
+	simPtr->drops++;
+	Tcl_DecrRefCount(vbList);
+	return TCL_OK;
+    }
+
+    replyPtr = (SimReply *) ckalloc(sizeof(SimReply));
+    memset((char *) replyPtr, 0, sizeof(SimReply));
+    reply = &replyPtr->pdu;
+    Tcl_DStringInit(&reply->varbind);
+    reply->vbList = NULL;
+    reply->addr = pdu->addr;
+    reply->type = ASN1_SNMP_RESPONSE;
+    reply->requestId = pdu->requestId;
+    reply->errorStatus = TNM_SNMP_NOERROR;
+
+    /*
+     * Counter64 values can not be sent to SNMPv1 managers. They are
+     * skipped like an SNMPv1 agent would do.
+     */
+
+#define SIM_VISIBLE(idx) \
+    ((idx) >= 0 && (session->version != TNM_SNMPv1 \
+		    || dataPtr->entries[idx]->syntax != ASN1_COUNTER64))
+#define SIM_NEXT(idx) \
+    do { \
+	while ((idx) >= 0 && ! SIM_VISIBLE(idx)) { \
+	    (idx) = ((idx) + 1 < dataPtr->size) ? (idx) + 1 : -1; \
+	} \
+    } while (0)
+
+    switch (pdu->type) {
+    case ASN1_SNMP_SET:
+	reply->errorStatus = TNM_SNMP_NOTWRITABLE;
+	reply->errorIndex = 1;
+	break;
+
+    case ASN1_SNMP_GET:
+    case ASN1_SNMP_GETNEXT:
+	for (i = 0; i < vbListLen; i++) {
+	    (void) Tcl_ListObjIndex(NULL, vbListElems[i], 0, &objPtr);
+	    oidPtr = objPtr ? TnmGetOidFromObj(NULL, objPtr) : NULL;
+	    if (! oidPtr) {
+		reply->errorStatus = TNM_SNMP_GENERR;
+		reply->errorIndex = i+1;
+		tnmSnmpStats.snmpOutGenErrs++;
+		break;
+	    }
+	    if (pdu->type == ASN1_SNMP_GETNEXT) {
+		idx = SimFind(dataPtr, oidPtr, 1);
+		SIM_NEXT(idx);
+	    } else {
+		idx = SimFind(dataPtr, oidPtr, 0);
+		idx = SIM_VISIBLE(idx) ? idx : -1;
+	    }
+	    if (idx >= 0) {
+		SimAppend(simPtr, reply, dataPtr->entries[idx]);
+		continue;
+	    }
+	    if (session->version == TNM_SNMPv1) {
+		reply->errorStatus = TNM_SNMP_NOSUCHNAME;
+		reply->errorIndex = i+1;
+		tnmSnmpStats.snmpOutNoSuchNames++;
+		break;
+	    }
+	    soid = TnmOidToString(oidPtr);
+	    if (pdu->type == ASN1_SNMP_GET) {
+		TnmMibNode *nodePtr = TnmMibFindNode(soid, NULL, 0);
+		AppendException(reply, soid,
+				(!nodePtr || nodePtr->childPtr)
+				? "noSuchObject" : "noSuchInstance");
+	    } else {
+		AppendException(reply, soid, "endOfMibView");
+	    }
+	}
+	if (Tcl_DStringLength(&reply->varbind) >= TNM_SNMP_MAXSIZE) {
+	    reply->errorStatus = TNM_SNMP_TOOBIG;
+	    reply->errorIndex = 0;
+	}
+	break;
+
+    case ASN1_SNMP_GETBULK:
+	nonRepeaters = pdu->errorStatus;
+	if (nonRepeaters < 0) {
+	    nonRepeaters = 0;
+	} else if (nonRepeaters > vbListLen) {
+	    nonRepeaters = (int) vbListLen;
+	}
+	maxRepetitions = pdu->errorIndex < 0 ? 0 : pdu->errorIndex;
+	repeaters = (int) vbListLen - nonRepeaters;
+	if (repeaters > 0) {
+	    cursor = (int *) ckalloc(2 * repeaters * sizeof(int));
+	}
+
+	/*
+	 * The cursor array keeps the index of the next entry of each
+	 * repeater followed by the index of the last entry returned
+	 * (or -1 if the repeater did not return anything yet).
+	 */
+
+	for (i = 0; i < vbListLen; i++) {
+	    (void) Tcl_ListObjIndex(NULL, vbListElems[i], 0, &objPtr);
+	    oidPtr = objPtr ? TnmGetOidFromObj(NULL, objPtr) : NULL;
+	    if (! oidPtr) {
+		reply->errorStatus = TNM_SNMP_GENERR;
+		reply->errorIndex = i+1;
+		tnmSnmpStats.snmpOutGenErrs++;
+		goto bulkDone;
+	    }
+	    idx = SimFind(dataPtr, oidPtr, 1);
+	    SIM_NEXT(idx);
+	    if (i >= nonRepeaters) {
+		cursor[i - nonRepeaters] = idx;
+		cursor[repeaters + i - nonRepeaters] = -1;
+	    } else if (idx < 0) {
+		AppendException(reply, TnmOidToString(oidPtr), "endOfMibView");
+	    } else {
+		SimAppend(simPtr, reply, dataPtr->entries[idx]);
+	    }
+	}
+
+	size = TnmSnmpMessageSize(interp, session, reply);
+	if (size < 0) {
+	    reply->errorStatus = TNM_SNMP_GENERR;
+	    reply->errorIndex = 0;
+	    tnmSnmpStats.snmpOutGenErrs++;
+	    goto bulkDone;
+	}
+	if (size > limit) {
+	    reply->errorStatus = TNM_SNMP_TOOBIG;
+	    reply->errorIndex = 0;
+	    goto bulkDone;
+	}
+
+	for (r = 0; r < maxRepetitions; r++) {
+	    for (i = 0, active = 0; i < repeaters; i++) {
+		active += (cursor[i] >= 0);
+	    }
+	    if (r > 0 && ! active) {
+		break;
+	    }
+	    for (i = 0; i < repeaters; i++) {
+		length = Tcl_DStringLength(&reply->varbind);
+		idx = cursor[i];
+		if (idx < 0) {
+		    if (cursor[repeaters + i] >= 0) {
+			soid = dataPtr->entries[cursor[repeaters + i]]->soid;
+		    } else {
+			(void) Tcl_ListObjIndex(NULL,
+					vbListElems[nonRepeaters + i], 0,
+					&objPtr);
+			soid = TnmOidToString(TnmGetOidFromObj(NULL, objPtr));
+		    }
+		    AppendException(reply, soid, "endOfMibView");
+		} else {
+		    SimAppend(simPtr, reply, dataPtr->entries[idx]);
+		    cursor[repeaters + i] = idx;
+		    idx = (idx + 1 < dataPtr->size) ? idx + 1 : -1;
+		    SIM_NEXT(idx);
+		    cursor[i] = idx;
+		}
+		n = TnmSnmpVarBindSize(interp, session, reply,
+				Tcl_DStringValue(&reply->varbind) + length);
+		if (n < 0) {
+		    reply->errorStatus = TNM_SNMP_GENERR;
+		    reply->errorIndex = nonRepeaters + i + 1;
+		    tnmSnmpStats.snmpOutGenErrs++;
+		    goto bulkDone;
+		}
+		if (size + n > limit) {
+		    Tcl_DStringSetLength(&reply->varbind, length);
+		    goto bulkDone;
+		}
+		size += n;
+	    }
+	}
+
+    bulkDone:
+	if (cursor) {
+	    ckfree((char *) cursor);
+	}
+	break;
+    }
+
+#undef SIM_NEXT
+#undef SIM_VISIBLE
+
+    Tcl_DecrRefCount(vbList);
+
+    if (reply->errorStatus != TNM_SNMP_NOERROR) {
+	Tcl_DStringFree(&reply->varbind);
+	Tcl_DStringAppend(&reply->varbind,
+			  Tcl_DStringValue(&pdu->varbind),
+			  Tcl_DStringLength(&pdu->varbind));
+    }
+
+    if (delay > 0) {
+	replyPtr->session = session;
+	replyPtr->nextPtr = simPtr->replyList;
+	simPtr->replyList = replyPtr;
+	replyPtr->token = Tcl_CreateTimerHandler(delay, SimReplyProc,
+						 (ClientData) replyPtr);
+	return TCL_OK;
+    }
+
+    code = TnmSnmpEncode(interp, session, reply, NULL, NULL);
+    Tcl_DStringFree(&reply->varbind);
+    ckfree((char *) replyPtr);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SimReplyProc --
+ *
+ *	This procedure is called by the timer which sends a delayed
+ *	reply of a simulated agent.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A response is sent to the manager.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SimReplyProc(ClientData clientData)
+{
+    SimReply *replyPtr = (SimReply *) clientData;
+    TnmSnmp *session = replyPtr->session;
+    SimReply **replyPtrPtr = &session->simPtr->replyList;
+    Tcl_Interp *interp = session->interp;
+
+    while (*replyPtrPtr != replyPtr) {
+	replyPtrPtr = &(*replyPtrPtr)->nextPtr;
+    }
+    *replyPtrPtr = replyPtr->nextPtr;
+
+    if (TnmSnmpEncode(interp, session, &replyPtr->pdu,
+		      NULL, NULL) != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (snmp send reply)");
+	Tcl_BackgroundError(interp);
+	Tcl_ResetResult(interp);
+    }
+    Tcl_DStringFree(&replyPtr->pdu.varbind);
+    ckfree((char *) replyPtr);
+}
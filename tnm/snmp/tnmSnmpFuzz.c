@@ -0,0 +1,197 @@
+/*
+ * tnmSnmpFuzz.c --
+ *
+ *	A fuzz target for the SNMP message decoder TnmSnmpDecode. The
+ *	messages are decoded by an interpreter with SNMPv1, SNMPv2c and
+ *	SNMPv3 responders so that the agent code is exercised as well.
+ *	Compiled with TNM_LIBFUZZER defined, the target is linked with
+ *	libFuzzer. Otherwise, the program decodes the files given on
+ *	the command line or the message read from stdin, which is the
+ *	interface expected by AFL and which can be used to replay
+ *	crashing inputs. The TNM_LIBRARY environment variable must point
+ *	to the installed Tnm library if the program does not live in
+ *	the installation tree.
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/*
+ * This program creates the interpreter and thus calls Tcl directly.
+ * The Tnm objects are still initialized through the stubs table.
+ */
+
+#undef USE_TCL_STUBS
+#include <tcl.h>
+
+#include "tnmSnmp.h"
+
+#include <stdint.h>
+
+static Tcl_Interp *interp = NULL;
+
+/*
+ * The script which creates the sessions decoding the messages. The
+ * responders use ephemeral ports so that several fuzzers can run in
+ * parallel.
+ */
+
+static char initScript[] =
+    "tnm::snmp responder -port 0 -version SNMPv1\n"
+    "tnm::snmp responder -port 0 -version SNMPv2c\n"
+    "tnm::snmp responder -port 0 -version SNMPv3 -user fuzz\n";
+
+/*
+ * Forward declarations for procedures defined later in this file:
+ */
+
+static void
+FuzzInit	(const char *argv0);
+
+EXTERN int
+Tnm_Init	(Tcl_Interp *interp);
+
+int
+LLVMFuzzerTestOneInput	(const uint8_t *data, size_t size);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FuzzInit --
+ *
+ *	This procedure creates the interpreter and the responders.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The program exits if the Tnm extension can not be initialized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FuzzInit(const char *argv0)
+{
+    Tcl_FindExecutable(argv0);
+    interp = Tcl_CreateInterp();
+    if (Tcl_Init(interp) != TCL_OK
+	|| Tnm_Init(interp) != TCL_OK
+	|| Tcl_Eval(interp, initScript) != TCL_OK) {
+	fprintf(stderr, "%s: %s\n", argv0, Tcl_GetStringResult(interp));
+	exit(2);
+    }
+    Tcl_ResetResult(interp);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LLVMFuzzerTestOneInput --
+ *
+ *	This procedure decodes a single message received from the
+ *	discard port of the local host. Responses sent by the agent
+ *	code are therefore dropped.
+ *
+ * Results:
+ *	Always 0.
+ *
+ * Side effects:
+ *	The SNMP statistics are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static u_char packet[TNM_SNMP_MAXSIZE];
+    struct sockaddr_in from;
+
+    if (! interp) {
+	FuzzInit("snmpfuzz");
+    }
+    if (size > sizeof(packet)) {
+	return 0;
+    }
+
+    /*
+     * The decoder works on a private copy since the input is
+     * read-only and the decoder may decrypt in place.
+     */
+
+    memcpy(packet, data, size);
+    memset((char *) &from, 0, sizeof(from));
+    from.sin_family = AF_INET;
+    from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    from.sin_port = htons(9);
+
+    (void) TnmSnmpDecode(interp, packet, (int) size, &from,
+			 NULL, NULL, NULL, NULL);
+    Tcl_ResetResult(interp);
+    return 0;
+}
+
+#ifdef TNM_LIBFUZZER
+
+int
+LLVMFuzzerInitialize(int *argcPtr, char ***argvPtr)
+{
+    FuzzInit((*argvPtr)[0]);
+    return 0;
+}
+
+#else
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * main --
+ *
+ *	This procedure decodes the files given as arguments or the
+ *	message read from stdin if there are no arguments.
+ *
+ * Results:
+ *	The exit code is 1 if a file can not be read.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+main(int argc, char *argv[])
+{
+    static uint8_t buffer[TNM_SNMP_MAXSIZE + 1];
+    FILE *file;
+    size_t size;
+    int i, code = 0;
+
+    FuzzInit(argv[0]);
+
+    if (argc == 1) {
+	size = fread(buffer, 1, sizeof(buffer), stdin);
+	LLVMFuzzerTestOneInput(buffer, size);
+    }
+
+    for (i = 1; i < argc; i++) {
+	file = fopen(argv[i], "rb");
+	if (! file) {
+	    perror(argv[i]);
+	    code = 1;
+	    continue;
+	}
+	size = fread(buffer, 1, sizeof(buffer), file);
+	fclose(file);
+	LLVMFuzzerTestOneInput(buffer, size);
+    }
+
+    return code;
+}
+
+#endif
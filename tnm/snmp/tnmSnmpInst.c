@@ -26,6 +26,103 @@
 
 static TnmSnmpNode *instTree = NULL;
 
+/*
+ * The hash table which maps Tcl variable names to the list of
+ * instance nodes linked to the variable. It is used to remove
+ * instances without a walk through the whole tree whenever a
+ * variable is unset.
+ */
+
+static Tcl_HashTable *instVarTable = NULL;
+
+/*
+ * The number of instance nodes freed so far. Callers that keep
+ * node pointers across Tcl callbacks use it to detect that nodes
+ * may have been removed in the meantime.
+ */
+
+unsigned long tnmSnmpInstEpoch = 0;
+
+/*
+ * A conceptual table served from a Tcl array, a Tcl dict or a row
+ * command. The rows are kept in a vector sorted by their instance
+ * identifiers, which are packed into a common pool. The vector is
+ * rebuilt lazily whenever the set of rows has changed. The keys of
+ * the rows are indexed by a hash table which is used to check
+ * quickly whether a new list of rows differs from the current one.
+ */
+
+typedef struct TableColumn {
+    u_int subid;			/* Sub identifier of the column. */
+    Tcl_Obj *nameObj;			/* Descriptor of the column.	 */
+    int syntax;				/* Base syntax of the column.	 */
+    int access;				/* Access mode of the column.	 */
+} TableColumn;
+
+typedef struct TableRow {
+    Tcl_Obj *keyObj;			/* The index values of the row.	 */
+    int offset;				/* Offset of the index in pool.	 */
+    int length;				/* Length of the index.		 */
+} TableRow;
+
+typedef struct TnmSnmpTable {
+    Tcl_Interp *interp;			/* Interpreter of the table.	 */
+    TnmSnmpNode *nodePtr;		/* Entry node or NULL if gone.	 */
+    TnmOid oid;				/* Object identifier of entry.	 */
+    int labelLength;			/* Length of the entry oid.	 */
+    char *varName;			/* Variable with the rows.	 */
+    Tcl_Obj *cmdObj;			/* Command prefix for the rows.	 */
+    TnmMibNode **indexNodeList;		/* NULL terminated index list.	 */
+    int numIndex;			/* Number of index objects.	 */
+    int implied;			/* IMPLIED bit of the index.	 */
+    TableColumn *columns;		/* Columns sorted by subid.	 */
+    int numColumns;			/* Number of columns.		 */
+    TableRow *rows;			/* Rows sorted by index.	 */
+    int numRows;			/* Number of rows.		 */
+    u_int *pool;			/* Packed index values.		 */
+    int isArray;			/* The variable is an array.	 */
+    int dirty;				/* The rows must be listed again. */
+    Tcl_HashTable keyTable;		/* The keys of all listed rows.	 */
+    int maxAge;				/* Lifetime of the row list.	 */
+    Tcl_Time listed;			/* Time of the last row list.	 */
+    unsigned long generation;		/* Request of the last row list. */
+    Tcl_Obj *rowKeyObj;			/* Key of the cached row.	 */
+    Tcl_Obj *rowObj;			/* Row cached for the command.	 */
+    unsigned long rowGeneration;	/* Request of the cached row.	 */
+} TnmSnmpTable;
+
+/*
+ * The cell of a table as seen by the agent. Cells are represented
+ * by temporary nodes which hang off the table node but are not
+ * linked into the instance tree.
+ */
+
+typedef struct TableCell {
+    TnmSnmpTable *tablePtr;		/* The table of the cell.	 */
+    int column;				/* Index into the columns.	 */
+    Tcl_Obj *keyObj;			/* Index values of the row.	 */
+    Tcl_Obj *valueObj;			/* The last value retrieved.	 */
+    TnmOid oid;				/* Object identifier of cell.	 */
+} TableCell;
+
+/*
+ * The list of cell nodes created while processing requests and the
+ * number of requests processed so far. Row commands are asked for
+ * the list of rows at most once per request.
+ */
+
+static TnmSnmpNode *cellList = NULL;
+static unsigned long tableGeneration = 0;
+
+/*
+ * The pool of packed index values while the rows are sorted.
+ */
+
+static u_int *sortPool = NULL;
+
+#define TABLE_TRACE_FLAGS \
+	(TCL_GLOBAL_ONLY | TCL_TRACE_WRITES | TCL_TRACE_UNSETS)
+
 /*
  * Forward declarations for procedures defined later in this file:
  */
@@ -36,15 +133,39 @@ DumpTree                (TnmSnmpNode *instPtr);
 static void
 FreeNode		(TnmSnmpNode *inst);
 
+static int
+ChildIndex		(TnmSnmpNode *nodePtr, u_int subid);
+
+static void
+InsertChild		(TnmSnmpNode *nodePtr, int index,
+				     TnmSnmpNode *childPtr);
+static void
+RemoveChild		(TnmSnmpNode *nodePtr, TnmSnmpNode *childPtr);
+
+static char*
+VarKey			(char *tclVarName);
+
+static void
+LinkVar			(TnmSnmpNode *nodePtr, char *tclVarName);
+
+static void
+UnlinkVar		(TnmSnmpNode *nodePtr);
+
 static TnmSnmpNode*
 AddNode			(char *id, int offset, int syntax,
 				     int access, char *tclVarName);
 static void
-RemoveNode		(TnmSnmpNode *root, char *varname);
+RemoveNode		(TnmSnmpNode *nodePtr);
 
 static TnmSnmpNode*
 FindNode		(TnmSnmpNode *root, TnmOid *oidPtr);
 
+static TnmSnmpNode*
+SkipNode		(TnmSnmpNode *nodePtr);
+
+static TnmSnmpNode*
+WalkNode		(TnmSnmpNode *nodePtr);
+
 static TnmSnmpNode*
 FindNextNode		(TnmSnmpNode *root, u_int *oid, int len);
 
@@ -52,7 +173,123 @@ static char*
 DeleteNodeProc		(ClientData clientData, Tcl_Interp *interp,
 				     char *name1, char *name2, int flags);
 
-
+static void
+ReleaseProvider		(TnmSnmpNode *nodePtr);
+
+static const char*
+GetUnsigned32		(TnmSnmpNode *inst, char *buffer);
+
+static const char*
+GetUnsigned64		(TnmSnmpNode *inst, char *buffer);
+
+static const char*
+GetObj			(TnmSnmpNode *inst, char *buffer);
+
+static int
+SetObj			(Tcl_Interp *interp, TnmSnmpNode *inst,
+				     const char *value);
+static void
+FreeObj			(ClientData clientData);
+
+static TnmSnmpNode*
+NextInstance		(TnmSnmpNode *nodePtr);
+
+static TnmSnmpNode*
+TableNode		(u_int *oid, int len);
+
+static TnmMibNode*
+GetTableEntry		(Tcl_Interp *interp, char *label,
+				     TnmOid *oidPtr);
+
+static void
+ReleaseTable		(TnmSnmpTable *tablePtr);
+
+static void
+FreeTable		(char *memPtr);
+
+static char*
+TraceTableProc		(ClientData clientData, Tcl_Interp *interp,
+				     char *name1, char *name2, int flags);
+static int
+EvalTableCommand	(TnmSnmpTable *tablePtr, char *option,
+				     Tcl_Obj *keyObj, Tcl_Obj *nameObj,
+				     Tcl_Obj *valueObj);
+static int
+CompareIndex		(u_int *oid1, int len1, u_int *oid2, int len2);
+
+static int
+CompareRows		(const void *row1, const void *row2);
+
+static void
+UpdateTable		(TnmSnmpTable *tablePtr);
+
+static int
+SearchRow		(TnmSnmpTable *tablePtr, u_int *oid, int len,
+				     int *exact);
+static Tcl_Obj*
+FetchCell		(TnmSnmpTable *tablePtr, int column,
+				     Tcl_Obj *keyObj);
+static TnmSnmpNode*
+NewCell			(TnmSnmpNode *nodePtr, int column, int row);
+
+static TnmSnmpNode*
+FindCell		(TnmSnmpNode *nodePtr, u_int *oid, int len);
+
+static TnmSnmpNode*
+NextCell		(TnmSnmpNode *nodePtr, u_int *oid, int len);
+
+static const char*
+GetCell			(TnmSnmpNode *inst, char *buffer);
+
+static int
+SetCell			(Tcl_Interp *interp, TnmSnmpNode *inst,
+				     const char *value);
+static void
+FreeCell		(ClientData clientData);
+
+/*
+ * The value providers implemented in this file. The unsigned
+ * providers read counters maintained somewhere in memory. The
+ * object provider keeps the value in a Tcl_Obj.
+ */
+
+TnmSnmpProvider tnmSnmpUnsigned32Provider = {
+    "unsigned32", GetUnsigned32, NULL, NULL
+};
+
+TnmSnmpProvider tnmSnmpUnsigned64Provider = {
+    "unsigned64", GetUnsigned64, NULL, NULL
+};
+
+TnmSnmpProvider tnmSnmpObjProvider = {
+    "object", GetObj, SetObj, FreeObj
+};
+
+/*
+ * The provider used by the cells of tables.
+ */
+
+static TnmSnmpProvider tableCellProvider = {
+    "table", GetCell, SetCell, FreeCell
+};
+
+/*
+ * The table of provider functions exported to other extensions
+ * as the client data of the tnm package.
+ */
+
+TnmSnmpStubs tnmSnmpStubs = {
+    TNM_SNMP_STUBS_MAGIC,
+    TnmSnmpCreateProviderNode,
+    TnmSnmpDeleteProviderNode,
+    TnmSnmpGetNodeValue,
+    TnmSnmpSetNodeValue,
+    &tnmSnmpUnsigned32Provider,
+    &tnmSnmpUnsigned64Provider,
+    &tnmSnmpObjProvider
+};
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -73,20 +310,19 @@ DeleteNodeProc		(ClientData clientData, Tcl_Interp *interp,
 static void
 DumpTree(TnmSnmpNode *instPtr)
 {
+    int i;
+
     if (instPtr) {
         fprintf(stderr, "** %s (%s)\n",
                 instPtr->label ? instPtr->label : "(none)",
                 TnmGetTableValue(tnmMibAccessTable,
 				 (unsigned) instPtr->access));
-        if (instPtr->childPtr) {
-            DumpTree(instPtr->childPtr);
-        }
-        if (instPtr->nextPtr) {
-            DumpTree(instPtr->nextPtr);
-        }
+	for (i = 0; i < instPtr->numChildren; i++) {
+	    DumpTree(instPtr->childv[i]);
+	}
     }
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
@@ -112,8 +348,13 @@ FreeNode(TnmSnmpNode *instPtr)
 	ckfree(instPtr->label);
     }
     if (instPtr->tclVarName) {
+	UnlinkVar(instPtr);
 	ckfree(instPtr->tclVarName);
     }
+    ReleaseProvider(instPtr);
+    if (instPtr->tablePtr) {
+	ReleaseTable(instPtr->tablePtr);
+    }
     while (instPtr->bindings) {
 	TnmSnmpBinding *bindPtr = instPtr->bindings;
 	instPtr->bindings = instPtr->bindings->nextPtr;
@@ -122,9 +363,231 @@ FreeNode(TnmSnmpNode *instPtr)
 	}
 	ckfree((char *) bindPtr);
     }
+    if (instPtr->childv) {
+	ckfree((char *) instPtr->childv);
+    }
     ckfree((char *) instPtr);
+    tnmSnmpInstEpoch++;
 }
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ChildIndex --
+ *
+ *	This procedure searches the sorted array of child nodes for
+ *	the given sub identifier.
+ *
+ * Results:
+ *	The index of the first child node whose sub identifier is not
+ *	lower than subid. This is the number of child nodes if all
+ *	child nodes have a lower sub identifier.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ChildIndex(TnmSnmpNode *nodePtr, u_int subid)
+{
+    int lo = 0, hi = nodePtr->numChildren;
+
+    /*
+     * Instances are usually created in lexicographic order. Check
+     * for an append before we start the binary search.
+     */
+
+    if (hi > 0 && nodePtr->childv[hi-1]->subid < subid) {
+	return hi;
+    }
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (nodePtr->childv[mid]->subid < subid) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InsertChild --
+ *
+ *	This procedure inserts a child node at the given index of
+ *	the array of child nodes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The array of child nodes grows if necessary.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InsertChild(TnmSnmpNode *nodePtr, int index, TnmSnmpNode *childPtr)
+{
+    if (nodePtr->numChildren == nodePtr->maxChildren) {
+	nodePtr->maxChildren = nodePtr->maxChildren ? 
+	    2 * nodePtr->maxChildren : 4;
+	nodePtr->childv = (TnmSnmpNode **) ckrealloc((char *) nodePtr->childv,
+			nodePtr->maxChildren * sizeof(TnmSnmpNode *));
+    }
+    memmove(nodePtr->childv + index + 1, nodePtr->childv + index,
+	    (nodePtr->numChildren - index) * sizeof(TnmSnmpNode *));
+    nodePtr->childv[index] = childPtr;
+    nodePtr->numChildren++;
+    childPtr->parentPtr = nodePtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RemoveChild --
+ *
+ *	This procedure removes a child node from the array of child
+ *	nodes.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RemoveChild(TnmSnmpNode *nodePtr, TnmSnmpNode *childPtr)
+{
+    int index = ChildIndex(nodePtr, childPtr->subid);
+
+    if (index < nodePtr->numChildren && nodePtr->childv[index] == childPtr) {
+	nodePtr->numChildren--;
+	memmove(nodePtr->childv + index, nodePtr->childv + index + 1,
+		(nodePtr->numChildren - index) * sizeof(TnmSnmpNode *));
+	childPtr->parentPtr = NULL;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VarKey --
+ *
+ *	This procedure returns the key used to index the variable
+ *	hash table. Instance variables are global variables and the
+ *	Tcl interpreter passes fully qualified names to traces if
+ *	the variable was accessed that way. We therefore strip a
+ *	leading namespace separator.
+ *
+ * Results:
+ *	A pointer into the variable name.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char*
+VarKey(char *tclVarName)
+{
+    return (strncmp(tclVarName, "::", 2) == 0) ? tclVarName + 2 : tclVarName;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LinkVar --
+ *
+ *	This procedure links an instance node to a Tcl variable
+ *	name and adds it to the list of nodes of this variable.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The variable hash table is created if necessary.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LinkVar(TnmSnmpNode *nodePtr, char *tclVarName)
+{
+    Tcl_HashEntry *entryPtr;
+    int isNew;
+
+    if (! instVarTable) {
+	instVarTable = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(instVarTable, TCL_STRING_KEYS);
+    }
+
+    entryPtr = Tcl_CreateHashEntry(instVarTable, VarKey(tclVarName), &isNew);
+    nodePtr->tclVarName = tclVarName;
+    nodePtr->varNextPtr = isNew ? NULL 
+	: (TnmSnmpNode *) Tcl_GetHashValue(entryPtr);
+    Tcl_SetHashValue(entryPtr, (ClientData) nodePtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UnlinkVar --
+ *
+ *	This procedure removes an instance node from the list of
+ *	nodes linked to its Tcl variable name.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash entry of the variable is removed together with
+ *	the last node linked to the variable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UnlinkVar(TnmSnmpNode *nodePtr)
+{
+    Tcl_HashEntry *entryPtr;
+    TnmSnmpNode **nodePtrPtr, *headPtr;
+
+    if (! instVarTable) {
+	return;
+    }
+
+    entryPtr = Tcl_FindHashEntry(instVarTable, VarKey(nodePtr->tclVarName));
+    if (! entryPtr) {
+	return;
+    }
+
+    headPtr = (TnmSnmpNode *) Tcl_GetHashValue(entryPtr);
+    for (nodePtrPtr = &headPtr; *nodePtrPtr;
+	 nodePtrPtr = &(*nodePtrPtr)->varNextPtr) {
+	if (*nodePtrPtr == nodePtr) {
+	    *nodePtrPtr = nodePtr->varNextPtr;
+	    break;
+	}
+    }
+    nodePtr->varNextPtr = NULL;
+
+    if (headPtr) {
+	Tcl_SetHashValue(entryPtr, (ClientData) headPtr);
+    } else {
+	Tcl_DeleteHashEntry(entryPtr);
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -146,7 +609,7 @@ static TnmSnmpNode*
 AddNode(char *soid, int offset, int syntax, int access, char *tclVarName)
 {
     Tnm_Oid *oid;
-    int i, oidlen;
+    int i, idx, oidlen;
     TnmSnmpNode *p, *q = NULL;
 
     if (instTree == NULL) {
@@ -165,68 +628,52 @@ AddNode(char *soid, int offset, int syntax, int access, char *tclVarName)
     }
 
     for (p = instTree, i = 1; i < oidlen; p = q, i++) {
-	for (q = p->childPtr; q; q = q->nextPtr) {
-	    if (q->subid == oid[i]) break;
+	idx = ChildIndex(p, oid[i]);
+	if (idx < p->numChildren && p->childv[idx]->subid == oid[i]) {
+	    q = p->childv[idx];
+	    continue;
 	}
-	if (! q) {
 
-	    /*
-	     * Create new intermediate nodes.
-	     */
-
-	    TnmSnmpNode *n;
-	    char *s = TnmOidToStr(oid, i+1);
-	    
-	    n = (TnmSnmpNode *) ckalloc(sizeof(TnmSnmpNode));
-	    memset((char *) n, 0, sizeof(TnmSnmpNode));
-	    n->label = ckstrdup(s);
-	    n->subid = oid[i];
-	    n->offset = offset;
-
-	    if (! p->childPtr) {			/* first node  */
-		p->childPtr = n;
-
-	    } else if (p->childPtr->subid > oid[i]) {	/* insert head */
-		n->nextPtr = p->childPtr;
-		p->childPtr = n;
-
-	    } else {					/* somewhere else */
-		for (q = p->childPtr; q->nextPtr && q->nextPtr->subid < oid[i]; 
-		     q = q->nextPtr) ;
-		if (q->nextPtr && q->nextPtr->subid == oid[i]) {
-		    continue;
-		}
-		n->nextPtr = q->nextPtr;
-		q->nextPtr = n;
-	    }
+	/*
+	 * Create new intermediate nodes.
+	 */
 
-	    q = n;
-	}
+	q = (TnmSnmpNode *) ckalloc(sizeof(TnmSnmpNode));
+	memset((char *) q, 0, sizeof(TnmSnmpNode));
+	q->label = ckstrdup(TnmOidToStr(oid, i+1));
+	q->subid = oid[i];
+	q->offset = offset;
+	InsertChild(p, idx, q);
     }
 
     if (q) {
 	if (q->label) ckfree(q->label);
 	if (q->tclVarName && q->tclVarName != tclVarName) {
+	    UnlinkVar(q);
 	    ckfree(q->tclVarName);
+	    q->tclVarName = NULL;
 	}
 	
 	q->label  = soid;
 	q->offset = offset;
 	q->syntax = syntax;
 	q->access = access;
-	q->tclVarName = tclVarName;
+	if (tclVarName && q->tclVarName != tclVarName) {
+	    ReleaseProvider(q);
+	    LinkVar(q, tclVarName);
+	}
     }
   
     return q;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * FindNextNode --
+ * SkipNode --
  *
- *	This procedure locates the lexikographic next instance
- *	node in the instance tree.
+ *	This procedure locates the node which follows the subtree
+ *	rooted at the given node in lexicographic order.
  *
  * Results:
  *	A pointer to the node or NULL if there is no next node.
@@ -238,77 +685,1840 @@ AddNode(char *soid, int offset, int syntax, int access, char *tclVarName)
  */
 
 static TnmSnmpNode*
-FindNextNode(TnmSnmpNode *root, u_int *oid, int len)
+SkipNode(TnmSnmpNode *nodePtr)
+{
+    TnmSnmpNode *parentPtr;
+    int idx;
+
+    for (; nodePtr->parentPtr; nodePtr = parentPtr) {
+	parentPtr = nodePtr->parentPtr;
+	idx = ChildIndex(parentPtr, nodePtr->subid);
+	if (idx + 1 < parentPtr->numChildren) {
+	    return parentPtr->childv[idx + 1];
+	}
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WalkNode --
+ *
+ *	This procedure locates the node which follows the given
+ *	node in lexicographic order. This is the first child node
+ *	if there is one.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there is no next node.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+WalkNode(TnmSnmpNode *nodePtr)
 {
-    TnmSnmpNode *p, *inst;
-    static int force = 0;
+    return nodePtr->numChildren ? nodePtr->childv[0] : SkipNode(nodePtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindNextNode --
+ *
+ *	This procedure locates the lexikographic next instance
+ *	node in the instance tree. We follow the oid down the tree
+ *	as far as possible and continue with the first node that
+ *	is larger than the oid. The search does not keep any state
+ *	outside of the stack and is thus reentrant. The search is
+ *	passed on to the table once we reach a table node.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there is no next node.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+FindNextNode(TnmSnmpNode *root, u_int *oid, int len)
+{
+    TnmSnmpNode *p = root, *q = NULL;
+    int i, idx;
+
+    if (! root) {
+	return NULL;
+    }
+
+    if (len == 0 || oid[0] < root->subid) {
+	q = root;
+    } else if (oid[0] > root->subid) {
+	return NULL;
+    } else {
+	for (i = 1; ; i++) {
+	    if (p->tablePtr) {
+		q = NextCell(p, oid + i, len - i);
+		if (q) {
+		    return q;
+		}
+		q = SkipNode(p);
+		break;
+	    }
+	    if (i == len) {
+		/* found - everything below this node is larger */
+		q = WalkNode(p);
+		break;
+	    }
+	    idx = ChildIndex(p, oid[i]);
+	    if (idx == p->numChildren) {
+		/* all children are smaller - skip this subtree */
+		q = SkipNode(p);
+		break;
+	    }
+	    if (p->childv[idx]->subid != oid[i]) {
+		/* no match - the child is larger than the oid */
+		q = p->childv[idx];
+		break;
+	    }
+	    p = p->childv[idx];
+	}
+    }
+
+    return NextInstance(q);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NextInstance --
+ *
+ *	This procedure skips over all intermediate nodes which do
+ *	not represent instances, starting with the given node. Tables
+ *	are asked for their first cell.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there is no next node.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+NextInstance(TnmSnmpNode *nodePtr)
+{
+    TnmSnmpNode *cellPtr;
+
+    while (nodePtr) {
+	if (nodePtr->tablePtr) {
+	    cellPtr = NextCell(nodePtr, NULL, 0);
+	    if (cellPtr) {
+		return cellPtr;
+	    }
+	    nodePtr = SkipNode(nodePtr);
+	} else if (nodePtr->syntax) {
+	    return nodePtr;
+	} else {
+	    nodePtr = WalkNode(nodePtr);
+	}
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TableNode --
+ *
+ *	This procedure checks whether an oid is located below a node
+ *	which serves a table.
+ *
+ * Results:
+ *	A pointer to the table node or NULL if there is none.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+TableNode(u_int *oid, int len)
+{
+    TnmSnmpNode *p = instTree;
+    int i, idx;
+
+    if (! p || len == 0 || oid[0] != p->subid) {
+	return NULL;
+    }
+    for (i = 1; i < len && ! p->tablePtr; i++) {
+	idx = ChildIndex(p, oid[i]);
+	if (idx == p->numChildren || p->childv[idx]->subid != oid[i]) {
+	    return NULL;
+	}
+	p = p->childv[idx];
+    }
+    return p->tablePtr ? p : NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindNode --
+ *
+ *	This procedure locates an instance node in the instance
+ *	node tree.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there is no next node.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+FindNode(TnmSnmpNode *root, TnmOid *oidPtr)
+{
+    TnmSnmpNode *p, *q = NULL;
+    int i, idx;
+    
+    if (TnmOidGet(oidPtr, 0) != 1) return NULL;
+    for (p = root, i = 1; p && i < TnmOidGetLength(oidPtr); p = q, i++) {
+	idx = ChildIndex(p, TnmOidGet(oidPtr, i));
+	if (idx == p->numChildren 
+	    || p->childv[idx]->subid != TnmOidGet(oidPtr, i)) {
+	    return NULL; 
+	}
+	q = p->childv[idx];
+    }
+    return q;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RemoveNode --
+ *
+ *	This procedure removes an instance node from the tree.
+ *	Intermediate nodes which are left without children are
+ *	removed as well unless they carry bindings.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A node with children is kept as an intermediate node.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RemoveNode(TnmSnmpNode *nodePtr)
+{
+    TnmSnmpNode *parentPtr;
+
+    nodePtr->syntax = 0;
+    nodePtr->access = 0;
+
+    while (nodePtr != instTree && nodePtr->numChildren == 0) {
+	parentPtr = nodePtr->parentPtr;
+	RemoveChild(parentPtr, nodePtr);
+	FreeNode(nodePtr);
+	nodePtr = parentPtr;
+	if (nodePtr->syntax || nodePtr->tclVarName || nodePtr->bindings
+	    || nodePtr->tablePtr) {
+	    break;
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DeleteNodeProc --
+ *
+ *	This procedure is a variable trace callback which is called
+ *	by the Tcl interpreter whenever a MIB variable is removed.
+ *	We remove all nodes linked to the variable.
+ *
+ * Results:
+ *	Always NULL.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char*
+DeleteNodeProc(clientData, interp, name1, name2, flags)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    char *name1;
+    char *name2;
+    int flags;
+{
+    size_t len = strlen(name1);
+    char *varName;
+    Tcl_HashEntry *entryPtr = NULL;
+    TnmSnmpNode *nodePtr, *nextPtr;
+			 
+    if (name2) {
+	len += strlen(name2);
+    }
+    varName = ckalloc(len + 3);
+    strcpy(varName, name1);
+    if (name2) {
+	strcat(varName,"(");
+	strcat(varName, name2);
+	strcat(varName,")");
+    }
+
+    if (instVarTable) {
+	entryPtr = Tcl_FindHashEntry(instVarTable, VarKey(varName));
+    }
+    ckfree(varName);
+    if (! entryPtr) {
+	return NULL;
+    }
+
+    nodePtr = (TnmSnmpNode *) Tcl_GetHashValue(entryPtr);
+    Tcl_DeleteHashEntry(entryPtr);
+    for (; nodePtr; nodePtr = nextPtr) {
+	nextPtr = nodePtr->varNextPtr;
+	nodePtr->varNextPtr = NULL;
+	ckfree(nodePtr->tclVarName);
+	nodePtr->tclVarName = NULL;
+	RemoveNode(nodePtr);
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseProvider --
+ *
+ *	This procedure detaches the value provider from an instance
+ *	node and releases the provider data.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseProvider(TnmSnmpNode *nodePtr)
+{
+    if (nodePtr->providerPtr && nodePtr->providerPtr->freeProc) {
+	nodePtr->providerPtr->freeProc(nodePtr->providerData);
+    }
+    nodePtr->providerPtr = NULL;
+    nodePtr->providerData = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetUnsigned32 --
+ *
+ *	This procedure is the get procedure of the unsigned32 value
+ *	provider. The provider data points to the counter.
+ *
+ * Results:
+ *	A pointer to the value in the buffer.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+GetUnsigned32(TnmSnmpNode *inst, char *buffer)
+{
+    sprintf(buffer, "%u", *(unsigned int *) inst->providerData);
+    return buffer;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetUnsigned64 --
+ *
+ *	This procedure is the get procedure of the unsigned64 value
+ *	provider. The provider data points to the counter.
+ *
+ * Results:
+ *	A pointer to the value in the buffer.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+GetUnsigned64(TnmSnmpNode *inst, char *buffer)
+{
+    sprintf(buffer, "%" TCL_LL_MODIFIER "u",
+	    *(Tcl_WideUInt *) inst->providerData);
+    return buffer;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetObj --
+ *
+ *	This procedure is the get procedure of the object value
+ *	provider. The string representation of the object is used
+ *	directly without any variable lookup.
+ *
+ * Results:
+ *	A pointer to the string representation of the object.
+ *
+ * Side effects:
+ *	The string representation is generated if necessary.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+GetObj(TnmSnmpNode *inst, char *buffer)
+{
+    return Tcl_GetString((Tcl_Obj *) inst->providerData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetObj --
+ *
+ *	This procedure is the set procedure of the object value
+ *	provider. It replaces the object held by the instance.
+ *
+ * Results:
+ *	Always TCL_OK.
+ *
+ * Side effects:
+ *	The previous object is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SetObj(Tcl_Interp *interp, TnmSnmpNode *inst, const char *value)
+{
+    Tcl_Obj *objPtr = Tcl_NewStringObj(value, -1);
+
+    Tcl_IncrRefCount(objPtr);
+    Tcl_DecrRefCount((Tcl_Obj *) inst->providerData);
+    inst->providerData = (ClientData) objPtr;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeObj --
+ *
+ *	This procedure is the free procedure of the object value
+ *	provider.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The reference to the object is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeObj(ClientData clientData)
+{
+    Tcl_DecrRefCount((Tcl_Obj *) clientData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CreateNode --
+ *
+ *	This procedure creates a new node in the instance tree. The
+ *	value of the instance is either kept in a Tcl array variable
+ *	that will be used to access and modify the instance from
+ *	within Tcl or it is supplied by a value provider.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there was an error. An
+ *	error message is left in the interpreter.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+ 
+static TnmSnmpNode*
+CreateNode(Tcl_Interp *interp, char *label, char *tclVarName, char *defval, TnmSnmpProvider *providerPtr, ClientData clientData)
+{
+    char *soid = NULL;
+    TnmMibNode *nodePtr = TnmMibFindNode(label, NULL, 0);
+    int access, offset = 0, syntax = 0;
+    char *varName = NULL;
+    TnmSnmpNode *inst;
+
+    if (!nodePtr || nodePtr->childPtr) {
+	Tcl_AppendResult(interp, "unknown object type \"", label, "\"", 
+			 (char *) NULL);
+	return NULL;
+    }
+
+    soid = ckstrdup(TnmMibGetOid(label));
+
+    if (! TnmIsOid(soid)) {
+	Tcl_AppendResult(interp, "illegal instance identifier \"",
+			 soid, "\"", (char *) NULL);
+	goto errorExit;
+    }
+
+    /*
+     * Calculate the instance identifier. Return an error if we
+     * have no real instance. Otherwise save a pointer to the
+     * instance identifier so that we can access it later.
+     */
+
+    {
+	int oidLen;
+	Tnm_Oid *oid;
+	TnmMibNode *basePtr = NULL;
+	char *freeme = NULL;
+
+	for (oid = TnmStrToOid(soid, &oidLen); oidLen; oidLen--) {
+	    freeme = TnmOidToStr(oid, oidLen);
+	    basePtr = TnmMibFindNode(freeme, NULL, 1);
+	    if (basePtr) break;
+	}
+
+	if (! basePtr || strlen(soid) <= strlen(freeme)) {
+	    Tcl_AppendResult(interp, "instance identifier missing in \"",
+			     label, "\"", (char *) NULL);
+	    goto errorExit;
+	}
+
+	if (freeme) {
+	    offset = strlen(freeme)+1;
+	}
+    }
+
+    syntax = TnmMibGetBaseSyntax(label);
+
+    /*
+     * Check whether the instance is accessible.
+     */
+
+    access = nodePtr->access;
+    if (access == TNM_MIB_NOACCESS) {
+	Tcl_AppendResult(interp, "object \"", label, "\" is not accessible",
+			 (char *) NULL);
+	goto errorExit;
+    }
+
+    /*
+     * Check if the instance identifier is "0" for scalars. We have
+     * a scalar if the parent node is not of ASN.1 syntax SEQUENCE.
+     *
+     * XXX We should also check if the instance identifier is valid
+     * for table entries.
+     */
+
+    if (! nodePtr->parentPtr) {
+	Tcl_AppendResult(interp, "instance \"", label, "\" not allowed",
+			 (char *) NULL);
+	goto errorExit;
+    }
+
+    if (nodePtr->parentPtr && nodePtr->parentPtr->syntax != ASN1_SEQUENCE) {
+	if (strcmp(soid + offset, "0") != 0) {
+	    Tcl_AppendResult(interp, "illegal instance identifier \"",
+			     soid + offset, "\" for instance \"", label, "\"",
+			     (char *) NULL);
+	    goto errorExit;
+	}
+    }
+
+    /*
+     * Instances can not be created below a table since the table
+     * answers all requests for its cells.
+     */
+
+    {
+	int oidLen;
+	Tnm_Oid *oid = TnmStrToOid(soid, &oidLen);
+	if (oid && TableNode(oid, oidLen)) {
+	    Tcl_AppendResult(interp, "instance \"", label, 
+			     "\" belongs to a table", (char *) NULL);
+	    goto errorExit;
+	}
+    }
+
+    /*
+     * Provider nodes are created without a Tcl variable. A provider
+     * replaces the Tcl variable of an existing instance.
+     */
+
+    if (providerPtr) {
+	inst = AddNode(soid, offset, syntax, access, NULL);
+	if (! inst) {
+	    Tcl_AppendResult(interp, "illegal instance identifier \"",
+			     soid, "\"", (char *) NULL);
+	    goto errorExit;
+	}
+	ReleaseProvider(inst);
+	inst->providerPtr = providerPtr;
+	inst->providerData = clientData;
+	Tcl_ResetResult(interp);
+	return inst;
+    }
+
+    /*
+     * Now create the Tcl variable and the instance tree node.
+     * Do not use tclVarName directly because it might be a string
+     * which is not writable and Tcl likes to modify this string
+     * internally.
+     */
+
+    varName = ckstrdup(tclVarName);
+
+    if (defval) {
+	if (Tcl_SetVar(interp, varName, defval, 
+		       TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+	    goto errorExit;
+	}
+    }
+
+    inst = AddNode(soid, offset, syntax, access, varName);
+    Tcl_TraceVar(interp, varName, TCL_TRACE_UNSETS | TCL_GLOBAL_ONLY, 
+		 (Tcl_VarTraceProc *) DeleteNodeProc, (ClientData) NULL);
+    Tcl_ResetResult(interp);
+    return inst;
+
+  errorExit:
+    if (soid) ckfree(soid);
+    if (varName) ckfree(varName);
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpCreateNode --
+ *
+ *	This procedure creates a new node in the instance tree 
+ *	and a Tcl array variable that will be used to access and 
+ *	modify the instance from within Tcl.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+ 
+int
+TnmSnmpCreateNode(Tcl_Interp *interp, char *label, char *tclVarName, char *defval)
+{
+    return CreateNode(interp, label, tclVarName, defval, NULL, NULL)
+	? TCL_OK : TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpCreateProviderNode --
+ *
+ *	This procedure creates a new node in the instance tree whose
+ *	value is supplied by the given value provider. Requests for
+ *	the instance are answered without entering the interpreter
+ *	unless bindings exist for the instance.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there was an error. An
+ *	error message is left in the interpreter.
+ *
+ * Side effects:
+ *	The provider data is owned by the node. It is released with
+ *	the free procedure of the provider.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TnmSnmpNode*
+TnmSnmpCreateProviderNode(Tcl_Interp *interp, char *label, TnmSnmpProvider *providerPtr, ClientData clientData)
+{
+    return CreateNode(interp, label, NULL, NULL, providerPtr, clientData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpDeleteProviderNode --
+ *
+ *	This procedure removes an instance node created by
+ *	TnmSnmpCreateProviderNode() from the instance tree.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The provider data is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpDeleteProviderNode(TnmSnmpNode *inst)
+{
+    ReleaseProvider(inst);
+    RemoveNode(inst);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpGetNodeValue --
+ *
+ *	This procedure retrieves the value of an instance either
+ *	from its value provider or from its Tcl variable.
+ *
+ * Results:
+ *	A pointer to the value or NULL if there is no value. An
+ *	error message is left in the interpreter in this case.
+ *
+ * Side effects:
+ *	Reading the Tcl variable may trigger variable traces.
+ *
+ *----------------------------------------------------------------------
+ */
+
+const char*
+TnmSnmpGetNodeValue(Tcl_Interp *interp, TnmSnmpNode *inst, char *buffer)
+{
+    const char *value;
+
+    if (inst->providerPtr) {
+	value = inst->providerPtr->getProc(inst, buffer);
+	if (! value) {
+	    Tcl_SetResult(interp, "genErr", TCL_STATIC);
+	}
+	return value;
+    }
+    if (! inst->tclVarName) {
+	Tcl_SetResult(interp, "genErr", TCL_STATIC);
+	return NULL;
+    }
+    return Tcl_GetVar(interp, inst->tclVarName,
+		      TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpSetNodeValue --
+ *
+ *	This procedure modifies the value of an instance either
+ *	through its value provider or by writing its Tcl variable.
+ *
+ * Results:
+ *	A standard Tcl result. The interpreter result contains an
+ *	SNMP error name if the provider does not accept the value.
+ *
+ * Side effects:
+ *	Writing the Tcl variable may trigger variable traces.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpSetNodeValue(Tcl_Interp *interp, TnmSnmpNode *inst, const char *value)
+{
+    if (inst->providerPtr) {
+	if (! inst->providerPtr->setProc) {
+	    Tcl_SetResult(interp, "notWritable", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	return inst->providerPtr->setProc(interp, inst, value);
+    }
+    if (! inst->tclVarName) {
+	Tcl_SetResult(interp, "notWritable", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (Tcl_SetVar(interp, inst->tclVarName, value,
+		   TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetTableEntry --
+ *
+ *	This procedure locates the conceptual row definition of a
+ *	table. The label may name the table or the table entry. The
+ *	object identifier of the entry is written to oidPtr.
+ *
+ * Results:
+ *	A pointer to the MIB node of the entry or NULL if the label
+ *	does not identify a table. An error message is left in the
+ *	interpreter in this case.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmMibNode*
+GetTableEntry(Tcl_Interp *interp, char *label, TnmOid *oidPtr)
+{
+    TnmMibNode *entryPtr, *nodePtr;
+    int i;
+
+    entryPtr = TnmMibFindNode(label, NULL, 1);
+    if (entryPtr && entryPtr->syntax == ASN1_SEQUENCE_OF
+	&& entryPtr->childPtr) {
+	entryPtr = entryPtr->childPtr;
+    }
+    if (! entryPtr || entryPtr->syntax != ASN1_SEQUENCE || ! entryPtr->index) {
+	Tcl_AppendResult(interp, "no table \"", label, "\"", (char *) NULL);
+	return NULL;
+    }
+
+    for (nodePtr = entryPtr, i = 0; nodePtr; nodePtr = nodePtr->parentPtr) {
+	i++;
+    }
+    TnmOidSetLength(oidPtr, i);
+    for (nodePtr = entryPtr; nodePtr; nodePtr = nodePtr->parentPtr) {
+	TnmOidSet(oidPtr, --i, nodePtr->subid);
+    }
+    return entryPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseTable --
+ *
+ *	This procedure detaches a table from its node in the instance
+ *	tree. The table is freed once no cell refers to it anymore.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The trace on the Tcl variable of the table is removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseTable(TnmSnmpTable *tablePtr)
+{
+    if (tablePtr->varName) {
+	Tcl_UntraceVar(tablePtr->interp, tablePtr->varName, TABLE_TRACE_FLAGS,
+		       (Tcl_VarTraceProc *) TraceTableProc,
+		       (ClientData) tablePtr);
+    }
+    if (tablePtr->nodePtr) {
+	tablePtr->nodePtr->tablePtr = NULL;
+	tablePtr->nodePtr = NULL;
+    }
+    tnmSnmpInstEpoch++;
+    Tcl_EventuallyFree((ClientData) tablePtr, (Tcl_FreeProc *) FreeTable);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeTable --
+ *
+ *	This procedure is invoked by Tcl_EventuallyFree or Tcl_Release
+ *	to free all resources of a table.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeTable(char *memPtr)
+{
+    TnmSnmpTable *tablePtr = (TnmSnmpTable *) memPtr;
+    int i;
+
+    for (i = 0; i < tablePtr->numColumns; i++) {
+	Tcl_DecrRefCount(tablePtr->columns[i].nameObj);
+    }
+    for (i = 0; i < tablePtr->numRows; i++) {
+	Tcl_DecrRefCount(tablePtr->rows[i].keyObj);
+    }
+    if (tablePtr->columns) ckfree((char *) tablePtr->columns);
+    if (tablePtr->rows) ckfree((char *) tablePtr->rows);
+    if (tablePtr->pool) ckfree((char *) tablePtr->pool);
+    if (tablePtr->indexNodeList) ckfree((char *) tablePtr->indexNodeList);
+    if (tablePtr->varName) ckfree(tablePtr->varName);
+    if (tablePtr->cmdObj) Tcl_DecrRefCount(tablePtr->cmdObj);
+    if (tablePtr->rowKeyObj) Tcl_DecrRefCount(tablePtr->rowKeyObj);
+    if (tablePtr->rowObj) Tcl_DecrRefCount(tablePtr->rowObj);
+    Tcl_DeleteHashTable(&tablePtr->keyTable);
+    TnmOidFree(&tablePtr->oid);
+    ckfree((char *) tablePtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TraceTableProc --
+ *
+ *	This procedure is a variable trace callback which is called
+ *	whenever the Tcl variable of a table is modified. The rows
+ *	are rebuilt if the modification may have changed the set of
+ *	rows. Writes to known elements of an array only change the
+ *	values of a row.
+ *
+ * Results:
+ *	Always NULL.
+ *
+ * Side effects:
+ *	The trace is created again if the variable was unset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char*
+TraceTableProc(clientData, interp, name1, name2, flags)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    char *name1;
+    char *name2;
+    int flags;
+{
+    TnmSnmpTable *tablePtr = (TnmSnmpTable *) clientData;
+
+    if ((flags & TCL_TRACE_WRITES) && name2 && tablePtr->isArray
+	&& Tcl_FindHashEntry(&tablePtr->keyTable, name2)) {
+	return NULL;
+    }
+    tablePtr->dirty = 1;
+    if ((flags & TCL_TRACE_DESTROYED) && ! (flags & TCL_INTERP_DESTROYED)) {
+	Tcl_TraceVar(interp, tablePtr->varName, TABLE_TRACE_FLAGS,
+		     (Tcl_VarTraceProc *) TraceTableProc, clientData);
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EvalTableCommand --
+ *
+ *	This procedure evaluates the row command of a table with the
+ *	given option and arguments appended.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Arbitrary side effects since a command is evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EvalTableCommand(TnmSnmpTable *tablePtr, char *option, Tcl_Obj *keyObj, Tcl_Obj *nameObj, Tcl_Obj *valueObj)
+{
+    Tcl_Obj *cmdObj;
+    int code;
+
+    cmdObj = Tcl_DuplicateObj(tablePtr->cmdObj);
+    Tcl_IncrRefCount(cmdObj);
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj(option, -1));
+    if (keyObj) {
+	Tcl_ListObjAppendElement(NULL, cmdObj, keyObj);
+    }
+    if (nameObj) {
+	Tcl_ListObjAppendElement(NULL, cmdObj, nameObj);
+    }
+    if (valueObj) {
+	Tcl_ListObjAppendElement(NULL, cmdObj, valueObj);
+    }
+    code = Tcl_EvalObjEx(tablePtr->interp, cmdObj, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(cmdObj);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareIndex --
+ *
+ *	This procedure compares two instance identifiers in
+ *	lexicographic order.
+ *
+ * Results:
+ *	An integer less than, equal to or greater than zero.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompareIndex(u_int *oid1, int len1, u_int *oid2, int len2)
+{
+    int i;
+
+    for (i = 0; i < len1 && i < len2; i++) {
+	if (oid1[i] != oid2[i]) {
+	    return (oid1[i] < oid2[i]) ? -1 : 1;
+	}
+    }
+    return (len1 < len2) ? -1 : (len1 > len2);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompareRows --
+ *
+ *	This procedure is used by qsort() to sort the rows of a table.
+ *	The packed index values are taken from the sortPool.
+ *
+ * Results:
+ *	An integer less than, equal to or greater than zero.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CompareRows(const void *row1, const void *row2)
+{
+    const TableRow *r1 = (const TableRow *) row1;
+    const TableRow *r2 = (const TableRow *) row2;
+
+    return CompareIndex(sortPool + r1->offset, r1->length,
+			sortPool + r2->offset, r2->length);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UpdateTable --
+ *
+ *	This procedure rebuilds the sorted vector of rows if the set
+ *	of rows may have changed. The rows of a variable are listed
+ *	again after the traces have seen a modification which may add
+ *	or remove a row. The row command is asked at most once per
+ *	request and only if the last list is older than the maximum
+ *	age of the table or if a set request went through the command.
+ *	The rows are rebuilt only if a key of the new list is missing
+ *	in the key table or if the number of keys differs. The index
+ *	values of every row are packed with TnmMibPack(). Rows with
+ *	index values that can not be packed are ignored.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The row command is evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UpdateTable(TnmSnmpTable *tablePtr)
+{
+    Tcl_Interp *interp = tablePtr->interp;
+    Tcl_Obj *listObj, *objPtr, *keyObj, **keyv, **idxv, *objv[3];
+    Tcl_Size i, keyc, idxc;
+    int n, done, isNew, size = 0, used = 0;
+    Tcl_DictSearch search;
+    TableRow *rowPtr;
+    Tcl_Time now;
+    TnmOid oid;
+
+    if (tablePtr->cmdObj) {
+	if (tablePtr->generation == tableGeneration) {
+	    return;
+	}
+	Tcl_GetTime(&now);
+	if (! tablePtr->dirty
+	    && (now.sec - tablePtr->listed.sec) * 1000
+	       + (now.usec - tablePtr->listed.usec) / 1000 < tablePtr->maxAge) {
+	    return;
+	}
+	tablePtr->generation = tableGeneration;
+	tablePtr->listed = now;
+	if (EvalTableCommand(tablePtr, "rows", NULL, NULL, NULL) != TCL_OK) {
+	    Tcl_AddErrorInfo(interp, "\n    (snmp table rows)");
+	    Tcl_BackgroundError(interp);
+	    listObj = Tcl_NewObj();
+	} else {
+	    listObj = Tcl_GetObjResult(interp);
+	}
+	Tcl_IncrRefCount(listObj);
+	Tcl_ResetResult(interp);
+    } else {
+	if (! tablePtr->dirty) {
+	    return;
+	}
+	objPtr = Tcl_GetVar2Ex(interp, tablePtr->varName, NULL,
+			       TCL_GLOBAL_ONLY);
+	tablePtr->isArray = (objPtr == NULL);
+	if (objPtr) {
+	    listObj = Tcl_NewObj();
+	    Tcl_IncrRefCount(listObj);
+	    if (Tcl_DictObjFirst(NULL, objPtr, &search, &keyObj, NULL,
+				 &done) == TCL_OK) {
+		for (; ! done; Tcl_DictObjNext(&search, &keyObj, NULL, &done)) {
+		    Tcl_ListObjAppendElement(NULL, listObj, keyObj);
+		}
+		Tcl_DictObjDone(&search);
+	    }
+	} else {
+	    objv[0] = Tcl_NewStringObj("array", -1);
+	    objv[1] = Tcl_NewStringObj("names", -1);
+	    objv[2] = Tcl_NewStringObj(tablePtr->varName, -1);
+	    for (i = 0; i < 3; i++) {
+		Tcl_IncrRefCount(objv[i]);
+	    }
+	    if (Tcl_EvalObjv(interp, 3, objv, TCL_EVAL_GLOBAL) == TCL_OK) {
+		listObj = Tcl_GetObjResult(interp);
+	    } else {
+		listObj = Tcl_NewObj();
+	    }
+	    Tcl_IncrRefCount(listObj);
+	    Tcl_ResetResult(interp);
+	    for (i = 0; i < 3; i++) {
+		Tcl_DecrRefCount(objv[i]);
+	    }
+	}
+    }
+    tablePtr->dirty = 0;
+
+    /*
+     * Keep the rows if the new list has the same keys. Keys which
+     * appear twice in the list make the lengths differ, which only
+     * means that the rows are rebuilt.
+     */
+
+    if (Tcl_ListObjGetElements(NULL, listObj, &keyc, &keyv) != TCL_OK) {
+	keyc = 0;
+    }
+    if (keyc == tablePtr->keyTable.numEntries) {
+	for (i = 0; i < keyc; i++) {
+	    if (! Tcl_FindHashEntry(&tablePtr->keyTable,
+				    Tcl_GetString(keyv[i]))) {
+		break;
+	    }
+	}
+	if (i == keyc) {
+	    Tcl_DecrRefCount(listObj);
+	    return;
+	}
+    }
+
+    /*
+     * Throw the old rows away and pack the index values of the new
+     * rows into the pool.
+     */
+
+    for (i = 0; i < tablePtr->numRows; i++) {
+	Tcl_DecrRefCount(tablePtr->rows[i].keyObj);
+    }
+    if (tablePtr->rows) {
+	ckfree((char *) tablePtr->rows);
+	tablePtr->rows = NULL;
+    }
+    if (tablePtr->pool) {
+	ckfree((char *) tablePtr->pool);
+	tablePtr->pool = NULL;
+    }
+    tablePtr->numRows = 0;
+    Tcl_DeleteHashTable(&tablePtr->keyTable);
+    Tcl_InitHashTable(&tablePtr->keyTable, TCL_STRING_KEYS);
+
+    if (keyc > 0) {
+	size = (int) keyc * (tablePtr->numIndex + 1);
+	tablePtr->rows = (TableRow *) ckalloc(keyc * sizeof(TableRow));
+	tablePtr->pool = (u_int *) ckalloc(size * sizeof(u_int));
+    }
+
+    TnmOidInit(&oid);
+    for (i = 0; i < keyc; i++) {
+	Tcl_CreateHashEntry(&tablePtr->keyTable,
+			    Tcl_GetString(keyv[i]), &isNew);
+	TnmOidSetLength(&oid, 0);
+	if (Tcl_ListObjGetElements(NULL, keyv[i], &idxc, &idxv) != TCL_OK
+	    || idxc != tablePtr->numIndex
+	    || TnmMibPack(interp, &oid, (int) idxc, idxv, tablePtr->implied,
+			  tablePtr->indexNodeList) != TCL_OK) {
+	    Tcl_ResetResult(interp);
+	    continue;
+	}
+	n = TnmOidGetLength(&oid);
+	if (used + n > size) {
+	    while (used + n > size) {
+		size *= 2;
+	    }
+	    tablePtr->pool = (u_int *) ckrealloc((char *) tablePtr->pool,
+						 size * sizeof(u_int));
+	}
+	memcpy((char *) (tablePtr->pool + used),
+	       (char *) TnmOidGetElements(&oid), n * sizeof(u_int));
+	rowPtr = tablePtr->rows + tablePtr->numRows++;
+	rowPtr->keyObj = keyv[i];
+	Tcl_IncrRefCount(rowPtr->keyObj);
+	rowPtr->offset = used;
+	rowPtr->length = n;
+	used += n;
+    }
+    TnmOidFree(&oid);
+    Tcl_DecrRefCount(listObj);
+
+    /*
+     * Sort the rows and remove rows with the same index.
+     */
+
+    sortPool = tablePtr->pool;
+    qsort((char *) tablePtr->rows, (size_t) tablePtr->numRows,
+	  sizeof(TableRow), CompareRows);
+    for (i = 0, n = 0; i < tablePtr->numRows; i++) {
+	if (n > 0 && CompareRows(tablePtr->rows + n - 1,
+				 tablePtr->rows + i) == 0) {
+	    Tcl_DecrRefCount(tablePtr->rows[i].keyObj);
+	    continue;
+	}
+	tablePtr->rows[n++] = tablePtr->rows[i];
+    }
+    tablePtr->numRows = n;
+    sortPool = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SearchRow --
+ *
+ *	This procedure searches the sorted rows of a table for the
+ *	given index.
+ *
+ * Results:
+ *	The position of the first row whose index is not lower than
+ *	the given index. The exact parameter is set to 1 if the row
+ *	matches the index.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SearchRow(TnmSnmpTable *tablePtr, u_int *oid, int len, int *exact)
+{
+    int lo = 0, hi = tablePtr->numRows, mid;
+    TableRow *rowPtr;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	rowPtr = tablePtr->rows + mid;
+	if (CompareIndex(tablePtr->pool + rowPtr->offset, rowPtr->length,
+			 oid, len) < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    rowPtr = tablePtr->rows + lo;
+    *exact = (lo < tablePtr->numRows
+	      && CompareIndex(tablePtr->pool + rowPtr->offset, rowPtr->length,
+			      oid, len) == 0);
+    return lo;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FetchCell --
+ *
+ *	This procedure retrieves the value of a cell. Rows are dicts
+ *	which map column descriptors to values. They are read from
+ *	the array element or the dict element named by the index
+ *	values or returned by the get option of the row command. The
+ *	row returned by the command is kept for the current request.
+ *
+ * Results:
+ *	A pointer to the value or NULL if the cell does not exist.
+ *
+ * Side effects:
+ *	Variable traces or the row command may be evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+FetchCell(TnmSnmpTable *tablePtr, int column, Tcl_Obj *keyObj)
+{
+    Tcl_Interp *interp = tablePtr->interp;
+    Tcl_Obj *objPtr, *rowObj = NULL, *valueObj = NULL;
+
+    if (tablePtr->cmdObj) {
+	if (tablePtr->rowKeyObj != keyObj
+	    || tablePtr->rowGeneration != tableGeneration) {
+	    if (tablePtr->rowKeyObj) {
+		Tcl_DecrRefCount(tablePtr->rowKeyObj);
+	    }
+	    if (tablePtr->rowObj) {
+		Tcl_DecrRefCount(tablePtr->rowObj);
+		tablePtr->rowObj = NULL;
+	    }
+	    tablePtr->rowKeyObj = keyObj;
+	    Tcl_IncrRefCount(keyObj);
+	    tablePtr->rowGeneration = tableGeneration;
+	    if (EvalTableCommand(tablePtr, "get", keyObj, NULL, NULL) == TCL_OK) {
+		tablePtr->rowObj = Tcl_GetObjResult(interp);
+		Tcl_IncrRefCount(tablePtr->rowObj);
+	    }
+	    Tcl_ResetResult(interp);
+	}
+	rowObj = tablePtr->rowObj;
+    } else if (tablePtr->isArray) {
+	rowObj = Tcl_GetVar2Ex(interp, tablePtr->varName,
+			       Tcl_GetString(keyObj), TCL_GLOBAL_ONLY);
+    } else {
+	objPtr = Tcl_GetVar2Ex(interp, tablePtr->varName, NULL,
+			       TCL_GLOBAL_ONLY);
+	if (objPtr && Tcl_DictObjGet(NULL, objPtr, keyObj, &rowObj) != TCL_OK) {
+	    rowObj = NULL;
+	}
+    }
+
+    if (rowObj && Tcl_DictObjGet(NULL, rowObj,
+				 tablePtr->columns[column].nameObj,
+				 &valueObj) != TCL_OK) {
+	valueObj = NULL;
+    }
+    return valueObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewCell --
+ *
+ *	This procedure creates the node which represents a cell of a
+ *	table while a request is processed. The node is not linked
+ *	into the instance tree. Its parent is the deepest node of the
+ *	instance tree on the path to the cell so that bindings are
+ *	found as usual.
+ *
+ * Results:
+ *	A pointer to the new node.
+ *
+ * Side effects:
+ *	The node is added to the list of cells released by
+ *	TnmSnmpReleaseCells().
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+NewCell(TnmSnmpNode *nodePtr, int column, int row)
+{
+    TnmSnmpTable *tablePtr = nodePtr->tablePtr;
+    TableColumn *colPtr = tablePtr->columns + column;
+    TableRow *rowPtr = tablePtr->rows + row;
+    TableCell *cellPtr;
+    TnmSnmpNode *inst, *p;
+    char subid[16];
+    u_int *oid;
+    int i, idx, len;
+
+    cellPtr = (TableCell *) ckalloc(sizeof(TableCell));
+    cellPtr->tablePtr = tablePtr;
+    Tcl_Preserve((ClientData) tablePtr);
+    cellPtr->column = column;
+    cellPtr->keyObj = rowPtr->keyObj;
+    Tcl_IncrRefCount(cellPtr->keyObj);
+    cellPtr->valueObj = NULL;
+    TnmOidInit(&cellPtr->oid);
+    TnmOidCopy(&cellPtr->oid, &tablePtr->oid);
+    TnmOidAppend(&cellPtr->oid, colPtr->subid);
+    for (i = 0; i < rowPtr->length; i++) {
+	TnmOidAppend(&cellPtr->oid, tablePtr->pool[rowPtr->offset + i]);
+    }
+    oid = TnmOidGetElements(&cellPtr->oid);
+    len = TnmOidGetLength(&cellPtr->oid);
+
+    inst = (TnmSnmpNode *) ckalloc(sizeof(TnmSnmpNode));
+    memset((char *) inst, 0, sizeof(TnmSnmpNode));
+    inst->label = ckstrdup(TnmOidToString(&cellPtr->oid));
+    inst->offset = tablePtr->labelLength + 1
+	+ sprintf(subid, "%u", colPtr->subid) + 1;
+    inst->syntax = colPtr->syntax;
+    inst->access = colPtr->access;
+    inst->subid = oid[len - 1];
+    inst->providerPtr = &tableCellProvider;
+    inst->providerData = (ClientData) cellPtr;
+
+    for (p = nodePtr, i = TnmOidGetLength(&tablePtr->oid); i < len; i++) {
+	idx = ChildIndex(p, oid[i]);
+	if (idx == p->numChildren || p->childv[idx]->subid != oid[i]) {
+	    break;
+	}
+	p = p->childv[idx];
+    }
+    inst->parentPtr = p;
+
+    inst->varNextPtr = cellList;
+    cellList = inst;
+    return inst;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindCell --
+ *
+ *	This procedure locates a cell of the table served by the
+ *	given node. The oid is the part of the instance identifier
+ *	following the table entry.
+ *
+ * Results:
+ *	A pointer to the cell node or NULL if there is no such cell.
+ *
+ * Side effects:
+ *	The rows of the table may be rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+FindCell(TnmSnmpNode *nodePtr, u_int *oid, int len)
+{
+    TnmSnmpTable *tablePtr = nodePtr->tablePtr;
+    TnmSnmpNode *inst = NULL;
+    int c, r, exact;
+
+    if (len < 2) {
+	return NULL;
+    }
+
+    Tcl_Preserve((ClientData) tablePtr);
+    UpdateTable(tablePtr);
+    for (c = 0; c < tablePtr->numColumns; c++) {
+	if (tablePtr->columns[c].subid == oid[0]) break;
+    }
+    if (c < tablePtr->numColumns && tablePtr->nodePtr) {
+	r = SearchRow(tablePtr, oid + 1, len - 1, &exact);
+	if (exact && FetchCell(tablePtr, c, tablePtr->rows[r].keyObj)
+	    && tablePtr->nodePtr && r < tablePtr->numRows) {
+	    inst = NewCell(nodePtr, c, r);
+	}
+    }
+    Tcl_Release((ClientData) tablePtr);
+    return inst;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NextCell --
+ *
+ *	This procedure locates the cell of the table served by the
+ *	given node which follows the oid in lexicographic order. The
+ *	oid is the part of the instance identifier following the
+ *	table entry. The search starts with a binary search in the
+ *	sorted rows and continues with the following rows and
+ *	columns until a row is found which has a value for the
+ *	column.
+ *
+ * Results:
+ *	A pointer to the cell node or NULL if there is no next cell
+ *	in this table.
+ *
+ * Side effects:
+ *	The rows of the table may be rebuilt.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpNode*
+NextCell(TnmSnmpNode *nodePtr, u_int *oid, int len)
+{
+    TnmSnmpTable *tablePtr = nodePtr->tablePtr;
+    TnmSnmpNode *inst = NULL;
+    Tcl_Obj *valueObj;
+    int c = 0, r = 0, exact;
+
+    Tcl_Preserve((ClientData) tablePtr);
+    UpdateTable(tablePtr);
+    if (len > 0) {
+	while (c < tablePtr->numColumns && tablePtr->columns[c].subid < oid[0]) {
+	    c++;
+	}
+	if (c < tablePtr->numColumns && tablePtr->columns[c].subid == oid[0]) {
+	    r = SearchRow(tablePtr, oid + 1, len - 1, &exact);
+	    r += exact;
+	}
+    }
+    for (; c < tablePtr->numColumns; c++, r = 0) {
+	for (; r < tablePtr->numRows; r++) {
+	    valueObj = FetchCell(tablePtr, c, tablePtr->rows[r].keyObj);
+	    if (! tablePtr->nodePtr) {
+		goto done;
+	    }
+	    if (valueObj && r < tablePtr->numRows) {
+		inst = NewCell(nodePtr, c, r);
+		goto done;
+	    }
+	}
+    }
+
+  done:
+    Tcl_Release((ClientData) tablePtr);
+    return inst;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetCell --
+ *
+ *	This procedure is the get procedure of table cells. The value
+ *	is retrieved again since a get binding may have modified it.
+ *
+ * Results:
+ *	A pointer to the value or NULL if the cell is gone.
+ *
+ * Side effects:
+ *	The value is kept with the cell until the cell is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+GetCell(TnmSnmpNode *inst, char *buffer)
+{
+    TableCell *cellPtr = (TableCell *) inst->providerData;
+    Tcl_Obj *valueObj;
+
+    if (! cellPtr->tablePtr->nodePtr) {
+	return NULL;
+    }
+    valueObj = FetchCell(cellPtr->tablePtr, cellPtr->column, cellPtr->keyObj);
+    if (! valueObj) {
+	return NULL;
+    }
+    Tcl_IncrRefCount(valueObj);
+    if (cellPtr->valueObj) {
+	Tcl_DecrRefCount(cellPtr->valueObj);
+    }
+    cellPtr->valueObj = valueObj;
+    return Tcl_GetString(valueObj);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetCell --
+ *
+ *	This procedure is the set procedure of table cells. The value
+ *	is written into the row dict of the array or the dict, or it
+ *	is passed to the set option of the row command.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The Tcl variable of the table is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SetCell(Tcl_Interp *interp, TnmSnmpNode *inst, const char *value)
+{
+    TableCell *cellPtr = (TableCell *) inst->providerData;
+    TnmSnmpTable *tablePtr = cellPtr->tablePtr;
+    Tcl_Obj *nameObj, *objPtr, *valueObj, *keyv[2];
+    char *key;
+    int code, shared;
+
+    if (! tablePtr->nodePtr) {
+	Tcl_SetResult(interp, "genErr", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    nameObj = tablePtr->columns[cellPtr->column].nameObj;
+    valueObj = Tcl_NewStringObj(value, -1);
+    Tcl_IncrRefCount(valueObj);
+
+    if (tablePtr->cmdObj) {
+	code = EvalTableCommand(tablePtr, "set", cellPtr->keyObj, nameObj,
+				valueObj);
+	tablePtr->rowGeneration = 0;
+	tablePtr->dirty = 1;
+	Tcl_DecrRefCount(valueObj);
+	return code;
+    }
+
+    key = tablePtr->isArray ? Tcl_GetString(cellPtr->keyObj) : NULL;
+    objPtr = Tcl_GetVar2Ex(interp, tablePtr->varName, key,
+			   TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG);
+    if (! objPtr) {
+	Tcl_DecrRefCount(valueObj);
+	return TCL_ERROR;
+    }
+    shared = Tcl_IsShared(objPtr);
+    if (shared) {
+	objPtr = Tcl_DuplicateObj(objPtr);
+	Tcl_IncrRefCount(objPtr);
+    }
+    if (key) {
+	code = Tcl_DictObjPut(interp, objPtr, nameObj, valueObj);
+    } else {
+	keyv[0] = cellPtr->keyObj;
+	keyv[1] = nameObj;
+	code = Tcl_DictObjPutKeyList(interp, objPtr, 2, keyv, valueObj);
+    }
+    if (code == TCL_OK
+	&& Tcl_SetVar2Ex(interp, tablePtr->varName, key, objPtr,
+			 TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
+	code = TCL_ERROR;
+    }
+    if (shared) {
+	Tcl_DecrRefCount(objPtr);
+    }
+    Tcl_DecrRefCount(valueObj);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeCell --
+ *
+ *	This procedure is the free procedure of table cells.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The table is freed if it was deleted and this was the last
+ *	cell referring to it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeCell(ClientData clientData)
+{
+    TableCell *cellPtr = (TableCell *) clientData;
+
+    Tcl_DecrRefCount(cellPtr->keyObj);
+    if (cellPtr->valueObj) {
+	Tcl_DecrRefCount(cellPtr->valueObj);
+    }
+    TnmOidFree(&cellPtr->oid);
+    Tcl_Release((ClientData) cellPtr->tablePtr);
+    ckfree((char *) cellPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpCreateTable --
+ *
+ *	This procedure registers a conceptual table which is served
+ *	from a Tcl variable or from a row command. The variable is
+ *	either an array whose element names are the index values of
+ *	the rows or a dict whose keys are the index values. Every row
+ *	is a dict which maps column descriptors to values. The row
+ *	command is called with the options rows, get and set to list
+ *	the rows, to retrieve a row and to modify a cell. The list of
+ *	rows is kept for maxAge milliseconds. No instance nodes are
+ *	created for the cells of the table.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	A table registered before for the same table is replaced.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    /*
-     * Reset the force flag if we start a new search from the root of
-     * the instance tree. The flag will be set whenever we decide that
-     * the next instance we find will be a good candidate.
-     */
+int
+TnmSnmpCreateTable(Tcl_Interp *interp, char *label, char *varName, Tcl_Obj *cmdObj, int maxAge)
+{
+    TnmMibNode *entryPtr, *indexPtr, *colPtr;
+    TnmSnmpTable *tablePtr;
+    TnmSnmpNode *nodePtr;
+    TableColumn column;
+    Tcl_Size argc, length;
+    const char **argv;
+    char *soid;
+    int i, j;
+
+    if (cmdObj && Tcl_ListObjLength(interp, cmdObj, &length) != TCL_OK) {
+	return TCL_ERROR;
+    }
 
-    if (root == instTree) {
-	force = 0;
+    tablePtr = (TnmSnmpTable *) ckalloc(sizeof(TnmSnmpTable));
+    memset((char *) tablePtr, 0, sizeof(TnmSnmpTable));
+    tablePtr->interp = interp;
+    tablePtr->dirty = 1;
+    tablePtr->maxAge = maxAge;
+    TnmOidInit(&tablePtr->oid);
+    Tcl_InitHashTable(&tablePtr->keyTable, TCL_STRING_KEYS);
+
+    entryPtr = GetTableEntry(interp, label, &tablePtr->oid);
+    if (! entryPtr) {
+	FreeTable((char *) tablePtr);
+	return TCL_ERROR;
     }
 
     /*
-     * Skip over all subidentifier that are lower than the
-     * subidentifier of interest.
+     * Resolve the index objects. A table augmentation uses the
+     * index of the table it augments.
      */
 
-    p = root;
-    if (len) {
-	while (p && p->subid < oid[0]) p = p->nextPtr;
+    indexPtr = entryPtr;
+    if (entryPtr->augment) {
+	indexPtr = TnmMibFindNode(entryPtr->index, NULL, 1);
+	if (! indexPtr || indexPtr->syntax != ASN1_SEQUENCE
+	    || ! indexPtr->index) {
+	    Tcl_AppendResult(interp, "failed to resolve index for \"",
+			     label, "\"", (char *) NULL);
+	    FreeTable((char *) tablePtr);
+	    return TCL_ERROR;
+	}
+    }
+    if (Tcl_SplitList(interp, indexPtr->index, &argc, &argv) != TCL_OK) {
+	FreeTable((char *) tablePtr);
+	return TCL_ERROR;
     }
+    tablePtr->numIndex = (int) argc;
+    tablePtr->implied = indexPtr->implied;
+    tablePtr->indexNodeList = (TnmMibNode **)
+	ckalloc((argc + 1) * sizeof(TnmMibNode *));
+    for (i = 0; i < argc; i++) {
+	tablePtr->indexNodeList[i] = TnmMibFindNode(argv[i], NULL, 1);
+	if (! tablePtr->indexNodeList[i]) {
+	    Tcl_AppendResult(interp, "unknown index object \"", argv[i],
+			     "\"", (char *) NULL);
+	    ckfree((char *) argv);
+	    FreeTable((char *) tablePtr);
+	    return TCL_ERROR;
+	}
+    }
+    tablePtr->indexNodeList[argc] = NULL;
+    ckfree((char *) argv);
 
     /*
-     * Loop over all neighbours at this tree level. Descend if possible.
+     * Collect the accessible columns sorted by their sub identifier.
      */
 
-    while (p) {
-	if (p->childPtr) {
-	    if (len > 0 && p->subid == oid[0]) {
-		/* descend - positive match */
-		inst = FindNextNode(p->childPtr, oid + 1, len - 1);
-	    } else if (p->syntax) {
-		/* no match - use this node */
-		return p;
-	    } else {
-		/* descend - force next node */
-		force = 1;
-		inst = FindNextNode(p->childPtr, NULL, 0);
-	    }
-	    if (inst) return inst;
-	} else {
-	    if (len == 0 && p->syntax) {
-		/* found - node has larger oid */
-		return p;
-	    } else if (((len && p->subid != oid[0]) || force) && p->syntax) {
-		/* no match - forced to use this node */
-		return p;
-	    } else {
-		/* force next node */
-		force = 1;
-	    }
+    for (colPtr = entryPtr->childPtr; colPtr; colPtr = colPtr->nextPtr) {
+	tablePtr->numColumns++;
+    }
+    tablePtr->columns = (TableColumn *)
+	ckalloc((tablePtr->numColumns + 1) * sizeof(TableColumn));
+    tablePtr->numColumns = 0;
+    for (colPtr = entryPtr->childPtr; colPtr; colPtr = colPtr->nextPtr) {
+	if (colPtr->access == TNM_MIB_NOACCESS
+	    || colPtr->access == TNM_MIB_FORNOTIFY) {
+	    continue;
+	}
+	column.subid = colPtr->subid;
+	column.nameObj = Tcl_NewStringObj(colPtr->label, -1);
+	Tcl_IncrRefCount(column.nameObj);
+	column.syntax = (colPtr->typePtr && colPtr->typePtr->name)
+	    ? colPtr->typePtr->syntax : colPtr->syntax;
+	column.access = colPtr->access;
+	for (j = tablePtr->numColumns; j > 0
+		 && tablePtr->columns[j-1].subid > column.subid; j--) {
+	    tablePtr->columns[j] = tablePtr->columns[j-1];
 	}
-	p = p->nextPtr;
+	tablePtr->columns[j] = column;
+	tablePtr->numColumns++;
     }
 
-    return NULL;
+    soid = ckstrdup(TnmOidToString(&tablePtr->oid));
+    tablePtr->labelLength = (int) strlen(soid);
+    nodePtr = AddNode(soid, 0, 0, 0, NULL);
+    if (! nodePtr) {
+	Tcl_AppendResult(interp, "illegal table identifier \"",
+			 soid, "\"", (char *) NULL);
+	ckfree(soid);
+	FreeTable((char *) tablePtr);
+	return TCL_ERROR;
+    }
+    if (nodePtr->tablePtr) {
+	ReleaseTable(nodePtr->tablePtr);
+    }
+    nodePtr->tablePtr = tablePtr;
+    tablePtr->nodePtr = nodePtr;
+
+    if (varName) {
+	tablePtr->varName = ckstrdup(varName);
+	Tcl_TraceVar(interp, tablePtr->varName, TABLE_TRACE_FLAGS,
+		     (Tcl_VarTraceProc *) TraceTableProc,
+		     (ClientData) tablePtr);
+    } else {
+	tablePtr->cmdObj = cmdObj;
+	Tcl_IncrRefCount(tablePtr->cmdObj);
+    }
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * FindNode --
+ * TnmSnmpDeleteTable --
  *
- *	This procedure locates an instance node in the instance
- *	node tree.
+ *	This procedure removes a table registered with
+ *	TnmSnmpCreateTable().
  *
  * Results:
- *	A pointer to the node or NULL if there is no next node.
+ *	A standard Tcl result.
  *
  * Side effects:
  *	None.
@@ -316,34 +2526,41 @@ FindNextNode(TnmSnmpNode *root, u_int *oid, int len)
  *----------------------------------------------------------------------
  */
 
-static TnmSnmpNode*
-FindNode(TnmSnmpNode *root, TnmOid *oidPtr)
+int
+TnmSnmpDeleteTable(Tcl_Interp *interp, char *label)
 {
-    TnmSnmpNode *p, *q = NULL;
-    int i;
-    
-    if (TnmOidGet(oidPtr, 0) != 1) return NULL;
-    for (p = root, i = 1; p && i < TnmOidGetLength(oidPtr); p = q, i++) {
-	for (q = p->childPtr; q; q = q->nextPtr) {
-	    if (q->subid == TnmOidGet(oidPtr, i)) break;
-	}
-	if (!q) {
-	    return NULL; 
+    TnmSnmpNode *nodePtr;
+    TnmOid oid;
+
+    TnmOidInit(&oid);
+    if (! GetTableEntry(interp, label, &oid)) {
+	TnmOidFree(&oid);
+	return TCL_ERROR;
+    }
+    nodePtr = FindNode(instTree, &oid);
+    TnmOidFree(&oid);
+
+    if (nodePtr && nodePtr->tablePtr) {
+	ReleaseTable(nodePtr->tablePtr);
+	if (! nodePtr->bindings && ! nodePtr->tclVarName) {
+	    RemoveNode(nodePtr);
 	}
     }
-    return q;
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * RemoveNode --
+ * TnmSnmpGetTable --
  *
- *	This procedure removes all nodes from the tree that are 
- *	associated with a given Tcl variable.
+ *	This procedure returns the source of a table registered with
+ *	TnmSnmpCreateTable(). This is either the variable name or a
+ *	list with the -command option and the command prefix followed
+ *	by the -maxAge option and the age.
  *
  * Results:
- *	None.
+ *	A standard Tcl result.
  *
  * Side effects:
  *	None.
@@ -351,223 +2568,113 @@ FindNode(TnmSnmpNode *root, TnmOid *oidPtr)
  *----------------------------------------------------------------------
  */
 
-static void
-RemoveNode(TnmSnmpNode *root, char *varName)
+int
+TnmSnmpGetTable(Tcl_Interp *interp, char *label)
 {
-    TnmSnmpNode *p, *q;
+    TnmSnmpNode *nodePtr;
+    TnmSnmpTable *tablePtr;
+    Tcl_Obj *listObj;
+    TnmOid oid;
 
-    if (!root) return;
+    TnmOidInit(&oid);
+    if (! GetTableEntry(interp, label, &oid)) {
+	TnmOidFree(&oid);
+	return TCL_ERROR;
+    }
+    nodePtr = FindNode(instTree, &oid);
+    TnmOidFree(&oid);
 
-    for (p = root; p; p = p->nextPtr) {
-	if (p->childPtr) {
-	    q = p->childPtr;
-	    RemoveNode(q, varName);
-	    if (q->tclVarName && (strcmp(q->tclVarName, varName) == 0)) {
-		p->childPtr = q->nextPtr;
-		FreeNode(q);
-	    }
-	}
-	if (p->nextPtr) {
-	    q = p->nextPtr;
-	    if (q->tclVarName && (strcmp(q->tclVarName, varName) == 0)) {
-		p->nextPtr = q->nextPtr;
-		FreeNode(q);
-	    }
-	}
+    if (! nodePtr || ! nodePtr->tablePtr) {
+	return TCL_OK;
+    }
+    tablePtr = nodePtr->tablePtr;
+    if (tablePtr->varName) {
+	Tcl_SetResult(interp, tablePtr->varName, TCL_VOLATILE);
+    } else {
+	listObj = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, listObj,
+				 Tcl_NewStringObj("-command", -1));
+	Tcl_ListObjAppendElement(NULL, listObj, tablePtr->cmdObj);
+	Tcl_ListObjAppendElement(NULL, listObj,
+				 Tcl_NewStringObj("-maxAge", -1));
+	Tcl_ListObjAppendElement(NULL, listObj,
+				 Tcl_NewIntObj(tablePtr->maxAge));
+	Tcl_SetObjResult(interp, listObj);
     }
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * DeleteNodeProc --
+ * TnmSnmpMarkCells --
  *
- *	This procedure is a variable trace callback which is called
- *	by the Tcl interpreter whenever a MIB variable is removed.
- *	We have to run through the whole tree to discard these 
- *	variables.
+ *	This procedure is called before a request is processed. It
+ *	marks the list of cell nodes so that the cells created while
+ *	processing the request can be released afterwards.
  *
  * Results:
- *	Always NULL.
+ *	The mark to be passed to TnmSnmpReleaseCells().
  *
  * Side effects:
- *	None.
+ *	Row commands are asked again for the list of rows.
  *
  *----------------------------------------------------------------------
  */
 
-static char*
-DeleteNodeProc(clientData, interp, name1, name2, flags)
-    ClientData clientData;
-    Tcl_Interp *interp;
-    char *name1;
-    char *name2;
-    int flags;
+TnmSnmpNode*
+TnmSnmpMarkCells(void)
 {
-    size_t len = strlen(name1);
-    char *varName;
-			 
-    if (name2) {
-	len += strlen(name2);
-    }
-    varName = ckalloc(len + 3);
-    strcpy(varName, name1);
-    if (name2) {
-	strcat(varName,"(");
-	strcat(varName, name2);
-	strcat(varName,")");
-    }
-
-    RemoveNode(instTree, varName);
-    ckfree(varName);
-    return NULL;
+    tableGeneration++;
+    return cellList;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * TnmSnmpCreateNode --
+ * TnmSnmpReleaseCells --
  *
- *	This procedure creates a new node in the instance tree 
- *	and a Tcl array variable that will be used to access and 
- *	modify the instance from within Tcl.
+ *	This procedure releases all cell nodes created since the
+ *	list of cells was marked. Marks of nested requests are
+ *	released first.
  *
  * Results:
- *	A standard Tcl result.
+ *	None.
  *
  * Side effects:
  *	None.
  *
  *----------------------------------------------------------------------
  */
- 
-int
-TnmSnmpCreateNode(Tcl_Interp *interp, char *label, char *tclVarName, char *defval)
-{
-    char *soid = NULL;
-    TnmMibNode *nodePtr = TnmMibFindNode(label, NULL, 0);
-    int access, offset = 0, syntax = 0;
-    char *varName = NULL;
-
-    if (!nodePtr || nodePtr->childPtr) {
-	Tcl_AppendResult(interp, "unknown object type \"", label, "\"", 
-			 (char *) NULL);
-	return TCL_ERROR;
-    }
-
-    soid = ckstrdup(TnmMibGetOid(label));
 
-    if (! TnmIsOid(soid)) {
-	Tcl_AppendResult(interp, "illegal instance identifier \"",
-			 soid, "\"", (char *) NULL);
-	return TCL_ERROR;
-    }
-
-    /*
-     * Calculate the instance identifier. Return an error if we
-     * have no real instance. Otherwise save a pointer to the
-     * instance identifier so that we can access it later.
-     */
-
-    {
-	int oidLen;
-	Tnm_Oid *oid;
-	TnmMibNode *basePtr = NULL;
-	char *freeme = NULL;
-
-	for (oid = TnmStrToOid(soid, &oidLen); oidLen; oidLen--) {
-	    freeme = TnmOidToStr(oid, oidLen);
-	    basePtr = TnmMibFindNode(freeme, NULL, 1);
-	    if (basePtr) break;
-	}
-
-	if (! basePtr || strlen(soid) <= strlen(freeme)) {
-	    Tcl_AppendResult(interp, "instance identifier missing in \"",
-			     label, "\"", (char *) NULL);
-	    return TCL_ERROR;
-	}
-
-	if (freeme) {
-	    offset = strlen(freeme)+1;
-	}
-    }
-
-    syntax = TnmMibGetBaseSyntax(label);
-
-    /*
-     * Check whether the instance is accessible.
-     */
-
-    access = nodePtr->access;
-    if (access == TNM_MIB_NOACCESS) {
-	Tcl_AppendResult(interp, "object \"", label, "\" is not accessible",
-			 (char *) NULL);
-	goto errorExit;
-    }
-
-    /*
-     * Check if the instance identifier is "0" for scalars. We have
-     * a scalar if the parent node is not of ASN.1 syntax SEQUENCE.
-     *
-     * XXX We should also check if the instance identifier is valid
-     * for table entries.
-     */
-
-    if (! nodePtr->parentPtr) {
-	Tcl_AppendResult(interp, "instance \"", label, "\" not allowed",
-			 (char *) NULL);
-	goto errorExit;
-    }
-
-    if (nodePtr->parentPtr && nodePtr->parentPtr->syntax != ASN1_SEQUENCE) {
-	if (strcmp(soid + offset, "0") != 0) {
-	    Tcl_AppendResult(interp, "illegal instance identifier \"",
-			     soid + offset, "\" for instance \"", label, "\"",
-			     (char *) NULL);
-	    goto errorExit;
-	}
-    }
-
-    /*
-     * Now create the Tcl variable and the instance tree node.
-     * Do not use tclVarName directly because it might be a string
-     * which is not writable and Tcl likes to modify this string
-     * internally.
-     */
-
-    varName = ckstrdup(tclVarName);
-
-    if (defval) {
-	if (Tcl_SetVar(interp, varName, defval, 
-		       TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG) == NULL) {
-	    goto errorExit;
-	}
+void
+TnmSnmpReleaseCells(TnmSnmpNode *markPtr)
+{
+    TnmSnmpNode *inst;
+
+    while (cellList && cellList != markPtr) {
+	inst = cellList;
+	cellList = inst->varNextPtr;
+	ReleaseProvider(inst);
+	ckfree(inst->label);
+	ckfree((char *) inst);
     }
-
-    AddNode(soid, offset, syntax, access, varName);
-    Tcl_TraceVar(interp, varName, TCL_TRACE_UNSETS | TCL_GLOBAL_ONLY, 
-		 (Tcl_VarTraceProc *) DeleteNodeProc, (ClientData) NULL);
-    Tcl_ResetResult(interp);
-    return TCL_OK;
-
-  errorExit:
-    if (soid) ckfree(soid);
-    return TCL_ERROR;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
  * TnmSnmpFindNode --
  *
  *	This procedure locates the instance node for the given oid
- *	in the instance node tree.
+ *	in the instance node tree. Cells of tables are looked up in
+ *	the table.
  *
  * Results:
  *	A pointer to the node or NULL if there is no next node.
  *
  * Side effects:
- *	None.
+ *	Cell nodes stay valid until TnmSnmpReleaseCells() is called.
  *
  *----------------------------------------------------------------------
  */
@@ -575,6 +2682,15 @@ TnmSnmpCreateNode(Tcl_Interp *interp, char *label, char *tclVarName, char *defva
 TnmSnmpNode*
 TnmSnmpFindNode(TnmSnmp *session, TnmOid *oidPtr)
 {
+    TnmSnmpNode *nodePtr;
+    int len = TnmOidGetLength(oidPtr);
+
+    nodePtr = TableNode(TnmOidGetElements(oidPtr), len);
+    if (nodePtr) {
+	len -= TnmOidGetLength(&nodePtr->tablePtr->oid);
+	return FindCell(nodePtr, TnmOidGetElements(oidPtr)
+			+ TnmOidGetLength(oidPtr) - len, len);
+    }
     return FindNode(instTree, oidPtr);
 }
 
@@ -605,6 +2721,46 @@ TnmSnmpFindNextNode(TnmSnmp *session, TnmOid *oidPtr)
 			TnmOidGetLength(oidPtr));
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpNextNode --
+ *
+ *	This procedure locates the instance which follows the given
+ *	instance node in the instance tree. It avoids the lookup of
+ *	the oid when walking the tree, e.g. to process getbulk
+ *	requests.
+ *
+ * Results:
+ *	A pointer to the node or NULL if there is no next node.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TnmSnmpNode*
+TnmSnmpNextNode(TnmSnmp *session, TnmSnmpNode *inst)
+{
+    TableCell *cellPtr;
+    TnmSnmpNode *nodePtr;
+    int len;
+
+    if (inst->providerPtr == &tableCellProvider) {
+	cellPtr = (TableCell *) inst->providerData;
+	nodePtr = cellPtr->tablePtr->nodePtr;
+	if (! nodePtr) {
+	    return NULL;
+	}
+	len = TnmOidGetLength(&cellPtr->tablePtr->oid);
+	inst = NextCell(nodePtr, TnmOidGetElements(&cellPtr->oid) + len,
+			TnmOidGetLength(&cellPtr->oid) - len);
+	return inst ? inst : NextInstance(SkipNode(nodePtr));
+    }
+    return NextInstance(WalkNode(inst));
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -739,6 +2895,23 @@ TnmSnmpEvalNodeBinding(TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpNode *inst, int
     TnmOid oid;
     int code = TCL_OK, len;
     char *instOid;
+    TnmSnmpNode *nodePtr;
+    TnmSnmpBinding *bindPtr = NULL;
+
+    /*
+     * Check the path to the top of the tree first. Most instances
+     * have no bindings and we can return without converting the
+     * oid and without calling into Tcl.
+     */
+
+    for (nodePtr = inst; nodePtr && !bindPtr; nodePtr = nodePtr->parentPtr) {
+	for (bindPtr = nodePtr->bindings; bindPtr; bindPtr = bindPtr->nextPtr) {
+	    if (bindPtr->event == event && bindPtr->command) break;
+	}
+    }
+    if (! bindPtr) {
+	return TCL_OK;
+    }
 
     TnmOidInit(&oid);
     TnmOidFromString(&oid, inst->label);
@@ -752,8 +2925,6 @@ TnmSnmpEvalNodeBinding(TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpNode *inst, int
     instOid = ckstrdup(inst->label+inst->offset);
 
     for (len = TnmOidGetLength(&oid); len > 0; len--) {
-	TnmSnmpBinding *bindPtr;
-
 	TnmOidSetLength(&oid, len);
 	inst = FindNode(instTree, &oid);
 	if (!inst) continue;
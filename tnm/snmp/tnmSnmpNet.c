@@ -1,7 +1,8 @@
 /*
  * tnmSnmpNet.c --
  *
- *	This file contains all functions that handle transport over UDP.
+ *	This file contains all functions that handle transport over UDP
+ *	and TCP.
  *
  * Copyright (c) 1994-1996 Technical University of Braunschweig.
  * Copyright (c) 1996-1997 University of Twente.
@@ -18,6 +19,10 @@
 
 #include "tnmSnmp.h"
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
 /*
  * Local variables:
  */
@@ -25,11 +30,17 @@
 extern int hexdump;		/* flag that controls hexdump */
 
 /*
- * Shared socket used for all asynchronous messages send out by this
- * manager or agent.
+ * Shared sockets used for all asynchronous messages send out by this
+ * manager or agent. Requests are distributed round robin over the
+ * sockets so that the responses of many agents are spread over
+ * several kernel receive queues. The interpreter is used to decode
+ * the responses received on any of these sockets.
  */
 
-static TnmSnmpSocket *asyncSocket = NULL;
+static TnmSnmpSocket **asyncSockets = NULL;
+static int asyncCount = 0;
+static int asyncNext = 0;
+static Tcl_Interp *asyncInterp = NULL;
 
 /*
  * Shared socket used for all synchronous manager initiated 
@@ -38,12 +49,30 @@ static TnmSnmpSocket *asyncSocket = NULL;
 
 static TnmSnmpSocket *syncSocket = NULL;
 
+/*
+ * The configuration of the shared manager sockets. Buffer sizes of 0
+ * keep the system defaults. The maximum number of asynchronous
+ * sockets keeps the select() mask of the event loop small.
+ */
+
+#define TNM_SNMP_MAX_MANAGER_SOCKETS	64
+
+static int managerRcvBuf = 0;
+static int managerSndBuf = 0;
+static int managerSockets = 1;
+
 /*
  * The list of all shared sockets maintained in this module.
  */
 
 TnmSnmpSocket *tnmSnmpSocketList = NULL;
 
+/*
+ * The port of the agent socket which received the current request.
+ */
+
+unsigned short tnmSnmpAgentPort = 0;
+
 /*
  * A global variable for performance measurements.
  */
@@ -52,6 +81,87 @@ TnmSnmpSocket *tnmSnmpSocketList = NULL;
 TnmSnmpMark tnmSnmpBenchMark;
 #endif
 
+/*
+ * The token bucket maintained for every manager that sends requests
+ * to a rate limited responder. The bucket holds at most one second
+ * worth of requests. Tokens are counted in thousandths so that the
+ * bucket can be refilled with millisecond granularity.
+ */
+
+typedef struct RateBucket {
+    long tokens;		/* Available tokens (in 1/1000). */
+    Tcl_Time last;		/* Time of the last refill. */
+    Tcl_HashEntry *entryPtr;	/* Entry in the table of buckets. */
+    struct RateBucket *prevPtr;	/* Bucket used less recently. */
+    struct RateBucket *nextPtr;	/* Bucket used more recently. */
+} RateBucket;
+
+/*
+ * The token buckets of a responder are indexed by the manager
+ * address and kept in a list ordered by the time of last use.
+ */
+
+typedef struct RateTable {
+    Tcl_HashTable table;	/* Buckets indexed by the address. */
+    RateBucket *firstPtr;	/* The least recently used bucket. */
+    RateBucket *lastPtr;	/* The most recently used bucket. */
+} RateTable;
+
+/*
+ * The number of token buckets a responder keeps. The least recently
+ * used bucket is removed when a new manager shows up and the table
+ * is full.
+ */
+
+#define TNM_SNMP_RATEBUCKETS	1024
+
+/*
+ * SNMP over TCP (RFC 3430) uses persistent connections to the agents.
+ * Asynchronous messages are pipelined over a small pool of connections
+ * per agent. A new connection is only opened if all connections carry
+ * TNM_SNMP_TCP_PIPELINE outstanding requests. Synchronous requests use
+ * a separate connection which is not watched by the event loop, just
+ * like the shared UDP sockets above. Messages on a connection are
+ * delimited by the length of the outer BER sequence. Connections
+ * without any traffic are closed after TNM_SNMP_TCP_IDLE ms.
+ */
+
+#define TNM_SNMP_TCP_CONNS	4
+#define TNM_SNMP_TCP_PIPELINE	64
+#define TNM_SNMP_TCP_IDLE	60000
+
+typedef struct TcpConn {
+    int sock;			/* The socket of this connection. */
+    int sync;			/* Set for the synchronous connection. */
+    int connected;		/* Set once the connect has completed. */
+    int closed;			/* Set when the connection is closed. */
+    int pending;		/* Requests waiting for a response. */
+    u_char *outBuf;		/* Messages not yet written. */
+    int outLen;			/* Number of bytes in outBuf. */
+    int outSize;		/* Size of the outBuf allocation. */
+    u_char inBuf[TNM_SNMP_MAXSIZE]; /* Bytes read but not yet decoded. */
+    int inLen;			/* Number of bytes in inBuf. */
+    Tcl_Time last;		/* Time of the last activity. */
+    Tcl_TimerToken timer;	/* Timer used to close idle connections. */
+    Tcl_Interp *interp;		/* Interpreter used to decode responses. */
+    struct TcpPool *poolPtr;	/* The pool this connection belongs to. */
+} TcpConn;
+
+typedef struct TcpPool {
+    struct sockaddr_in addr;	/* The transport address of the agent. */
+    TcpConn *syncConn;		/* The synchronous connection (if any). */
+    TcpConn *conns[TNM_SNMP_TCP_CONNS]; /* The asynchronous connections. */
+    int numConns;		/* Number of asynchronous connections. */
+    Tcl_HashEntry *entryPtr;	/* The entry in the pool table. */
+} TcpPool;
+
+typedef struct TcpKey {
+    int addr;
+    int port;
+} TcpKey;
+
+static Tcl_HashTable *tcpPoolTable = NULL;
+
 /*
  * Forward declarations for procedures defined later in this file:
  */
@@ -59,13 +169,75 @@ TnmSnmpMark tnmSnmpBenchMark;
 static void
 ResponseProc		(ClientData clientData, int mask);
 
+static int
+LateResponse		(u_char *packet, int packetlen);
+
 static void
 AgentProc		(ClientData clientData, int mask);
 
 static int
-AgentRecv		(Tcl_Interp *interp, TnmSnmp *session,
+SocketRecv		(Tcl_Interp *interp, TnmSnmpSocket *sockPtr,
 				     u_char *packet, int *packetlen,
 				     struct sockaddr_in *from);
+static void
+SocketBuffers		(TnmSnmpSocket *sockPtr);
+
+static int
+ManagerResize		(Tcl_Interp *interp, int sockets);
+
+static TnmSnmpSocket *
+OpenReusePort		(Tcl_Interp *interp, struct sockaddr_in *addr);
+
+static int
+RateAdmit		(TnmSnmp *session, struct sockaddr_in *from);
+static void
+AgentSocketClose	(TnmSnmp *session);
+
+static TcpPool*
+TcpPoolGet		(struct sockaddr_in *addr, int create);
+
+static void
+TcpPoolFree		(TcpPool *poolPtr);
+
+static TcpConn*
+TcpConnect		(Tcl_Interp *interp, TcpPool *poolPtr, int sync);
+
+static TcpConn*
+TcpGet			(Tcl_Interp *interp, struct sockaddr_in *addr,
+				     int sync);
+static void
+TcpClose		(TcpConn *connPtr);
+
+static void
+TcpCloseAll		(void);
+
+static void
+TcpWatch		(TcpConn *connPtr);
+
+static int
+TcpWrite		(TcpConn *connPtr, u_char *packet, int packetlen);
+
+static int
+TcpService		(TcpConn *connPtr, int mask);
+
+static int
+TcpFrame		(TcpConn *connPtr);
+
+static int
+TcpNext			(TcpConn *connPtr, u_char *packet);
+
+static int
+TcpSend			(Tcl_Interp *interp, u_char *packet, int packetlen,
+				     struct sockaddr_in *to, int flags,
+				     TcpConn **connPtrPtr);
+static int
+TcpWait			(TnmSnmp *session, int ms);
+
+static void
+TcpProc			(ClientData clientData, int mask);
+
+static void
+TcpIdleProc		(ClientData clientData);
 
 
 /*
@@ -149,6 +321,13 @@ TnmSnmpOpen(Tcl_Interp *interp, struct sockaddr_in *addr)
     }
 #endif
 
+#ifdef SO_RXQ_OVFL
+    {
+	int on = 1;
+	setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, (char *) &on, sizeof(on));
+    }
+#endif
+
     sockPtr = (TnmSnmpSocket *) ckalloc(sizeof(TnmSnmpSocket));
     memset((char *) sockPtr, 0, sizeof(TnmSnmpSocket));
     sockPtr->sock = socket;
@@ -254,7 +433,8 @@ TnmSnmpDumpPacket(u_char *packet, int packetlen, struct sockaddr_in *from, struc
  * TnmSnmpWait --
  *
  *	This procedure waits for a specified time for an answer. It 
- *	is used to implement synchronous operations.
+ *	is used to implement synchronous operations. Sessions using
+ *	the TCP domain wait on their synchronous connection.
  *
  * Results:
  *	1 if the socket is readable, otherwise 0.
@@ -266,15 +446,19 @@ TnmSnmpDumpPacket(u_char *packet, int packetlen, struct sockaddr_in *from, struc
  */
 
 int
-TnmSnmpWait(int ms, int flags)
+TnmSnmpWait(TnmSnmp *session, int ms, int flags)
 {
     struct timeval wait;
     fd_set readfds;
     int width;
     TnmSnmpSocket *snmpSocket = NULL;
 
-    if (flags & TNM_SNMP_ASYNC) {
-	snmpSocket = asyncSocket;
+    if (session && TNM_SNMP_TCP(session) && (flags & TNM_SNMP_SYNC)) {
+	return TcpWait(session, ms);
+    }
+
+    if (flags & TNM_SNMP_ASYNC && asyncCount) {
+	snmpSocket = asyncSockets[0];
     }
     if (flags & TNM_SNMP_SYNC) {
 	snmpSocket = syncSocket;
@@ -372,14 +556,11 @@ TnmSnmpManagerOpen(Tcl_Interp *interp)
 	if (! syncSocket) {
 	    return TCL_ERROR;
 	}
+	SocketBuffers(syncSocket);
     }
-    if (! asyncSocket) {
-	asyncSocket = TnmSnmpOpen(interp, &addr);
-	if (! asyncSocket) {
-	    return TCL_ERROR;
-	}
-	TnmCreateSocketHandler(asyncSocket->sock, TCL_READABLE, 
-			       ResponseProc, (ClientData) interp);
+    if (! asyncCount) {
+	asyncInterp = interp;
+	return ManagerResize(interp, managerSockets);
     }
     return TCL_OK;
 }
@@ -389,7 +570,8 @@ TnmSnmpManagerOpen(Tcl_Interp *interp)
  *
  * TnmSnmpManagerClose --
  *
- *	This procedure closes the shared manager socket.
+ *	This procedure closes the shared manager sockets and all
+ *	TCP connections to agents.
  *
  * Results:
  *	None.
@@ -403,10 +585,176 @@ TnmSnmpManagerOpen(Tcl_Interp *interp)
 void
 TnmSnmpManagerClose()
 {
-    TnmSnmpClose(asyncSocket);
-    asyncSocket = NULL;
+    (void) ManagerResize(NULL, 0);
     TnmSnmpClose(syncSocket);
     syncSocket = NULL;
+    TcpCloseAll();
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpManagerConfig --
+ *
+ *	This procedure changes the socket buffer sizes and the number
+ *	of asynchronous manager sockets. The new values are applied
+ *	to the sockets which are already open. A negative value
+ *	leaves the corresponding setting unchanged.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Manager sockets may be opened or closed. Responses to requests
+ *	sent on a closed socket are lost and the requests are
+ *	retransmitted on the remaining sockets.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpManagerConfig(Tcl_Interp *interp, int rcvbuf, int sndbuf, int sockets)
+{
+    int i;
+
+    if (sockets > TNM_SNMP_MAX_MANAGER_SOCKETS) {
+	char buffer[40];
+	sprintf(buffer, "%d", TNM_SNMP_MAX_MANAGER_SOCKETS);
+	Tcl_AppendResult(interp, "too many manager sockets: maximum is ",
+			 buffer, (char *) NULL);
+	return TCL_ERROR;
+    }
+
+    if (rcvbuf >= 0) {
+	managerRcvBuf = rcvbuf;
+    }
+    if (sndbuf >= 0) {
+	managerSndBuf = sndbuf;
+    }
+    if (syncSocket) {
+	SocketBuffers(syncSocket);
+    }
+    for (i = 0; i < asyncCount; i++) {
+	SocketBuffers(asyncSockets[i]);
+    }
+
+    if (sockets > 0) {
+	managerSockets = sockets;
+	if (asyncCount) {
+	    return ManagerResize(interp, managerSockets);
+	}
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpManagerGetConfig --
+ *
+ *	This procedure returns the current configuration of the
+ *	manager sockets.
+ *
+ * Results:
+ *	The buffer sizes and the number of sockets are stored in
+ *	the arguments.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpManagerGetConfig(int *rcvbuf, int *sndbuf, int *sockets)
+{
+    *rcvbuf = managerRcvBuf;
+    *sndbuf = managerSndBuf;
+    *sockets = managerSockets;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ManagerResize --
+ *
+ *	This procedure opens or closes asynchronous manager sockets
+ *	until the given number of sockets is open. Every socket has
+ *	its own event handler which decodes the received responses.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Sockets are opened or closed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ManagerResize(Tcl_Interp *interp, int sockets)
+{
+    struct sockaddr_in addr;
+    TnmSnmpSocket *sockPtr;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    while (asyncCount > sockets) {
+	TnmSnmpClose(asyncSockets[--asyncCount]);
+    }
+    if (sockets == 0 && asyncSockets) {
+	ckfree((char *) asyncSockets);
+	asyncSockets = NULL;
+    }
+
+    if (asyncCount < sockets) {
+	asyncSockets = (TnmSnmpSocket **) ckrealloc((char *) asyncSockets,
+				sockets * sizeof(TnmSnmpSocket *));
+    }
+    while (asyncCount < sockets) {
+	sockPtr = TnmSnmpOpen(interp, &addr);
+	if (! sockPtr) {
+	    return TCL_ERROR;
+	}
+	SocketBuffers(sockPtr);
+	TnmCreateSocketHandler(sockPtr->sock, TCL_READABLE,
+			       ResponseProc, (ClientData) sockPtr);
+	asyncSockets[asyncCount++] = sockPtr;
+    }
+    asyncNext = 0;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SocketBuffers --
+ *
+ *	This procedure sets the kernel buffer sizes of a manager
+ *	socket. A size of 0 keeps the current buffer size.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The socket buffers may be resized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SocketBuffers(TnmSnmpSocket *sockPtr)
+{
+    if (managerRcvBuf > 0) {
+	setsockopt(sockPtr->sock, SOL_SOCKET, SO_RCVBUF,
+		   (char *) &managerRcvBuf, sizeof(managerRcvBuf));
+    }
+    if (managerSndBuf > 0) {
+	setsockopt(sockPtr->sock, SOL_SOCKET, SO_SNDBUF,
+		   (char *) &managerSndBuf, sizeof(managerSndBuf));
+    }
 }
 
 /*
@@ -416,7 +764,9 @@ TnmSnmpManagerClose()
  *
  *	This procedure creates a socket for a command responder session
  *	on a given port. If an agent socket is already created, we close
- *	the socket and open a new one.
+ *	the socket and open a new one. Responders configured with
+ *	-reusePort bind a socket of their own with SO_REUSEPORT so
+ *	that several agent processes can share the port.
  *
  * Results:
  *	A standard Tcl result.
@@ -430,15 +780,19 @@ TnmSnmpManagerClose()
 int
 TnmSnmpResponderOpen(Tcl_Interp *interp, TnmSnmp *session)
 {
-    if (session->socket) {
-	TnmSnmpClose(session->socket);
+    TnmSnmpResponderClose(session);
+
+    if (session->reusePort) {
+	session->socket = OpenReusePort(interp, &session->maddr);
+    } else {
+	session->socket = TnmSnmpOpen(interp, &session->maddr);
     }
-    session->socket = TnmSnmpOpen(interp, &session->maddr);
     if (! session->socket) {
 	return TCL_ERROR;
     }
+    session->socket->session = session;
     TnmCreateSocketHandler(session->socket->sock, TCL_READABLE,
-			   AgentProc, (ClientData) session);
+			   AgentProc, (ClientData) session->socket);
     return TCL_OK;
 }
 
@@ -453,7 +807,7 @@ TnmSnmpResponderOpen(Tcl_Interp *interp, TnmSnmp *session)
  *	None.
  *
  * Side effects:
- *	None.
+ *	The token buckets of the rate limit are discarded.
  *
  *----------------------------------------------------------------------
  */
@@ -461,9 +815,60 @@ TnmSnmpResponderOpen(Tcl_Interp *interp, TnmSnmp *session)
 void
 TnmSnmpResponderClose(TnmSnmp *session)
 {
-    if (session->socket) {
-	TnmSnmpClose(session->socket);
+    RateBucket *bucketPtr;
+
+    AgentSocketClose(session);
+
+    if (session->rateTable) {
+	while (session->rateTable->firstPtr) {
+	    bucketPtr = session->rateTable->firstPtr;
+	    session->rateTable->firstPtr = bucketPtr->nextPtr;
+	    ckfree((char *) bucketPtr);
+	}
+	Tcl_DeleteHashTable(&session->rateTable->table);
+	ckfree((char *) session->rateTable);
+	session->rateTable = NULL;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AgentSocketClose --
+ *
+ *	This procedure releases the agent socket of a responder or a
+ *	listener. A shared socket is handed over to another session
+ *	of the same type bound to the same port (e.g. a responder
+ *	with a different community string).
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The socket is closed if no other session uses it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AgentSocketClose(TnmSnmp *session)
+{
+    TnmSnmp *s;
+
+    if (! session->socket) {
+	return;
+    }
+    if (session->socket->session == session) {
+	session->socket->session = NULL;
+	for (s = tnmSnmpList; s; s = s->nextPtr) {
+	    if (s != session && s->type == session->type
+		&& s->socket == session->socket) {
+		session->socket->session = s;
+		break;
+	    }
+	}
     }
+    TnmSnmpClose(session->socket);
     session->socket = NULL;
 }
 
@@ -494,15 +899,14 @@ TnmSnmpListenerOpen(Tcl_Interp *interp, TnmSnmp *session)
     }
 #endif
     
-    if (session->socket) {
-	TnmSnmpClose(session->socket);
-    }
+    AgentSocketClose(session);
     session->socket = TnmSnmpOpen(interp, &session->maddr);
     if (! session->socket) {
 	return TCL_ERROR;
     }
+    session->socket->session = session;
     TnmCreateSocketHandler(session->socket->sock, TCL_READABLE,
-			   AgentProc, (ClientData) session);
+			   AgentProc, (ClientData) session->socket);
     return TCL_OK;
 }
 
@@ -531,10 +935,7 @@ TnmSnmpListenerClose(TnmSnmp *session)
     }
 #endif
     
-    if (session->socket) {
-	TnmSnmpClose(session->socket);
-    }
-    session->socket = NULL;
+    AgentSocketClose(session);
 }
 
 /*
@@ -543,6 +944,8 @@ TnmSnmpListenerClose(TnmSnmp *session)
  * TnmSnmpSend --
  *
  *	This procedure sends a packet to the destination address.
+ *	Generator and notifier sessions in the TCP domain queue the
+ *	packet on a connection to the destination.
  *
  * Results:
  *	A standard Tcl result.
@@ -558,9 +961,8 @@ TnmSnmpSend(Tcl_Interp *interp, TnmSnmp *session, u_char *packet, int packetlen,
 {
     int code, sock;
 
-    if (session->domain == TNM_SNMP_TCP_DOMAIN) {
-	/* 1 get suitable tcp socket */
-	/* 2. send the packet */
+    if (TNM_SNMP_TCP(session)) {
+	return TcpSend(interp, packet, packetlen, to, flags, NULL);
     }
 
     if (! tnmSnmpSocketList) {
@@ -569,8 +971,9 @@ TnmSnmpSend(Tcl_Interp *interp, TnmSnmp *session, u_char *packet, int packetlen,
     }
 
     sock = tnmSnmpSocketList ? tnmSnmpSocketList->sock : -1;
-    if (flags & TNM_SNMP_ASYNC && asyncSocket) {
-	sock = asyncSocket->sock;
+    if (flags & TNM_SNMP_ASYNC && asyncCount) {
+	sock = asyncSockets[asyncNext]->sock;
+	asyncNext = (asyncNext + 1) % asyncCount;
     }
     if (flags & TNM_SNMP_SYNC && syncSocket) {
 	sock = syncSocket->sock;
@@ -622,7 +1025,8 @@ TnmSnmpSend(Tcl_Interp *interp, TnmSnmp *session, u_char *packet, int packetlen,
  * TnmSnmpRecv --
  *
  *	This procedure reads incoming responses from the 
- *	manager socket.
+ *	manager socket or from the synchronous TCP connection
+ *	of a session in the TCP domain.
  *
  * Results:
  *	A standard Tcl result. The data and the length of the
@@ -636,30 +1040,40 @@ TnmSnmpSend(Tcl_Interp *interp, TnmSnmp *session, u_char *packet, int packetlen,
  */
 
 int
-TnmSnmpRecv(Tcl_Interp *interp, u_char *packet, int	*packetlen, struct sockaddr_in *from, int flags)
+TnmSnmpRecv(Tcl_Interp *interp, TnmSnmp *session, u_char *packet, int *packetlen, struct sockaddr_in *from, int flags)
 {
-    int sock;
-    socklen_t fromlen = sizeof(*from);
+    TnmSnmpSocket *sockPtr;
+
+    if (session && TNM_SNMP_TCP(session) && (flags & TNM_SNMP_SYNC)) {
+	TcpPool *poolPtr = TcpPoolGet(&session->maddr, 0);
+	int len = 0;
+
+	if (poolPtr && poolPtr->syncConn && *packetlen >= TNM_SNMP_MAXSIZE) {
+	    *from = poolPtr->addr;
+	    len = TcpNext(poolPtr->syncConn, packet);
+	}
+	if (len <= 0) {
+	    Tcl_SetResult(interp, "recv failed: no message", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	*packetlen = len;
+	return TCL_OK;
+    }
 
     if (! tnmSnmpSocketList) {
 	Tcl_SetResult(interp, "sendto failed: no open socket", TCL_STATIC);
 	return TCL_ERROR;
     }
 
-    sock = tnmSnmpSocketList ? tnmSnmpSocketList->sock : -1;
-    if (flags & TNM_SNMP_ASYNC && asyncSocket) {
-	sock = asyncSocket->sock;
+    sockPtr = tnmSnmpSocketList;
+    if (flags & TNM_SNMP_ASYNC && asyncCount) {
+	sockPtr = asyncSockets[0];
     }
     if (flags & TNM_SNMP_SYNC && syncSocket) {
-	sock = syncSocket->sock;
+	sockPtr = syncSocket;
     }
 
-    *packetlen = TnmSocketRecvFrom(sock, packet, (size_t) *packetlen, 0,
-				   (struct sockaddr *) from, &fromlen);
-
-    if (*packetlen == TNM_SOCKET_ERROR) {
-	Tcl_AppendResult(interp, "recvfrom failed: ",
-			 Tcl_PosixError(interp), (char *) NULL);
+    if (SocketRecv(interp, sockPtr, packet, packetlen, from) != TCL_OK) {
 	return TCL_ERROR;
     }
 
@@ -668,60 +1082,75 @@ TnmSnmpRecv(Tcl_Interp *interp, u_char *packet, int	*packetlen, struct sockaddr_
     tnmSnmpBenchMark.recvSize = *packetlen;
 #endif
 
-    if (hexdump) {
-	struct sockaddr_in name, *to = NULL;
-	socklen_t namelen = sizeof(name);
-
-#ifdef _WIN32
-        {
-            int namelen_int = (int)namelen;
-            if (getsockname(sock, (struct sockaddr *) &name, &namelen_int) == 0) {
-                namelen = namelen_int;
-#else
-	if (getsockname(sock, (struct sockaddr *) &name, &namelen) == 0) {
-#endif
-	    to = &name;
-	}
-#ifdef _WIN32
-        }
-#endif
-
-	TnmSnmpDumpPacket(packet, *packetlen, from, to);
-    }
-
     return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * AgentRecv --
+ * SocketRecv --
  *
- *	This procedure reads from the socket to process incoming
- *	SNMP requests.
+ *	This procedure reads a message from a shared socket. The
+ *	datagrams dropped by the kernel because the receive queue of
+ *	the socket was full are counted where the system reports them.
  *
  * Results:
  *	A standard Tcl result.
  *
  * Side effects:
- *	None.
+ *	The socketOverflows statistics counter may be updated.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-AgentRecv(Tcl_Interp	*interp, TnmSnmp *session, u_char *packet, int *packetlen, struct sockaddr_in *from)
+SocketRecv(Tcl_Interp	*interp, TnmSnmpSocket *sockPtr, u_char *packet, int *packetlen, struct sockaddr_in *from)
 {
-    int sock = session->socket->sock;
-    socklen_t fromlen = sizeof(*from);
+    int sock = sockPtr->sock;
+#ifdef SO_RXQ_OVFL
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(u_int))];
+    } control;
+    u_int drops;
 
-    if (! session->socket) {
-	Tcl_SetResult(interp, "recvfrom failed: no agent socket", TCL_STATIC);
-	return TCL_ERROR;
+    /*
+     * The kernel reports the number of datagrams dropped on this
+     * socket so far with every received datagram. We only account
+     * for the difference to the value seen last.
+     */
+
+    iov.iov_base = (char *) packet;
+    iov.iov_len = (size_t) *packetlen;
+    memset((char *) &msg, 0, sizeof(msg));
+    msg.msg_name = (struct sockaddr *) from;
+    msg.msg_namelen = sizeof(*from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *packetlen = recvmsg(sock, &msg, 0);
+
+    if (*packetlen >= 0) {
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    if (cmsg->cmsg_level == SOL_SOCKET
+		&& cmsg->cmsg_type == SO_RXQ_OVFL) {
+		memcpy((char *) &drops, CMSG_DATA(cmsg), sizeof(drops));
+		tnmSnmpStats.tnmSocketOverflows += drops - sockPtr->drops;
+		sockPtr->drops = drops;
+	    }
+	}
     }
+#else
+    socklen_t fromlen = sizeof(*from);
 
     *packetlen = TnmSocketRecvFrom(sock, packet, (size_t) *packetlen, 0,
 				   (struct sockaddr *) from, &fromlen);
+#endif
 
     if (*packetlen == TNM_SOCKET_ERROR) {
 	Tcl_AppendResult(interp, "recvfrom failed: ",
@@ -759,7 +1188,8 @@ AgentRecv(Tcl_Interp	*interp, TnmSnmp *session, u_char *packet, int *packetlen,
  * TnmSnmpTimeoutProc --
  *
  *	This procedure is called from the event dispatcher whenever
- *	a timeout occurs so that we can retransmit packets.
+ *	a timeout occurs so that we can retransmit packets. Requests
+ *	sent over TCP are never retransmitted (RFC 3430 section 2.4).
  *
  * Results:
  *	None.
@@ -776,8 +1206,10 @@ TnmSnmpTimeoutProc(ClientData clientData)
     TnmSnmpRequest *request = (TnmSnmpRequest *) clientData;
     TnmSnmp *session = request->session;
     Tcl_Interp *interp = request->interp;
+    int tcp = TNM_SNMP_TCP(session);
+    int code, ms;
 
-    if (request->sends < (1 + session->retries)) {
+    if (request->sends < (tcp ? 1 : 1 + session->retries)) {
 	
 	/* 
 	 * Reinstall TimerHandler for this request and retransmit
@@ -790,18 +1222,43 @@ TnmSnmpTimeoutProc(ClientData clientData)
 	}
 #endif
 	TnmSnmpDelay(session);
-	TnmSnmpSend(interp, session, request->packet, request->packetlen, 
-		    &session->maddr, TNM_SNMP_ASYNC);
+	if (! request->sends) {
+	    TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_WAIT,
+				 TnmSnmpElapsed(&request->queued));
+	    Tcl_GetTime(&request->sent);
+	}
+	if (tcp) {
+	    code = TcpSend(interp, request->packet, request->packetlen,
+			   &session->maddr, TNM_SNMP_ASYNC, &request->connPtr);
+	} else {
+	    code = TnmSnmpSend(interp, session, request->packet,
+			       request->packetlen, &session->maddr,
+			       TNM_SNMP_ASYNC);
+	}
 #ifdef TNM_SNMP_BENCH
 	if (request->stats.sendSize == 0) {
 	    request->stats.sendSize = tnmSnmpBenchMark.sendSize;
 	    request->stats.sendTime = tnmSnmpBenchMark.sendTime;
 	}
 #endif
+	if (request->sends) {
+	    session->retransmits++;
+	    tnmSnmpStats.tnmRetransmits++;
+	}
         request->sends++;
-	request->timer = Tcl_CreateTimerHandler(
-			(session->timeout * 1000) / (session->retries + 1),
-			TnmSnmpTimeoutProc, (ClientData) request);
+
+	/*
+	 * A request that could not be sent over TCP is never answered
+	 * and expires at once with a noResponse error.
+	 */
+
+	if (tcp) {
+	    ms = (code == TCL_OK) ? session->timeout * 1000 : 0;
+	} else {
+	    ms = (session->timeout * 1000) / (session->retries + 1);
+	}
+	request->timer = Tcl_CreateTimerHandler(ms, TnmSnmpTimeoutProc,
+						(ClientData) request);
 
     } else {
 
@@ -820,6 +1277,10 @@ TnmSnmpTimeoutProc(ClientData clientData)
 	pdu->errorStatus = TNM_SNMP_NORESPONSE;
 	Tcl_DStringInit(&pdu->varbind);
 
+	TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_TIMEOUT,
+			     (u_int) (request->sends - 1));
+	tnmSnmpStats.tnmTimeouts++;
+
 	Tcl_Preserve((ClientData) request);
 	Tcl_Preserve((ClientData) session);
 	TnmSnmpDeleteRequest(request);
@@ -852,15 +1313,25 @@ TnmSnmpTimeoutProc(ClientData clientData)
 static void
 ResponseProc(ClientData	clientData, int mask)
 {
-    Tcl_Interp *interp = (Tcl_Interp *) clientData;
+    TnmSnmpSocket *sockPtr = (TnmSnmpSocket *) clientData;
+    Tcl_Interp *interp = asyncInterp;
     u_char packet[TNM_SNMP_MAXSIZE];
     int code, packetlen = TNM_SNMP_MAXSIZE;
     struct sockaddr_in from;
 
     Tcl_ResetResult(interp);
-    code = TnmSnmpRecv(interp, packet, &packetlen, &from, TNM_SNMP_ASYNC);
+    code = SocketRecv(interp, sockPtr, packet, &packetlen, &from);
     if (code != TCL_OK) return;
 
+#ifdef TNM_SNMP_BENCH
+    Tcl_GetTime(&tnmSnmpBenchMark.recvTime);
+    tnmSnmpBenchMark.recvSize = packetlen;
+#endif
+
+    if (LateResponse(packet, packetlen)) {
+	return;
+    }
+
     code = TnmSnmpDecode(interp, packet, packetlen, &from, 
 			 NULL, NULL, NULL, NULL);
     if (code == TCL_ERROR) {
@@ -873,6 +1344,41 @@ ResponseProc(ClientData	clientData, int mask)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * LateResponse --
+ *
+ *	This procedure checks whether a message received by the
+ *	manager is a response to a request which is not outstanding
+ *	anymore. This happens if a request was retransmitted and the
+ *	agent answers every copy or if the response arrives after
+ *	the request timed out. Such responses are dropped before the
+ *	varbind list is decoded and formatted.
+ *
+ * Results:
+ *	1 if the message should be dropped, 0 otherwise.
+ *
+ * Side effects:
+ *	The lateResponses statistics counter is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LateResponse(u_char *packet, int packetlen)
+{
+    int id;
+
+    if (TnmSnmpPeekResponse(packet, packetlen, &id)
+	&& ! TnmSnmpFindRequest(id)) {
+	tnmSnmpStats.snmpInPkts++;
+	tnmSnmpStats.tnmLateResponses++;
+	return 1;
+    }
+    return 0;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -893,20 +1399,30 @@ ResponseProc(ClientData	clientData, int mask)
 static void
 AgentProc(ClientData clientData, int mask)
 {
-    TnmSnmp *session = (TnmSnmp *) clientData;
-    Tcl_Interp *interp = session->interp;
+    TnmSnmpSocket *sockPtr = (TnmSnmpSocket *) clientData;
+    TnmSnmp *session = sockPtr->session;
+    Tcl_Interp *interp;
     u_char packet[TNM_SNMP_MAXSIZE];
     int code, packetlen = TNM_SNMP_MAXSIZE;
     struct sockaddr_in from;
 
-    if (! interp) return;
+    if (! session || ! session->interp) return;
+    interp = session->interp;
 
     Tcl_ResetResult(interp);
-    code = AgentRecv(interp, session, packet, &packetlen, &from);
+    code = SocketRecv(interp, sockPtr, packet, &packetlen, &from);
     if (code != TCL_OK) return;
+
+    if (session->rateLimit && ! RateAdmit(session, &from)) {
+	session->rateDrops++;
+	tnmSnmpStats.tnmRateDrops++;
+	return;
+    }
     
+    tnmSnmpAgentPort = session->maddr.sin_port;
     code = TnmSnmpDecode(interp, packet, packetlen, &from, 
 			 NULL, NULL, NULL, NULL);
+    tnmSnmpAgentPort = 0;
     if (code == TCL_ERROR) {
 	Tcl_AddErrorInfo(interp, "\n    (snmp agent event)");
 	Tcl_BackgroundError(interp);
@@ -917,3 +1433,1016 @@ AgentProc(ClientData clientData, int mask)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * OpenReusePort --
+ *
+ *	This procedure opens an agent socket with the SO_REUSEPORT
+ *	option set so that other processes running the same agent
+ *	can bind to the same transport address. The kernel spreads
+ *	the managers across the processes. The socket is never
+ *	shared with other sessions.
+ *
+ * Results:
+ *	A pointer to the socket or NULL if the socket can't be
+ *	opened. An error message is left in interp->result if
+ *	interp is not a NULL pointer.
+ *
+ * Side effects:
+ *	A real socket is opened.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TnmSnmpSocket *
+OpenReusePort(Tcl_Interp *interp, struct sockaddr_in *addr)
+{
+#ifdef SO_REUSEPORT
+    TnmSnmpSocket *sockPtr;
+    int code, socket, on = 1;
+
+    socket = TnmSocket(AF_INET, SOCK_DGRAM, 0);
+    if (socket == TNM_SOCKET_ERROR) {
+	if (interp) {
+	    Tcl_AppendResult(interp, "can not create socket: ",
+			     Tcl_PosixError(interp), (char *) NULL);
+	}
+        return NULL;
+    }
+
+    code = setsockopt(socket, SOL_SOCKET, SO_REUSEPORT,
+		      (char *) &on, sizeof(on));
+    if (code == 0) {
+	code = TnmSocketBind(socket, (struct sockaddr *) addr, sizeof(*addr));
+    }
+    if (code == TNM_SOCKET_ERROR) {
+	if (interp) {
+	    Tcl_AppendResult(interp, "can not bind socket: ",
+			     Tcl_PosixError(interp), (char *) NULL);
+	}
+	TnmSocketClose(socket);
+        return NULL;
+    }
+
+#ifdef SO_RXQ_OVFL
+    {
+	int on = 1;
+	setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, (char *) &on, sizeof(on));
+    }
+#endif
+
+    sockPtr = (TnmSnmpSocket *) ckalloc(sizeof(TnmSnmpSocket));
+    memset((char *) sockPtr, 0, sizeof(TnmSnmpSocket));
+    sockPtr->sock = socket;
+    sockPtr->refCount = 1;
+    sockPtr->nextPtr = tnmSnmpSocketList;
+    tnmSnmpSocketList = sockPtr;
+    return sockPtr;
+#else
+    if (interp) {
+	Tcl_SetResult(interp, "SO_REUSEPORT not supported on this platform",
+		      TCL_STATIC);
+    }
+    return NULL;
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RateAdmit --
+ *
+ *	This procedure implements the per manager rate limit of a
+ *	responder. Every manager address owns a token bucket which
+ *	is refilled with rateLimit tokens per second and holds at
+ *	most rateLimit tokens. A request is admitted if a token can
+ *	be taken from the bucket of the sender.
+ *
+ * Results:
+ *	1 if the request is admitted and 0 if it should be dropped.
+ *
+ * Side effects:
+ *	The token bucket of the sender is updated. The least recently
+ *	used bucket is removed if the table grows too large.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RateAdmit(TnmSnmp *session, struct sockaddr_in *from)
+{
+    RateTable *rateTable = session->rateTable;
+    Tcl_HashEntry *entryPtr;
+    RateBucket *bucketPtr;
+    Tcl_Time now;
+    long max = (long) session->rateLimit * 1000, delta;
+    int isNew;
+
+    Tcl_GetTime(&now);
+
+    if (! rateTable) {
+	rateTable = (RateTable *) ckalloc(sizeof(RateTable));
+	Tcl_InitHashTable(&rateTable->table, TCL_ONE_WORD_KEYS);
+	rateTable->firstPtr = rateTable->lastPtr = NULL;
+	session->rateTable = rateTable;
+    }
+
+    entryPtr = Tcl_CreateHashEntry(&rateTable->table,
+		   (char *) (size_t) from->sin_addr.s_addr, &isNew);
+    if (isNew) {
+
+	/*
+	 * Make room by removing the least recently used bucket.
+	 */
+
+	if (rateTable->table.numEntries > TNM_SNMP_RATEBUCKETS) {
+	    bucketPtr = rateTable->firstPtr;
+	    rateTable->firstPtr = bucketPtr->nextPtr;
+	    rateTable->firstPtr->prevPtr = NULL;
+	    Tcl_DeleteHashEntry(bucketPtr->entryPtr);
+	    ckfree((char *) bucketPtr);
+	}
+	bucketPtr = (RateBucket *) ckalloc(sizeof(RateBucket));
+	bucketPtr->tokens = max;
+	bucketPtr->last = now;
+	bucketPtr->entryPtr = entryPtr;
+	Tcl_SetHashValue(entryPtr, (ClientData) bucketPtr);
+    } else {
+	bucketPtr = (RateBucket *) Tcl_GetHashValue(entryPtr);
+	delta = (now.sec - bucketPtr->last.sec) * 1000
+	    + (now.usec - bucketPtr->last.usec) / 1000;
+	if (delta > 1000 || delta < 0) {
+	    delta = 1000;
+	}
+	if (delta > 0) {
+	    bucketPtr->tokens += delta * session->rateLimit;
+	    if (bucketPtr->tokens > max) {
+		bucketPtr->tokens = max;
+	    }
+	    bucketPtr->last = now;
+	}
+	if (bucketPtr == rateTable->lastPtr) {
+	    goto admit;
+	}
+	if (bucketPtr->prevPtr) {
+	    bucketPtr->prevPtr->nextPtr = bucketPtr->nextPtr;
+	} else {
+	    rateTable->firstPtr = bucketPtr->nextPtr;
+	}
+	bucketPtr->nextPtr->prevPtr = bucketPtr->prevPtr;
+    }
+
+    /*
+     * Move the bucket to the end of the list of buckets.
+     */
+
+    bucketPtr->nextPtr = NULL;
+    bucketPtr->prevPtr = rateTable->lastPtr;
+    if (rateTable->lastPtr) {
+	rateTable->lastPtr->nextPtr = bucketPtr;
+    } else {
+	rateTable->firstPtr = bucketPtr;
+    }
+    rateTable->lastPtr = bucketPtr;
+
+  admit:
+    if (bucketPtr->tokens < 1000) {
+	return 0;
+    }
+    bucketPtr->tokens -= 1000;
+    return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpPoolGet --
+ *
+ *	This procedure looks up the pool of TCP connections to an
+ *	agent. A new and empty pool is created if create is set.
+ *
+ * Results:
+ *	A pointer to the pool or NULL if there is no pool.
+ *
+ * Side effects:
+ *	A new pool might be created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TcpPool*
+TcpPoolGet(struct sockaddr_in *addr, int create)
+{
+    Tcl_HashEntry *entryPtr;
+    TcpPool *poolPtr;
+    TcpKey key;
+    int isNew;
+
+    if (! tcpPoolTable) {
+	if (! create) {
+	    return NULL;
+	}
+	tcpPoolTable = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(tcpPoolTable, sizeof(TcpKey) / sizeof(int));
+    }
+
+    memset((char *) &key, 0, sizeof(key));
+    key.addr = (int) addr->sin_addr.s_addr;
+    key.port = (int) addr->sin_port;
+
+    if (! create) {
+	entryPtr = Tcl_FindHashEntry(tcpPoolTable, (char *) &key);
+	return entryPtr ? (TcpPool *) Tcl_GetHashValue(entryPtr) : NULL;
+    }
+
+    entryPtr = Tcl_CreateHashEntry(tcpPoolTable, (char *) &key, &isNew);
+    if (isNew) {
+	poolPtr = (TcpPool *) ckalloc(sizeof(TcpPool));
+	memset((char *) poolPtr, 0, sizeof(TcpPool));
+	poolPtr->addr = *addr;
+	poolPtr->entryPtr = entryPtr;
+	Tcl_SetHashValue(entryPtr, (ClientData) poolPtr);
+    }
+    return (TcpPool *) Tcl_GetHashValue(entryPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpPoolFree --
+ *
+ *	This procedure removes a pool from the pool table once it
+ *	does not contain any connections anymore.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The pool might be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpPoolFree(TcpPool *poolPtr)
+{
+    if (poolPtr->syncConn || poolPtr->numConns) {
+	return;
+    }
+    Tcl_DeleteHashEntry(poolPtr->entryPtr);
+    ckfree((char *) poolPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpConnect --
+ *
+ *	This procedure opens a new TCP connection to the agent of a
+ *	pool. The connect is non-blocking and completes later when
+ *	the socket becomes writable. Messages written before are
+ *	buffered until the connection is established.
+ *
+ * Results:
+ *	A pointer to the new connection or NULL if the connection
+ *	can not be opened. An error message is left in the interp.
+ *
+ * Side effects:
+ *	A socket is created and the pool might be freed on errors.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TcpConn*
+TcpConnect(Tcl_Interp *interp, TcpPool *poolPtr, int sync)
+{
+    TcpConn *connPtr;
+    int sock, code;
+
+    sock = TnmSocket(AF_INET, SOCK_STREAM, 0);
+    if (sock == TNM_SOCKET_ERROR) {
+	Tcl_AppendResult(interp, "can not create socket: ",
+			 Tcl_PosixError(interp), (char *) NULL);
+	TcpPoolFree(poolPtr);
+	return NULL;
+    }
+    TnmSocketSetNonBlocking(sock);
+
+#ifdef TCP_NODELAY
+    {
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+    }
+#endif
+
+    code = TnmSocketConnect(sock, (struct sockaddr *) &poolPtr->addr,
+			    sizeof(poolPtr->addr));
+    if (code == TNM_SOCKET_ERROR
+	&& errno != EINPROGRESS && errno != EWOULDBLOCK) {
+	Tcl_AppendResult(interp, "can not connect: ",
+			 Tcl_PosixError(interp), (char *) NULL);
+	TnmSocketClose(sock);
+	tnmSnmpStats.tnmConnectErrors++;
+	TcpPoolFree(poolPtr);
+	return NULL;
+    }
+
+    connPtr = (TcpConn *) ckalloc(sizeof(TcpConn));
+    memset((char *) connPtr, 0, sizeof(TcpConn));
+    connPtr->sock = sock;
+    connPtr->sync = sync;
+    connPtr->connected = (code == 0);
+    connPtr->interp = interp;
+    connPtr->poolPtr = poolPtr;
+    Tcl_GetTime(&connPtr->last);
+    connPtr->timer = Tcl_CreateTimerHandler(TNM_SNMP_TCP_IDLE,
+				    TcpIdleProc, (ClientData) connPtr);
+    if (sync) {
+	poolPtr->syncConn = connPtr;
+    } else {
+	poolPtr->conns[poolPtr->numConns++] = connPtr;
+	TcpWatch(connPtr);
+    }
+    tnmSnmpStats.tnmConnects++;
+    return connPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpGet --
+ *
+ *	This procedure selects the connection used to send a message
+ *	to an agent. Asynchronous messages go to the connection with
+ *	the fewest outstanding requests. Another connection is opened
+ *	if all connections are busy and the pool is not yet full.
+ *
+ * Results:
+ *	A pointer to the connection or NULL if no connection can be
+ *	opened. An error message is left in the interp.
+ *
+ * Side effects:
+ *	A new connection might be opened.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TcpConn*
+TcpGet(Tcl_Interp *interp, struct sockaddr_in *addr, int sync)
+{
+    TcpPool *poolPtr = TcpPoolGet(addr, 1);
+    TcpConn *connPtr, *bestPtr = NULL;
+    int i;
+
+    if (sync) {
+	if (poolPtr->syncConn) {
+	    return poolPtr->syncConn;
+	}
+	return TcpConnect(interp, poolPtr, 1);
+    }
+
+    for (i = 0; i < poolPtr->numConns; i++) {
+	connPtr = poolPtr->conns[i];
+	if (! bestPtr || connPtr->pending < bestPtr->pending) {
+	    bestPtr = connPtr;
+	}
+    }
+
+    if (! bestPtr || (bestPtr->pending >= TNM_SNMP_TCP_PIPELINE
+		      && poolPtr->numConns < TNM_SNMP_TCP_CONNS)) {
+	connPtr = TcpConnect(interp, poolPtr, 0);
+	if (connPtr || ! bestPtr) {
+	    return connPtr;
+	}
+	Tcl_ResetResult(interp);
+    }
+    return bestPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpClose --
+ *
+ *	This procedure closes a TCP connection and removes it from
+ *	its pool. Requests sent over the connection are not answered
+ *	anymore and expire at once.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The socket is closed and the pool might be freed. The memory
+ *	is released once the connection is not preserved anymore.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpClose(TcpConn *connPtr)
+{
+    TcpPool *poolPtr = connPtr->poolPtr;
+    int i;
+
+    if (connPtr->closed) {
+	return;
+    }
+    connPtr->closed = 1;
+
+    if (poolPtr->syncConn == connPtr) {
+	poolPtr->syncConn = NULL;
+    }
+    for (i = 0; i < poolPtr->numConns; i++) {
+	if (poolPtr->conns[i] == connPtr) {
+	    poolPtr->conns[i] = poolPtr->conns[--poolPtr->numConns];
+	    break;
+	}
+    }
+    TcpPoolFree(poolPtr);
+    connPtr->poolPtr = NULL;
+
+    if (connPtr->pending) {
+	TnmSnmpExpireRequests(connPtr);
+    }
+
+    if (! connPtr->sync) {
+	TnmDeleteSocketHandler(connPtr->sock);
+    }
+    Tcl_DeleteTimerHandler(connPtr->timer);
+    TnmSocketClose(connPtr->sock);
+    if (connPtr->outBuf) {
+	ckfree((char *) connPtr->outBuf);
+	connPtr->outBuf = NULL;
+    }
+    Tcl_EventuallyFree((ClientData) connPtr, TCL_DYNAMIC);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpCloseAll --
+ *
+ *	This procedure closes all TCP connections and frees the
+ *	pool table.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpCloseAll(void)
+{
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    TcpPool *poolPtr;
+
+    if (! tcpPoolTable) {
+	return;
+    }
+
+    while ((entryPtr = Tcl_FirstHashEntry(tcpPoolTable, &search))) {
+	poolPtr = (TcpPool *) Tcl_GetHashValue(entryPtr);
+	TcpClose(poolPtr->numConns ? poolPtr->conns[0] : poolPtr->syncConn);
+    }
+    Tcl_DeleteHashTable(tcpPoolTable);
+    ckfree((char *) tcpPoolTable);
+    tcpPoolTable = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpWatch --
+ *
+ *	This procedure updates the event handler of an asynchronous
+ *	connection. We always wait for incoming messages and we wait
+ *	for the socket to become writable while the connect is in
+ *	progress or while there are buffered messages.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpWatch(TcpConn *connPtr)
+{
+    int mask = TCL_READABLE;
+
+    if (connPtr->sync || connPtr->closed) {
+	return;
+    }
+    if (! connPtr->connected || connPtr->outLen) {
+	mask |= TCL_WRITABLE;
+    }
+    TnmCreateSocketHandler(connPtr->sock, mask, TcpProc, (ClientData) connPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpWrite --
+ *
+ *	This procedure writes a message to a connection. The message
+ *	is written directly if the connection is established and
+ *	idle. Everything that can not be written without blocking is
+ *	appended to the output buffer.
+ *
+ * Results:
+ *	A standard Tcl result. The errno variable is set on errors.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpWrite(TcpConn *connPtr, u_char *packet, int packetlen)
+{
+    int n = 0, len;
+
+    Tcl_GetTime(&connPtr->last);
+
+    if (connPtr->connected && connPtr->outLen == 0) {
+	n = TnmSocketSend(connPtr->sock, packet, (size_t) packetlen, 0);
+	if (n == TNM_SOCKET_ERROR) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		return TCL_ERROR;
+	    }
+	    n = 0;
+	}
+    }
+
+    len = packetlen - n;
+    if (len > 0) {
+	if (connPtr->outLen + len > connPtr->outSize) {
+	    connPtr->outSize = 2 * (connPtr->outLen + len);
+	    if (connPtr->outBuf) {
+		connPtr->outBuf = (u_char *) ckrealloc((char *) connPtr->outBuf,
+						       connPtr->outSize);
+	    } else {
+		connPtr->outBuf = (u_char *) ckalloc(connPtr->outSize);
+	    }
+	}
+	memcpy(connPtr->outBuf + connPtr->outLen, packet + n, (size_t) len);
+	connPtr->outLen += len;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpService --
+ *
+ *	This procedure handles a readable or writable connection. It
+ *	completes a pending connect, writes buffered messages and
+ *	reads incoming data into the input buffer.
+ *
+ * Results:
+ *	A standard Tcl result. TCL_ERROR is returned if the connection
+ *	failed or was closed by the agent.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpService(TcpConn *connPtr, int mask)
+{
+    int n;
+
+    if ((mask & TCL_WRITABLE) && ! connPtr->connected) {
+	int error = TnmSocketError(connPtr->sock);
+
+	if (error) {
+	    errno = error;
+	    return TCL_ERROR;
+	}
+	connPtr->connected = 1;
+    }
+
+    if ((mask & TCL_WRITABLE) && connPtr->connected) {
+	while (connPtr->outLen > 0) {
+	    n = TnmSocketSend(connPtr->sock, connPtr->outBuf,
+			      (size_t) connPtr->outLen, 0);
+	    if (n == TNM_SOCKET_ERROR) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		    break;
+		}
+		return TCL_ERROR;
+	    }
+	    memmove(connPtr->outBuf, connPtr->outBuf + n,
+		    (size_t) (connPtr->outLen - n));
+	    connPtr->outLen -= n;
+	}
+    }
+
+    if (mask & TCL_READABLE) {
+	n = TnmSocketRecv(connPtr->sock, connPtr->inBuf + connPtr->inLen,
+			  sizeof(connPtr->inBuf) - connPtr->inLen, 0);
+	if (n == 0) {
+	    errno = ECONNRESET;
+	    return TCL_ERROR;
+	}
+	if (n == TNM_SOCKET_ERROR) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		return TCL_ERROR;
+	    }
+	} else {
+	    connPtr->inLen += n;
+	    Tcl_GetTime(&connPtr->last);
+	}
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpFrame --
+ *
+ *	This procedure checks whether the input buffer starts with a
+ *	complete message. The length of the message is taken from
+ *	the header of the outer BER sequence.
+ *
+ * Results:
+ *	The length of the message, 0 if the message is not yet
+ *	complete or -1 if the input is not a valid message.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpFrame(TcpConn *connPtr)
+{
+    u_char *p = connPtr->inBuf;
+    int i, n, len;
+
+    if (connPtr->inLen < 2) {
+	return 0;
+    }
+    if (p[0] != ASN1_SEQUENCE) {
+	return -1;
+    }
+    if (p[1] < 0x80) {
+	len = 2 + p[1];
+    } else {
+	n = p[1] & 0x7f;
+	if (n == 0 || n > 3) {
+	    return -1;
+	}
+	if (connPtr->inLen < 2 + n) {
+	    return 0;
+	}
+	for (len = 0, i = 0; i < n; i++) {
+	    len = (len << 8) | p[2 + i];
+	}
+	len += 2 + n;
+    }
+    if (len > TNM_SNMP_MAXSIZE) {
+	return -1;
+    }
+    return (connPtr->inLen >= len) ? len : 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpNext --
+ *
+ *	This procedure removes the next complete message from the
+ *	input buffer of a connection.
+ *
+ * Results:
+ *	The length of the message copied to packet, 0 if there is no
+ *	complete message or -1 if the input is not a valid message.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpNext(TcpConn *connPtr, u_char *packet)
+{
+    int len = TcpFrame(connPtr);
+
+    if (len <= 0) {
+	return len;
+    }
+
+    memcpy(packet, connPtr->inBuf, (size_t) len);
+    memmove(connPtr->inBuf, connPtr->inBuf + len,
+	    (size_t) (connPtr->inLen - len));
+    connPtr->inLen -= len;
+
+#ifdef TNM_SNMP_BENCH
+    Tcl_GetTime(&tnmSnmpBenchMark.recvTime);
+    tnmSnmpBenchMark.recvSize = len;
+#endif
+
+    if (hexdump && connPtr->poolPtr) {
+	TnmSnmpDumpPacket(packet, len, &connPtr->poolPtr->addr, NULL);
+    }
+    return len;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpSend --
+ *
+ *	This procedure sends a message over a TCP connection to the
+ *	destination address. The connection is saved in connPtrPtr
+ *	for asynchronous requests, which count as pending on the
+ *	connection until they are released by TnmSnmpReleaseConn().
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	A connection might be opened or closed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpSend(Tcl_Interp *interp, u_char *packet, int packetlen, struct sockaddr_in *to, int flags, TcpConn **connPtrPtr)
+{
+    TcpConn *connPtr;
+
+    connPtr = TcpGet(interp, to, flags & TNM_SNMP_SYNC);
+    if (! connPtr) {
+	return TCL_ERROR;
+    }
+
+    if (TcpWrite(connPtr, packet, packetlen) != TCL_OK) {
+	Tcl_AppendResult(interp, "send failed: ",
+			 Tcl_PosixError(interp), (char *) NULL);
+	tnmSnmpStats.tnmConnectErrors++;
+	TcpClose(connPtr);
+	return TCL_ERROR;
+    }
+    if (connPtrPtr) {
+	Tcl_Preserve((ClientData) connPtr);
+	connPtr->pending++;
+	*connPtrPtr = connPtr;
+    }
+    TcpWatch(connPtr);
+
+    tnmSnmpStats.snmpOutPkts++;
+#ifdef TNM_SNMP_BENCH
+    Tcl_GetTime(&tnmSnmpBenchMark.sendTime);
+    tnmSnmpBenchMark.sendSize = packetlen;
+#endif
+    if (hexdump) {
+	TnmSnmpDumpPacket(packet, packetlen, NULL, to);
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpReleaseConn --
+ *
+ *	This procedure releases the TCP connection used by a request
+ *	once the request is answered, timed out or cancelled.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The pending counter of the connection is decremented.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpReleaseConn(TnmSnmpRequest *request)
+{
+    TcpConn *connPtr = request->connPtr;
+
+    if (! connPtr) {
+	return;
+    }
+    request->connPtr = NULL;
+    if (! connPtr->closed && connPtr->pending > 0) {
+	connPtr->pending--;
+    }
+    Tcl_Release((ClientData) connPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpWait --
+ *
+ *	This procedure waits for a message on the synchronous TCP
+ *	connection of a session. Buffered requests are written while
+ *	we wait.
+ *
+ * Results:
+ *	1 if a complete message is available, otherwise 0.
+ *
+ * Side effects:
+ *	The connection is closed if it fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TcpWait(TnmSnmp *session, int ms)
+{
+    TcpPool *poolPtr = TcpPoolGet(&session->maddr, 0);
+    TcpConn *connPtr = poolPtr ? poolPtr->syncConn : NULL;
+    struct timeval wait;
+    fd_set readfds, writefds, exceptfds;
+    Tcl_Time start, now;
+    int n, mask, left;
+
+    if (! connPtr) {
+	return 0;
+    }
+
+    Tcl_GetTime(&start);
+    while (1) {
+	n = TcpFrame(connPtr);
+	if (n > 0) {
+	    return 1;
+	}
+	if (n < 0) {
+	    tnmSnmpStats.tnmConnectErrors++;
+	    TcpClose(connPtr);
+	    return 0;
+	}
+
+	Tcl_GetTime(&now);
+	left = ms - (int) ((now.sec - start.sec) * 1000
+			   + (now.usec - start.usec) / 1000);
+	if (left <= 0) {
+	    return 0;
+	}
+
+	wait.tv_sec  = left / 1000;
+	wait.tv_usec = (left % 1000) * 1000;
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	FD_ZERO(&exceptfds);
+	FD_SET(connPtr->sock, &readfds);
+	if (! connPtr->connected || connPtr->outLen) {
+	    FD_SET(connPtr->sock, &writefds);
+	}
+
+	/*
+	 * Windows Sockets report a failed connect as an exception
+	 * instead of making the socket writable.
+	 */
+
+	if (! connPtr->connected) {
+	    FD_SET(connPtr->sock, &exceptfds);
+	}
+	n = select(connPtr->sock + 1, &readfds, &writefds,
+		   &exceptfds, &wait);
+	if (n <= 0) {
+	    continue;
+	}
+
+	mask = 0;
+	if (FD_ISSET(connPtr->sock, &readfds)) {
+	    mask |= TCL_READABLE;
+	}
+	if (FD_ISSET(connPtr->sock, &writefds)
+	    || FD_ISSET(connPtr->sock, &exceptfds)) {
+	    mask |= TCL_WRITABLE;
+	}
+	if (TcpService(connPtr, mask) != TCL_OK) {
+	    tnmSnmpStats.tnmConnectErrors++;
+	    TcpClose(connPtr);
+	    return 0;
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpProc --
+ *
+ *	This procedure is called from the event dispatcher whenever
+ *	an asynchronous connection becomes readable or writable. All
+ *	complete messages are decoded like messages received on the
+ *	shared manager socket.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The connection is closed if it fails or if the agent sends
+ *	something that is not an SNMP message.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpProc(ClientData clientData, int mask)
+{
+    TcpConn *connPtr = (TcpConn *) clientData;
+    Tcl_Interp *interp = connPtr->interp;
+    u_char packet[TNM_SNMP_MAXSIZE];
+    struct sockaddr_in from;
+    int code, packetlen;
+
+    Tcl_Preserve((ClientData) connPtr);
+
+    from = connPtr->poolPtr->addr;
+    if (TcpService(connPtr, mask) != TCL_OK) {
+	tnmSnmpStats.tnmConnectErrors++;
+	TcpClose(connPtr);
+    }
+
+    while (! connPtr->closed) {
+	packetlen = TcpNext(connPtr, packet);
+	if (packetlen == 0) {
+	    break;
+	}
+	if (packetlen < 0) {
+	    tnmSnmpStats.tnmConnectErrors++;
+	    TcpClose(connPtr);
+	    break;
+	}
+
+	if (LateResponse(packet, packetlen)) {
+	    continue;
+	}
+
+	Tcl_ResetResult(interp);
+	code = TnmSnmpDecode(interp, packet, packetlen, &from,
+			     NULL, NULL, NULL, NULL);
+	if (code == TCL_ERROR) {
+	    Tcl_AddErrorInfo(interp, "\n    (snmp response event)");
+	    Tcl_BackgroundError(interp);
+	}
+	if (code == TCL_CONTINUE && hexdump) {
+	    TnmWriteMessage(Tcl_GetStringResult(interp));
+	    TnmWriteMessage("\n");
+	}
+    }
+
+    TcpWatch(connPtr);
+    Tcl_Release((ClientData) connPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TcpIdleProc --
+ *
+ *	This procedure is called from the event dispatcher to close
+ *	connections that have not been used for TNM_SNMP_TCP_IDLE ms.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The connection might be closed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TcpIdleProc(ClientData clientData)
+{
+    TcpConn *connPtr = (TcpConn *) clientData;
+    Tcl_Time now;
+    long idle;
+
+    connPtr->timer = NULL;
+    Tcl_GetTime(&now);
+    idle = (now.sec - connPtr->last.sec) * 1000
+	+ (now.usec - connPtr->last.usec) / 1000;
+    if (idle >= TNM_SNMP_TCP_IDLE || idle < 0) {
+	TcpClose(connPtr);
+	return;
+    }
+    connPtr->timer = Tcl_CreateTimerHandler(TNM_SNMP_TCP_IDLE - (int) idle,
+				    TcpIdleProc, (ClientData) connPtr);
+}
@@ -57,6 +57,9 @@ typedef struct Message {
     int engineIDLength;
     int engineBoots;
     int engineTime;
+    u_char *privParams;
+    int privParamsLength;
+    u_char *plain;
 } Message;
 
 /*
@@ -72,17 +75,28 @@ Authentic		(TnmSnmp *session,
 static int
 DecodeMessage		(Tcl_Interp	*interp, 
 				     Message *msg, TnmSnmpPdu *pdu,
-				     TnmBer *ber);
+				     TnmBer *ber, TnmSnmp *session);
 static TnmBer*
 DecodeHeader		(Message *msg, TnmSnmpPdu *pdu,
 				     TnmBer *ber);
 static TnmBer*
 DecodeScopedPDU		(TnmBer *ber, TnmSnmpPdu *pdu);
 
+static int
+DecryptScopedPDU	(Message *msg, TnmSnmpPdu *pdu,
+				     u_char *encrypted, int length,
+				     TnmSnmp *session);
+
 static TnmBer*
 DecodeUsmSecParams	(Message *msg, TnmSnmpPdu *pdu,
 				     TnmBer *ber);
 
+static void
+SendUsmReport		(Tcl_Interp *interp, 
+				     TnmSnmp *session, 
+				     struct sockaddr_in *to, 
+				     int reqid, u_int *statPtr);
+
 #ifdef TNM_SNMPv2U
 static int
 DecodeUsecParameter	(Message *msg);
@@ -97,6 +111,13 @@ SendUsecReport		(Tcl_Interp *interp,
 static TnmBer*
 DecodePDU		(TnmBer *ber, TnmSnmpPdu *pdu);
 
+static void
+PduFree			(TnmSnmpPdu *pdu);
+
+static void
+AppendVarBind		(Tcl_Obj *listObj, const char *oid,
+			     const char *syntax, Tcl_Obj *valueObj);
+
 
 /*
  *----------------------------------------------------------------------
@@ -124,21 +145,35 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
     TnmSnmpRequest *request = NULL;
     int code, delivered = 0;
     TnmBer *ber;
+    u_char plain[TNM_SNMP_MAXSIZE];
 
     if (reqid) {
 	*reqid = 0;
     }
     memset((char *) msg, 0, sizeof(Message));
+    msg->plain = plain;
     Tcl_DStringInit(&pdu->varbind);
+    pdu->vbList = NULL;
+    pdu->maxSize = 0;
     pdu->addr = *from;
 
     tnmSnmpStats.snmpInPkts++;
     ber = TnmBerCreate(packet, packetlen);
-    code = DecodeMessage(interp, msg, pdu, ber);
+    code = DecodeMessage(interp, msg, pdu, ber, session);
     TnmBerDelete(ber);
-    if (code == TCL_ERROR) {
-	Tcl_DStringFree(&pdu->varbind);
-	return TCL_ERROR;
+    if (code != TCL_OK) {
+	PduFree(pdu);
+	return code;
+    }
+
+    /*
+     * Responses are handed to the callbacks as the list object built
+     * by the decoder. All other PDUs are processed by code working
+     * on the string representation of the varbind list.
+     */
+
+    if (pdu->type != ASN1_SNMP_RESPONSE) {
+	Tcl_DStringAppend(&pdu->varbind, Tcl_GetString(pdu->vbList), -1);
     }
 
     /*
@@ -154,7 +189,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 	    s = request->session;
 	}
 	if (! s) {
-	    Tcl_DStringFree(&pdu->varbind);
+	    PduFree(pdu);
 	    return TCL_CONTINUE;
 	}
 
@@ -167,11 +202,49 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 
 	TnmSnmpEvalBinding(interp, s, pdu, TNM_SNMP_RECV_EVENT);
 
-	TnmSetOctetStringObj(s->engineID, msg->engineID, msg->engineIDLength);
+	Tcl_DecrRefCount(s->engineID);
+	s->engineID = TnmNewOctetStringObj(msg->engineID, msg->engineIDLength);
+	Tcl_IncrRefCount(s->engineID);
 	s->engineBoots = msg->engineBoots;
 	s->engineTime = msg->engineTime;
+	TnmSnmpComputeKeys(s);
+
+	/*
+	 * Remember the engine parameters for other sessions talking
+	 * to this agent. The engine cache is shared by all sessions
+	 * and therefore only updated from authenticated reports or
+	 * from the report which answers our own discovery probe.
+	 * Anybody can send us unauthenticated reports.
+	 */
+
+	if ((request && s->discoverId == request->id
+	     && msg->msgID == request->id)
+	    || ((*msg->msgFlags & TNM_SNMP_FLAG_AUTH)
+		&& Authentic(s, msg, pdu, packet, packetlen, NULL))) {
+	    TnmSnmpEngineUpdate(&s->maddr, msg->engineID, 
+				msg->engineIDLength,
+				msg->engineBoots, msg->engineTime);
+	}
+
+	/*
+	 * A report answering an engine discovery probe completes the
+	 * probe. The report is passed to the callback of the probe.
+	 */
+
+	if (request && s->discoverId == request->id) {
+	    Tcl_Preserve((ClientData) request);
+	    Tcl_Preserve((ClientData) s);
+	    TnmSnmpDeleteRequest(request);
+	    if (request->proc) {
+		(request->proc) (s, pdu, request->clientData);
+	    }
+	    Tcl_Release((ClientData) s);
+	    Tcl_Release((ClientData) request);
+	    PduFree(pdu);
+	    return TCL_OK;
+	}
 	
-	Tcl_DStringFree(&pdu->varbind);
+	PduFree(pdu);
 	return TCL_BREAK;
     }
 
@@ -205,7 +278,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 	    s = request->session;
 	}
 	if (! s) {
-	    Tcl_DStringFree(&pdu->varbind);
+	    PduFree(pdu);
 	    return TCL_CONTINUE;
 	}
 
@@ -260,7 +333,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 			    &s->maddr, TNM_SNMP_ASYNC);
 	    }
 	}
-	Tcl_DStringFree(&pdu->varbind);
+	PduFree(pdu);
 	return TCL_BREAK;
     }
 #endif
@@ -285,7 +358,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 
 	if (! request) {
 	    if (! session) {
-		Tcl_DStringFree(&pdu->varbind);
+		PduFree(pdu);
 		return TCL_CONTINUE;
 	    }
 	    
@@ -295,7 +368,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 
 	    if (! Authentic(session, msg, pdu, packet, packetlen, NULL)) {
 		Tcl_SetResult(interp, "authentication failure", TCL_STATIC);
-		Tcl_DStringFree(&pdu->varbind);
+		PduFree(pdu);
 		return TCL_CONTINUE;
 	    }
 
@@ -310,15 +383,15 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 				 (char *) NULL);
 		sprintf(buf, " %d ", pdu->errorIndex - 1);
 		Tcl_AppendResult(interp, buf, 
-				  Tcl_DStringValue(&pdu->varbind),
+				  Tcl_GetString(pdu->vbList),
 				  (char *) NULL);
-		Tcl_DStringFree(&pdu->varbind);
+		PduFree(pdu);
 		if (status) *status = pdu->errorStatus;
 		if (index) *index = pdu->errorIndex;
 		return TCL_ERROR;
 	    }
-	    Tcl_ResetResult(interp);
-	    Tcl_DStringResult(interp, &pdu->varbind);
+	    Tcl_SetObjResult(interp, pdu->vbList);
+	    PduFree(pdu);
 	    return TCL_OK;
 
 	} else {
@@ -327,10 +400,15 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 
 	    if (! Authentic(session, msg, pdu, packet, packetlen, NULL)) {
 		Tcl_SetResult(interp, "authentication failure", TCL_STATIC);
-		Tcl_DStringFree(&pdu->varbind);
+		PduFree(pdu);
 		return TCL_CONTINUE;
 	    }
 
+	    TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_RTT,
+				 TnmSnmpElapsed(&request->sent));
+	    TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_RETRY,
+				 (u_int) (request->sends - 1));
+
 #ifdef TNM_SNMP_BENCH
 	    request->stats.recvSize = tnmSnmpBenchMark.recvSize;
 	    request->stats.recvTime = tnmSnmpBenchMark.recvTime;
@@ -359,7 +437,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 	     * Free response message structure.
 	     */
 	    
-	    Tcl_DStringFree(&pdu->varbind);
+	    PduFree(pdu);
 	    return TCL_OK;
 	}
     }
@@ -413,7 +491,7 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 		pdu->type = ASN1_SNMP_RESPONSE;
 		if (TnmSnmpEncode(interp, session, pdu, NULL, NULL)
 		    != TCL_OK) {
-		    Tcl_DStringFree(&pdu->varbind);
+		    PduFree(pdu);
 		    return TCL_ERROR;
 		}
             }
@@ -424,16 +502,23 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 	  case ASN1_SNMP_GETNEXT:
 	  case ASN1_SNMP_SET: 
 	    {
-		u_int *statPtr;
+		u_int *statPtr = NULL;
 		if (session->type != TNM_SNMP_RESPONDER) break;
+		if (tnmSnmpAgentPort
+		    && session->maddr.sin_port != tnmSnmpAgentPort) break;
 		if (Authentic(session, msg, pdu, packet, packetlen, &statPtr)) {
 		    TnmSnmpEvalBinding(interp, session, pdu, TNM_SNMP_RECV_EVENT);
 		    if (TnmSnmpAgentRequest(interp, session, pdu) != TCL_OK) {
-			Tcl_DStringFree(&pdu->varbind);
+			PduFree(pdu);
 			return TCL_ERROR;
 		    }
 		    delivered++;
 		} else {
+		    if (session->version == TNM_SNMPv3
+			&& *msg->msgFlags & TNM_SNMP_FLAG_REPORT) {
+			SendUsmReport(interp, session, from,
+				      pdu->requestId, statPtr);
+		    }
 #ifdef TNM_SNMPv2U
 		    if (session->version == TNM_SNMPv2U 
 			&& msg->qos & USEC_QOS_REPORT) {
@@ -451,10 +536,95 @@ TnmSnmpDecode(Tcl_Interp *interp, u_char *packet, int	packetlen, struct sockaddr
 	tnmSnmpStats.snmpInBadCommunityNames++;
     }
 
-    Tcl_DStringFree(&pdu->varbind);
+    PduFree(pdu);
     return TCL_CONTINUE;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PduFree --
+ *
+ *	This procedure frees the varbind list of a decoded PDU.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PduFree(TnmSnmpPdu *pdu)
+{
+    Tcl_DStringFree(&pdu->varbind);
+    if (pdu->vbList) {
+	Tcl_DecrRefCount(pdu->vbList);
+	pdu->vbList = NULL;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpPeekResponse --
+ *
+ *	This procedure scans the header of a message received on a
+ *	manager socket just far enough to find the request-id of a
+ *	response PDU. SNMPv3 messages are identified by the msgID of
+ *	messages without the reportable flag (responses and reports),
+ *	which works for encrypted scoped PDUs as well. This allows to
+ *	drop responses to requests which are not outstanding anymore
+ *	without decoding the varbind list.
+ *
+ * Results:
+ *	1 if the message carries a response and the id was stored
+ *	in id, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpPeekResponse(u_char *packet, int packetlen, int *id)
+{
+    TnmBer *ber;
+    u_char *token, tag;
+    char *octets;
+    int length, version, found = 0;
+
+    ber = TnmBerCreate(packet, packetlen);
+    if (! TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &token, &length)
+	|| ! TnmBerDecInt(ber, ASN1_INTEGER, &version)) {
+	TnmBerDelete(ber);
+	return 0;
+    }
+
+    if (version == 3) {
+	if (TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &token, &length)
+	    && TnmBerDecInt(ber, ASN1_INTEGER, id)
+	    && TnmBerDecInt(ber, ASN1_INTEGER, &length)
+	    && TnmBerDecOctetString(ber, ASN1_OCTET_STRING, &octets, &length)
+	    && length == 1 && ! (*octets & TNM_SNMP_FLAG_REPORT)) {
+	    found = 1;
+	}
+    } else if (version == 0 || version == 1) {
+	if (TnmBerDecOctetString(ber, ASN1_OCTET_STRING, &octets, &length)
+	    && TnmBerDecPeek(ber, &tag) && tag == ASN1_SNMP_RESPONSE
+	    && TnmBerDecSequenceStart(ber, tag, &token, &length)
+	    && TnmBerDecInt(ber, ASN1_INTEGER, id)) {
+	    found = 1;
+	}
+    }
+
+    TnmBerDelete(ber);
+    return found;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -630,15 +800,71 @@ Authentic(TnmSnmp *session, Message *msg, TnmSnmpPdu *pdu, u_char *packet, int p
 	break;
 #endif
     case TNM_SNMPv3:
-	if (! (*msg->msgFlags & TNM_SNMP_FLAG_AUTH)
-	    && ! (*msg->msgFlags & TNM_SNMP_FLAG_PRIV)) {
-	    char *user;
-	    Tcl_Size userLength;
-	    user = Tcl_GetStringFromObj(session->user, &userLength);
+	{
+	    char *user, *engineID;
+	    Tcl_Size userLength, engineIDLength;
+	    int authProto = session->securityLevel & TNM_SNMP_AUTH_MASK;
+	    int privProto = session->securityLevel & TNM_SNMP_PRIV_MASK;
 
+	    if (snmpStatPtr) {
+		*snmpStatPtr = NULL;
+	    }
+
+	    /*
+	     * A responder is the authoritative engine and only accepts
+	     * messages for its own engine ID (RFC 3414 section 3.2
+	     * step 3). This is how managers discover the engine ID.
+	     */
+
+	    if (session->type == TNM_SNMP_RESPONDER) {
+		engineID = TnmGetOctetStringFromObj(NULL, session->engineID,
+						    &engineIDLength);
+		if (engineIDLength != msg->engineIDLength
+		    || memcmp(engineID, msg->engineID,
+			      (size_t) engineIDLength) != 0) {
+		    tnmSnmpStats.usmStatsUnknownEngineIDs++;
+		    if (snmpStatPtr) {
+			*snmpStatPtr = &tnmSnmpStats.usmStatsUnknownEngineIDs;
+		    }
+		    break;
+		}
+	    }
+
+	    user = Tcl_GetStringFromObj(session->user, &userLength);
 	    authentic = (userLength == msg->userLength)
 		&& (memcmp(user, msg->user, (size_t) userLength) == 0);
-	    break;
+
+	    /*
+	     * The security level of the message must match the
+	     * security level of the session.
+	     */
+
+	    if (! (*msg->msgFlags & TNM_SNMP_FLAG_AUTH)
+		!= (authProto == TNM_SNMP_AUTH_NONE)
+		|| ! (*msg->msgFlags & TNM_SNMP_FLAG_PRIV)
+		!= (privProto == TNM_SNMP_PRIV_NONE)) {
+		authentic = 0;
+	    }
+	    if (! authentic || ! (*msg->msgFlags & TNM_SNMP_FLAG_AUTH)) {
+		break;
+	    }
+
+	    /*
+	     * Verify the HMAC digest of authenticated messages
+	     * (RFC 3414 section 6.3.2 and 7.3.2).
+	     */
+
+	    authentic = authProto != TNM_SNMP_AUTH_NONE
+		&& session->usmAuthKey
+		&& msg->authDigestLen == TnmSnmpAuthLength(authProto)
+		&& TnmSnmpAuthInMsg(session, authProto,
+				    packet, packetlen, msg->authDigest);
+	    if (! authentic) {
+		tnmSnmpStats.usmStatsWrongDigests++;
+		if (snmpStatPtr) {
+		    *snmpStatPtr = &tnmSnmpStats.usmStatsWrongDigests;
+		}
+	    }
 	}
 	break;
     }
@@ -664,7 +890,7 @@ Authentic(TnmSnmp *session, Message *msg, TnmSnmpPdu *pdu, u_char *packet, int p
  */
 
 static int
-DecodeMessage(Tcl_Interp *interp, Message *msg, TnmSnmpPdu *pdu, TnmBer *ber)
+DecodeMessage(Tcl_Interp *interp, Message *msg, TnmSnmpPdu *pdu, TnmBer *ber, TnmSnmp *session)
 {
     int version, msgSeqLength;
     u_char *msgSeqToken, *msgSeqStart;
@@ -758,7 +984,19 @@ DecodeMessage(Tcl_Interp *interp, Message *msg, TnmSnmpPdu *pdu, TnmBer *ber)
 	    goto asn1Error;
 	}
 	TnmBerDelete(usmBer);
-	if (! DecodeScopedPDU(ber, pdu)) {
+	if (*msg->msgFlags & TNM_SNMP_FLAG_PRIV) {
+	    u_char *encrypted;
+	    int length;
+	    if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING,
+				       (char **) &encrypted, &length)) {
+		goto asn1Error;
+	    }
+	    if (! DecryptScopedPDU(msg, pdu, encrypted, length, session)) {
+		Tcl_SetResult(interp, "decryption error", TCL_STATIC);
+		tnmSnmpStats.usmStatsDecryptionErrors++;
+		return TCL_CONTINUE;
+	    }
+	} else if (! DecodeScopedPDU(ber, pdu)) {
 	    goto asn1Error;
 	}
     }
@@ -828,6 +1066,7 @@ DecodeHeader(Message *msg, TnmSnmpPdu *pdu, TnmBer *ber)
     if (msg->maxSize < 484) {
 	return NULL;
     }
+    pdu->maxSize = msg->maxSize;
     if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING,
 			       &msg->msgFlags, &flagsLen)) {
 	return NULL;
@@ -902,16 +1141,92 @@ DecodeUsmSecParams(Message *msg, TnmSnmpPdu *pdu, TnmBer *ber)
 			       &msg->user, &msg->userLength)) {
 	return NULL;
     }
-    if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING, NULL, NULL)) {
+    if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING,
+			       (char **) &msg->authDigest,
+			       &msg->authDigestLen)) {
 	return NULL;
     }
-    if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING, NULL, NULL)) {
+    if (! TnmBerDecOctetString(ber, ASN1_OCTET_STRING,
+			       (char **) &msg->privParams,
+			       &msg->privParamsLength)) {
 	return NULL;
     }
 
     return TnmBerDecSequenceEnd(ber, seqToken, seqLength);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * DecryptScopedPDU --
+ *
+ *	This procedure decrypts and decodes an encrypted scoped PDU
+ *	(RFC 3826 section 3.1.4). The privacy key is taken from the
+ *	session of the outstanding request with the same message ID,
+ *	from the session we are waiting on, or from the first
+ *	responder or notification receiver of the user. The plain
+ *	text is kept in the buffer of the message structure because
+ *	the decoded PDU points into it.
+ *
+ * Results:
+ *	1 on success and 0 if the scoped PDU could not be decrypted.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DecryptScopedPDU(Message *msg, TnmSnmpPdu *pdu, u_char *encrypted, int length, TnmSnmp *session)
+{
+    char *user;
+    Tcl_Size userLength;
+    TnmSnmpRequest *request;
+    TnmBer *plainBer;
+    int ok;
+
+    request = TnmSnmpFindRequest(msg->msgID);
+    if (request) {
+	session = request->session;
+    }
+    if (session && session->version != TNM_SNMPv3) {
+	session = NULL;
+    }
+    if (! session) {
+	for (session = tnmSnmpList; session; session = session->nextPtr) {
+	    if (session->version != TNM_SNMPv3
+		|| session->type == TNM_SNMP_GENERATOR
+		|| ! (session->securityLevel & TNM_SNMP_PRIV_MASK)) {
+		continue;
+	    }
+	    user = Tcl_GetStringFromObj(session->user, &userLength);
+	    if (userLength == msg->userLength
+		&& memcmp(user, msg->user, (size_t) userLength) == 0) {
+		break;
+	    }
+	}
+    }
+
+    if (! session || ! session->usmPrivKey
+	|| msg->privParamsLength != 8 || length > TNM_SNMP_MAXSIZE) {
+	return 0;
+    }
+
+    memcpy(msg->plain, encrypted, (size_t) length);
+    if (! TnmSnmpPrivInMsg(session,
+			   session->securityLevel & TNM_SNMP_PRIV_MASK,
+			   msg->engineBoots, msg->engineTime,
+			   msg->privParams, msg->plain, length)) {
+	return 0;
+    }
+
+    plainBer = TnmBerCreate(msg->plain, length);
+    ok = (DecodeScopedPDU(plainBer, pdu) != NULL);
+    TnmBerDelete(plainBer);
+    return ok;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1100,6 +1415,7 @@ SendUsecReport(Tcl_Interp *interp, TnmSnmp *session, struct sockaddr_in *to, int
     pdu->errorIndex = 0;    
     pdu->trapOID = NULL;
     Tcl_DStringInit(&pdu->varbind);
+    pdu->vbList = NULL;
     
     if (statPtr > &tnmSnmpStats.usecStatsUnsupportedQoS) {
 	sprintf(varbind, "{1.3.6.1.6.3.6.1.2.%d %u}", 
@@ -1128,6 +1444,62 @@ SendUsecReport(Tcl_Interp *interp, TnmSnmp *session, struct sockaddr_in *to, int
     session->qos = qos;
 }
 #endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SendUsmReport --
+ *
+ *	This procedure sends a SNMPv3 report PDU to inform a manager
+ *	that a request used an unknown engine ID. The report carries
+ *	the engine ID, boots and time of the responder and completes
+ *	the engine discovery of the manager (RFC 3414 section 4).
+ *	Other USM errors are not reported.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A report PDU is sent to the manager.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SendUsmReport(Tcl_Interp *interp, TnmSnmp *session, struct sockaddr_in *to, int reqid, u_int *statPtr)
+{
+    TnmSnmpPdu _pdu, *pdu = &_pdu;
+    char varbind[80];
+    char securityLevel;
+
+    if (session->type != TNM_SNMP_RESPONDER
+	|| statPtr != &tnmSnmpStats.usmStatsUnknownEngineIDs) {
+	return;
+    }
+
+    pdu->addr = *to;
+    pdu->type = ASN1_SNMP_REPORT;
+    pdu->requestId = reqid;
+    pdu->errorStatus = TNM_SNMP_NOERROR;
+    pdu->errorIndex = 0;    
+    pdu->trapOID = NULL;
+    Tcl_DStringInit(&pdu->varbind);
+    pdu->vbList = NULL;
+
+    sprintf(varbind, "{1.3.6.1.6.3.15.1.1.4.0 Counter32 %u}", *statPtr);
+    Tcl_DStringAppend(&pdu->varbind, varbind, -1);
+
+    /*
+     * The report is not authenticated since the manager does not
+     * know our engine ID and hence can not localize its keys.
+     */
+
+    securityLevel = session->securityLevel;
+    session->securityLevel = TNM_SNMP_AUTH_NONE | TNM_SNMP_PRIV_NONE;
+    TnmSnmpEncode(interp, session, pdu, NULL, NULL);
+    session->securityLevel = securityLevel;
+    Tcl_DStringFree(&pdu->varbind);
+}
 
 /*
  *----------------------------------------------------------------------
@@ -1136,7 +1508,7 @@ SendUsecReport(Tcl_Interp *interp, TnmSnmp *session, struct sockaddr_in *to, int
  *
  *	This procedure takes a serialized packet and decodes the PDU. 
  *	The result is written to the pdu structure and varbind list 
- *	is converted to a TCL list contained in pdu->varbind.
+ *	is converted to a Tcl list object contained in pdu->vbList.
  *
  * Results:
  *	A standard Tcl result.
@@ -1158,7 +1530,8 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
     char *exception, *freeme;
     static char *vboid;
     static int vboidLen = 0;
-    char *snmpTrapEnterprise = NULL;
+    Tcl_Obj *snmpTrapEnterprise = NULL;
+    Tcl_Obj *vbObj, *valObj;
     u_char byte;
 
     u_char tag;
@@ -1170,7 +1543,11 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	return NULL;
     }
 
-    Tcl_DStringInit(&pdu->varbind);
+    if (pdu->vbList) {
+	Tcl_DecrRefCount(pdu->vbList);
+    }
+    pdu->vbList = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(pdu->vbList);
 
     /*
      * Decode the PDU sequence and check whether the PDU type is
@@ -1212,14 +1589,10 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	 */
 
 	{
-	    char *tmp;
-	    snmpTrapEnterprise = TnmOidToStr(oid, oidlen);
-	    tmp = TnmMibGetName(snmpTrapEnterprise, 0);
-	    if (tmp) {
-		snmpTrapEnterprise = ckstrdup(tmp);
-	    } else {
-		snmpTrapEnterprise = ckstrdup(snmpTrapEnterprise);
-	    }
+	    char *tmp, *soid = TnmOidToStr(oid, oidlen);
+	    tmp = TnmMibGetName(soid, 0);
+	    snmpTrapEnterprise = Tcl_NewStringObj(tmp ? tmp : soid, -1);
+	    Tcl_IncrRefCount(snmpTrapEnterprise);
 	}
 
 	if (! TnmBerDecOctetString(ber, ASN1_IPADDRESS, 
@@ -1254,13 +1627,8 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	if (! TnmBerDecInt(ber, ASN1_TIMETICKS, &int_val)) {
 	    goto asn1Error;
 	}
-	{   sprintf(buf, "%u", int_val);
-	    Tcl_DStringStartSublist(&pdu->varbind);
-	    Tcl_DStringAppendElement(&pdu->varbind, "1.3.6.1.2.1.1.3.0");
-	    Tcl_DStringAppendElement(&pdu->varbind, "TimeTicks");
-	    Tcl_DStringAppendElement(&pdu->varbind, buf);
-	    Tcl_DStringEndSublist(&pdu->varbind);
-	}
+	AppendVarBind(pdu->vbList, "1.3.6.1.2.1.1.3.0", "TimeTicks",
+		      Tcl_NewWideIntObj((Tcl_WideInt) (u_int) int_val));
 
 	switch (generic) {
 	  case 0:				/* coldStart*/
@@ -1288,33 +1656,14 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	    break;
 	}
 
-	Tcl_DStringStartSublist(&pdu->varbind);
-	Tcl_DStringAppendElement(&pdu->varbind, "1.3.6.1.6.3.1.1.4.1.0");
-	Tcl_DStringAppendElement(&pdu->varbind, "OBJECT IDENTIFIER");
-	{
-#if 1
-	    Tcl_Obj *tmp = TnmMibFormat("1.3.6.1.6.3.1.1.4.1.0", 0, toid);
-	    if (tmp) {
-		Tcl_DStringAppendElement(&pdu->varbind, Tcl_GetString(tmp));
-		Tcl_DecrRefCount(tmp);
-	    } else {
-		Tcl_DStringAppendElement(&pdu->varbind, toid);
-	    }
-#else
-	    char *tmp = TnmMibGetName(toid, 0);
-	    if (tmp) {
-		Tcl_DStringAppendElement(&pdu->varbind, tmp);
-	    } else {
-		Tcl_DStringAppendElement(&pdu->varbind, toid);
-	    }
-#endif
-	}
+	valObj = TnmMibFormat("1.3.6.1.6.3.1.1.4.1.0", 0, toid);
+	AppendVarBind(pdu->vbList, "1.3.6.1.6.3.1.1.4.1.0",
+		      "OBJECT IDENTIFIER",
+		      valObj ? valObj : Tcl_NewStringObj(toid, -1));
 
-	if (((generic < 0) || (generic > 5)) && toid) {
+	if ((generic < 0) || (generic > 5)) {
 	    ckfree(toid);
-	    toid = NULL;
 	}
-	Tcl_DStringEndSublist(&pdu->varbind);
 
 	if (ber == NULL) {
 	    goto trapError;
@@ -1401,7 +1750,8 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	    goto asn1Error;
 	}
 	
-	Tcl_DStringStartSublist(&pdu->varbind);
+	vbObj = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, pdu->vbList, vbObj);
 	
 	/*
 	 * Decode the OBJECT-IDENTIFIER of the varbind.
@@ -1421,7 +1771,8 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	    } else {
 		strcpy(vboid, soid);
 	    }
-	    Tcl_DStringAppendElement(&pdu->varbind, vboid);
+	    Tcl_ListObjAppendElement(NULL, vbObj,
+				     Tcl_NewStringObj(vboid, len));
 	}
 
 	/*
@@ -1435,10 +1786,11 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 
 	exception = TnmGetTableValue(tnmSnmpExceptionTable, tag);
 	if (exception) {
-	    Tcl_DStringAppendElement(&pdu->varbind, exception);
-	    Tcl_DStringAppendElement(&pdu->varbind, 
-				     TnmMibGetBaseSyntax(vboid)
-				     == ASN1_OCTET_STRING ? "" : "0");
+	    Tcl_ListObjAppendElement(NULL, vbObj,
+				     Tcl_NewStringObj(exception, -1));
+	    Tcl_ListObjAppendElement(NULL, vbObj, 
+		     Tcl_NewStringObj(TnmMibGetBaseSyntax(vboid)
+				      == ASN1_OCTET_STRING ? "" : "0", -1));
 	    TnmBerDecNull(ber, tag);
 	    goto nextVarBind;
 	}
@@ -1449,8 +1801,8 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 
 	{
 	    char *syntax = TnmGetTableValue(tnmSnmpTypeTable, tag);
-	    Tcl_DStringAppendElement(&pdu->varbind, syntax
-				     ? syntax : "Opaque");
+	    Tcl_ListObjAppendElement(NULL, vbObj,
+			     Tcl_NewStringObj(syntax ? syntax : "Opaque", -1));
 	}
 
 	/*
@@ -1464,62 +1816,43 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 	    if (! TnmBerDecInt(ber, tag, &int_val)) {
 		goto asn1Error;
 	    }
-	    sprintf(buf, "%u", int_val);
-            Tcl_DStringAppendElement(&pdu->varbind, buf);
+	    valObj = Tcl_NewWideIntObj((Tcl_WideInt) (u_int) int_val);
             break;
 	case ASN1_INTEGER:
 	    if (! TnmBerDecInt(ber, tag, &int_val)) {
 		goto asn1Error;
 	    }
-	    {   Tcl_Obj *tmp;
-		sprintf(buf, "%d", int_val);
-		tmp = TnmMibFormat(vboid, 0, buf);
-		if (tmp) {
-		    Tcl_DStringAppendElement(&pdu->varbind,
-					     Tcl_GetString(tmp));
-		    Tcl_DecrRefCount(tmp);
-		} else {
-		    Tcl_DStringAppendElement(&pdu->varbind, buf);
-		}
+	    sprintf(buf, "%d", int_val);
+	    valObj = TnmMibFormat(vboid, 0, buf);
+	    if (! valObj) {
+		valObj = Tcl_NewIntObj(int_val);
 	    }
             break;
 	case ASN1_COUNTER64:
 	    {
 		TnmUnsigned64 u;
-		Tcl_Obj *objPtr;
 		if (! TnmBerDecUnsigned64(ber, &u)) {
 		    goto asn1Error;
 		}
-		objPtr = TnmNewUnsigned64Obj(u);
-		Tcl_DStringAppendElement(&pdu->varbind, 
-					 Tcl_GetStringFromObj(objPtr, NULL));
-		Tcl_DecrRefCount(objPtr);
+		valObj = TnmNewUnsigned64Obj(u);
 	    }
 	    break;
 	case ASN1_NULL:
 	    if (! TnmBerDecNull(ber, ASN1_NULL)) {
 		goto asn1Error;
 	    }
-	    Tcl_DStringAppendElement(&pdu->varbind, "");
+	    valObj = Tcl_NewObj();
             break;
 	case ASN1_OBJECT_IDENTIFIER:
 	    if (! TnmBerDecOID(ber, oid, &oidlen)) {
 		goto asn1Error;
 	    }
-#if 1
 	    {   char *soid = TnmOidToStr(oid, oidlen);
-		Tcl_Obj *tmp = TnmMibFormat(vboid, 0, soid);
-		if (tmp) {
-		    Tcl_DStringAppendElement(&pdu->varbind,
-					     Tcl_GetString(tmp));
-		    Tcl_DecrRefCount(tmp);
-		} else {
-		    Tcl_DStringAppendElement(&pdu->varbind, soid);
+		valObj = TnmMibFormat(vboid, 0, soid);
+		if (! valObj) {
+		    valObj = Tcl_NewStringObj(soid, -1);
 		}
 	    }
-#else
-	    Tcl_DStringAppendElement(&pdu->varbind, TnmOidToStr(oid, oidlen));
-#endif
             break;
 	case ASN1_IPADDRESS:
 	    if (! TnmBerDecOctetString(ber, ASN1_IPADDRESS, 
@@ -1527,12 +1860,10 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 		 goto asn1Error;
 	    }
 	    if (int_val != 4) goto asn1Error;
-            Tcl_DStringAppend(&pdu->varbind, " ", 1);
 	    {
 		struct sockaddr_in addr;
 		memcpy(&addr.sin_addr, freeme, 4);
-		Tcl_DStringAppendElement(&pdu->varbind, 
-					 inet_ntoa(addr.sin_addr));
+		valObj = Tcl_NewStringObj(inet_ntoa(addr.sin_addr), -1);
 	    }
             break;
 	case ASN1_OPAQUE:
@@ -1550,18 +1881,12 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 		    hex = ckalloc(hexLen);
 		}
 		TnmHexEnc(freeme, int_val, hex);
+		valObj = NULL;
 		if (tag == ASN1_OCTET_STRING) {
-		    Tcl_Obj *tmp;
-		    tmp = TnmMibFormat(vboid, 0, hex);
-		    if (tmp) {
-			Tcl_DStringAppendElement(&pdu->varbind,
-						 Tcl_GetString(tmp));
-			Tcl_DecrRefCount(tmp);
-		    } else {
-			Tcl_DStringAppendElement(&pdu->varbind, hex);
-		    }
-		} else {
-		    Tcl_DStringAppendElement(&pdu->varbind, hex);
+		    valObj = TnmMibFormat(vboid, 0, hex);
+		}
+		if (! valObj) {
+		    valObj = Tcl_NewStringObj(hex, -1);
 		}
 	    }
             break;
@@ -1578,14 +1903,14 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
 		    hex = ckalloc(hexLen);
 		}
 		TnmHexEnc(freeme, int_val, hex);
-		Tcl_DStringAppendElement(&pdu->varbind, hex);
+		valObj = Tcl_NewStringObj(hex, -1);
 	    }
 	    break;
 	}
+	Tcl_ListObjAppendElement(NULL, vbObj, valObj);
 	
       nextVarBind:
 
-	Tcl_DStringEndSublist(&pdu->varbind);
 	if (! TnmBerDecSequenceEnd(ber, vbSeqToken, vbSeqLength)) {
 	    goto asn1Error;
 	}
@@ -1597,12 +1922,10 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
      */
 
     if (pdu->type == ASN1_SNMP_TRAP1 && snmpTrapEnterprise) {
-	Tcl_DStringStartSublist(&pdu->varbind);
-	Tcl_DStringAppendElement(&pdu->varbind, "1.3.6.1.6.3.1.1.4.3.0");
-        Tcl_DStringAppendElement(&pdu->varbind, "OBJECT IDENTIFIER");
-	Tcl_DStringAppendElement(&pdu->varbind, snmpTrapEnterprise);
-	Tcl_DStringEndSublist(&pdu->varbind);
-	ckfree(snmpTrapEnterprise);
+	AppendVarBind(pdu->vbList, "1.3.6.1.6.3.1.1.4.3.0",
+		      "OBJECT IDENTIFIER", snmpTrapEnterprise);
+	Tcl_DecrRefCount(snmpTrapEnterprise);
+	snmpTrapEnterprise = NULL;
     }
 
     if (! TnmBerDecSequenceEnd(ber, vblSeqToken, vblSeqLength)) {
@@ -1615,13 +1938,47 @@ DecodePDU(TnmBer *ber, TnmSnmpPdu *pdu)
     return ber;
     
   asn1Error:
+    if (snmpTrapEnterprise) {
+	Tcl_DecrRefCount(snmpTrapEnterprise);
+    }
     tnmSnmpStats.snmpInASNParseErrs++;
     return NULL;
 
   trapError:
+    if (snmpTrapEnterprise) {
+	Tcl_DecrRefCount(snmpTrapEnterprise);
+    }
     return ber;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendVarBind --
+ *
+ *	This procedure appends a varbind with the given object
+ *	identifier, type and value to a varbind list.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The list object is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendVarBind(Tcl_Obj *listObj, const char *oid, const char *syntax, Tcl_Obj *valueObj)
+{
+    Tcl_Obj *vbObj = Tcl_NewListObj(0, NULL);
+
+    Tcl_ListObjAppendElement(NULL, vbObj, Tcl_NewStringObj(oid, -1));
+    Tcl_ListObjAppendElement(NULL, vbObj, Tcl_NewStringObj(syntax, -1));
+    Tcl_ListObjAppendElement(NULL, vbObj, valueObj);
+    Tcl_ListObjAppendElement(NULL, listObj, vbObj);
+}
+
 /*
  * Local Variables:
  * compile-command: "make -k -C ../../unix"
@@ -40,10 +40,16 @@ EncodeHeader		(Tcl_Interp *interp, TnmSnmp *session,
 				     TnmSnmpPdu *pdu, TnmBer *ber);
 static TnmBer*
 EncodeScopedPDU		(Tcl_Interp *interp, TnmSnmp *session,
-				     TnmSnmpPdu *pdu, TnmBer *ber);
+				     TnmSnmpPdu *pdu, u_char *salt,
+				     TnmBer *ber);
 static u_char*
 EncodeUsmSecParams	(TnmSnmp *session, TnmSnmpPdu *pdu,
-				     int *lengthPtr);
+				     u_char *salt, int *lengthPtr);
+#ifdef TNM_SNMPv3
+static void
+UsmAuth			(TnmSnmp *session, u_char *packet,
+				     int packetlen);
+#endif
 #ifdef TNM_SNMPv2U
 static int
 EncodeUsecParameter	(TnmSnmp *session, TnmSnmpPdu *pdu, 
@@ -54,6 +60,10 @@ static TnmBer*
 EncodePDU		(Tcl_Interp *interp, 
 				     TnmSnmp *sess, TnmSnmpPdu *pdu,
 				     TnmBer *ber);
+static TnmBer*
+EncodeVarBind		(Tcl_Interp *interp,
+				     TnmSnmp *session, TnmSnmpPdu *pdu,
+				     const char *varbind, TnmBer *ber);
 
 /*
  *----------------------------------------------------------------------
@@ -76,7 +86,8 @@ EncodePDU		(Tcl_Interp *interp,
 int
 TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequestProc *proc, ClientData clientData)
 {
-    int	retry = 0, packetlen = 0, code = 0;
+    int	retry = 0, retries, packetlen = 0, code = 0;
+    Tcl_Time sent;
     u_char packet[TNM_SNMP_MAXSIZE];
     TnmBer *ber;
 
@@ -141,6 +152,13 @@ TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequ
     packetlen = TnmBerSize(ber);
     TnmBerDelete(ber);
 
+#ifdef TNM_SNMPv3
+    if (session->version == TNM_SNMPv3
+	&& session->securityLevel & TNM_SNMP_AUTH_MASK) {
+	UsmAuth(session, packet, packetlen);
+    }
+#endif
+
     switch (pdu->type) {
       case ASN1_SNMP_GET:
 	  tnmSnmpStats.snmpOutGetRequests++;
@@ -204,7 +222,15 @@ TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequ
      * Synchronous request: send packet and wait for response.
      */
     
-    for (retry = 0; retry <= session->retries; retry++) {
+    /*
+     * Requests sent over TCP are never retransmitted. We wait for
+     * the whole timeout interval instead.
+     */
+
+    retries = TNM_SNMP_TCP(session) ? 0 : session->retries;
+
+    Tcl_GetTime(&sent);
+    for (retry = 0; retry <= retries; retry++) {
 	int id, status, index;
 #ifdef TNM_SNMP_BENCH
 	TnmSnmpMark stats;
@@ -223,6 +249,10 @@ TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequ
 	if (code != TCL_OK) {
 	    return TCL_ERROR;
 	}
+	if (retry) {
+	    session->retransmits++;
+	    tnmSnmpStats.tnmRetransmits++;
+	}
 
 #ifdef TNM_SNMP_BENCH
 	if (stats.sendSize == 0) {
@@ -231,25 +261,45 @@ TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequ
 	}
 #endif
 
-	while (TnmSnmpWait(session->timeout * 1000
-			   / (session->retries + 1), TNM_SNMP_SYNC) > 0) {
+	while (TnmSnmpWait(session, session->timeout * 1000
+			   / (retries + 1), TNM_SNMP_SYNC) > 0) {
 	    u_char packet[TNM_SNMP_MAXSIZE];
 	    int rc, packetlen = TNM_SNMP_MAXSIZE;
 	    struct sockaddr_in from;
 
-	    code = TnmSnmpRecv(interp, packet, &packetlen, 
+	    code = TnmSnmpRecv(interp, session, packet, &packetlen, 
 			       &from, TNM_SNMP_SYNC);
 	    if (code != TCL_OK) {
 		return TCL_ERROR;
 	    }
 	    
+	    /*
+	     * Skip responses to earlier synchronous requests without
+	     * decoding them. They arrive late or are answers to a
+	     * retransmitted copy of a request that was answered.
+	     */
+
+	    if (TnmSnmpPeekResponse(packet, packetlen, &id)
+		&& id != pdu->requestId) {
+		tnmSnmpStats.snmpInPkts++;
+		tnmSnmpStats.tnmLateResponses++;
+		continue;
+	    }
+
+	    id = -1;
 	    rc = TnmSnmpDecode(interp, packet, packetlen, &from,
 			       session, &id, &status, &index);
 	    if (rc == TCL_BREAK) {
-		if (retry++ <= session->retries + 1) {
+		if (retry++ <= retries + 1) {
 		    goto repeat;
 		}
 	    }
+	    if ((rc == TCL_OK || rc == TCL_ERROR) && id == pdu->requestId) {
+		TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_RTT,
+				     TnmSnmpElapsed(&sent));
+		TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_RETRY,
+				     (u_int) retry);
+	    }
 	    if (rc == TCL_OK) {
 		if (id == pdu->requestId) {
 #ifdef TNM_SNMP_BENCH
@@ -276,10 +326,93 @@ TnmSnmpEncode(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmSnmpRequ
 	}
     }
     
+    TnmSnmpLatencyRecord(session, TNM_SNMP_LATENCY_TIMEOUT,
+			 (u_int) retries);
+    tnmSnmpStats.tnmTimeouts++;
     Tcl_SetResult(interp, "noResponse 0 {}", TCL_STATIC);
     return TCL_ERROR;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpMessageSize --
+ *
+ *	This procedure computes the length of the message which
+ *	carries the pdu on the given session. The message is encoded
+ *	but neither authenticated nor sent.
+ *
+ * Results:
+ *	The length of the encoded message or -1 if the pdu could not
+ *	be encoded. An error message is left in the interpreter.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpMessageSize(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu)
+{
+    u_char packet[TNM_SNMP_MAXSIZE];
+    TnmBer *ber;
+    int size = -1;
+
+    ber = TnmBerCreate(packet, sizeof(packet));
+    if (EncodeMessage(interp, session, pdu, ber) == TCL_OK) {
+	size = TnmBerSize(ber);
+    }
+    TnmBerDelete(ber);
+    return size;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpVarBindSize --
+ *
+ *	This procedure computes the number of bytes the varbinds in
+ *	the Tcl list varbinds add to the message which carries the
+ *	pdu. The length of the enclosing sequences is not included.
+ *
+ * Results:
+ *	The length of the encoded varbinds or -1 if the varbinds could
+ *	not be encoded. An error message is left in the interpreter.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpVarBindSize(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, const char *varbinds)
+{
+    u_char packet[TNM_SNMP_MAXSIZE];
+    TnmBer *ber, *p;
+    Tcl_Size i, vblc;
+    const char **vblv;
+    int size = -1;
+
+    if (Tcl_SplitList(interp, varbinds, &vblc, &vblv) != TCL_OK) {
+	return -1;
+    }
+
+    ber = p = TnmBerCreate(packet, sizeof(packet));
+    for (i = 0; p && i < vblc; i++) {
+	p = EncodeVarBind(interp, session, pdu, vblv[i], p);
+    }
+    if (p) {
+	size = TnmBerSize(ber);
+    } else if (*Tcl_GetStringResult(interp) == '\0') {
+	Tcl_SetResult(interp, TnmBerGetError(NULL), TCL_STATIC);
+    }
+    TnmBerDelete(ber);
+    ckfree((char *) vblv);
+    return size;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -356,16 +489,32 @@ EncodeMessage(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber
 
     if (version == 3) {
 	int secParamLength;
-	unsigned char *secParam;
+	unsigned char *secParam, salt[8], *saltPtr = NULL;
+
+	switch (session->securityLevel & TNM_SNMP_PRIV_MASK) {
+	case TNM_SNMP_PRIV_NONE:
+	    break;
+	case TNM_SNMP_PRIV_AES:
+	case TNM_SNMP_PRIV_AES192:
+	case TNM_SNMP_PRIV_AES256:
+	    TnmSnmpPrivSalt(salt);
+	    saltPtr = salt;
+	    break;
+	default:
+	    Tcl_SetResult(interp, "privacy protocol not supported",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+
 	ber = EncodeHeader(interp, session, pdu, ber);
-	secParam = EncodeUsmSecParams(session, pdu, &secParamLength);
+	secParam = EncodeUsmSecParams(session, pdu, saltPtr, &secParamLength);
 	if (! secParam) {
 	    Tcl_SetResult(interp, TnmBerGetError(NULL), TCL_STATIC);
 	    return TCL_ERROR;
 	}
 	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING,
 				   (char *) secParam, secParamLength);
-	ber = EncodeScopedPDU(interp, session, pdu, ber);
+	ber = EncodeScopedPDU(interp, session, pdu, saltPtr, ber);
 	if (*Tcl_GetStringResult (interp) == '\0') {
 	    Tcl_SetResult(interp, TnmBerGetError(NULL), TCL_STATIC);
 	}
@@ -432,7 +581,7 @@ EncodeHeader(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
     ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &seqToken);
 
     ber = TnmBerEncInt(ber, ASN1_INTEGER, pdu->requestId);
-    ber = TnmBerEncInt(ber, ASN1_INTEGER, TNM_SNMP_MAXSIZE);
+    ber = TnmBerEncInt(ber, ASN1_INTEGER, session->maxSize);
     ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, &flags, 1);
     ber = TnmBerEncInt(ber, ASN1_INTEGER, TNM_SNMP_USM_SEC_MODEL);
 
@@ -457,6 +606,9 @@ EncodeHeader(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
  *	        msgPrivacyParameters         OCTET STRING
  *	  }
  *
+ *	The msgPrivacyParameters contain the salt if the scoped PDU
+ *	is encrypted.
+ *
  * Results:
  *	A pointer to the beginning to the encoded security parameters.
  *	The length is returned in the lengthPtr parameter.
@@ -468,7 +620,7 @@ EncodeHeader(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
  */
 
 static u_char*
-EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, int *lengthPtr)
+EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, u_char *salt, int *lengthPtr)
 {
     u_char *seqToken;
     char *user, *engineID;
@@ -488,7 +640,7 @@ EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, int *lengthPtr)
     ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING,
 			       engineID, engineIDLength);
 
-    if (pdu->type == ASN1_SNMP_RESPONSE
+    if (pdu->type == ASN1_SNMP_RESPONSE || pdu->type == ASN1_SNMP_REPORT
 	|| session->securityLevel & TNM_SNMP_AUTH_MASK) {
 	ber = TnmBerEncInt(ber, ASN1_INTEGER, session->engineBoots);
 	ber = TnmBerEncInt(ber, ASN1_INTEGER, session->engineTime);
@@ -502,13 +654,19 @@ EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, int *lengthPtr)
 			       user, userLength);
     
     if (session->securityLevel & TNM_SNMP_AUTH_MASK) {
-	char zeros[12];
-	memset(zeros, 0, 12);
-	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, zeros, 12);
+	char zeros[64];
+	int authLength = TnmSnmpAuthLength(session->securityLevel
+					   & TNM_SNMP_AUTH_MASK);
+	memset(zeros, 0, sizeof(zeros));
+	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, zeros, authLength);
+    } else {
+	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, "", 0);
+    }
+    if (salt) {
+	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, (char *) salt, 8);
     } else {
 	ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, "", 0);
     }
-    ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, "", 0);
     ber = TnmBerEncSequenceEnd(ber, seqToken);
 
     if (! ber) {
@@ -536,6 +694,9 @@ EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, int *lengthPtr)
  *		data             ANY -- e.g., PDUs as defined in RFC1905
  *	    }
  *
+ *	The scoped PDU is encrypted and encoded as an OCTET STRING
+ *	if a salt for the privacy protocol is given (RFC 3826).
+ *
  * Results:
  *	A standard Tcl result.
  *
@@ -546,12 +707,39 @@ EncodeUsmSecParams(TnmSnmp *session, TnmSnmpPdu *pdu, int *lengthPtr)
  */
 
 static TnmBer*
-EncodeScopedPDU(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
+EncodeScopedPDU(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, u_char *salt, TnmBer *ber)
 {
     u_char *seqToken;
     char *context, *engineID;
     Tcl_Size contextLength, engineIDLength;
 
+    if (salt) {
+	u_char buffer[TNM_SNMP_MAXSIZE];
+	TnmBer *plainBer;
+	int length;
+
+	if (! ber) {
+	    return NULL;
+	}
+	plainBer = TnmBerCreate(buffer, sizeof(buffer));
+	if (! EncodeScopedPDU(interp, session, pdu, NULL, plainBer)) {
+	    TnmBerDelete(plainBer);
+	    return NULL;
+	}
+	length = TnmBerSize(plainBer);
+	TnmBerDelete(plainBer);
+	if (! session->usmPrivKey
+	    || ! TnmSnmpPrivOutMsg(session,
+				   session->securityLevel & TNM_SNMP_PRIV_MASK,
+				   session->engineBoots, session->engineTime,
+				   salt, buffer, length)) {
+	    Tcl_SetResult(interp, "no usable privacy key", TCL_STATIC);
+	    return NULL;
+	}
+	return TnmBerEncOctetString(ber, ASN1_OCTET_STRING,
+				    (char *) buffer, length);
+    }
+
     ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &seqToken);
 
     engineID = TnmGetOctetStringFromObj(NULL, session->engineID,
@@ -567,6 +755,71 @@ EncodeScopedPDU(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *b
     return ber;
 }
 
+#ifdef TNM_SNMPv3
+/*
+ *----------------------------------------------------------------------
+ *
+ * UsmAuth --
+ *
+ *	This procedure patches the USM authentication parameters into
+ *	a BER encoded SNMPv3 message. We decode the message until we
+ *	have found the msgAuthenticationParameters, which were encoded
+ *	as zero bytes by EncodeUsmSecParams(), and compute the
+ *	digest over the whole message.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The authentication parameters of the message are filled in.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UsmAuth(TnmSnmp *session, u_char *packet, int packetlen)
+{
+    TnmBer *ber, *usmBer;
+    u_char *token, *usmParam, *authParam = NULL;
+    int length, dummy, usmParamLength, authParamLength = 0;
+    int authProto = session->securityLevel & TNM_SNMP_AUTH_MASK;
+
+    if (! session->usmAuthKey) {
+	return;
+    }
+
+    ber = TnmBerCreate(packet, packetlen);
+    if (TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &token, &length)
+	&& TnmBerDecInt(ber, ASN1_INTEGER, &dummy)
+	&& TnmBerDecSequenceStart(ber, ASN1_SEQUENCE, &token, &length)) {
+	ber->current = token + length;
+	if (TnmBerDecOctetString(ber, ASN1_OCTET_STRING,
+				 (char **) &usmParam, &usmParamLength)) {
+	    usmBer = TnmBerCreate(usmParam, usmParamLength);
+	    if (! TnmBerDecSequenceStart(usmBer, ASN1_SEQUENCE,
+					 &token, &length)
+		|| ! TnmBerDecOctetString(usmBer, ASN1_OCTET_STRING,
+					  NULL, NULL)
+		|| ! TnmBerDecInt(usmBer, ASN1_INTEGER, &dummy)
+		|| ! TnmBerDecInt(usmBer, ASN1_INTEGER, &dummy)
+		|| ! TnmBerDecOctetString(usmBer, ASN1_OCTET_STRING,
+					  NULL, NULL)
+		|| ! TnmBerDecOctetString(usmBer, ASN1_OCTET_STRING,
+					  (char **) &authParam,
+					  &authParamLength)) {
+		authParam = NULL;
+	    }
+	    TnmBerDelete(usmBer);
+	}
+    }
+    TnmBerDelete(ber);
+
+    if (authParam && authParamLength == TnmSnmpAuthLength(authProto)) {
+	TnmSnmpAuthOutMsg(session, authProto, packet, packetlen, authParam);
+    }
+}
+#endif
+
 #ifdef TNM_SNMPv2U
 /*
  *----------------------------------------------------------------------
@@ -805,8 +1058,8 @@ EncodePDU(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
 {    
     u_char *pduSeqToken, *vbSeqToken, *vblSeqToken;
     
-    Tcl_Size i, vblc, vbc;
-    const char **vblv, **vbv;
+    Tcl_Size i, vblc;
+    const char **vblv;
 
     Tnm_Oid *oid;
     int oidlen;
@@ -927,274 +1180,303 @@ EncodePDU(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, TnmBer *ber)
     }
     
     for (i = 0; i < vblc; i++) {
-	
-        const char *value;
-	int asn1_type = ASN1_OTHER;
-	char string[64];
-	
-	/*
-	 * split a single varbind into its components
-	 */
-	
-	if (Tcl_SplitList(interp, vblv[i], &vbc, &vbv) != TCL_OK) {
+	ber = EncodeVarBind(interp, session, pdu, vblv[i], ber);
+	if (ber == NULL) {
 	    ckfree((char *) vblv);
 	    return NULL;
 	}
+    }
 
-	if (vbc == 0) {
-	    Tcl_SetResult(interp, "missing OBJECT IDENTIFIER", TCL_STATIC);
-	    ckfree((char *) vblv);
-            return NULL;
-	}
-	
-	/*
-	 * encode each VarBind ( SEQUENCE name, value )
-	 */
-	
-	ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &vbSeqToken);
+    ckfree((char *) vblv);
 
-	/*
-	 * encode the object identifier, perhaps consulting the MIB
-	 */
+    ber = TnmBerEncSequenceEnd(ber, vblSeqToken);
+    ber = TnmBerEncSequenceEnd(ber, pduSeqToken);
+    return ber;
+}
 
-	oid = TnmStrToOid(vbv[0], &oidlen);
-	if (! oid) {
-	    char *tmp = TnmMibGetOid(vbv[0]);
-	    if (tmp) {
-		oid = TnmStrToOid(tmp, &oidlen);
-	    }
-	}
-	if (! oid) {
-	    Tcl_ResetResult(interp);
-	    Tcl_AppendResult(interp, "invalid object identifier \"",
-			     vbv[0], "\"", (char *) NULL);
-	    ckfree((char *) vbv);
-	    ckfree((char *) vblv);
-	    return NULL;
-	}
+/*
+ *----------------------------------------------------------------------
+ *
+ * EncodeVarBind --
+ *
+ *	This procedure serializes a single varbind given as a Tcl
+ *	list containing the object identifier, the type and the
+ *	value. The type and the value are optional.
+ *
+ * Results:
+ *	A pointer to the BER byte stream or NULL.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	ber = TnmBerEncOID(ber, oid, oidlen);
-	if (ber == NULL) {
-	    break;
+static TnmBer*
+EncodeVarBind(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, const char *varbind, TnmBer *ber)
+{
+    u_char *vbSeqToken;
+    Tcl_Size vbc;
+    const char **vbv, *value;
+    Tnm_Oid *oid;
+    int oidlen, asn1_type = ASN1_OTHER;
+    char string[64];
+
+    /*
+     * split a single varbind into its components
+     */
+
+    if (Tcl_SplitList(interp, varbind, &vbc, &vbv) != TCL_OK) {
+	return NULL;
+    }
+
+    if (vbc == 0) {
+	Tcl_SetResult(interp, "missing OBJECT IDENTIFIER", TCL_STATIC);
+	goto error;
+    }
+
+    /*
+     * encode each VarBind ( SEQUENCE name, value )
+     */
+
+    ber = TnmBerEncSequenceStart(ber, ASN1_SEQUENCE, &vbSeqToken);
+
+    /*
+     * encode the object identifier, perhaps consulting the MIB
+     */
+
+    oid = TnmStrToOid(vbv[0], &oidlen);
+    if (! oid) {
+	char *tmp = TnmMibGetOid(vbv[0]);
+	if (tmp) {
+	    oid = TnmStrToOid(tmp, &oidlen);
 	}
+    }
+    if (! oid) {
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, "invalid object identifier \"",
+			 vbv[0], "\"", (char *) NULL);
+	goto error;
+    }
 
-	/*
-	 * guess the asn1 type field and the value
-	 */
+    ber = TnmBerEncOID(ber, oid, oidlen);
+    if (ber == NULL) {
+	goto error;
+    }
 
-	switch (vbc) {
-	  case 1:
-	    value = "";
-	    asn1_type = ASN1_NULL;
-	    break;
-	  case 2:
-	    value = vbv[1];
-	    asn1_type = TnmMibGetBaseSyntax(vbv[0]);
-	    break;
-	  default:
-	    value = vbv[2];
+    /*
+     * guess the asn1 type field and the value
+     */
 
-	    /*
-	     * Check if there is an exception in the asn1 type field.
-	     * Convert this into an appropriate NULL type if we create
-	     * a response PDU. Otherwise, ignore this stuff and use
-	     * the type found in the MIB.
-	     */
+    switch (vbc) {
+      case 1:
+	value = "";
+	asn1_type = ASN1_NULL;
+	break;
+      case 2:
+	value = vbv[1];
+	asn1_type = TnmMibGetBaseSyntax(vbv[0]);
+	break;
+      default:
+	value = vbv[2];
 
-	    if (pdu->type == ASN1_SNMP_RESPONSE) {
-		asn1_type = TnmGetTableKey(tnmSnmpExceptionTable, vbv[1]);
-	        if (asn1_type < 0) {
-		    asn1_type = TnmGetTableKey(tnmSnmpTypeTable, vbv[1]);
-		    if (asn1_type < 0) {
-			asn1_type = ASN1_OTHER;
-		    }
-		}
-	    } else {
+	/*
+	 * Check if there is an exception in the asn1 type field.
+	 * Convert this into an appropriate NULL type if we create
+	 * a response PDU. Otherwise, ignore this stuff and use
+	 * the type found in the MIB.
+	 */
+
+	if (pdu->type == ASN1_SNMP_RESPONSE) {
+	    asn1_type = TnmGetTableKey(tnmSnmpExceptionTable, vbv[1]);
+	    if (asn1_type < 0) {
 		asn1_type = TnmGetTableKey(tnmSnmpTypeTable, vbv[1]);
 		if (asn1_type < 0) {
 		    asn1_type = ASN1_OTHER;
 		}
 	    }
-
-	    if (asn1_type == ASN1_OTHER) {
-		TnmMibType *typePtr;
-		typePtr = TnmMibFindType(vbv[1]);
-		if (typePtr) {
-		    asn1_type = typePtr->syntax;
-		}
+	} else {
+	    asn1_type = TnmGetTableKey(tnmSnmpTypeTable, vbv[1]);
+	    if (asn1_type < 0) {
+		asn1_type = ASN1_OTHER;
 	    }
-	    break;
 	}
 
 	if (asn1_type == ASN1_OTHER) {
-	    Tcl_ResetResult(interp);
-	    Tcl_AppendResult(interp, "unknown type \"", vbv[1], "\"",
-			     (char *) NULL);
-	    ckfree((char *) vbv);
-	    ckfree((char *) vblv);
-	    return NULL;
+	    TnmMibType *typePtr;
+	    typePtr = TnmMibFindType(vbv[1]);
+	    if (typePtr) {
+		asn1_type = typePtr->syntax;
+	    }
 	}
+	break;
+    }
 
-	/*
-         * Check whether we have to encode the value. Don't bother
-	 * to encode the actual value for retrieval operations.
-	 */
+    if (asn1_type == ASN1_OTHER) {
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, "unknown type \"", vbv[1], "\"",
+			 (char *) NULL);
+	goto error;
+    }
 
-	if (TnmSnmpGet(pdu->type)) {
-	    ber = TnmBerEncNull(ber, ASN1_NULL);
-	} else {
-	    switch (asn1_type) {
-	    case ASN1_INTEGER:
-	    case ASN1_COUNTER32:
-	    case ASN1_GAUGE32:
-	    case ASN1_TIMETICKS: {
-		int int_val, rc;
+    /*
+     * Check whether we have to encode the value. Don't bother
+     * to encode the actual value for retrieval operations.
+     */
+
+    if (TnmSnmpGet(pdu->type)) {
+	ber = TnmBerEncNull(ber, ASN1_NULL);
+    } else {
+	switch (asn1_type) {
+	case ASN1_INTEGER:
+	case ASN1_COUNTER32:
+	case ASN1_GAUGE32:
+	case ASN1_TIMETICKS: {
+	    int int_val, rc;
+	    rc = Tcl_GetInt(interp, value, &int_val);
+	    if (rc != TCL_OK) {
+		char *tmp = TnmMibScan(vbv[0], 0, value);
+		if (tmp && *tmp) {
+		    Tcl_ResetResult(interp);
+		    rc = Tcl_GetInt(interp, tmp, &int_val);
+		}
+		if (rc != TCL_OK) goto error;
+	    }
+	    ber = TnmBerEncInt(ber, (u_char) asn1_type, int_val);
+	    break;
+	}
+	case ASN1_COUNTER64: {
+	    int int_val, rc;
+	    if (session->version == TNM_SNMPv1) {
+		Tcl_SetResult(interp,
+			      "Counter64 not allowed on an SNMPv1 session",
+			      TCL_STATIC);
+		goto error;
+	    }
+	    if (sizeof(int) >= 8) {
 		rc = Tcl_GetInt(interp, value, &int_val);
 		if (rc != TCL_OK) {
-		    char *tmp = TnmMibScan(vbv[0], 0, value);
-		    if (tmp && *tmp) {
-			Tcl_ResetResult(interp);
-			rc = Tcl_GetInt(interp, tmp, &int_val);
-		    }
-		    if (rc != TCL_OK) return NULL;
+		    goto error;
 		}
-		ber = TnmBerEncInt(ber, (u_char) asn1_type, int_val);
-		break;
-	    }
-	    case ASN1_COUNTER64: {
-		int int_val, rc;
-		if (session->version == TNM_SNMPv1) {
-		    Tcl_SetResult(interp,
-				  "Counter64 not allowed on an SNMPv1 session",
-				  TCL_STATIC);
-		    return NULL;
+		ber = TnmBerEncInt(ber, ASN1_COUNTER64, int_val);
+	    } else {
+		double d;
+		rc = Tcl_GetDouble(interp, value, &d);
+		if (rc != TCL_OK) {
+		    goto error;
 		}
-		if (sizeof(int) >= 8) {
-		    rc = Tcl_GetInt(interp, value, &int_val);
-		    if (rc != TCL_OK) {
-			return NULL;
-		    }
-		    ber = TnmBerEncInt(ber, ASN1_COUNTER64, int_val);
-		} else {
-		    double d;
-		    rc = Tcl_GetDouble(interp, value, &d);
-		    if (rc != TCL_OK) {
-			return NULL;
-		    }
-		    if (d < 0) {
-			Tcl_SetResult(interp, "negativ counter value",
-				      TCL_STATIC);
-			return NULL;
-		    }
-		    ber = TnmBerEncUnsigned64(ber, d);
+		if (d < 0) {
+		    Tcl_SetResult(interp, "negativ counter value",
+				  TCL_STATIC);
+		    goto error;
 		}
-		break;
+		ber = TnmBerEncUnsigned64(ber, d);
 	    }
-	    case ASN1_IPADDRESS: {
-		int a, b, c, d, addr = inet_addr(value);
-		int cnt = sscanf(value, "%d.%d.%d.%d", &a, &b, &c, &d);
-		if ((addr == -1 && strcmp(value, "255.255.255.255") != 0)
-		    || (cnt != 4)) {
-		    Tcl_SetResult(interp, "invalid IP address", TCL_STATIC);
-		    return NULL;
-		}
-		ber = TnmBerEncOctetString(ber, ASN1_IPADDRESS,
-					   (char *) &addr, 4);
+	    break;
+	}
+	case ASN1_IPADDRESS: {
+	    int a, b, c, d, addr = inet_addr(value);
+	    int cnt = sscanf(value, "%d.%d.%d.%d", &a, &b, &c, &d);
+	    if ((addr == -1 && strcmp(value, "255.255.255.255") != 0)
+		|| (cnt != 4)) {
+		Tcl_SetResult(interp, "invalid IP address", TCL_STATIC);
+		goto error;
+	    }
+	    ber = TnmBerEncOctetString(ber, ASN1_IPADDRESS,
+				       (char *) &addr, 4);
+	    break;
+	}
+	case ASN1_OCTET_STRING: {
+	    const char *hex = value, *scan;
+	    Tcl_Size len;
+	    static char *bin = NULL;
+	    static size_t binLen = 0;
+	    /* quick test for empty strings ... */
+	    if (value[0] == 0) {
+		ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, NULL, 0);
 		break;
 	    }
-	    case ASN1_OCTET_STRING: {
-		const char *hex = value, *scan;
-		Tcl_Size len;
-		static char *bin = NULL;
-		static size_t binLen = 0;
-		/* quick test for empty strings ... */
-		if (value[0] == 0) {
-		    ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, NULL, 0);
-		    break;
+	    scan = TnmMibScan(vbv[0], 0, value);
+	    if (scan) hex = scan;
+	    if (*hex) {
+		len = strlen(hex);
+		if (binLen < len + 1) {
+		    if (bin) ckfree(bin);
+		    binLen = len + 1;
+		    bin = ckalloc(binLen);
 		}
-		scan = TnmMibScan(vbv[0], 0, value);
-		if (scan) hex = scan;
-		if (*hex) {
-		    len = strlen(hex);
-		    if (binLen < len + 1) {
-			if (bin) ckfree(bin);
-			binLen = len + 1;
-			bin = ckalloc(binLen);
-		    }
-		    if (TnmHexDec(hex, bin, &len) < 0) {
-			Tcl_SetResult(interp, "illegal OCTET STRING value",
-				      TCL_STATIC);
-			return NULL;
-		    }
-		} else {
-		    len = 0;
+		if (TnmHexDec(hex, bin, &len) < 0) {
+		    Tcl_SetResult(interp, "illegal OCTET STRING value",
+				  TCL_STATIC);
+		    goto error;
 		}
-		ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, bin, len);
-		break;
+	    } else {
+		len = 0;
 	    }
-	    case ASN1_OPAQUE: {
-		const char *hex = value;
-		Tcl_Size len;
-		static char *bin = NULL;
-		static size_t binLen = 0;
-		if (*hex) {
-		    len = strlen(hex);
-		    if (binLen < len + 1) {
-			if (bin) ckfree(bin);
-			binLen = len + 1;
-			bin = ckalloc(binLen);
-		    }
-		    if (TnmHexDec(hex, bin, &len) < 0) {
-			Tcl_SetResult(interp, "illegal Opaque value",
-				      TCL_STATIC);
-			return NULL;
-		    }
-		} else {
-		    len = 0;
+	    ber = TnmBerEncOctetString(ber, ASN1_OCTET_STRING, bin, len);
+	    break;
+	}
+	case ASN1_OPAQUE: {
+	    const char *hex = value;
+	    Tcl_Size len;
+	    static char *bin = NULL;
+	    static size_t binLen = 0;
+	    if (*hex) {
+		len = strlen(hex);
+		if (binLen < len + 1) {
+		    if (bin) ckfree(bin);
+		    binLen = len + 1;
+		    bin = ckalloc(binLen);
 		}
-		ber = TnmBerEncOctetString(ber, ASN1_OPAQUE, bin, len);
-		break;
-	    }
-	    case ASN1_OBJECT_IDENTIFIER:
-		oid = TnmStrToOid(value, &oidlen);
-		if (! oid) {
-		    char *tmp = TnmMibGetOid(value);
-		    if (tmp) {
-			oid = TnmStrToOid(tmp, &oidlen);
-		    }
+		if (TnmHexDec(hex, bin, &len) < 0) {
+		    Tcl_SetResult(interp, "illegal Opaque value",
+				  TCL_STATIC);
+		    goto error;
 		}
-		if (! oid) {
-		    Tcl_AppendResult(interp, 
-				     "illegal object identifier \"",
-				     value, "\"", (char *) NULL);
-		    return NULL;
+	    } else {
+		len = 0;
+	    }
+	    ber = TnmBerEncOctetString(ber, ASN1_OPAQUE, bin, len);
+	    break;
+	}
+	case ASN1_OBJECT_IDENTIFIER:
+	    oid = TnmStrToOid(value, &oidlen);
+	    if (! oid) {
+		char *tmp = TnmMibGetOid(value);
+		if (tmp) {
+		    oid = TnmStrToOid(tmp, &oidlen);
 		}
-		ber = TnmBerEncOID(ber, oid, oidlen);
-		break;
-	    case ASN1_NO_SUCH_OBJECT:
-	    case ASN1_NO_SUCH_INSTANCE:
-	    case ASN1_END_OF_MIB_VIEW:
-	    case ASN1_NULL:
-		ber = TnmBerEncNull(ber, (u_char) asn1_type);
-		break;
-	    default:
-		sprintf(string, "unknown asn1 type 0x%.2x",
-			asn1_type);
-		Tcl_SetResult (interp, string, TCL_VOLATILE);
-		return NULL;
 	    }
+	    if (! oid) {
+		Tcl_AppendResult(interp, 
+				 "illegal object identifier \"",
+				 value, "\"", (char *) NULL);
+		goto error;
+	    }
+	    ber = TnmBerEncOID(ber, oid, oidlen);
+	    break;
+	case ASN1_NO_SUCH_OBJECT:
+	case ASN1_NO_SUCH_INSTANCE:
+	case ASN1_END_OF_MIB_VIEW:
+	case ASN1_NULL:
+	    ber = TnmBerEncNull(ber, (u_char) asn1_type);
+	    break;
+	default:
+	    sprintf(string, "unknown asn1 type 0x%.2x",
+		    asn1_type);
+	    Tcl_SetResult (interp, string, TCL_VOLATILE);
+	    goto error;
 	}
-	
-	ber = TnmBerEncSequenceEnd(ber, vbSeqToken);
-
-	ckfree((char *) vbv);
     }
 
-    ckfree((char *) vblv);
+    ber = TnmBerEncSequenceEnd(ber, vbSeqToken);
 
-    ber = TnmBerEncSequenceEnd(ber, vblSeqToken);
-    ber = TnmBerEncSequenceEnd(ber, pduSeqToken);
+    ckfree((char *) vbv);
     return ber;
+
+  error:
+    ckfree((char *) vbv);
+    return NULL;
 }
 
 
@@ -48,6 +48,167 @@ typedef struct SnmpControl {
     Tcl_HashTable aliasTable;	/* The hash table with SNMP aliases. */
 } SnmpControl;
 
+/*
+ * The following structure describes a Tcl command that should be
+ * evaluated once we receive a response for a SNMP request. The
+ * command is either a script with % escapes or a command prefix
+ * which is called with the response as additional arguments.
+ */
+
+typedef struct AsyncToken {
+    Tcl_Interp *interp;
+    Tcl_Obj *tclCmd;
+    Tcl_Obj *oidList;
+    int prefix;
+} AsyncToken;
+
+/*
+ * The following structure describes a walk which writes the retrieved
+ * varbinds to a Tcl channel instead of evaluating a script for every
+ * row. Asynchronous walks pause while the channel has more than one
+ * buffer of output pending so that slow channels throttle the walk.
+ * Asynchronous walks are kept in the streamWalkList so that paused
+ * walks can be terminated when their session is destroyed.
+ */
+
+enum walkFormats { walkText, walkBinary };
+
+typedef struct WalkStream {
+    Tcl_Interp *interp;		/* The interpreter of the walk. */
+    TnmSnmp *session;		/* The session used for the walk. */
+    Tcl_Channel channel;	/* The channel receiving the varbinds. */
+    int format;			/* The output format (walkText, ...). */
+    Tcl_Obj *oidList;		/* The subtrees being walked. */
+    Tcl_Obj *tclCmd;		/* Script evaluated at the end or NULL. */
+    Tcl_DString next;		/* The varbinds of the last row. */
+    Tcl_WideInt rows;		/* Number of varbinds written. */
+    int repeaters;		/* Current max-repetitions * columns. */
+    int warpLimit;		/* Upper limit for repeaters. */
+    int paused;			/* Set while waiting for the channel. */
+    struct WalkStream *nextPtr;	/* Next asynchronous walk. */
+} WalkStream;
+
+static WalkStream *streamWalkList = NULL;
+
+/*
+ * The following structures are used to merge asynchronous get
+ * requests send to the same session within the -coalesce window
+ * into a single PDU. Every original request is kept as a part
+ * which remembers the request id returned to the caller and the
+ * position of its varbinds in the merged PDU. Merged PDUs which
+ * are on the wire are kept in the coalesceList so that we can
+ * wait for the original request ids.
+ */
+
+typedef struct CoalescePart {
+    int requestId;			/* Request id seen by the caller. */
+    int offset;				/* First varbind in merged PDU. */
+    Tcl_Size length;			/* Number of varbinds. */
+    Tcl_Obj *vbList;			/* The original varbind list. */
+    AsyncToken *atPtr;			/* The callback of the caller. */
+    struct CoalescePart *nextPtr;
+} CoalescePart;
+
+typedef struct Coalesce {
+    TnmSnmp *session;			/* The session of all parts. */
+    Tcl_Interp *interp;			/* The interpreter of all parts. */
+    int count;				/* Total number of varbinds. */
+    Tcl_Size size;			/* Size of the varbind strings. */
+    Tcl_TimerToken timer;		/* Timer which closes the window. */
+    CoalescePart *partList;		/* The list of merged requests. */
+    CoalescePart *lastPart;		/* The last part in the list. */
+    struct Coalesce *nextPtr;
+} Coalesce;
+
+static Coalesce *coalesceList = NULL;
+static int coalesceOpen = 0;
+
+/*
+ * The following structures implement the response cache used by
+ * get requests with a -maxage. Every session keeps a hash table
+ * which maps object identifiers to the last varbind received for
+ * them. A get request sends only the varbinds which are not fresh
+ * enough and merges the response with the cached varbinds. Async
+ * requests answered completely from the cache are delivered from
+ * an idle handler and kept in the cacheHitList until then. The
+ * entries are also kept in a list ordered by the time they were
+ * received so that the oldest entry can be removed once the cache
+ * holds TNM_SNMP_CACHEENTRIES varbinds.
+ */
+
+#define TNM_SNMP_CACHEENTRIES	1024
+
+typedef struct CacheEntry {
+    Tcl_Obj *vbObj;			/* The cached varbind. */
+    Tcl_Time stamp;			/* Time when it was received. */
+    Tcl_HashEntry *entryPtr;		/* The entry in the cache table. */
+    struct CacheEntry *prevPtr;		/* Entry received before. */
+    struct CacheEntry *nextPtr;		/* Entry received after. */
+} CacheEntry;
+
+typedef struct ResponseCache {
+    Tcl_HashTable table;		/* Entries indexed by the oid. */
+    CacheEntry *firstPtr;		/* The oldest entry. */
+    CacheEntry *lastPtr;		/* The youngest entry. */
+} ResponseCache;
+
+typedef struct CacheToken {
+    int requestId;			/* Request id seen by the caller. */
+    TnmSnmp *session;			/* The session of the request. */
+    Tcl_Obj *vbList;			/* The original varbind list. */
+    Tcl_Obj *result;			/* The merged varbind list. */
+    int *index;				/* Positions of the varbinds sent. */
+    Tcl_Size count;			/* Number of varbinds sent. */
+    AsyncToken *atPtr;			/* The callback of the caller. */
+    struct CacheToken *nextPtr;
+} CacheToken;
+
+static CacheToken *cacheHitList = NULL;
+
+/*
+ * The following structures are used by the benchmark command. A
+ * Bench record holds the parameters and the measurements of a run.
+ * Every operation in flight is described by a BenchOp. A getbulk
+ * operation walks the system group and thus may send a sequence
+ * of requests before it is finished.
+ */
+
+enum benchOps { benchGet, benchGetBulk, benchSet, benchOps };
+
+typedef struct Bench {
+    Tcl_Interp *interp;			/* The interpreter running the test. */
+    TnmSnmp **sessions;			/* The generators sending requests. */
+    int numSessions;			/* Number of generators. */
+    int mix[benchOps];			/* Weights of the operations. */
+    int weight;				/* Sum of all weights. */
+    Tcl_DString vbl[benchOps];		/* Varbind lists of the operations. */
+    int maxReps;			/* Max. repetitions of getbulk. */
+    int count;				/* Number of operations to run. */
+    int rate;				/* Operations per second (0 = any). */
+    int window;				/* Max. number of operations active. */
+    int started;			/* Number of operations started. */
+    int active;				/* Number of operations in flight. */
+    u_int requests;			/* Number of requests sent. */
+    u_int responses;			/* Number of responses received. */
+    u_int errors;			/* Responses with an error status. */
+    u_int timeouts;			/* Requests without a response. */
+    Tcl_Time start;			/* Time when the run started. */
+    double *samples;			/* Round trip times (microseconds). */
+    int numSamples;			/* Number of round trip times. */
+    int maxSamples;			/* Size of the samples array. */
+    Tcl_TimerToken timer;		/* Timer which starts operations. */
+    int code;				/* Error while sending a request. */
+    Tcl_Obj *errorPtr;			/* The error message (if any). */
+} Bench;
+
+typedef struct BenchOp {
+    Bench *benchPtr;			/* The benchmark run. */
+    int op;				/* The type of the operation. */
+    int type;				/* The PDU type of the requests. */
+    TnmSnmp *session;			/* The session used for this op. */
+    Tcl_Time sent;			/* Time when the request was sent. */
+} BenchOp;
+
 /*
  * Forward declarations for procedures defined later in this file:
  */
@@ -70,6 +231,12 @@ GetOption	(Tcl_Interp *interp, ClientData object,
 static int
 SetOption	(Tcl_Interp *interp, ClientData object, 
 			     int option, Tcl_Obj *objPtr);
+static Tcl_Obj*
+ManagerGetOption	(Tcl_Interp *interp, ClientData object, 
+			     int option);
+static int
+ManagerSetOption	(Tcl_Interp *interp, ClientData object, 
+			     int option, Tcl_Obj *objPtr);
 static int
 BindEvent	(Tcl_Interp *interp, TnmSnmp *session,
 			     Tcl_Obj *eventPtr, Tcl_Obj *script);
@@ -98,8 +265,79 @@ static int
 Notify		(Tcl_Interp *interp, TnmSnmp *session, int type,
 			     Tcl_Obj *oid, Tcl_Obj *vbList, Tcl_Obj *script);
 static int
+RequestOptions	(Tcl_Interp *interp, int objc,
+			     Tcl_Obj *const objv[], int first,
+			     int *maxAgePtr, Tcl_Obj **cmdPtr);
+static int
 Request		(Tcl_Interp *interp, TnmSnmp *session, int type,
-			     int n, int m, Tcl_Obj *vbList, Tcl_Obj *cmd);
+			     int n, int m, Tcl_Obj *vbList, Tcl_Obj *cmd,
+			     int prefix);
+static AsyncToken*
+AsyncTokenCreate	(Tcl_Interp *interp, Tcl_Obj *cmdObj, 
+			     int prefix);
+static int
+CoalesceAdd	(Tcl_Interp *interp, TnmSnmp *session,
+			     Tcl_Obj *vbList, Tcl_Obj *cmdObj,
+			     int prefix);
+static void
+CoalesceFlush	(TnmSnmp *session);
+
+static void
+CoalesceTimerProc	(ClientData clientData);
+
+static void
+CoalesceProc	(TnmSnmp *session, TnmSnmpPdu *pdu, 
+			     ClientData clientData);
+static void
+CoalesceDeliver	(TnmSnmp *session, TnmSnmpPdu *pdu,
+			     CoalescePart *partPtr,
+			     int status, int index, Tcl_Obj *vbList);
+static void
+CoalesceResend	(Tcl_Interp *interp, TnmSnmp *session,
+			     CoalescePart *partPtr);
+static void
+CoalesceFree	(Coalesce *cPtr);
+
+static int
+CoalesceFind	(int id);
+
+static void
+CoalesceDiscard	(TnmSnmp *session);
+
+static int
+CacheGet	(Tcl_Interp *interp, TnmSnmp *session, int maxAge,
+			     Tcl_Obj *vbList, Tcl_Obj *cmdObj, int prefix);
+static const char*
+CacheKey	(Tcl_Obj *vbObj);
+
+static void
+CacheStore	(TnmSnmp *session, Tcl_Obj *vbObj, Tcl_Time *now);
+
+static int
+CacheMerge	(TnmSnmp *session, CacheToken *ctPtr, Tcl_Obj *vbList);
+
+static void
+CacheProc	(TnmSnmp *session, TnmSnmpPdu *pdu, 
+			     ClientData clientData);
+static void
+CacheIdleProc	(ClientData clientData);
+
+static void
+CacheTokenFree	(CacheToken *ctPtr);
+
+static int
+CacheFind	(int id);
+
+
+static void
+CacheFlush	(TnmSnmp *session);
+
+static int
+CacheInfo	(Tcl_Interp *interp, TnmSnmp *session,
+			     int objc, Tcl_Obj *const objv[]);
+
+static void
+CacheDiscard	(TnmSnmp *session);
 static Tcl_Obj*
 WalkCheck	(int oidListLen, Tcl_Obj **oidListElems, 
 			     int vbListLen, Tcl_Obj **vbListElems);
@@ -114,6 +352,60 @@ SyncWalk	(Tcl_Interp *interp, TnmSnmp *session,
 			     Tcl_Obj *varName, Tcl_Obj *oidList, 
 			     Tcl_Obj *tclCmd);
 static int
+StreamWalk	(Tcl_Interp *interp, TnmSnmp *session,
+			     int objc, Tcl_Obj *const objv[]);
+static int
+StreamWalkWrite	(WalkStream *wsPtr, Tcl_Obj *vbPtr);
+static int
+StreamWalkRows	(WalkStream *wsPtr, Tcl_Obj *vbList, int *donePtr);
+static void
+StreamWalkRequest	(WalkStream *wsPtr, TnmSnmpPdu *pdu);
+static void
+StreamWalkNext	(WalkStream *wsPtr);
+static void
+StreamWalkProc	(TnmSnmp *session, TnmSnmpPdu *pdu, 
+			     ClientData clientData);
+static void
+StreamWalkWritable	(ClientData clientData, int mask);
+static void
+StreamWalkClosed	(ClientData clientData);
+static void
+StreamWalkAbort	(ClientData clientData);
+static void
+StreamWalkDone	(WalkStream *wsPtr, int status);
+static void
+StreamWalkDiscard	(TnmSnmp *session);
+static int
+Discover	(Tcl_Interp *interp, Tcl_Obj *listPtr,
+			     Tcl_Obj *script);
+static int
+DiscoverProbe	(Tcl_Interp *interp, TnmSnmp *session,
+			     TnmSnmpRequestProc *proc, 
+			     ClientData clientData);
+static void
+DiscoverProc	(TnmSnmp *session, TnmSnmpPdu *pdu, 
+			     ClientData clientData);
+static void
+DiscoverSyncProc	(TnmSnmp *session, TnmSnmpPdu *pdu, 
+			     ClientData clientData);
+static int
+Benchmark	(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+static TnmSnmp*
+BenchSession	(Tcl_Interp *interp, int type, int port,
+			     Tcl_Obj *version, Tcl_Obj *timeout,
+			     Tcl_Obj *retries);
+static void
+BenchFill	(Bench *benchPtr);
+static void
+BenchSend	(BenchOp *opPtr, const char *vbl);
+static void
+BenchProc	(TnmSnmp *session, TnmSnmpPdu *pdu,
+			     ClientData clientData);
+static void
+BenchTimerProc	(ClientData clientData);
+static int
+BenchCompare	(const void *a, const void *b);
+static int
 Delta		(Tcl_Interp *interp, Tcl_Obj *vbl1,
 			     Tcl_Obj *vbl2);
 static int
@@ -151,7 +443,8 @@ enum options {
 #ifdef TNM_SNMPv2U
     optPassword,
 #endif
-    optTransport, optTimeout, optRetries, optWindow, optDelay,
+    optTransport, optTimeout, optRetries, optWindow, optDelay, optCoalesce,
+    optMaxSize, optCacheSize, optReusePort, optRateLimit, optProxy, optProxyMaxAge,
 #ifdef TNM_SNMP_BENCH
     optRtt, optSendSize, optRecvSize
 #endif
@@ -179,6 +472,8 @@ static TnmTable generatorOptionTable[] = {
     { optRetries,	"-retries" },
     { optWindow,	"-window" },
     { optDelay,		"-delay" },
+    { optCoalesce,	"-coalesce" },
+    { optMaxSize,	"-maxSize" },
     { optTags,		"-tags" },
 #ifdef TNM_SNMP_BENCH
     { optRtt,		"-rtt" },
@@ -221,6 +516,12 @@ static TnmTable responderOptionTable[] = {
     { optRetries,	"-retries" },
     { optWindow,	"-window" },
     { optDelay,		"-delay" },
+    { optMaxSize,	"-maxSize" },
+    { optCacheSize,	"-cacheSize" },
+    { optReusePort,	"-reusePort" },
+    { optRateLimit,	"-rateLimit" },
+    { optProxy,		"-proxy" },
+    { optProxyMaxAge,	"-proxyMaxAge" },
     { optTags,		"-tags" },
     { 0, NULL }
 };
@@ -314,15 +615,26 @@ static TnmTable listenerEventTable[] = {
 };
 
 /*
- * The following structure describes a Tcl command that should be
- * evaluated once we receive a response for a SNMP request.
+ * The options of the sockets shared by all manager sessions.
  */
 
-typedef struct AsyncToken {
-    Tcl_Interp *interp;
-    Tcl_Obj *tclCmd;
-    Tcl_Obj *oidList;
-} AsyncToken;
+enum managerOptions {
+    optManagerRcvBuf, optManagerSndBuf, optManagerSockets
+};
+
+static TnmTable managerOptionTable[] = {
+    { optManagerRcvBuf,	"-rcvbuf" },
+    { optManagerSndBuf,	"-sndbuf" },
+    { optManagerSockets, "-sockets" },
+    { 0, NULL }
+};
+
+static TnmConfig managerConfig = {
+    managerOptionTable,
+    ManagerSetOption,
+    ManagerGetOption
+};
+
 
 
 /*
@@ -391,17 +703,12 @@ AssocDeleteProc(ClientData clientData, Tcl_Interp *interp)
 static void
 DeleteProc(ClientData clientData)
 {
-    TnmSnmp **sPtrPtr, *session = (TnmSnmp *) clientData;
-
-    sPtrPtr = &tnmSnmpList;
-    while (*sPtrPtr && (*sPtrPtr) != session) {
-	sPtrPtr = &(*sPtrPtr)->nextPtr;
-    }
-
-    if (*sPtrPtr) {
-	(*sPtrPtr) = session->nextPtr;
-    }
+    TnmSnmp *session = (TnmSnmp *) clientData;
 
+    TnmSnmpUnregisterSession(session);
+    CoalesceDiscard(session);
+    CacheDiscard(session);
+    StreamWalkDiscard(session);
     TnmSnmpDeleteSession(session);
 
     if (tnmSnmpList == NULL) {
@@ -435,6 +742,7 @@ PduInit(TnmSnmpPdu *pduPtr, TnmSnmp *session, int type)
     pduPtr->errorIndex = 0;    
     pduPtr->trapOID = NULL;
     Tcl_DStringInit(&pduPtr->varbind);
+    pduPtr->vbList = NULL;
 
 #ifdef TNM_SNMP_BENCH
     memset((char *) &session->stats, 0, sizeof(session->stats));
@@ -552,17 +860,30 @@ GetOption(Tcl_Interp *interp, ClientData object, int option)
 	return Tcl_NewStringObj(TnmGetTableValue(tnmSnmpDomainTable, 
 					 (unsigned) session->domain), -1);
     case optTimeout:
-	if (session->domain != TNM_SNMP_UDP_DOMAIN) return NULL;
 	return Tcl_NewIntObj(session->timeout);
     case optRetries:
 	if (session->domain != TNM_SNMP_UDP_DOMAIN) return NULL;
 	return Tcl_NewIntObj(session->retries);
     case optWindow:
-	if (session->domain != TNM_SNMP_UDP_DOMAIN) return NULL;
 	return Tcl_NewIntObj(session->window);
     case optDelay:
 	if (session->domain != TNM_SNMP_UDP_DOMAIN) return NULL;
 	return Tcl_NewIntObj(session->delay);
+    case optCoalesce:
+	if (session->domain != TNM_SNMP_UDP_DOMAIN) return NULL;
+	return Tcl_NewIntObj(session->coalesce);
+    case optMaxSize:
+	return Tcl_NewIntObj(session->maxSize);
+    case optCacheSize:
+	return Tcl_NewIntObj(session->cacheSize);
+    case optReusePort:
+	return Tcl_NewBooleanObj(session->reusePort);
+    case optRateLimit:
+	return Tcl_NewIntObj(session->rateLimit);
+    case optProxy:
+	return session->proxy ? session->proxy : Tcl_NewObj();
+    case optProxyMaxAge:
+	return Tcl_NewIntObj(session->proxyMaxAge);
     case optTags:
 	return session->tagList;
     case optEnterprise:
@@ -839,6 +1160,56 @@ SetOption(Tcl_Interp *interp, ClientData object, int option, Tcl_Obj *objPtr)
 	}
 	session->delay = num;
 	return TCL_OK;
+    case optCoalesce:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->coalesce = num;
+	return TCL_OK;
+    case optMaxSize:
+	if (TnmGetIntRangeFromObj(interp, objPtr, 484, TNM_SNMP_MAXSIZE,
+				  &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->maxSize = num;
+	return TCL_OK;
+    case optCacheSize:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->cacheSize = num;
+	return TCL_OK;
+    case optReusePort:
+	if (Tcl_GetBooleanFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->reusePort = num;
+	return TCL_OK;
+    case optRateLimit:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->rateLimit = num;
+	return TCL_OK;
+    case optProxy:
+	if (*Tcl_GetString(objPtr) && ! TnmSnmpProxySession(interp, objPtr)) {
+	    return TCL_ERROR;
+	}
+	if (session->proxy) {
+	    Tcl_DecrRefCount(session->proxy);
+	    session->proxy = NULL;
+	}
+	if (*Tcl_GetString(objPtr)) {
+	    session->proxy = objPtr;
+	    Tcl_IncrRefCount(session->proxy);
+	}
+	return TCL_OK;
+    case optProxyMaxAge:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	session->proxyMaxAge = num;
+	return TCL_OK;
     case optTags:
 	if (session->tagList) {
 	    Tcl_DecrRefCount(session->tagList);
@@ -859,6 +1230,83 @@ SetOption(Tcl_Interp *interp, ClientData object, int option, Tcl_Obj *objPtr)
 
     return TCL_OK;
 }
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ManagerGetOption --
+ *
+ *	This procedure retrieves the value of a manager socket option.
+ *
+ * Results:
+ *	A pointer to the value or NULL for unknown options.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+ManagerGetOption(Tcl_Interp *interp, ClientData object, int option)
+{
+    int rcvbuf, sndbuf, sockets;
+
+    TnmSnmpManagerGetConfig(&rcvbuf, &sndbuf, &sockets);
+
+    switch ((enum managerOptions) option) {
+    case optManagerRcvBuf:
+	return Tcl_NewIntObj(rcvbuf);
+    case optManagerSndBuf:
+	return Tcl_NewIntObj(sndbuf);
+    case optManagerSockets:
+	return Tcl_NewIntObj(sockets);
+    }
+    return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ManagerSetOption --
+ *
+ *	This procedure modifies a manager socket option. The new
+ *	value is applied to the manager sockets which are already
+ *	open and to all sockets opened later.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Manager sockets may be opened, closed or resized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ManagerSetOption(Tcl_Interp *interp, ClientData object, int option, Tcl_Obj *objPtr)
+{
+    int num;
+
+    switch ((enum managerOptions) option) {
+    case optManagerRcvBuf:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	return TnmSnmpManagerConfig(interp, num, -1, 0);
+    case optManagerSndBuf:
+	if (TnmGetUnsignedFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	return TnmSnmpManagerConfig(interp, -1, num, 0);
+    case optManagerSockets:
+	if (TnmGetPositiveFromObj(interp, objPtr, &num) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	return TnmSnmpManagerConfig(interp, -1, -1, num);
+    }
+    return TCL_OK;
+}
 
 /*
  *----------------------------------------------------------------------
@@ -1073,8 +1521,10 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #if 0
 	cmdArray,
 #endif
-	cmdDelta, cmdExpand, cmdFind, cmdGenerator, cmdInfo,
-	cmdListener, cmdNotifier, cmdOid, cmdResponder,
+	cmdBenchmark, cmdDelta, cmdDiscover, cmdEngines, cmdExpand, cmdFind,
+	cmdGenerator,
+	cmdInfo, cmdLatency,
+	cmdListener, cmdManager, cmdNotifier, cmdOid, cmdResponder,
 	cmdType, cmdValue, cmdWait, cmdWatch 
     } cmd;
 
@@ -1083,20 +1533,21 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #if 0
 	"array",
 #endif
-	"delta", "expand", "find", "generator", "info",
-	"listener", "notifier", "oid", "responder",
+	"benchmark", "delta", "discover", "engines", "expand", "find",
+	"generator", "info", "latency",
+	"listener", "manager", "notifier", "oid", "responder",
 	"type", "value", "wait", "watch",
 	(char *) NULL
     };
 
     enum infos { 
-	infoDomains, infoErrors, infoExceptions, infoPDUs, infoSecurity,
-	infoTypes, infoVersions 
+	infoDomains, infoErrors, infoExceptions, infoPDUs, infoQueue,
+	infoSecurity, infoStats, infoTypes, infoVersions 
     } info;
 
     static const char *infoTable[] = {
-	"domains", "errors", "exceptions", "pdus", "security",
-	"types", "versions", (char *) NULL
+	"domains", "errors", "exceptions", "pdus", "queue", "security",
+	"stats", "types", "versions", (char *) NULL
     };
 
     if (! control) {
@@ -1184,6 +1635,10 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
     }
 #endif
 
+    case cmdBenchmark:
+	result = Benchmark(interp, objc, objv);
+	break;
+
     case cmdDelta:
 	if (objc != 4) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "varBindList1 varBindList2");
@@ -1193,6 +1648,28 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 	result = Delta(interp, objv[2], objv[3]);
 	break;
 
+    case cmdDiscover:
+	if (objc < 3 || objc > 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "sessionList ?script?");
+	    result = TCL_ERROR;
+	    break;
+	}
+	result = Discover(interp, objv[2], (objc == 4) ? objv[3] : NULL);
+	break;
+
+    case cmdEngines:
+	if (objc > 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?engineList?");
+	    result = TCL_ERROR;
+	    break;
+	}
+	if (objc == 3) {
+	    result = TnmSnmpEngineSet(interp, objv[2]);
+	    break;
+	}
+	Tcl_SetObjResult(interp, TnmSnmpEngineGet());
+	break;
+
     case cmdExpand:
         if (objc != 3) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "varBindList");
@@ -1253,8 +1730,7 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #endif
 	TnmSnmpComputeKeys(session);
 
-	session->nextPtr = tnmSnmpList;
-	tnmSnmpList = session;
+	TnmSnmpRegisterSession(session);
 
 	/*
 	 * Finally create a Tcl command for this session.
@@ -1293,9 +1769,19 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 	case infoPDUs:
 	    TnmListFromTable(tnmSnmpPDUTable, listPtr, pattern);
 	    break;
+	case infoQueue:
+	    Tcl_SetObjResult(interp, TnmSnmpQueueGet(interp, pattern));
+	    break;
 	case infoSecurity:
 	    TnmListFromTable(tnmSnmpSecurityLevelTable, listPtr, pattern);
 	    break;
+	case infoStats:
+	    if (pattern && strcmp(pattern, "reset") == 0) {
+		TnmSnmpStatsReset();
+		break;
+	    }
+	    Tcl_SetObjResult(interp, TnmSnmpStatsGet(pattern));
+	    break;
 	case infoTypes:
 	    TnmListFromTable(tnmSnmpTypeTable, listPtr, pattern);
 	    break;
@@ -1305,6 +1791,19 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 	}
 	break;
 
+    case cmdLatency:
+	if (objc == 3 && strcmp(Tcl_GetString(objv[2]), "reset") == 0) {
+	    TnmSnmpLatencyReset(NULL);
+	    break;
+	}
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?reset?");
+	    result = TCL_ERROR;
+	    break;
+	}
+	Tcl_SetObjResult(interp, TnmSnmpLatencyGet(NULL));
+	break;
+
     case cmdListener:
 	if (TnmMibLoad(interp) != TCL_OK) {
 	    result = TCL_ERROR;
@@ -1339,8 +1838,7 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #endif
 	TnmSnmpComputeKeys(session);
 
-	session->nextPtr = tnmSnmpList;
-	tnmSnmpList = session;
+	TnmSnmpRegisterSession(session);
 
 	/*
 	 * Finally create a Tcl command for this session.
@@ -1352,6 +1850,14 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 	Tcl_SetStringObj(Tcl_GetObjResult(interp), name, -1);
 	break;
 
+    case cmdManager:
+	if (objc == 3) {
+	    result = TnmGetConfig(interp, &managerConfig, NULL, objc, objv);
+	    break;
+	}
+	result = TnmSetConfig(interp, &managerConfig, NULL, objc, objv);
+	break;
+
     case cmdNotifier:
 	if (TnmMibLoad(interp) != TCL_OK) {
 	    result = TCL_ERROR;
@@ -1377,8 +1883,7 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #endif
 	TnmSnmpComputeKeys(session);
 
-	session->nextPtr = tnmSnmpList;
-	tnmSnmpList = session;
+	TnmSnmpRegisterSession(session);
 
 	/*
 	 * Finally create a Tcl command for this session.
@@ -1433,8 +1938,7 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 #endif
 	TnmSnmpComputeKeys(session);
 
-	session->nextPtr = tnmSnmpList;
-	tnmSnmpList = session;
+	TnmSnmpRegisterSession(session);
 
 	/*
 	 * Finally create a Tcl command for this session.
@@ -1478,12 +1982,18 @@ Tnm_SnmpObjCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *con
 	    result = TCL_ERROR;
 	    break;
 	}
-      repeat:
-	for (session = tnmSnmpList; session; session = session->nextPtr) {
-	    if (TnmSnmpQueueRequest(session, NULL)) {
-		Tcl_DoOneEvent(0);
-		goto repeat;
+	while (1) {
+	    if (coalesceOpen) {
+		for (session = tnmSnmpList; session; session = session->nextPtr) {
+		    if (session->coalescePtr) {
+			CoalesceFlush(session);
+		    }
+		}
+	    }
+	    if (! TnmSnmpQueueLength() && ! cacheHitList) {
+		break;
 	    }
+	    Tcl_DoOneEvent(0);
 	}
 	break;
 
@@ -1527,22 +2037,25 @@ static int
 GeneratorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
 {
     TnmSnmp *session = (TnmSnmp *) clientData;
-    int code, nonReps, maxReps;
+    int i, code, nonReps, maxReps, maxAge, prefix = 1;
+    Tcl_Obj *cmdObj;
 
     enum commands {
-	cmdBind, cmdCget, cmdConfigure, cmdDestroy, cmdGet, cmdGetBulk, cmdGetNext, 
+	cmdBind, cmdCache, cmdCget, cmdConfigure, cmdDestroy, cmdGet, cmdGetBulk,
+	cmdGetNext, 
 #ifdef ASN1_SNMP_GETRANGE
 	cmdGetRange, 
 #endif
-	cmdSet, cmdWait, cmdWalk
+	cmdLatency, cmdSet, cmdWait, cmdWalk
     } cmd;
 
     static const char *cmdTable[] = {
-	"bind", "cget", "configure", "destroy", "get", "getbulk", "getnext",
+	"bind", "cache", "cget", "configure", "destroy", "get", "getbulk",
+	"getnext",
 #ifdef ASN1_SNMP_GETRANGE
  	"getrange", 
 #endif
-	"set", "wait", "walk", (char *) NULL
+	"latency", "set", "wait", "walk", (char *) NULL
     };
 
     if (objc < 2) {
@@ -1583,25 +2096,13 @@ GeneratorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const
 #endif
 	TnmSnmpComputeKeys(session);
 
-	if (session->domain == TNM_SNMP_TCP_DOMAIN) {
-	    Tcl_Channel c;
-	    Tcl_Obj *savedResult;
+	/*
+	 * Cached responses may belong to a different agent or
+	 * a different context after a configuration change.
+	 */
 
-	    savedResult = Tcl_GetObjResult(interp);
-	    Tcl_IncrRefCount(savedResult);
-	    Tcl_ResetResult(interp);
-	    c = Tcl_OpenTcpClient(interp,
-				  ntohs(session->maddr.sin_port),
-				  inet_ntoa(session->maddr.sin_addr),
-				  0, 0, 0);
-	    if (! c) {
-		Tcl_Release((ClientData) session);
-		Tcl_DecrRefCount(savedResult);
-		session->domain = TNM_SNMP_UDP_DOMAIN;
-		return TCL_ERROR;
-	    }
-	    Tcl_SetObjResult(interp, savedResult);
-	    Tcl_DecrRefCount(savedResult);
+	if (objc > 3) {
+	    CacheFlush(session);
 	}
 
 	Tcl_Release((ClientData) session);
@@ -1616,35 +2117,73 @@ GeneratorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const
 	return TCL_OK;
 
     case cmdGet:
-	if (objc < 3 || objc > 4) {
-	    Tcl_WrongNumArgs(interp, 2, objv, "varBindList ?script?");
+	i = RequestOptions(interp, objc, objv, 2, &maxAge, &cmdObj);
+	if (i < 0) {
+	    return TCL_ERROR;
+	}
+	if (objc - i < 1 || objc - i > (cmdObj ? 1 : 2)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, 
+		     "?-maxage ms? ?-command prefix? varBindList ?script?");
 	    return TCL_ERROR;
 	}
+	if (objc - i == 2) {
+	    cmdObj = objv[i+1];
+	    prefix = 0;
+	}
+	if (maxAge >= 0) {
+	    return CacheGet(interp, session, maxAge, objv[i], cmdObj, prefix);
+	}
 	return Request(interp, session, ASN1_SNMP_GET, 0, 0,
-		       objv[2], (objc == 4) ? objv[3] : NULL);
+		       objv[i], cmdObj, prefix);
+
+    case cmdCache:
+	return CacheInfo(interp, session, objc, objv);
+
+    case cmdLatency:
+	if (objc == 3 && strcmp(Tcl_GetString(objv[2]), "reset") == 0) {
+	    TnmSnmpLatencyReset(session);
+	    return TCL_OK;
+	}
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?reset?");
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, TnmSnmpLatencyGet(session));
+	return TCL_OK;
 
     case cmdGetNext:
-	if (objc < 3 || objc > 4) {
-	    Tcl_WrongNumArgs(interp, 2, objv, "varBindList ?script?");
+	i = RequestOptions(interp, objc, objv, 2, NULL, &cmdObj);
+	if (objc - i < 1 || objc - i > (cmdObj ? 1 : 2)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, 
+			     "?-command prefix? varBindList ?script?");
 	    return TCL_ERROR;
 	}
+	if (objc - i == 2) {
+	    cmdObj = objv[i+1];
+	    prefix = 0;
+	}
 	return Request(interp, session, ASN1_SNMP_GETNEXT, 0, 0, 
-		       objv[2], (objc == 4) ? objv[3] : NULL);
+		       objv[i], cmdObj, prefix);
 
     case cmdGetBulk:
-	if (objc < 5 || objc > 6) {
+	i = RequestOptions(interp, objc, objv, 2, NULL, &cmdObj);
+	if (objc - i < 3 || objc - i > (cmdObj ? 3 : 4)) {
 	    Tcl_WrongNumArgs(interp, 2, objv, 
-		    "nonRepeaters maxRepetitions varBindList ?script?");
+	    "?-command prefix? nonRepeaters maxRepetitions varBindList ?script?");
 	    return TCL_ERROR;
 	}
-	if (TnmGetUnsignedFromObj(interp, objv[2], &nonReps) != TCL_OK) {
+	if (TnmGetUnsignedFromObj(interp, objv[i], &nonReps) != TCL_OK) {
 	    return TCL_ERROR;
 	}
-	if (TnmGetPositiveFromObj(interp, objv[3], &maxReps) != TCL_OK) {
+	if (TnmGetPositiveFromObj(interp, objv[i+1], &maxReps) != TCL_OK) {
 	    return TCL_ERROR;
 	}
+	if (objc - i == 4) {
+	    cmdObj = objv[i+3];
+	    prefix = 0;
+	}
 	return Request(interp, session, ASN1_SNMP_GETBULK, nonReps, maxReps,
-		       objv[4], (objc == 6) ? objv[5] : NULL);
+		       objv[i+2], cmdObj, prefix);
 
 #ifdef ASN1_SNMP_GETRANGE
     case cmdGetRange:
@@ -1660,16 +2199,22 @@ GeneratorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const
 	    return TCL_ERROR;
 	}
 	return Request(interp, session, ASN1_SNMP_GETRANGE, nonReps, maxReps,
-		       objv[4], (objc == 6) ? objv[5] : NULL);
+		       objv[4], (objc == 6) ? objv[5] : NULL, 0);
 #endif
 
     case cmdSet:
-	if (objc < 3 || objc > 4) {
-	    Tcl_WrongNumArgs(interp, 2, objv, "varBindList ?script?");
+	i = RequestOptions(interp, objc, objv, 2, NULL, &cmdObj);
+	if (objc - i < 1 || objc - i > (cmdObj ? 1 : 2)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, 
+			     "?-command prefix? varBindList ?script?");
 	    return TCL_ERROR;
 	}
+	if (objc - i == 2) {
+	    cmdObj = objv[i+1];
+	    prefix = 0;
+	}
 	return Request(interp, session, ASN1_SNMP_SET, 0, 0,
-		       objv[2], (objc == 4) ? objv[3] : NULL);
+		       objv[i], cmdObj, prefix);
 
     case cmdWait:
 	if (objc == 2) {
@@ -1685,6 +2230,9 @@ GeneratorCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const
 	return TCL_ERROR;
 
     case cmdWalk:
+	if (objc > 2 && strcmp(Tcl_GetString(objv[2]), "-channel") == 0) {
+	    return StreamWalk(interp, session, objc, objv);
+	}
 	if (objc < 4 || objc > 5) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "?varName? varBindList script");
 	    return TCL_ERROR;
@@ -1987,12 +2535,13 @@ ResponderCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *const
     int code;
 
     enum commands {
-	cmdBind, cmdCget, cmdConfigure, cmdDestroy, cmdInstance
+	cmdBind, cmdCache, cmdCget, cmdConfigure, cmdDestroy, cmdInstance,
+	cmdSimulate, cmdTable
     } cmd;
 
-    static const char *cmdTable[] = {
-	"bind", "cget", "configure", "destroy", "instance",
-	(char *) NULL
+    static const char *responderCmdTable[] = {
+	"bind", "cache", "cget", "configure", "destroy", "instance",
+	"simulate", "table", (char *) NULL
     };
 
     if (objc < 2) {
@@ -2000,7 +2549,7 @@ ResponderCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *const
         return TCL_ERROR;
     }
 
-    code = Tcl_GetIndexFromObj(interp, objv[1], cmdTable, 
+    code = Tcl_GetIndexFromObj(interp, objv[1], responderCmdTable, 
 			       "option", TCL_EXACT, (int *) &cmd);
     if (code != TCL_OK) {
 	return code;
@@ -2039,6 +2588,9 @@ ResponderCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *const
 	Tcl_Release((ClientData) session);
 	break;
 
+    case cmdCache:
+	return CacheInfo(interp, session, objc, objv);
+
     case cmdDestroy:
 	if (objc != 2) {
 	    Tcl_WrongNumArgs(interp, 2, objv, (char *) NULL);
@@ -2069,6 +2621,41 @@ ResponderCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *const
 	    return code;
 	}
 	break;
+
+    case cmdSimulate:
+	return TnmSnmpSimulate(interp, session, objc, objv);
+
+    case cmdTable: {
+	char *label, *varName = NULL;
+	int maxAge = TNM_SNMP_TABLE_MAXAGE;
+	if (objc == 4) {
+	    varName = Tcl_GetStringFromObj(objv[3], NULL);
+	} else if ((objc == 5 || objc == 7)
+		   && strcmp(Tcl_GetStringFromObj(objv[3], NULL),
+			     "-command") == 0
+		   && (objc == 5
+		       || strcmp(Tcl_GetStringFromObj(objv[5], NULL),
+				 "-maxAge") == 0)) {
+	    if (objc == 7
+		&& TnmGetUnsignedFromObj(interp, objv[6], &maxAge) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv,
+		     "oid ?varName? ?-command prefix ?-maxAge milliseconds??");
+	    return TCL_ERROR;
+	}
+	label = Tcl_GetStringFromObj(objv[2], NULL);
+	if (objc == 3) {
+	    return TnmSnmpGetTable(interp, label);
+	}
+	if ((varName && *varName == '\0')
+	    || (! varName && *Tcl_GetStringFromObj(objv[4], NULL) == '\0')) {
+	    return TnmSnmpDeleteTable(interp, label);
+	}
+	return TnmSnmpCreateTable(session->interp, label, varName,
+				  varName ? NULL : objv[4], maxAge);
+    }
     }
 
     return TCL_OK;
@@ -2095,39 +2682,38 @@ ResponderCmd(ClientData clientData, Tcl_Interp *interp, int	objc, Tcl_Obj *const
 static int
 WaitSession(Tcl_Interp *interp, TnmSnmp *session, int request)
 {
-    const char *cmdName;
-    char *name;
-
-    cmdName = Tcl_GetCommandName(interp, session->token);
-    if (! cmdName) {
+    if (! TnmSnmpSessionValid(session)) {
 	return TCL_OK;
     }
 
     /*
-     * Do not use the session pointer! We have to search for the
-     * session name after each single event because the session
-     * may be deleted as a side effect of the event.
+     * The session may be deleted as a side effect of an event. We
+     * keep the memory alive and check the session index after each
+     * event. The per session counters tell us when we are done.
      */
 
-    name = ckstrdup(cmdName);
-  repeat:
-    for (session = tnmSnmpList; session; session = session->nextPtr) {
-	const char *thisName = Tcl_GetCommandName(interp, session->token);
-	if (strcmp(thisName, name) != 0) continue;
+    Tcl_Preserve((ClientData) session);
+    while (TnmSnmpSessionValid(session)) {
+	if (session->coalescePtr) {
+	    CoalesceFlush(session);
+	}
 	if (! request) {
-	    if (TnmSnmpQueueRequest(session, NULL)) {
-		Tcl_DoOneEvent(0);
-		goto repeat;
+	    if (session->waiting && ! session->active) {
+		TnmSnmpQueueRequest(session, NULL);
+	    }
+	    if (! session->active && ! session->waiting
+		&& ! session->cachePending) {
+		break;
 	    }
 	} else {
-	    if (TnmSnmpFindRequest(request)) {
-		Tcl_DoOneEvent(0);
-		goto repeat;
+	    if (! TnmSnmpFindRequest(request) && ! CoalesceFind(request)
+		&& ! CacheFind(request)) {
+		break;
 	    }
 	}
+	Tcl_DoOneEvent(0);
     }
-    
-    ckfree(name);
+    Tcl_Release((ClientData) session);
     return TCL_OK;
 }
 
@@ -2137,7 +2723,8 @@ WaitSession(Tcl_Interp *interp, TnmSnmp *session, int request)
  * ResponseProc --
  *
  *	This procedure is called once we have received the response
- *	for an asynchronous SNMP request. It evaluates a Tcl script.
+ *	for an asynchronous SNMP request. It evaluates a Tcl script
+ *	unless the session has been destroyed.
  *
  * Results:
  *	None.
@@ -2152,9 +2739,16 @@ static void
 ResponseProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
 {
     AsyncToken *atPtr = (AsyncToken *) clientData;
-    TnmSnmpEvalCallback(atPtr->interp, session, pdu, 
-			Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
-			NULL, NULL, NULL, NULL);
+
+    if (TnmSnmpSessionValid(session)) {
+	if (atPtr->prefix) {
+	    TnmSnmpEvalCommand(atPtr->interp, session, pdu, atPtr->tclCmd);
+	} else {
+	    TnmSnmpEvalCallback(atPtr->interp, session, pdu, 
+				Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
+				NULL, NULL, NULL, NULL);
+	}
+    }
     Tcl_DecrRefCount(atPtr->tclCmd);
     ckfree((char *) atPtr);
 }
@@ -2222,13 +2816,23 @@ Notify(Tcl_Interp *interp, TnmSnmp *session, int type, Tcl_Obj *oid, Tcl_Obj *vb
  */
 
 static int
-Request(Tcl_Interp *interp, TnmSnmp *session, int type, int non, int max, Tcl_Obj *vbList, Tcl_Obj *cmdObj)
+Request(Tcl_Interp *interp, TnmSnmp *session, int type, int non, int max, Tcl_Obj *vbList, Tcl_Obj *cmdObj, int prefix)
 {
     TnmSnmpPdu pdu;
     int code = TCL_OK;
     char *vbl = Tcl_GetStringFromObj(vbList, NULL);
     char *cmd = cmdObj ? Tcl_GetStringFromObj(cmdObj, NULL) : NULL;
 
+    /*
+     * Asynchronous get requests are merged with other get requests
+     * to the same session if the session has a coalesce window.
+     */
+
+    if (cmd && type == ASN1_SNMP_GET && session->coalesce > 0
+	&& session->domain == TNM_SNMP_UDP_DOMAIN && *vbl) {
+	return CoalesceAdd(interp, session, vbList, cmdObj, prefix);
+    }
+
     PduInit(&pdu, session, type);
     if (type == ASN1_SNMP_GETBULK) {
 	pdu.errorStatus = non > 0 ? non : 0;
@@ -2237,11 +2841,7 @@ Request(Tcl_Interp *interp, TnmSnmp *session, int type, int non, int max, Tcl_Ob
     Tcl_DStringAppend(&pdu.varbind, vbl, -1);
 
     if (cmd) {
-	AsyncToken *atPtr = (AsyncToken *) ckalloc(sizeof(AsyncToken));
-	atPtr->interp = interp;
-	atPtr->tclCmd = cmdObj;
-	Tcl_IncrRefCount(atPtr->tclCmd);
-	atPtr->oidList = NULL;
+	AsyncToken *atPtr = AsyncTokenCreate(interp, cmdObj, prefix);
 	code = TnmSnmpEncode(interp, session, &pdu, 
 			     ResponseProc, (ClientData) atPtr);
 	if (code != TCL_OK) {
@@ -2259,416 +2859,3039 @@ Request(Tcl_Interp *interp, TnmSnmp *session, int type, int non, int max, Tcl_Ob
 /*
  *----------------------------------------------------------------------
  *
- * WalkCheck --
+ * RequestOptions --
  *
- *	This procedure is used to implement MIB walks. It takes
- *	a list of object identifier values and a varbind list as
- *	input and checks whether the varbinds are contained in
- *	the subtrees defined by the object identifier values. This
- *	procedure also checks whether a syntax value of a varbind
- *	matches the endOfMibView exception.
+ *	This procedure parses the options of the generator commands
+ *	which send requests, starting at the argument first. The
+ *	-maxage option is only accepted if maxAgePtr is not NULL.
  *
  * Results:
- *	A pointer to the varbind list or NULL if the varbind list
- *	elements are not contained in the subtrees defined by the
- *	object identifier list.
+ *	The index of the first argument which is not an option or
+ *	-1 if an option value is invalid.
  *
  * Side effects:
- *	None.
+ *	The option values are stored in maxAgePtr and cmdPtr.
  *
  *----------------------------------------------------------------------
  */
 
-static Tcl_Obj*
-WalkCheck(int oidListLen, Tcl_Obj **oidListElems, int vbListLen, Tcl_Obj **vbListElems)
+static int
+RequestOptions(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[], int first, int *maxAgePtr, Tcl_Obj **cmdPtr)
 {
-    int i, code;
-    Tcl_Obj *objPtr;
+    int i;
+    const char *option;
 
-    /*
-     * Check if all the object identifiers are in the subtree.
-     */
-    
-    for (i = 0; i < oidListLen; i++) {
-	code = Tcl_ListObjIndex(NULL, vbListElems[i], 0, &objPtr);
-	if (code != TCL_OK || !objPtr) {
-	    Tcl_Panic("WalkCheck: no object identifier in varbind list");
-	}
-	code = TnmOidInTree(TnmGetOidFromObj(NULL, oidListElems[i]),
-			    TnmGetOidFromObj(NULL, objPtr));
-	if (! code) {
-	    return NULL;
-	}
+    if (maxAgePtr) {
+	*maxAgePtr = -1;
     }
+    *cmdPtr = NULL;
 
-    /*
-     * Check if we got an endOfMibView exception.
-     */
-
-    for (i = 0; i < oidListLen; i++) {
-	code = Tcl_ListObjIndex(NULL, vbListElems[i], 1, &objPtr);
-	if (code != TCL_OK || !objPtr) {
-	    Tcl_Panic("WalkCheck: no syntax in varbind list");
-	}
-	code = TnmGetTableKey(tnmSnmpExceptionTable,
-			      Tcl_GetStringFromObj(objPtr, NULL));
-	if (code == ASN1_END_OF_MIB_VIEW) {
-	    return NULL;
+    for (i = first; i < objc; i += 2) {
+	option = Tcl_GetString(objv[i]);
+	if (strcmp(option, "-command") == 0) {
+	    if (i + 1 == objc) {
+		return objc;
+	    }
+	    *cmdPtr = objv[i+1];
+	} else if (maxAgePtr && strcmp(option, "-maxage") == 0) {
+	    if (i + 1 == objc) {
+		return objc;
+	    }
+	    if (TnmGetUnsignedFromObj(interp, objv[i+1], 
+				      maxAgePtr) != TCL_OK) {
+		return -1;
+	    }
+	} else {
+	    break;
 	}
     }
-
-    objPtr = Tcl_NewListObj(oidListLen, vbListElems);
-    return objPtr;
+    return i;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AsyncWalkProc --
+ * AsyncTokenCreate --
  *
- *	This procedure is called once we have received the response
- *	during an asynchronous SNMP walk. It evaluates a Tcl script
- *	and starts another SNMP getnext if we did not reach the end
- *	of the MIB view.
+ *	This procedure creates the callback token for an asynchronous
+ *	request. The command is a command prefix if prefix is set or
+ *	a script with % escapes otherwise.
  *
  * Results:
- *	None.
+ *	A pointer to the new token.
  *
  * Side effects:
- *	Arbitrary side effects since commands are evaluated.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-AsyncWalkProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+static AsyncToken*
+AsyncTokenCreate(Tcl_Interp *interp, Tcl_Obj *cmdObj, int prefix)
 {
-    AsyncToken *atPtr = (AsyncToken *) clientData;
-    Tcl_Interp *interp = atPtr->interp;
-    Tcl_Obj *vbList, *newList, **vbListElems, **oidListElems;
-    Tcl_Size vbListLen, oidListLen;
-
-#if 0
-    if (pdu->errorStatus == TNM_SNMP_NOSUCHNAME) {
-	pdu->errorStatus = TNM_SNMP_ENDOFWALK;
-	TnmSnmpEvalCallback(interp, session, pdu, 
-			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
-			    NULL, NULL, NULL, NULL);
-	goto done;
-    }
-#endif
-
-    if (pdu->errorStatus != TNM_SNMP_NOERROR) {
-	TnmSnmpEvalCallback(interp, session, pdu, 
-			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
-			    NULL, NULL, NULL, NULL);
-	goto done;
-    }
-
-    vbList = Tcl_NewStringObj(Tcl_DStringValue(&pdu->varbind), 
-			      Tcl_DStringLength(&pdu->varbind));
-    
-    if (Tcl_ListObjGetElements(interp, atPtr->oidList,
-			       &oidListLen, &oidListElems) != TCL_OK) {
-	Tcl_Panic("AsyncWalkProc: failed to split object identifier list");
-    }
-    
-    if (Tcl_ListObjGetElements(interp, vbList,
-			       &vbListLen, &vbListElems) != TCL_OK) {
-	Tcl_Panic("AsyncWalkProc: failed to split varbind list");
-    }
-    
-    newList = WalkCheck(oidListLen, oidListElems, vbListLen, vbListElems);
-    Tcl_DecrRefCount(vbList);
-    if (! newList) {
-	pdu->errorStatus = TNM_SNMP_ENDOFWALK;
-	Tcl_DStringFree(&pdu->varbind);
-	TnmSnmpEvalCallback(interp, session, pdu, 
-			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
-			    NULL, NULL, NULL, NULL);
-	goto done;
-    }
-    TnmSnmpEvalCallback(interp, session, pdu, 
-			Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
-			NULL, NULL, NULL, NULL);
-    pdu->type = ASN1_SNMP_GETNEXT;
-    pdu->requestId = TnmSnmpGetRequestId();
-    (void) TnmSnmpEncode(interp, session, pdu, AsyncWalkProc, 
-			 (ClientData) atPtr);
-    Tcl_DecrRefCount(newList);
-    return;
+    AsyncToken *atPtr = (AsyncToken *) ckalloc(sizeof(AsyncToken));
 
-done:
-    Tcl_DecrRefCount(atPtr->tclCmd);
-    Tcl_DecrRefCount(atPtr->oidList);
-    ckfree((char *) atPtr);
+    atPtr->interp = interp;
+    atPtr->tclCmd = cmdObj;
+    Tcl_IncrRefCount(atPtr->tclCmd);
+    atPtr->oidList = NULL;
+    atPtr->prefix = prefix;
+    return atPtr;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AsyncWalk --
+ * CoalesceAdd --
  *
- *	This procedure walks a MIB tree. It evaluates the given Tcl
- *	command foreach varbind retrieved using getbulk requests.
- *	First, all variables contained in the list argument are
- *	converted to their OIDs. Then we start an asynchronous loop
- *	using gebulk requests until we get an error or until one
- *	returned variable starts with an OID not being a valid prefix.
+ *	This procedure adds an asynchronous get request to the set of
+ *	get requests which will be merged into a single PDU once the
+ *	coalesce window of the session closes. The merged PDU is sent
+ *	early if adding the varbind list would exceed the message size.
  *
  * Results:
- *	A standard Tcl result.
+ *	A standard Tcl result. The request id of the original request
+ *	is left in the interpreter result.
  *
  * Side effects:
- *	None.
+ *	A timer handler may be created.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-AsyncWalk(Tcl_Interp *interp, TnmSnmp *session, Tcl_Obj *oidList, Tcl_Obj *tclCmd)
+CoalesceAdd(Tcl_Interp *interp, TnmSnmp *session, Tcl_Obj *vbList, Tcl_Obj *cmdObj, int prefix)
 {
-    TnmSnmpPdu pdu;
-    Tcl_Size i, oidListLen;
-    int result;
+    Tcl_Size i, vbc, size;
+    Tcl_Obj **vbv, *oidObj;
+    Coalesce *cPtr;
+    CoalescePart *partPtr;
     AsyncToken *atPtr;
+    char *soid;
 
-    Tcl_Obj **oidListElems;
-    
     /*
-     * Make sure our argument is a valid Tcl list where every 
-     * element in the list is a valid object identifier.
+     * Check the varbind list now since errors in a merged PDU would
+     * be reported to all requests merged into it.
      */
 
-    result = Tcl_ListObjGetElements(interp, oidList,
-				    &oidListLen, &oidListElems);
-    if (result != TCL_OK) {
+    if (Tcl_ListObjGetElements(interp, vbList, &vbc, &vbv) != TCL_OK) {
 	return TCL_ERROR;
     }
-    if (oidListLen == 0) {
-	return TCL_OK;
-    }
-
-    for (i = 0; i < oidListLen; i++) {
-	TnmOid *oidPtr = TnmGetOidFromObj(interp, oidListElems[i]);
-	if (! oidPtr) {
+    for (i = 0; i < vbc; i++) {
+	if (Tcl_ListObjIndex(interp, vbv[i], 0, &oidObj) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (! oidObj) {
+	    Tcl_SetResult(interp, "missing OBJECT IDENTIFIER", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	soid = Tcl_GetStringFromObj(oidObj, NULL);
+	if (! TnmIsOid(soid) && ! TnmMibGetOid(soid)) {
+	    Tcl_AppendResult(interp, "invalid object identifier \"",
+			     soid, "\"", (char *) NULL);
 	    return TCL_ERROR;
 	}
     }
 
-    /*
-     * The structure where we keep all information about this
-     * asynchronous walk.
-     */
+    (void) Tcl_GetStringFromObj(vbList, &size);
+    cPtr = session->coalescePtr;
+    if (cPtr && cPtr->size + size > session->maxSize / 2) {
+	CoalesceFlush(session);
+	cPtr = NULL;
+    }
+    if (! cPtr) {
+	cPtr = (Coalesce *) ckalloc(sizeof(Coalesce));
+	memset((char *) cPtr, 0, sizeof(Coalesce));
+	cPtr->session = session;
+	cPtr->interp = interp;
+	cPtr->timer = Tcl_CreateTimerHandler(session->coalesce,
+				     CoalesceTimerProc, (ClientData) session);
+	session->coalescePtr = cPtr;
+	coalesceOpen++;
+    }
 
-    atPtr = (AsyncToken *) ckalloc(sizeof(AsyncToken));
-    atPtr->interp = interp;
-    atPtr->tclCmd = tclCmd;
-    Tcl_IncrRefCount(atPtr->tclCmd);
-    atPtr->oidList = oidList;
-    Tcl_IncrRefCount(atPtr->oidList);
+    atPtr = AsyncTokenCreate(interp, cmdObj, prefix);
 
-    PduInit(&pdu, session, ASN1_SNMP_GETNEXT);
-    Tcl_DStringAppend(&pdu.varbind, Tcl_GetStringFromObj(oidList, NULL), -1);
-    result = TnmSnmpEncode(interp, session, &pdu, 
-			   AsyncWalkProc, (ClientData) atPtr);
-    if (result != TCL_OK) {
-	Tcl_DecrRefCount(atPtr->tclCmd);
-	Tcl_DecrRefCount(atPtr->oidList);
-	ckfree((char *) atPtr);
+    partPtr = (CoalescePart *) ckalloc(sizeof(CoalescePart));
+    partPtr->requestId = TnmSnmpGetRequestId();
+    partPtr->offset = cPtr->count;
+    partPtr->length = vbc;
+    partPtr->vbList = vbList;
+    Tcl_IncrRefCount(partPtr->vbList);
+    partPtr->atPtr = atPtr;
+    partPtr->nextPtr = NULL;
+
+    if (cPtr->lastPart) {
+	cPtr->lastPart->nextPtr = partPtr;
+    } else {
+	cPtr->partList = partPtr;
     }
-    PduFree(&pdu);
-    return result;
+    cPtr->lastPart = partPtr;
+    cPtr->count += vbc;
+    cPtr->size += size;
+
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(partPtr->requestId));
+    return TCL_OK;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * SyncWalk --
+ * CoalesceTimerProc --
  *
- *	This procedure walks a MIB tree. It evaluates the given Tcl
- *	command foreach varbind retrieved using getbulk requests.
- *	First, all variables contained in the list argument are
- *	converted to their OIDs. Then we loop using gebulk requests
- *	until we get an error or until one returned variable starts
- *	with an OID not being a valid prefix.
+ *	This procedure is called when the coalesce window of a
+ *	session closes.
  *
  * Results:
- *	A standard Tcl result.
+ *	None.
  *
  * Side effects:
+ *	The merged get request is sent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceTimerProc(ClientData clientData)
+{
+    TnmSnmp *session = (TnmSnmp *) clientData;
+
+    if (session->coalescePtr) {
+	session->coalescePtr->timer = NULL;
+	CoalesceFlush(session);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceFlush --
+ *
+ *	This procedure builds a single get request out of all the
+ *	get requests collected for a session and queues it. A single
+ *	request is sent as it is. The requests are sent individually
+ *	if the merged PDU can not be encoded.
+ *
+ * Results:
  *	None.
  *
+ * Side effects:
+ *	A request is queued.
+ *
  *----------------------------------------------------------------------
  */
 
-static int
-SyncWalk(Tcl_Interp *interp, TnmSnmp *session, Tcl_Obj *varName, Tcl_Obj *oidList, Tcl_Obj *tclCmd)
+static void
+CoalesceFlush(TnmSnmp *session)
 {
-    Tcl_Size i, j, oidListLen, vbListLen;
-    int result;
+    Coalesce *cPtr = session->coalescePtr;
+    Tcl_Interp *interp;
+    CoalescePart *partPtr;
+    TnmSnmpPdu pdu;
+    Tcl_Size i, vbc;
+    Tcl_Obj **vbv;
+
+    if (! cPtr) {
+	return;
+    }
+    session->coalescePtr = NULL;
+    coalesceOpen--;
+    if (cPtr->timer) {
+	Tcl_DeleteTimerHandler(cPtr->timer);
+	cPtr->timer = NULL;
+    }
+    interp = cPtr->interp;
+
+    if (cPtr->partList == cPtr->lastPart) {
+	CoalesceResend(interp, session, cPtr->partList);
+	cPtr->partList->atPtr = NULL;
+	CoalesceFree(cPtr);
+	return;
+    }
+
+    PduInit(&pdu, session, ASN1_SNMP_GET);
+    for (partPtr = cPtr->partList; partPtr; partPtr = partPtr->nextPtr) {
+	(void) Tcl_ListObjGetElements(NULL, partPtr->vbList, &vbc, &vbv);
+	for (i = 0; i < vbc; i++) {
+	    Tcl_DStringAppendElement(&pdu.varbind, 
+				     Tcl_GetStringFromObj(vbv[i], NULL));
+	}
+    }
+
+    cPtr->nextPtr = coalesceList;
+    coalesceList = cPtr;
+    if (TnmSnmpEncode(interp, session, &pdu, 
+		      CoalesceProc, (ClientData) cPtr) != TCL_OK) {
+	coalesceList = cPtr->nextPtr;
+	for (partPtr = cPtr->partList; partPtr; partPtr = partPtr->nextPtr) {
+	    CoalesceResend(interp, session, partPtr);
+	    partPtr->atPtr = NULL;
+	}
+	CoalesceFree(cPtr);
+    }
+    PduFree(&pdu);
+    Tcl_ResetResult(interp);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceProc --
+ *
+ *	This procedure is called once we have received the response
+ *	for a merged get request. It splits the response and evaluates
+ *	the callbacks of the original requests. An error reported for
+ *	a varbind is passed to the request owning this varbind while
+ *	the other requests are sent again individually. The same
+ *	happens to all requests if the response was too big.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    Coalesce **cPtrPtr, *cPtr = (Coalesce *) clientData;
+    CoalescePart *partPtr;
+    Tcl_Obj *vbList, **vbv = NULL;
+    Tcl_Size vbc = 0;
+
+    /*
+     * Unlink the merged request first so that callbacks which
+     * destroy the session do not touch it.
+     */
+
+    for (cPtrPtr = &coalesceList; *cPtrPtr; cPtrPtr = &(*cPtrPtr)->nextPtr) {
+	if (*cPtrPtr == cPtr) {
+	    *cPtrPtr = cPtr->nextPtr;
+	    break;
+	}
+    }
+
+    vbList = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(vbList);
+    if (Tcl_ListObjGetElements(NULL, vbList, &vbc, &vbv) != TCL_OK) {
+	vbc = 0;
+    }
+
+    for (partPtr = cPtr->partList; partPtr; partPtr = partPtr->nextPtr) {
+
+	if (! TnmSnmpSessionValid(session)) {
+	    break;
+	}
+
+	if (pdu->errorStatus == TNM_SNMP_NORESPONSE) {
+	    CoalesceDeliver(session, pdu, partPtr, pdu->errorStatus, 0, NULL);
+	} else if (pdu->errorStatus == TNM_SNMP_NOERROR && vbc == cPtr->count) {
+	    Tcl_Obj *objPtr = Tcl_NewListObj(partPtr->length, 
+					     vbv + partPtr->offset);
+	    CoalesceDeliver(session, pdu, partPtr, 
+			    TNM_SNMP_NOERROR, 0, objPtr);
+	} else if (pdu->errorStatus != TNM_SNMP_NOERROR
+		   && pdu->errorStatus != TNM_SNMP_TOOBIG
+		   && pdu->errorIndex > partPtr->offset
+		   && pdu->errorIndex <= partPtr->offset + partPtr->length) {
+	    CoalesceDeliver(session, pdu, partPtr, pdu->errorStatus,
+			    pdu->errorIndex - partPtr->offset, 
+			    partPtr->vbList);
+	} else {
+	    CoalesceResend(cPtr->interp, session, partPtr);
+	    partPtr->atPtr = NULL;
+	}
+    }
+
+    Tcl_DecrRefCount(vbList);
+    CoalesceFree(cPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceDeliver --
+ *
+ *	This procedure evaluates the callback of an original request
+ *	with a response PDU assembled from the merged response.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceDeliver(TnmSnmp *session, TnmSnmpPdu *pdu, CoalescePart *partPtr, int status, int index, Tcl_Obj *vbList)
+{
+    TnmSnmpPdu part;
+
+    part = *pdu;
+    part.requestId = partPtr->requestId;
+    part.errorStatus = status;
+    part.errorIndex = index;
+    Tcl_DStringInit(&part.varbind);
+    part.vbList = vbList;
+    if (vbList) {
+	Tcl_IncrRefCount(vbList);
+    }
+
+    ResponseProc(session, &part, (ClientData) partPtr->atPtr);
+    partPtr->atPtr = NULL;
+    if (vbList) {
+	Tcl_DecrRefCount(vbList);
+    }
+    Tcl_DStringFree(&part.varbind);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceResend --
+ *
+ *	This procedure sends an original request as it was issued
+ *	by the caller, reusing the request id seen by the caller.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A request is queued. The callback token is owned by the
+ *	queued request or freed if the request can not be sent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceResend(Tcl_Interp *interp, TnmSnmp *session, CoalescePart *partPtr)
+{
+    TnmSnmpPdu pdu;
+    AsyncToken *atPtr = partPtr->atPtr;
+
+    PduInit(&pdu, session, ASN1_SNMP_GET);
+    pdu.requestId = partPtr->requestId;
+    Tcl_DStringAppend(&pdu.varbind, 
+		      Tcl_GetStringFromObj(partPtr->vbList, NULL), -1);
+    if (TnmSnmpEncode(interp, session, &pdu, 
+		      ResponseProc, (ClientData) atPtr) != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (snmp coalesced request)");
+	Tcl_BackgroundError(interp);
+	Tcl_DecrRefCount(atPtr->tclCmd);
+	ckfree((char *) atPtr);
+    }
+    PduFree(&pdu);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceFree --
+ *
+ *	This procedure frees a set of merged requests. Callback tokens
+ *	still owned by the parts are freed as well.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceFree(Coalesce *cPtr)
+{
+    CoalescePart *partPtr;
+
+    while (cPtr->partList) {
+	partPtr = cPtr->partList;
+	cPtr->partList = partPtr->nextPtr;
+	if (partPtr->atPtr) {
+	    Tcl_DecrRefCount(partPtr->atPtr->tclCmd);
+	    ckfree((char *) partPtr->atPtr);
+	}
+	Tcl_DecrRefCount(partPtr->vbList);
+	ckfree((char *) partPtr);
+    }
+    if (cPtr->timer) {
+	Tcl_DeleteTimerHandler(cPtr->timer);
+    }
+    ckfree((char *) cPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceFind --
+ *
+ *	This procedure checks whether a request id belongs to a
+ *	request merged into a get request that is still on the wire.
+ *
+ * Results:
+ *	1 if the request is still outstanding, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CoalesceFind(int id)
+{
+    Coalesce *cPtr;
+    CoalescePart *partPtr;
+
+    for (cPtr = coalesceList; cPtr; cPtr = cPtr->nextPtr) {
+	for (partPtr = cPtr->partList; partPtr; partPtr = partPtr->nextPtr) {
+	    if (partPtr->requestId == id) {
+		return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CoalesceDiscard --
+ *
+ *	This procedure discards the merged get request of a session
+ *	that is going to be destroyed and not yet sent. Merged requests
+ *	on the wire are freed by CoalesceProc() when the request queue
+ *	is cleared by TnmSnmpDeleteSession().
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CoalesceDiscard(TnmSnmp *session)
+{
+    if (session->coalescePtr) {
+	CoalesceFree(session->coalescePtr);
+	session->coalescePtr = NULL;
+	coalesceOpen--;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheGet --
+ *
+ *	This procedure processes a get request with a maximum age.
+ *	Varbinds found in the response cache of the session which
+ *	are younger than maxAge milliseconds are taken from the
+ *	cache, so a maxAge of 0 always queries the agent. A get
+ *	request is sent for the remaining varbinds and the response
+ *	is merged with the cached varbinds.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The cache and the cache counters of the session are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheGet(Tcl_Interp *interp, TnmSnmp *session, int maxAge, Tcl_Obj *vbList, Tcl_Obj *cmdObj, int prefix)
+{
+    Tcl_Size i, vbc, count = 0;
+    Tcl_Obj **vbv;
+    Tcl_HashEntry *entryPtr;
+    CacheEntry *cePtr;
+    CacheToken *ctPtr;
+    TnmSnmpPdu pdu;
+    Tcl_Time now;
+    const char *key;
+    long age;
+    int code;
+
+    if (Tcl_ListObjGetElements(interp, vbList, &vbc, &vbv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    if (! session->cachePtr) {
+	session->cachePtr = (ResponseCache *) ckalloc(sizeof(ResponseCache));
+	Tcl_InitHashTable(&session->cachePtr->table, TCL_STRING_KEYS);
+	session->cachePtr->firstPtr = session->cachePtr->lastPtr = NULL;
+    }
+
+    ctPtr = (CacheToken *) ckalloc(sizeof(CacheToken));
+    memset((char *) ctPtr, 0, sizeof(CacheToken));
+    ctPtr->session = session;
+    ctPtr->vbList = vbList;
+    Tcl_IncrRefCount(ctPtr->vbList);
+    ctPtr->result = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(ctPtr->result);
+    ctPtr->index = (int *) ckalloc(sizeof(int) * (vbc ? vbc : 1));
+
+    PduInit(&pdu, session, ASN1_SNMP_GET);
+    Tcl_GetTime(&now);
+    for (i = 0; i < vbc; i++) {
+	key = CacheKey(vbv[i]);
+	entryPtr = key ? Tcl_FindHashEntry(&session->cachePtr->table, key)
+	    : NULL;
+	if (entryPtr) {
+	    cePtr = (CacheEntry *) Tcl_GetHashValue(entryPtr);
+	    age = (now.sec - cePtr->stamp.sec) * 1000
+		+ (now.usec - cePtr->stamp.usec) / 1000;
+	    if (age < maxAge) {
+		Tcl_ListObjAppendElement(NULL, ctPtr->result, cePtr->vbObj);
+		session->cacheHits++;
+		continue;
+	    }
+	}
+	Tcl_ListObjAppendElement(NULL, ctPtr->result, vbv[i]);
+	Tcl_DStringAppendElement(&pdu.varbind, Tcl_GetString(vbv[i]));
+	ctPtr->index[count++] = (int) i;
+	session->cacheMisses++;
+    }
+    ctPtr->count = count;
+
+    /*
+     * Requests answered completely from the cache. Async requests
+     * get a request id and their callback is evaluated once we are
+     * back in the event loop.
+     */
+
+    if (count == 0) {
+	code = TCL_OK;
+	if (cmdObj) {
+	    ctPtr->requestId = pdu.requestId;
+	    ctPtr->atPtr = AsyncTokenCreate(interp, cmdObj, prefix);
+	    ctPtr->nextPtr = cacheHitList;
+	    cacheHitList = ctPtr;
+	    session->cachePending++;
+	    Tcl_DoWhenIdle(CacheIdleProc, (ClientData) ctPtr);
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(ctPtr->requestId));
+	} else {
+	    Tcl_SetObjResult(interp, ctPtr->result);
+	    CacheTokenFree(ctPtr);
+	}
+	PduFree(&pdu);
+	return code;
+    }
+
+    if (cmdObj) {
+	ctPtr->atPtr = AsyncTokenCreate(interp, cmdObj, prefix);
+	code = TnmSnmpEncode(interp, session, &pdu, 
+			     CacheProc, (ClientData) ctPtr);
+	if (code != TCL_OK) {
+	    CacheTokenFree(ctPtr);
+	}
+	PduFree(&pdu);
+	return code;
+    }
+
+    code = TnmSnmpEncode(interp, session, &pdu, NULL, NULL);
+    if (code == TCL_OK) {
+	if (CacheMerge(session, ctPtr, Tcl_GetObjResult(interp)) == TCL_OK) {
+	    Tcl_SetObjResult(interp, ctPtr->result);
+	}
+    } else if (pdu.errorStatus != TNM_SNMP_NOERROR
+	       && pdu.errorIndex > 0 && pdu.errorIndex <= count) {
+	const char *name;
+	char buf[20];
+
+	/*
+	 * Map the error index back into the varbind list of the
+	 * caller so that the error looks like the one reported
+	 * for a plain get request.
+	 */
+	
+	name = TnmGetTableValue(tnmSnmpErrorTable, 
+				(unsigned) pdu.errorStatus);
+	sprintf(buf, " %d ", ctPtr->index[pdu.errorIndex - 1]);
+	Tcl_ResetResult(interp);
+	Tcl_AppendResult(interp, name ? name : "unknown", buf,
+			 Tcl_GetString(vbList), (char *) NULL);
+    }
+    CacheTokenFree(ctPtr);
+    PduFree(&pdu);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheKey --
+ *
+ *	This procedure returns the key used to locate a varbind in
+ *	the response cache, which is the object identifier of the
+ *	varbind in dotted notation.
+ *
+ * Results:
+ *	The key or NULL if the varbind has no valid object identifier.
+ *	The key may point to a static buffer.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char*
+CacheKey(Tcl_Obj *vbObj)
+{
+    Tcl_Obj *oidObj;
+    char *soid;
+
+    if (Tcl_ListObjIndex(NULL, vbObj, 0, &oidObj) != TCL_OK || ! oidObj) {
+	return NULL;
+    }
+    soid = Tcl_GetString(oidObj);
+    return TnmIsOid(soid) ? soid : TnmMibGetOid(soid);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheStore --
+ *
+ *	This procedure saves a varbind received from an agent in the
+ *	response cache of a session. Exceptions are not cached since
+ *	the instance may show up at any time. The oldest entry is
+ *	removed if the cache is full.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A cache entry is created, updated or removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheStore(TnmSnmp *session, Tcl_Obj *vbObj, Tcl_Time *now)
+{
+    ResponseCache *cachePtr = session->cachePtr;
+    Tcl_HashEntry *entryPtr;
+    CacheEntry *cePtr;
+    Tcl_Obj *typeObj;
+    const char *key;
+    int isNew;
+
+    if (! cachePtr) {
+	return;
+    }
+    if (Tcl_ListObjIndex(NULL, vbObj, 1, &typeObj) == TCL_OK && typeObj
+	&& TnmGetTableKey(tnmSnmpExceptionTable,
+			  Tcl_GetString(typeObj)) >= 0) {
+	return;
+    }
+    key = CacheKey(vbObj);
+    if (! key) {
+	return;
+    }
+
+    entryPtr = Tcl_CreateHashEntry(&cachePtr->table, key, &isNew);
+    if (isNew) {
+
+	/*
+	 * Make room by removing the oldest entry.
+	 */
+
+	if (cachePtr->table.numEntries > TNM_SNMP_CACHEENTRIES) {
+	    cePtr = cachePtr->firstPtr;
+	    cachePtr->firstPtr = cePtr->nextPtr;
+	    cachePtr->firstPtr->prevPtr = NULL;
+	    Tcl_DeleteHashEntry(cePtr->entryPtr);
+	    Tcl_DecrRefCount(cePtr->vbObj);
+	    ckfree((char *) cePtr);
+	}
+	cePtr = (CacheEntry *) ckalloc(sizeof(CacheEntry));
+	cePtr->entryPtr = entryPtr;
+	Tcl_SetHashValue(entryPtr, (ClientData) cePtr);
+    } else {
+	cePtr = (CacheEntry *) Tcl_GetHashValue(entryPtr);
+	Tcl_DecrRefCount(cePtr->vbObj);
+	if (cePtr->prevPtr) {
+	    cePtr->prevPtr->nextPtr = cePtr->nextPtr;
+	} else {
+	    cachePtr->firstPtr = cePtr->nextPtr;
+	}
+	if (cePtr->nextPtr) {
+	    cePtr->nextPtr->prevPtr = cePtr->prevPtr;
+	} else {
+	    cachePtr->lastPtr = cePtr->prevPtr;
+	}
+    }
+    cePtr->vbObj = vbObj;
+    Tcl_IncrRefCount(cePtr->vbObj);
+    cePtr->stamp = *now;
+
+    cePtr->nextPtr = NULL;
+    cePtr->prevPtr = cachePtr->lastPtr;
+    if (cachePtr->lastPtr) {
+	cachePtr->lastPtr->nextPtr = cePtr;
+    } else {
+	cachePtr->firstPtr = cePtr;
+    }
+    cachePtr->lastPtr = cePtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheMerge --
+ *
+ *	This procedure merges the varbinds received for the varbinds
+ *	that were not found in the cache into the result list of a
+ *	cached request and saves them in the cache.
+ *
+ * Results:
+ *	A standard Tcl result. TCL_ERROR is returned if the response
+ *	does not match the request.
+ *
+ * Side effects:
+ *	The cache of the session is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheMerge(TnmSnmp *session, CacheToken *ctPtr, Tcl_Obj *vbList)
+{
+    Tcl_Size i, vbc;
+    Tcl_Obj **vbv;
+    Tcl_Time now;
+
+    if (Tcl_ListObjGetElements(NULL, vbList, &vbc, &vbv) != TCL_OK
+	|| vbc != ctPtr->count) {
+	return TCL_ERROR;
+    }
+
+    Tcl_GetTime(&now);
+    for (i = 0; i < vbc; i++) {
+	Tcl_ListObjReplace(NULL, ctPtr->result, ctPtr->index[i], 1,
+			   1, vbv + i);
+	CacheStore(session, vbv[i], &now);
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheProc --
+ *
+ *	This procedure is called once we have received the response
+ *	for the varbinds of a cached request that had to be sent to
+ *	the agent. It evaluates the callback of the caller with the
+ *	merged varbind list. Error indices are mapped back into the
+ *	varbind list of the caller.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    CacheToken *ctPtr = (CacheToken *) clientData;
+    TnmSnmpPdu part;
+    Tcl_Obj *vbList;
+
+    vbList = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(vbList);
+
+    part = *pdu;
+    Tcl_DStringInit(&part.varbind);
+    if (pdu->errorStatus == TNM_SNMP_NOERROR
+	&& CacheMerge(session, ctPtr, vbList) == TCL_OK) {
+	part.vbList = ctPtr->result;
+    } else if (pdu->errorStatus != TNM_SNMP_NOERROR
+	       && pdu->errorStatus != TNM_SNMP_NORESPONSE
+	       && pdu->errorIndex > 0 && pdu->errorIndex <= ctPtr->count) {
+	part.errorIndex = ctPtr->index[pdu->errorIndex - 1] + 1;
+	part.vbList = ctPtr->vbList;
+    } else {
+	part.vbList = vbList;
+    }
+    Tcl_IncrRefCount(part.vbList);
+
+    ResponseProc(session, &part, (ClientData) ctPtr->atPtr);
+    ctPtr->atPtr = NULL;
+    Tcl_DecrRefCount(part.vbList);
+    Tcl_DecrRefCount(vbList);
+    Tcl_DStringFree(&part.varbind);
+    CacheTokenFree(ctPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheIdleProc --
+ *
+ *	This procedure evaluates the callback of an async request
+ *	which was answered completely from the response cache.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheIdleProc(ClientData clientData)
+{
+    CacheToken **ctPtrPtr, *ctPtr = (CacheToken *) clientData;
+    TnmSnmpPdu pdu;
+
+    for (ctPtrPtr = &cacheHitList; *ctPtrPtr; ctPtrPtr = &(*ctPtrPtr)->nextPtr) {
+	if (*ctPtrPtr == ctPtr) {
+	    *ctPtrPtr = ctPtr->nextPtr;
+	    break;
+	}
+    }
+    ctPtr->session->cachePending--;
+
+    PduInit(&pdu, ctPtr->session, ASN1_SNMP_RESPONSE);
+    pdu.requestId = ctPtr->requestId;
+    Tcl_DStringAppend(&pdu.varbind, Tcl_GetString(ctPtr->result), -1);
+    ResponseProc(ctPtr->session, &pdu, (ClientData) ctPtr->atPtr);
+    ctPtr->atPtr = NULL;
+    PduFree(&pdu);
+    CacheTokenFree(ctPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheTokenFree --
+ *
+ *	This procedure frees a cached request. The callback token is
+ *	freed as well if it is still owned by the request.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheTokenFree(CacheToken *ctPtr)
+{
+    if (ctPtr->atPtr) {
+	Tcl_DecrRefCount(ctPtr->atPtr->tclCmd);
+	ckfree((char *) ctPtr->atPtr);
+    }
+    Tcl_DecrRefCount(ctPtr->vbList);
+    Tcl_DecrRefCount(ctPtr->result);
+    ckfree((char *) ctPtr->index);
+    ckfree((char *) ctPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheFind --
+ *
+ *	This procedure checks whether a request id belongs to a
+ *	request answered from the cache that was not yet delivered.
+ *
+ * Results:
+ *	1 if the request is still outstanding, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheFind(int id)
+{
+    CacheToken *ctPtr;
+
+    for (ctPtr = cacheHitList; ctPtr; ctPtr = ctPtr->nextPtr) {
+	if (ctPtr->requestId == id) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheFlush --
+ *
+ *	This procedure removes all entries from the response cache
+ *	of a session and resets the cache counters.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheFlush(TnmSnmp *session)
+{
+    ResponseCache *cachePtr = session->cachePtr;
+    CacheEntry *cePtr;
+
+    session->cacheHits = session->cacheMisses = 0;
+    if (! cachePtr) {
+	return;
+    }
+
+    while (cachePtr->firstPtr) {
+	cePtr = cachePtr->firstPtr;
+	cachePtr->firstPtr = cePtr->nextPtr;
+	Tcl_DecrRefCount(cePtr->vbObj);
+	ckfree((char *) cePtr);
+    }
+    Tcl_DeleteHashTable(&cachePtr->table);
+    ckfree((char *) cachePtr);
+    session->cachePtr = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheInfo --
+ *
+ *	This procedure implements the cache session command. It returns
+ *	the counters and the number of entries of the response cache of
+ *	a generator or of the cache of answered requests of a responder,
+ *	or flushes the cache.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The cache is flushed if requested.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheInfo(Tcl_Interp *interp, TnmSnmp *session, int objc, Tcl_Obj *const objv[])
+{
+    Tcl_Obj *listPtr;
+    int entries;
+
+    if (objc == 3 && strcmp(Tcl_GetString(objv[2]), "flush") == 0) {
+	if (session->type == TNM_SNMP_RESPONDER) {
+	    TnmSnmpAgentCacheFlush(session);
+	} else {
+	    CacheFlush(session);
+	}
+	return TCL_OK;
+    }
+    if (objc != 2) {
+	Tcl_WrongNumArgs(interp, 2, objv, "?flush?");
+	return TCL_ERROR;
+    }
+
+    if (session->type == TNM_SNMP_RESPONDER) {
+	entries = TnmSnmpAgentCacheEntries(session);
+    } else {
+	entries = session->cachePtr ? session->cachePtr->table.numEntries : 0;
+    }
+
+    listPtr = Tcl_GetObjResult(interp);
+    Tcl_ListObjAppendElement(interp, listPtr, 
+			     Tcl_NewStringObj("hits", -1));
+    Tcl_ListObjAppendElement(interp, listPtr,
+			     Tcl_NewWideIntObj(session->cacheHits));
+    Tcl_ListObjAppendElement(interp, listPtr, 
+			     Tcl_NewStringObj("misses", -1));
+    Tcl_ListObjAppendElement(interp, listPtr,
+			     Tcl_NewWideIntObj(session->cacheMisses));
+    Tcl_ListObjAppendElement(interp, listPtr, 
+			     Tcl_NewStringObj("entries", -1));
+    Tcl_ListObjAppendElement(interp, listPtr, Tcl_NewIntObj(entries));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheDiscard --
+ *
+ *	This procedure discards the response cache and all undelivered
+ *	cache hits of a session that is going to be destroyed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Idle handlers are cancelled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheDiscard(TnmSnmp *session)
+{
+    CacheToken **ctPtrPtr = &cacheHitList;
+
+    while (*ctPtrPtr && session->cachePending) {
+	if ((*ctPtrPtr)->session == session) {
+	    CacheToken *ctPtr = *ctPtrPtr;
+	    *ctPtrPtr = ctPtr->nextPtr;
+	    session->cachePending--;
+	    Tcl_CancelIdleCall(CacheIdleProc, (ClientData) ctPtr);
+	    CacheTokenFree(ctPtr);
+	} else {
+	    ctPtrPtr = &(*ctPtrPtr)->nextPtr;
+	}
+    }
+    CacheFlush(session);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WalkCheck --
+ *
+ *	This procedure is used to implement MIB walks. It takes
+ *	a list of object identifier values and a varbind list as
+ *	input and checks whether the varbinds are contained in
+ *	the subtrees defined by the object identifier values. This
+ *	procedure also checks whether a syntax value of a varbind
+ *	matches the endOfMibView exception.
+ *
+ * Results:
+ *	A pointer to the varbind list or NULL if the varbind list
+ *	elements are not contained in the subtrees defined by the
+ *	object identifier list.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+WalkCheck(int oidListLen, Tcl_Obj **oidListElems, int vbListLen, Tcl_Obj **vbListElems)
+{
+    int i, code;
+    Tcl_Obj *objPtr;
+
+    /*
+     * Check if all the object identifiers are in the subtree.
+     */
+    
+    for (i = 0; i < oidListLen; i++) {
+	code = Tcl_ListObjIndex(NULL, vbListElems[i], 0, &objPtr);
+	if (code != TCL_OK || !objPtr) {
+	    Tcl_Panic("WalkCheck: no object identifier in varbind list");
+	}
+	code = TnmOidInTree(TnmGetOidFromObj(NULL, oidListElems[i]),
+			    TnmGetOidFromObj(NULL, objPtr));
+	if (! code) {
+	    return NULL;
+	}
+    }
+
+    /*
+     * Check if we got an endOfMibView exception.
+     */
+
+    for (i = 0; i < oidListLen; i++) {
+	code = Tcl_ListObjIndex(NULL, vbListElems[i], 1, &objPtr);
+	if (code != TCL_OK || !objPtr) {
+	    Tcl_Panic("WalkCheck: no syntax in varbind list");
+	}
+	code = TnmGetTableKey(tnmSnmpExceptionTable,
+			      Tcl_GetStringFromObj(objPtr, NULL));
+	if (code == ASN1_END_OF_MIB_VIEW) {
+	    return NULL;
+	}
+    }
+
+    objPtr = Tcl_NewListObj(oidListLen, vbListElems);
+    return objPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AsyncWalkProc --
+ *
+ *	This procedure is called once we have received the response
+ *	during an asynchronous SNMP walk. It evaluates a Tcl script
+ *	and starts another SNMP getnext if we did not reach the end
+ *	of the MIB view.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AsyncWalkProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    AsyncToken *atPtr = (AsyncToken *) clientData;
+    Tcl_Interp *interp = atPtr->interp;
+    Tcl_Obj *vbList, *newList, **vbListElems, **oidListElems;
+    Tcl_Size vbListLen, oidListLen;
+
+    if (! TnmSnmpSessionValid(session)) {
+	goto done;
+    }
+
+#if 0
+    if (pdu->errorStatus == TNM_SNMP_NOSUCHNAME) {
+	pdu->errorStatus = TNM_SNMP_ENDOFWALK;
+	TnmSnmpEvalCallback(interp, session, pdu, 
+			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
+			    NULL, NULL, NULL, NULL);
+	goto done;
+    }
+#endif
+
+    if (pdu->errorStatus != TNM_SNMP_NOERROR) {
+	TnmSnmpEvalCallback(interp, session, pdu, 
+			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
+			    NULL, NULL, NULL, NULL);
+	goto done;
+    }
+
+    vbList = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(vbList);
+    
+    if (Tcl_ListObjGetElements(interp, atPtr->oidList,
+			       &oidListLen, &oidListElems) != TCL_OK) {
+	Tcl_Panic("AsyncWalkProc: failed to split object identifier list");
+    }
+    
+    if (Tcl_ListObjGetElements(interp, vbList,
+			       &vbListLen, &vbListElems) != TCL_OK) {
+	Tcl_Panic("AsyncWalkProc: failed to split varbind list");
+    }
+    
+    newList = WalkCheck(oidListLen, oidListElems, vbListLen, vbListElems);
+    if (! newList) {
+	Tcl_DecrRefCount(vbList);
+	pdu->errorStatus = TNM_SNMP_ENDOFWALK;
+	Tcl_DStringFree(&pdu->varbind);
+	if (pdu->vbList) {
+	    Tcl_DecrRefCount(pdu->vbList);
+	    pdu->vbList = NULL;
+	}
+	TnmSnmpEvalCallback(interp, session, pdu, 
+			    Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
+			    NULL, NULL, NULL, NULL);
+	goto done;
+    }
+    TnmSnmpEvalCallback(interp, session, pdu, 
+			Tcl_GetStringFromObj(atPtr->tclCmd, NULL),
+			NULL, NULL, NULL, NULL);
+    if (pdu->vbList) {
+	Tcl_DStringFree(&pdu->varbind);
+	Tcl_DStringAppend(&pdu->varbind, Tcl_GetString(vbList), -1);
+    }
+    Tcl_DecrRefCount(vbList);
+    pdu->type = ASN1_SNMP_GETNEXT;
+    pdu->requestId = TnmSnmpGetRequestId();
+    (void) TnmSnmpEncode(interp, session, pdu, AsyncWalkProc, 
+			 (ClientData) atPtr);
+    Tcl_DecrRefCount(newList);
+    return;
+
+done:
+    Tcl_DecrRefCount(atPtr->tclCmd);
+    Tcl_DecrRefCount(atPtr->oidList);
+    ckfree((char *) atPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AsyncWalk --
+ *
+ *	This procedure walks a MIB tree. It evaluates the given Tcl
+ *	command foreach varbind retrieved using getbulk requests.
+ *	First, all variables contained in the list argument are
+ *	converted to their OIDs. Then we start an asynchronous loop
+ *	using gebulk requests until we get an error or until one
+ *	returned variable starts with an OID not being a valid prefix.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AsyncWalk(Tcl_Interp *interp, TnmSnmp *session, Tcl_Obj *oidList, Tcl_Obj *tclCmd)
+{
+    TnmSnmpPdu pdu;
+    Tcl_Size i, oidListLen;
+    int result;
+    AsyncToken *atPtr;
+
+    Tcl_Obj **oidListElems;
+    
+    /*
+     * Make sure our argument is a valid Tcl list where every 
+     * element in the list is a valid object identifier.
+     */
+
+    result = Tcl_ListObjGetElements(interp, oidList,
+				    &oidListLen, &oidListElems);
+    if (result != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (oidListLen == 0) {
+	return TCL_OK;
+    }
+
+    for (i = 0; i < oidListLen; i++) {
+	TnmOid *oidPtr = TnmGetOidFromObj(interp, oidListElems[i]);
+	if (! oidPtr) {
+	    return TCL_ERROR;
+	}
+    }
+
+    /*
+     * The structure where we keep all information about this
+     * asynchronous walk.
+     */
+
+    atPtr = (AsyncToken *) ckalloc(sizeof(AsyncToken));
+    atPtr->interp = interp;
+    atPtr->tclCmd = tclCmd;
+    Tcl_IncrRefCount(atPtr->tclCmd);
+    atPtr->oidList = oidList;
+    Tcl_IncrRefCount(atPtr->oidList);
+    atPtr->prefix = 0;
+
+    PduInit(&pdu, session, ASN1_SNMP_GETNEXT);
+    Tcl_DStringAppend(&pdu.varbind, Tcl_GetStringFromObj(oidList, NULL), -1);
+    result = TnmSnmpEncode(interp, session, &pdu, 
+			   AsyncWalkProc, (ClientData) atPtr);
+    if (result != TCL_OK) {
+	Tcl_DecrRefCount(atPtr->tclCmd);
+	Tcl_DecrRefCount(atPtr->oidList);
+	ckfree((char *) atPtr);
+    }
+    PduFree(&pdu);
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SyncWalk --
+ *
+ *	This procedure walks a MIB tree. It evaluates the given Tcl
+ *	command foreach varbind retrieved using getbulk requests.
+ *	First, all variables contained in the list argument are
+ *	converted to their OIDs. Then we loop using gebulk requests
+ *	until we get an error or until one returned variable starts
+ *	with an OID not being a valid prefix.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SyncWalk(Tcl_Interp *interp, TnmSnmp *session, Tcl_Obj *varName, Tcl_Obj *oidList, Tcl_Obj *tclCmd)
+{
+    Tcl_Size i, j, oidListLen, vbListLen;
+    int result;
     TnmSnmpPdu pdu;
     int numRepeaters = 0;
     Tcl_Obj **oidListElems, **vbListElems, *vbList;
 
-    /* 
-     * Set warpFactor and warpLimit variables defined below control
-     * how we increate the numRepeaters parameter while walking the
-     * MIB tree. We currently use the sequence 4 8 12 16 20 ... 48.
-     *
-     * The warpFactor defines the amount used to increase the value on
-     * numRepeaters in every round. The warpLimit defines an upper
-     * limit for numRepeaters. Note, the code below reduces the upper
-     * limit whenever a response is received with contains an
-     * "incomplete row".
-     *
-     * Some measurements show some real interesting effects. If you
-     * increase the warp factor too much, you will risk timeouts
-     * because the agent might need a lot of time to build the
-     * response. If the agent does not cache response packets, you
-     * will get very bad performance once the agents input queue fills
-     * up with retries. Therefore, we have limited the `warp' factor to
-     * 48 which works well with scotty's default parameters on an
-     * Ethernet. (This number should not be hard coded but perhaps it
-     * is better so because everyone should read this comment before
-     * playing with these parameters.)
+    /* 
+     * Set warpFactor and warpLimit variables defined below control
+     * how we increate the numRepeaters parameter while walking the
+     * MIB tree. We currently use the sequence 4 8 12 16 20 ... 48.
+     *
+     * The warpFactor defines the amount used to increase the value on
+     * numRepeaters in every round. The warpLimit defines an upper
+     * limit for numRepeaters. Note, the code below reduces the upper
+     * limit whenever a response is received with contains an
+     * "incomplete row".
+     *
+     * Some measurements show some real interesting effects. If you
+     * increase the warp factor too much, you will risk timeouts
+     * because the agent might need a lot of time to build the
+     * response. If the agent does not cache response packets, you
+     * will get very bad performance once the agents input queue fills
+     * up with retries. Therefore, we have limited the `warp' factor to
+     * 48 which works well with scotty's default parameters on an
+     * Ethernet. (This number should not be hard coded but perhaps it
+     * is better so because everyone should read this comment before
+     * playing with these parameters.)
+     */
+
+    int warpLimit = 48;
+    int warpFactor = 4;
+    
+    /*
+     * Make sure our argument is a valid Tcl list where every 
+     * element in the list is a valid object identifier.
+     */
+
+    result = Tcl_ListObjGetElements(interp, oidList,
+				    &oidListLen, &oidListElems);
+    if (result != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (oidListLen == 0) {
+	return TCL_OK;
+    }
+
+    PduInit(&pdu, session, ASN1_SNMP_GETBULK);
+
+    for (i = 0; i < oidListLen; i++) {
+	TnmOid *oidPtr = TnmGetOidFromObj(interp, oidListElems[i]);
+	if (! oidPtr) {
+	    PduFree(&pdu);
+	    return TCL_ERROR;
+	}
+	Tcl_DStringAppendElement(&pdu.varbind, TnmOidToString(oidPtr));
+    }
+
+    while (1) {
+
+	pdu.type        = ASN1_SNMP_GETBULK;
+	pdu.requestId   = TnmSnmpGetRequestId();
+
+	if (numRepeaters < warpLimit ) {
+	    numRepeaters += warpFactor;
+	}
+
+	pdu.errorStatus = 0;
+	pdu.errorIndex  = (numRepeaters / oidListLen > 0) 
+	    ? numRepeaters / oidListLen : 1;
+
+	result = TnmSnmpEncode(interp, session, &pdu, NULL, NULL);
+	vbList = Tcl_GetObjResult(interp);
+	if (result == TCL_ERROR && pdu.errorStatus == TNM_SNMP_NOSUCHNAME) {
+	    result = TCL_OK;
+	    break;
+	}
+	if (result != TCL_OK) {
+            break;
+        }
+	
+	result = Tcl_ListObjGetElements(interp, vbList,
+					&vbListLen, &vbListElems);
+	if (result != TCL_OK) {
+	    break;
+	}
+
+	if (vbListLen < oidListLen) {
+	    Tcl_SetResult(interp, "response with wrong # of varbinds",
+			  TCL_STATIC);
+	    result = TCL_ERROR;
+	    break;
+	}
+	if (vbListLen % oidListLen) {
+	    /*
+	     * This case is legal according to RFC 1905 when an agent
+	     * truncates the varbind list due to message size
+	     * restrictions.  We handle this case by ignoring the
+	     * trailing varbinds. Otherwise our walk would get out of
+	     * sync. 
+	     */
+	    vbListLen -= vbListLen % oidListLen;
+	    if (warpLimit > 0) {
+		numRepeaters -= warpFactor;
+		warpLimit = numRepeaters;
+	    }
+	}
+
+	Tcl_IncrRefCount(vbList);
+	for (j = 0; j < vbListLen / oidListLen; j++) {
+
+	    Tcl_Obj *newList;
+
+	    newList = WalkCheck(oidListLen, oidListElems, oidListLen,
+			vbListElems + (j * oidListLen));
+	    if (! newList) {
+		Tcl_DecrRefCount(vbList);
+		goto loopDone;
+	    }
+
+	    PduFree(&pdu);
+	    Tcl_DStringAppend(&pdu.varbind, 
+			      Tcl_GetStringFromObj(newList, NULL), -1);
+
+	    if (Tcl_ObjSetVar2(interp, varName, (Tcl_Obj *) NULL,
+			       newList, TCL_LEAVE_ERR_MSG) == NULL) {
+		result = TCL_ERROR;
+		Tcl_DecrRefCount(vbList);
+		Tcl_DecrRefCount(newList);
+		goto loopDone;
+	    }
+
+	    result = Tcl_EvalObj(interp, tclCmd);
+	    if (result != TCL_OK) {
+		if (result == TCL_CONTINUE) {
+		    result = TCL_OK;
+		} else if (result == TCL_BREAK) {
+		    result = TCL_OK;
+		    Tcl_DecrRefCount(vbList);
+		    goto loopDone;
+		} else if (result == TCL_ERROR) {
+		    char msg[100];
+		    sprintf(msg, "\n    (\"%s walk\" body line %d)",
+			    Tcl_GetCommandName(interp, session->token),
+			    Tcl_GetErrorLine(interp));
+		    Tcl_AddErrorInfo(interp, msg);
+		    Tcl_DecrRefCount(vbList);
+		    goto loopDone;
+		} else {
+		    Tcl_DecrRefCount(vbList);
+		    goto loopDone;
+		}
+	    }
+	}
+	Tcl_DecrRefCount(vbList);
+    }
+
+  loopDone:
+    PduFree(&pdu);
+    if (result == TCL_OK) {
+	Tcl_ResetResult(interp);
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalk --
+ *
+ *	This procedure walks a MIB tree and writes every varbind
+ *	retrieved to a Tcl channel. The text format writes one varbind
+ *	per line as a Tcl list containing the object identifier, the
+ *	type and the value. Elements containing newlines are quoted
+ *	with backslashes so that every line is a proper list. The
+ *	binary format writes the same three strings, each preceded by
+ *	its length as a 32 bit integer in network byte order. The walk
+ *	is synchronous unless a script is given, which is evaluated
+ *	once the walk has finished.
+ *
+ * Results:
+ *	A standard Tcl result. The number of varbinds written is left
+ *	in the interpreter after a synchronous walk.
+ *
+ * Side effects:
+ *	Data is written to the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StreamWalk(Tcl_Interp *interp, TnmSnmp *session, int objc, Tcl_Obj *const objv[])
+{
+    WalkStream ws, *wsPtr = &ws;
+    TnmSnmpPdu pdu;
+    Tcl_Size i, oidListLen;
+    Tcl_Obj **oidListElems, *vbList;
+    Tcl_Channel channel;
+    int mode, format = walkText, done = 0, result, idx = 4;
+
+    static const char *formatTable[] = {
+	"text", "binary", (char *) NULL
+    };
+
+    if (objc < 5) {
+	goto wrongArgs;
+    }
+    channel = Tcl_GetChannel(interp, Tcl_GetString(objv[3]), &mode);
+    if (! channel) {
+	return TCL_ERROR;
+    }
+    if (! (mode & TCL_WRITABLE)) {
+	Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[3]),
+			 "\" wasn't opened for writing", (char *) NULL);
+	return TCL_ERROR;
+    }
+    if (strcmp(Tcl_GetString(objv[idx]), "-format") == 0) {
+	if (objc < 7) {
+	    goto wrongArgs;
+	}
+	if (Tcl_GetIndexFromObj(interp, objv[idx+1], formatTable,
+				"format", TCL_EXACT, &format) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	idx += 2;
+    }
+    if (objc - idx < 1 || objc - idx > 2) {
+	goto wrongArgs;
+    }
+
+    /*
+     * Make sure our argument is a valid Tcl list where every 
+     * element in the list is a valid object identifier.
+     */
+
+    if (Tcl_ListObjGetElements(interp, objv[idx],
+			       &oidListLen, &oidListElems) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    for (i = 0; i < oidListLen; i++) {
+	if (! TnmGetOidFromObj(interp, oidListElems[i])) {
+	    return TCL_ERROR;
+	}
+    }
+
+    if (objc - idx == 2) {
+	wsPtr = (WalkStream *) ckalloc(sizeof(WalkStream));
+    }
+    memset((char *) wsPtr, 0, sizeof(WalkStream));
+    wsPtr->interp = interp;
+    wsPtr->session = session;
+    wsPtr->channel = channel;
+    wsPtr->format = format;
+    wsPtr->oidList = objv[idx];
+    Tcl_IncrRefCount(wsPtr->oidList);
+    wsPtr->warpLimit = 48;
+    Tcl_DStringInit(&wsPtr->next);
+    for (i = 0; i < oidListLen; i++) {
+	Tcl_DStringAppendElement(&wsPtr->next,
+		TnmOidToString(TnmGetOidFromObj(interp, oidListElems[i])));
+    }
+
+    if (objc - idx == 2) {
+	wsPtr->tclCmd = objv[idx+1];
+	Tcl_IncrRefCount(wsPtr->tclCmd);
+	Tcl_Preserve((ClientData) session);
+	wsPtr->nextPtr = streamWalkList;
+	streamWalkList = wsPtr;
+	Tcl_CreateCloseHandler(channel, StreamWalkClosed,
+			       (ClientData) wsPtr);
+	if (oidListLen == 0) {
+	    StreamWalkDone(wsPtr, TNM_SNMP_ENDOFWALK);
+	    return TCL_OK;
+	}
+	PduInit(&pdu, session, ASN1_SNMP_GETBULK);
+	StreamWalkRequest(wsPtr, &pdu);
+	result = TnmSnmpEncode(interp, session, &pdu,
+			       StreamWalkProc, (ClientData) wsPtr);
+	PduFree(&pdu);
+	if (result != TCL_OK) {
+	    Tcl_DecrRefCount(wsPtr->tclCmd);
+	    wsPtr->tclCmd = NULL;
+	    StreamWalkDone(wsPtr, TNM_SNMP_GENERR);
+	}
+	return result;
+    }
+
+    result = TCL_OK;
+    PduInit(&pdu, session, ASN1_SNMP_GETBULK);
+    while (oidListLen > 0 && ! done) {
+	StreamWalkRequest(wsPtr, &pdu);
+	result = TnmSnmpEncode(interp, session, &pdu, NULL, NULL);
+	if (result == TCL_ERROR && pdu.errorStatus == TNM_SNMP_NOSUCHNAME) {
+	    result = TCL_OK;
+	    break;
+	}
+	if (result != TCL_OK) {
+	    break;
+	}
+	vbList = Tcl_GetObjResult(interp);
+	Tcl_IncrRefCount(vbList);
+	result = StreamWalkRows(wsPtr, vbList, &done);
+	Tcl_DecrRefCount(vbList);
+	if (result != TCL_OK) {
+	    break;
+	}
+    }
+    PduFree(&pdu);
+
+    if (result == TCL_OK) {
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(wsPtr->rows));
+    }
+    Tcl_DStringFree(&wsPtr->next);
+    Tcl_DecrRefCount(wsPtr->oidList);
+    return result;
+
+ wrongArgs:
+    Tcl_WrongNumArgs(interp, 2, objv,
+	     "-channel channel ?-format format? varBindList ?script?");
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkWrite --
+ *
+ *	This procedure writes a single varbind to the channel of a
+ *	walk in the format selected for the walk.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Data is written to the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StreamWalkWrite(WalkStream *wsPtr, Tcl_Obj *vbPtr)
+{
+    Tcl_Obj **elems;
+    Tcl_Size i, n, len, used;
+    Tcl_DString ds;
+    char *string;
+    int flags, code = 0;
+
+    if (Tcl_ListObjGetElements(NULL, vbPtr, &n, &elems) != TCL_OK
+	|| n < 3) {
+	return TCL_OK;
+    }
+
+    Tcl_DStringInit(&ds);
+    for (i = 0; i < 3; i++) {
+	string = Tcl_GetStringFromObj(elems[i], &len);
+	used = Tcl_DStringLength(&ds);
+	if (wsPtr->format == walkBinary) {
+	    u_char hdr[4];
+	    hdr[0] = (len >> 24) & 0xff;
+	    hdr[1] = (len >> 16) & 0xff;
+	    hdr[2] = (len >> 8) & 0xff;
+	    hdr[3] = len & 0xff;
+	    Tcl_DStringAppend(&ds, (char *) hdr, 4);
+	    Tcl_DStringAppend(&ds, string, len);
+	} else {
+	    len = Tcl_ScanElement(string, &flags);
+	    if (strchr(string, '\n')) {
+		flags |= TCL_DONT_USE_BRACES;
+	    }
+	    Tcl_DStringSetLength(&ds, used + len + 1);
+	    if (i > 0) {
+		Tcl_DStringValue(&ds)[used++] = ' ';
+	    }
+	    len = Tcl_ConvertElement(string, Tcl_DStringValue(&ds) + used,
+				     flags);
+	    Tcl_DStringSetLength(&ds, used + len);
+	}
+    }
+
+    if (wsPtr->format == walkBinary) {
+	code = Tcl_Write(wsPtr->channel, Tcl_DStringValue(&ds),
+			 Tcl_DStringLength(&ds));
+    } else {
+	Tcl_DStringAppend(&ds, "\n", 1);
+	code = Tcl_WriteChars(wsPtr->channel, Tcl_DStringValue(&ds),
+			      Tcl_DStringLength(&ds));
+    }
+    Tcl_DStringFree(&ds);
+
+    if (code < 0) {
+	Tcl_ResetResult(wsPtr->interp);
+	Tcl_AppendResult(wsPtr->interp, "error writing \"",
+			 Tcl_GetChannelName(wsPtr->channel), "\": ",
+			 Tcl_PosixError(wsPtr->interp), (char *) NULL);
+	return TCL_ERROR;
+    }
+    wsPtr->rows++;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkRows --
+ *
+ *	This procedure writes the rows of a getbulk response that
+ *	are contained in the walked subtrees. The varbinds of the
+ *	last row are saved to continue the walk.
+ *
+ * Results:
+ *	A standard Tcl result. The done flag is set if the end of
+ *	the subtrees was reached.
+ *
+ * Side effects:
+ *	Data is written to the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StreamWalkRows(WalkStream *wsPtr, Tcl_Obj *vbList, int *donePtr)
+{
+    Tcl_Size i, j, oidListLen, vbListLen;
+    Tcl_Obj **oidListElems, **vbListElems, *newList;
+    Tcl_Interp *interp = wsPtr->interp;
+
+    if (Tcl_ListObjGetElements(interp, wsPtr->oidList,
+			       &oidListLen, &oidListElems) != TCL_OK
+	|| Tcl_ListObjGetElements(interp, vbList,
+				  &vbListLen, &vbListElems) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    if (vbListLen < oidListLen) {
+	Tcl_SetResult(interp, "response with wrong # of varbinds",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (vbListLen % oidListLen) {
+	/*
+	 * Ignore the trailing varbinds of an incomplete row and
+	 * lower the limit for the number of repetitions (see the
+	 * comment in SyncWalk).
+	 */
+	vbListLen -= vbListLen % oidListLen;
+	if (wsPtr->warpLimit > 0) {
+	    wsPtr->repeaters -= 4;
+	    wsPtr->warpLimit = wsPtr->repeaters;
+	}
+    }
+
+    for (j = 0; j < vbListLen / oidListLen; j++) {
+	newList = WalkCheck(oidListLen, oidListElems, oidListLen,
+			    vbListElems + (j * oidListLen));
+	if (! newList) {
+	    *donePtr = 1;
+	    return TCL_OK;
+	}
+	Tcl_IncrRefCount(newList);
+	for (i = 0; i < oidListLen; i++) {
+	    if (StreamWalkWrite(wsPtr, vbListElems[j * oidListLen + i])
+		!= TCL_OK) {
+		Tcl_DecrRefCount(newList);
+		return TCL_ERROR;
+	    }
+	}
+	Tcl_DStringFree(&wsPtr->next);
+	Tcl_DStringAppend(&wsPtr->next, Tcl_GetString(newList), -1);
+	Tcl_DecrRefCount(newList);
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkRequest --
+ *
+ *	This procedure prepares the getbulk request which retrieves
+ *	the rows following the last row written. The number of
+ *	repetitions grows like in SyncWalk.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The PDU is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkRequest(WalkStream *wsPtr, TnmSnmpPdu *pdu)
+{
+    Tcl_Size oidListLen;
+
+    if (Tcl_ListObjLength(NULL, wsPtr->oidList, &oidListLen) != TCL_OK
+	|| oidListLen == 0) {
+	oidListLen = 1;
+    }
+    if (wsPtr->repeaters < wsPtr->warpLimit) {
+	wsPtr->repeaters += 4;
+    }
+
+    Tcl_DStringFree(&pdu->varbind);
+    Tcl_DStringAppend(&pdu->varbind, Tcl_DStringValue(&wsPtr->next),
+		      Tcl_DStringLength(&wsPtr->next));
+    pdu->type        = ASN1_SNMP_GETBULK;
+    pdu->requestId   = TnmSnmpGetRequestId();
+    pdu->errorStatus = 0;
+    pdu->errorIndex  = (wsPtr->repeaters / oidListLen > 0)
+	? wsPtr->repeaters / oidListLen : 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkNext --
+ *
+ *	This procedure sends the next request of an asynchronous
+ *	walk unless the channel has more than one buffer of output
+ *	pending. In that case, the walk continues once the channel
+ *	becomes writable again.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	A request is sent or a channel handler is created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkNext(WalkStream *wsPtr)
+{
+    TnmSnmpPdu pdu;
+    int code;
+
+    if (Tcl_OutputBuffered(wsPtr->channel)
+	> Tcl_GetChannelBufferSize(wsPtr->channel)) {
+	if (! wsPtr->paused) {
+	    wsPtr->paused = 1;
+	    Tcl_CreateChannelHandler(wsPtr->channel, TCL_WRITABLE,
+				     StreamWalkWritable, (ClientData) wsPtr);
+	}
+	return;
+    }
+    if (wsPtr->paused) {
+	wsPtr->paused = 0;
+	Tcl_DeleteChannelHandler(wsPtr->channel, StreamWalkWritable,
+				 (ClientData) wsPtr);
+    }
+
+    PduInit(&pdu, wsPtr->session, ASN1_SNMP_GETBULK);
+    StreamWalkRequest(wsPtr, &pdu);
+    code = TnmSnmpEncode(wsPtr->interp, wsPtr->session, &pdu,
+			 StreamWalkProc, (ClientData) wsPtr);
+    PduFree(&pdu);
+    if (code != TCL_OK) {
+	Tcl_AddErrorInfo(wsPtr->interp, "\n    (snmp walk event)");
+	Tcl_BackgroundError(wsPtr->interp);
+	StreamWalkDone(wsPtr, TNM_SNMP_GENERR);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkProc --
+ *
+ *	This procedure is called once we have received the response
+ *	during an asynchronous walk to a channel. It writes the rows
+ *	and continues the walk until we reach the end of the
+ *	subtrees or an error occurs.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Data is written to the channel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    WalkStream *wsPtr = (WalkStream *) clientData;
+    Tcl_Obj *vbList;
+    int code, done = 0;
+
+    if (! wsPtr->channel) {
+	StreamWalkDone(wsPtr, TNM_SNMP_GENERR);
+	return;
+    }
+    if (pdu->errorStatus == TNM_SNMP_NOSUCHNAME) {
+	StreamWalkDone(wsPtr, TNM_SNMP_ENDOFWALK);
+	return;
+    }
+    if (pdu->errorStatus != TNM_SNMP_NOERROR) {
+	StreamWalkDone(wsPtr, pdu->errorStatus);
+	return;
+    }
+
+    vbList = TnmSnmpPduVarbinds(pdu);
+    Tcl_IncrRefCount(vbList);
+    code = StreamWalkRows(wsPtr, vbList, &done);
+    Tcl_DecrRefCount(vbList);
+
+    if (code != TCL_OK) {
+	Tcl_AddErrorInfo(wsPtr->interp, "\n    (snmp walk event)");
+	Tcl_BackgroundError(wsPtr->interp);
+	StreamWalkDone(wsPtr, TNM_SNMP_GENERR);
+    } else if (done) {
+	StreamWalkDone(wsPtr, TNM_SNMP_ENDOFWALK);
+    } else {
+	StreamWalkNext(wsPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkWritable --
+ *
+ *	This procedure is called when the channel of a paused walk
+ *	becomes writable.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The walk may continue.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkWritable(ClientData clientData, int mask)
+{
+    StreamWalkNext((WalkStream *) clientData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkClosed --
+ *
+ *	This procedure is called when the channel of an asynchronous
+ *	walk is closed. A paused walk is terminated from an idle
+ *	handler. Otherwise, the walk terminates once the outstanding
+ *	response is received.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkClosed(ClientData clientData)
+{
+    WalkStream *wsPtr = (WalkStream *) clientData;
+
+    wsPtr->channel = NULL;
+    if (wsPtr->paused) {
+	wsPtr->paused = 0;
+	Tcl_DoWhenIdle(StreamWalkAbort, clientData);
+    }
+}
+
+static void
+StreamWalkAbort(ClientData clientData)
+{
+    StreamWalkDone((WalkStream *) clientData, TNM_SNMP_GENERR);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkDone --
+ *
+ *	This procedure finishes an asynchronous walk to a channel.
+ *	The script of the walk is evaluated with the final error
+ *	status, which is endOfWalk if the walk completed.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkDone(WalkStream *wsPtr, int status)
+{
+    TnmSnmp *session = wsPtr->session;
+    WalkStream **wsPtrPtr;
+    TnmSnmpPdu pdu;
+
+    for (wsPtrPtr = &streamWalkList; *wsPtrPtr;
+	 wsPtrPtr = &(*wsPtrPtr)->nextPtr) {
+	if (*wsPtrPtr == wsPtr) {
+	    *wsPtrPtr = wsPtr->nextPtr;
+	    break;
+	}
+    }
+
+    if (wsPtr->channel) {
+	if (wsPtr->paused) {
+	    Tcl_DeleteChannelHandler(wsPtr->channel, StreamWalkWritable,
+				     (ClientData) wsPtr);
+	}
+	Tcl_DeleteCloseHandler(wsPtr->channel, StreamWalkClosed,
+			       (ClientData) wsPtr);
+    }
+
+    if (wsPtr->tclCmd && TnmSnmpSessionValid(session)) {
+	PduInit(&pdu, session, ASN1_SNMP_RESPONSE);
+	pdu.errorStatus = status;
+	TnmSnmpEvalCallback(wsPtr->interp, session, &pdu,
+			    Tcl_GetStringFromObj(wsPtr->tclCmd, NULL),
+			    NULL, NULL, NULL, NULL);
+	PduFree(&pdu);
+    }
+
+    if (wsPtr->tclCmd) {
+	Tcl_DecrRefCount(wsPtr->tclCmd);
+    }
+    Tcl_DecrRefCount(wsPtr->oidList);
+    Tcl_DStringFree(&wsPtr->next);
+    Tcl_Release((ClientData) session);
+    ckfree((char *) wsPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StreamWalkDiscard --
+ *
+ *	This procedure terminates the paused walks of a session that
+ *	is going to be destroyed. Walks waiting for a response are
+ *	terminated when the request is cancelled.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Channel handlers are removed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StreamWalkDiscard(TnmSnmp *session)
+{
+    WalkStream **wsPtrPtr = &streamWalkList;
+
+    while (*wsPtrPtr) {
+	if ((*wsPtrPtr)->session == session && (*wsPtrPtr)->paused) {
+	    StreamWalkDone(*wsPtrPtr, TNM_SNMP_NORESPONSE);
+	} else {
+	    wsPtrPtr = &(*wsPtrPtr)->nextPtr;
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Discover --
+ *
+ *	This procedure discovers the engine ID, the engine boots and
+ *	the engine time for a list of SNMPv3 generator sessions. The
+ *	discovery probes for all sessions are sent at once. Sessions
+ *	which already know the engine ID are not probed. The script
+ *	is evaluated for every probe once it completes. Without a
+ *	script, we wait until all probes are done.
+ *
+ * Results:
+ *	A standard Tcl result. The list of sessions for which the
+ *	discovery failed is left in the interpreter if there is no
+ *	script.
+ *
+ * Side effects:
+ *	Discovery probes are sent and Tcl events are processed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Discover(Tcl_Interp *interp, Tcl_Obj *listPtr, Tcl_Obj *script)
+{
+    Tcl_Size i, objc;
+    Tcl_Obj **objv, *failed;
+    TnmSnmp **sessions, *session;
+    AsyncToken *atPtr;
+    int *ids, code = TCL_OK;
+    Tcl_Size length;
+
+    if (Tcl_ListObjGetElements(interp, listPtr, &objc, &objv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    /*
+     * Check the session list before we send any probes.
+     */
+
+    sessions = (TnmSnmp **) ckalloc(sizeof(TnmSnmp *) * (objc ? objc : 1));
+    for (i = 0; i < objc; i++) {
+	const char *name = Tcl_GetString(objv[i]);
+	session = TnmSnmpFindSession(interp, name);
+	if (! session || session->type != TNM_SNMP_GENERATOR
+	    || session->version != TNM_SNMPv3) {
+	    Tcl_AppendResult(interp, "unknown SNMPv3 generator session \"",
+			     name, "\"", (char *) NULL);
+	    ckfree((char *) sessions);
+	    return TCL_ERROR;
+	}
+	sessions[i] = session;
+    }
+
+    failed = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(failed);
+    ids = (int *) ckalloc(sizeof(int) * (objc ? objc : 1));
+
+    for (i = 0; i < objc; i++) {
+	session = sessions[i];
+	ids[i] = 0;
+	if (TnmGetOctetStringFromObj(NULL, session->engineID, &length)
+	    && length > 0) {
+	    continue;
+	}
+	if (script) {
+	    atPtr = AsyncTokenCreate(interp, script, 0);
+	    code = DiscoverProbe(interp, session, DiscoverProc, 
+				 (ClientData) atPtr);
+	    if (code != TCL_OK) {
+		Tcl_DecrRefCount(atPtr->tclCmd);
+		ckfree((char *) atPtr);
+	    }
+	} else {
+	    code = DiscoverProbe(interp, session, DiscoverSyncProc, 
+				 (ClientData) failed);
+	}
+	if (code != TCL_OK) {
+	    break;
+	}
+	ids[i] = session->discoverId;
+    }
+    ckfree((char *) sessions);
+
+    /*
+     * Wait for the probes to complete. Do not use the session
+     * pointers since sessions may be destroyed while we wait.
+     * A probe which has completed stays completed, so every
+     * probe is waited for only once.
+     */
+
+    if (! script) {
+	for (i = 0; i < objc; i++) {
+	    while (ids[i] && TnmSnmpFindRequest(ids[i])) {
+		Tcl_DoOneEvent(0);
+	    }
+	}
+	if (code == TCL_OK) {
+	    Tcl_SetObjResult(interp, failed);
+	}
+    } else if (code == TCL_OK) {
+	Tcl_ResetResult(interp);
+    }
+
+    ckfree((char *) ids);
+    Tcl_DecrRefCount(failed);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DiscoverProbe --
+ *
+ *	This procedure sends an engine discovery probe for a session.
+ *	The probe is an unauthenticated get request with an empty
+ *	varbind list which is answered by a report PDU carrying the
+ *	engine parameters of the agent (RFC 3414, section 4).
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	A request is queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DiscoverProbe(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpRequestProc *proc, ClientData clientData)
+{
+    TnmSnmpPdu pdu;
+    char securityLevel = session->securityLevel;
+    int code;
+
+    PduInit(&pdu, session, ASN1_SNMP_GET);
+    session->securityLevel = TNM_SNMP_AUTH_NONE | TNM_SNMP_PRIV_NONE;
+    code = TnmSnmpEncode(interp, session, &pdu, proc, clientData);
+    session->securityLevel = securityLevel;
+    if (code == TCL_OK) {
+	session->discoverId = pdu.requestId;
+    }
+    PduFree(&pdu);
+    return code;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DiscoverProc --
+ *
+ *	This procedure is called once an asynchronous discovery probe
+ *	completes. The callback sees the error status noError if the
+ *	engine was discovered.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Arbitrary side effects since commands are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DiscoverProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    if (pdu->type == ASN1_SNMP_REPORT) {
+	pdu->errorStatus = TNM_SNMP_NOERROR;
+	pdu->errorIndex = 0;
+    }
+    ResponseProc(session, pdu, clientData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DiscoverSyncProc --
+ *
+ *	This procedure is called once a discovery probe of a
+ *	synchronous discovery completes. Sessions for which no
+ *	report was received are added to the list of failures.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DiscoverSyncProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    Tcl_Obj *failed = (Tcl_Obj *) clientData;
+
+    if (pdu->type != ASN1_SNMP_REPORT && TnmSnmpSessionValid(session)
+	&& session->token) {
+	Tcl_ListObjAppendElement(NULL, failed, Tcl_NewStringObj(
+		 Tcl_GetCommandName(session->interp, session->token), -1));
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Benchmark --
+ *
+ *	This procedure implements the benchmark command. It creates a
+ *	responder and a generator for every SNMP version on the local
+ *	host and runs a mix of get, getbulk and set operations at the
+ *	requested rate. The encoder and the decoder are exercised on
+ *	both sides since the responder runs in the same process.
+ *
+ * Results:
+ *	A standard Tcl result. The result is a list of name value
+ *	pairs describing throughput, latency and cpu usage.
+ *
+ * Side effects:
+ *	The system group instances are written by set operations
+ *	(with their current values).
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Benchmark(Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Bench bench;
+    TnmSnmp **responders = NULL;
+    Tcl_Obj *versions = NULL, *timeout = NULL, *retries = NULL;
+    Tcl_Obj **elemv, *resultPtr, *latencyPtr;
+    Tcl_Size elemc;
+    Tcl_Time end;
+    clock_t cpu;
+    u_int retransmits = 0, retransmitted = 0;
+    int i, j, port = 16161, varbinds = 4, code = TCL_OK;
+    double elapsed;
+
+    enum options {
+	optCount, optMix, optPort, optRate, optRetries, optTimeout,
+	optVarbinds, optVersions, optWindow
+    } option;
+
+    static const char *optionTable[] = {
+	"-count", "-mix", "-port", "-rate", "-retries", "-timeout",
+	"-varbinds", "-versions", "-window", (char *) NULL
+    };
+
+    static const char *opTable[] = {
+	"get", "getbulk", "set", (char *) NULL
+    };
+
+    /*
+     * The get operations cycle through the scalars of the system
+     * group. The set operations write the writable ones.
+     */
+
+    static char *getOids[] = {
+	"1.3.6.1.2.1.1.1.0", "1.3.6.1.2.1.1.2.0", "1.3.6.1.2.1.1.3.0",
+	"1.3.6.1.2.1.1.4.0", "1.3.6.1.2.1.1.5.0", "1.3.6.1.2.1.1.6.0",
+	"1.3.6.1.2.1.1.7.0"
+    };
+    static char *setOids[] = {
+	"1.3.6.1.2.1.1.4.0", "1.3.6.1.2.1.1.5.0", "1.3.6.1.2.1.1.6.0"
+    };
+    static char *setVars[] = {
+	"sysContact", "sysName", "sysLocation"
+    };
+
+    memset((char *) &bench, 0, sizeof(Bench));
+    bench.interp = interp;
+    bench.count = 1000;
+    bench.window = 16;
+    bench.mix[benchGet] = 8;
+    bench.mix[benchGetBulk] = 1;
+    bench.mix[benchSet] = 1;
+    for (i = 0; i < benchOps; i++) {
+	Tcl_DStringInit(&bench.vbl[i]);
+    }
+
+    if (objc % 2) {
+	Tcl_WrongNumArgs(interp, 2, objv, "?option value ...?");
+	code = TCL_ERROR;
+	goto done;
+    }
+
+    for (i = 2; i < objc; i += 2) {
+	code = Tcl_GetIndexFromObj(interp, objv[i], optionTable,
+				   "option", TCL_EXACT, (int *) &option);
+	if (code != TCL_OK) {
+	    goto done;
+	}
+	switch (option) {
+	case optCount:
+	    code = TnmGetPositiveFromObj(interp, objv[i+1], &bench.count);
+	    break;
+	case optMix:
+	    code = Tcl_ListObjGetElements(interp, objv[i+1], &elemc, &elemv);
+	    if (code == TCL_OK && elemc % 2) {
+		Tcl_SetResult(interp,
+			      "mix must be a list of operations and weights",
+			      TCL_STATIC);
+		code = TCL_ERROR;
+	    }
+	    memset((char *) bench.mix, 0, sizeof(bench.mix));
+	    for (j = 0; code == TCL_OK && j < elemc; j += 2) {
+		int op;
+		code = Tcl_GetIndexFromObj(interp, elemv[j], opTable,
+					   "operation", TCL_EXACT, &op);
+		if (code == TCL_OK) {
+		    code = TnmGetUnsignedFromObj(interp, elemv[j+1],
+						 &bench.mix[op]);
+		}
+	    }
+	    break;
+	case optPort:
+	    code = TnmGetPositiveFromObj(interp, objv[i+1], &port);
+	    if (code == TCL_OK && port > 65535) {
+		Tcl_SetResult(interp, "invalid port number", TCL_STATIC);
+		code = TCL_ERROR;
+	    }
+	    break;
+	case optRate:
+	    code = TnmGetUnsignedFromObj(interp, objv[i+1], &bench.rate);
+	    break;
+	case optRetries:
+	    retries = objv[i+1];
+	    break;
+	case optTimeout:
+	    timeout = objv[i+1];
+	    break;
+	case optVarbinds:
+	    code = TnmGetPositiveFromObj(interp, objv[i+1], &varbinds);
+	    break;
+	case optVersions:
+	    versions = objv[i+1];
+	    break;
+	case optWindow:
+	    code = TnmGetPositiveFromObj(interp, objv[i+1], &bench.window);
+	    break;
+	}
+	if (code != TCL_OK) {
+	    goto done;
+	}
+    }
+
+    for (i = 0; i < benchOps; i++) {
+	bench.weight += bench.mix[i];
+    }
+    if (bench.weight == 0) {
+	Tcl_SetResult(interp, "empty operation mix", TCL_STATIC);
+	code = TCL_ERROR;
+	goto done;
+    }
+
+    if (versions) {
+	code = Tcl_ListObjGetElements(interp, versions, &elemc, &elemv);
+	if (code != TCL_OK) {
+	    goto done;
+	}
+    } else {
+	versions = Tcl_NewStringObj("SNMPv2c", -1);
+	elemc = 1;
+	elemv = &versions;
+    }
+    Tcl_IncrRefCount(versions);
+    if (elemc == 0) {
+	Tcl_SetResult(interp, "no SNMP version given", TCL_STATIC);
+	code = TCL_ERROR;
+	goto done;
+    }
+    for (i = 0; i < elemc; i++) {
+	if (TnmGetTableKeyFromObj(interp, tnmSnmpVersionTable,
+				  elemv[i], "SNMP version") < 0) {
+	    code = TCL_ERROR;
+	    goto done;
+	}
+    }
+
+    /*
+     * Create the sessions. Only one responder is created for every
+     * version since all responders share the same port.
+     */
+
+    if (TnmMibLoad(interp) != TCL_OK) {
+	code = TCL_ERROR;
+	goto done;
+    }
+    bench.sessions = (TnmSnmp **) ckalloc(elemc * sizeof(TnmSnmp *));
+    responders = (TnmSnmp **) ckalloc(elemc * sizeof(TnmSnmp *));
+    memset((char *) bench.sessions, 0, elemc * sizeof(TnmSnmp *));
+    memset((char *) responders, 0, elemc * sizeof(TnmSnmp *));
+    bench.numSessions = elemc;
+    for (i = 0; i < elemc; i++) {
+	for (j = 0; j < i; j++) {
+	    if (strcmp(Tcl_GetString(elemv[i]),
+		       Tcl_GetString(elemv[j])) == 0) break;
+	}
+	if (j == i) {
+	    responders[i] = BenchSession(interp, TNM_SNMP_RESPONDER, port,
+					 elemv[i], NULL, NULL);
+	    if (! responders[i]) {
+		code = TCL_ERROR;
+		goto done;
+	    }
+	}
+	bench.sessions[i] = BenchSession(interp, TNM_SNMP_GENERATOR, port,
+					 elemv[i], timeout, retries);
+	if (! bench.sessions[i]) {
+	    code = TCL_ERROR;
+	    goto done;
+	}
+    }
+
+    /*
+     * Prepare the varbind lists. The set operations write the
+     * current values back so that the benchmark has no visible
+     * side effects on the system group.
      */
 
-    int warpLimit = 48;
-    int warpFactor = 4;
-    
+    for (i = 0; i < varbinds; i++) {
+	Tcl_DStringAppendElement(&bench.vbl[benchGet], 
+			 getOids[i % (sizeof(getOids) / sizeof(char *))]);
+    }
+    for (i = 0; i < varbinds && i < 3; i++) {
+	const char *value = Tcl_GetVar2(interp, "tnm_system", setVars[i],
+					TCL_GLOBAL_ONLY);
+	Tcl_DStringStartSublist(&bench.vbl[benchSet]);
+	Tcl_DStringAppendElement(&bench.vbl[benchSet], setOids[i]);
+	Tcl_DStringAppendElement(&bench.vbl[benchSet], "OCTET STRING");
+	Tcl_DStringAppendElement(&bench.vbl[benchSet], value ? value : "");
+	Tcl_DStringEndSublist(&bench.vbl[benchSet]);
+    }
+    Tcl_DStringAppendElement(&bench.vbl[benchGetBulk], "1.3.6.1.2.1.1");
+    bench.maxReps = varbinds;
+
     /*
-     * Make sure our argument is a valid Tcl list where every 
-     * element in the list is a valid object identifier.
+     * Run the operations and wait until all of them are finished.
      */
 
-    result = Tcl_ListObjGetElements(interp, oidList,
-				    &oidListLen, &oidListElems);
-    if (result != TCL_OK) {
-	return TCL_ERROR;
+    for (i = 0; i < bench.numSessions; i++) {
+	retransmits += bench.sessions[i]->retransmits;
     }
-    if (oidListLen == 0) {
-	return TCL_OK;
+    bench.maxSamples = bench.count;
+    bench.samples = (double *) ckalloc(bench.maxSamples * sizeof(double));
+    cpu = clock();
+    Tcl_GetTime(&bench.start);
+
+    BenchFill(&bench);
+    while (bench.active > 0
+	   || (bench.code == TCL_OK && bench.started < bench.count)) {
+	Tcl_DoOneEvent(0);
+    }
+    if (bench.timer) {
+	Tcl_DeleteTimerHandler(bench.timer);
+	bench.timer = NULL;
     }
 
-    PduInit(&pdu, session, ASN1_SNMP_GETBULK);
+    Tcl_GetTime(&end);
+    cpu = clock() - cpu;
+    for (i = 0; i < bench.numSessions; i++) {
+	retransmitted += bench.sessions[i]->retransmits;
+    }
+    retransmitted -= retransmits;
 
-    for (i = 0; i < oidListLen; i++) {
-	TnmOid *oidPtr = TnmGetOidFromObj(interp, oidListElems[i]);
-	if (! oidPtr) {
-	    PduFree(&pdu);
-	    return TCL_ERROR;
+    if (bench.code != TCL_OK) {
+	Tcl_SetObjResult(interp, bench.errorPtr);
+	code = TCL_ERROR;
+	goto done;
+    }
+
+    elapsed = (end.sec - bench.start.sec) * 1000.0
+	+ (end.usec - bench.start.usec) / 1000.0;
+    qsort((char *) bench.samples, (size_t) bench.numSamples, 
+	  sizeof(double), BenchCompare);
+
+    latencyPtr = Tcl_NewListObj(0, NULL);
+    if (bench.numSamples) {
+	static const char *names[] = { "min", "p50", "p90", "p99", "max" };
+	static const double ranks[] = { 0.0, 0.50, 0.90, 0.99, 1.0 };
+	for (i = 0; i < 5; i++) {
+	    j = (int) (ranks[i] * bench.numSamples + 0.5) - 1;
+	    if (j < 0) j = 0;
+	    Tcl_ListObjAppendElement(NULL, latencyPtr,
+				     Tcl_NewStringObj(names[i], -1));
+	    Tcl_ListObjAppendElement(NULL, latencyPtr,
+				     Tcl_NewDoubleObj(bench.samples[j]));
 	}
-	Tcl_DStringAppendElement(&pdu.varbind, TnmOidToString(oidPtr));
     }
 
-    while (1) {
+    resultPtr = Tcl_GetObjResult(interp);
+    Tcl_ResetResult(interp);
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("operations", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewIntObj(bench.started));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("requests", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewWideIntObj(bench.requests));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("responses", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewWideIntObj(bench.responses));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("errors", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewWideIntObj(bench.errors));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("timeouts", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewWideIntObj(bench.timeouts));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("retransmissions", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewWideIntObj(retransmitted));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("elapsed", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewDoubleObj(elapsed));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("throughput", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewDoubleObj(
+	elapsed > 0 ? bench.requests * 1000.0 / elapsed : 0.0));
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("latency", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, latencyPtr);
+    Tcl_ListObjAppendElement(NULL, resultPtr,
+			     Tcl_NewStringObj("cpu", -1));
+    Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewDoubleObj(
+	bench.requests ? (cpu * 1000000.0 / CLOCKS_PER_SEC) / bench.requests
+	: 0.0));
+
+  done:
+    for (i = 0; i < bench.numSessions; i++) {
+	if (bench.sessions[i] && bench.sessions[i]->token) {
+	    Tcl_DeleteCommandFromToken(interp, bench.sessions[i]->token);
+	}
+	if (responders[i] && responders[i]->token) {
+	    Tcl_DeleteCommandFromToken(interp, responders[i]->token);
+	}
+    }
+    if (bench.sessions) ckfree((char *) bench.sessions);
+    if (responders) ckfree((char *) responders);
+    if (bench.samples) ckfree((char *) bench.samples);
+    if (bench.errorPtr) Tcl_DecrRefCount(bench.errorPtr);
+    if (versions) Tcl_DecrRefCount(versions);
+    for (i = 0; i < benchOps; i++) {
+	Tcl_DStringFree(&bench.vbl[i]);
+    }
+    return code;
+}
 
-	pdu.type        = ASN1_SNMP_GETBULK;
-	pdu.requestId   = TnmSnmpGetRequestId();
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchSession --
+ *
+ *	This procedure creates a responder or a generator session for
+ *	the benchmark command. SNMPv3 sessions use a fixed user and
+ *	engine identifier so that no engine discovery is needed.
+ *
+ * Results:
+ *	A pointer to the new session or NULL if the session could not
+ *	be created. An error message is left in the interpreter.
+ *
+ * Side effects:
+ *	A new session command is created.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	if (numRepeaters < warpLimit ) {
-	    numRepeaters += warpFactor;
-	}
+static TnmSnmp*
+BenchSession(Tcl_Interp *interp, int type, int port, Tcl_Obj *version, Tcl_Obj *timeout, Tcl_Obj *retries)
+{
+    Tcl_Obj *objv[20];
+    Tcl_CmdInfo info;
+    TnmSnmp *session = NULL;
+    int i, objc = 0;
+
+    objv[objc++] = Tcl_NewStringObj("snmp", -1);
+    objv[objc++] = Tcl_NewStringObj(type == TNM_SNMP_RESPONDER
+				    ? "responder" : "generator", -1);
+    if (type == TNM_SNMP_GENERATOR) {
+	objv[objc++] = Tcl_NewStringObj("-address", -1);
+	objv[objc++] = Tcl_NewStringObj("127.0.0.1", -1);
+    }
+    objv[objc++] = Tcl_NewStringObj("-port", -1);
+    objv[objc++] = Tcl_NewIntObj(port);
+    objv[objc++] = Tcl_NewStringObj("-version", -1);
+    objv[objc++] = version;
+    if (strcmp(Tcl_GetString(version), "SNMPv3") == 0) {
+	objv[objc++] = Tcl_NewStringObj("-user", -1);
+	objv[objc++] = Tcl_NewStringObj("tnm", -1);
+	objv[objc++] = Tcl_NewStringObj("-engineID", -1);
+	objv[objc++] = Tcl_NewStringObj("80:00:1F:88:04:74:6E:6D", -1);
+    }
+    if (timeout) {
+	objv[objc++] = Tcl_NewStringObj("-timeout", -1);
+	objv[objc++] = timeout;
+    }
+    if (retries) {
+	objv[objc++] = Tcl_NewStringObj("-retries", -1);
+	objv[objc++] = retries;
+    }
 
-	pdu.errorStatus = 0;
-	pdu.errorIndex  = (numRepeaters / oidListLen > 0) 
-	    ? numRepeaters / oidListLen : 1;
+    for (i = 0; i < objc; i++) {
+	Tcl_IncrRefCount(objv[i]);
+    }
+    if (Tnm_SnmpObjCmd(NULL, interp, objc, objv) == TCL_OK
+	&& Tcl_GetCommandInfo(interp, Tcl_GetStringResult(interp), &info)) {
+	session = (TnmSnmp *) info.objClientData;
+    }
+    for (i = 0; i < objc; i++) {
+	Tcl_DecrRefCount(objv[i]);
+    }
+    return session;
+}
 
-	result = TnmSnmpEncode(interp, session, &pdu, NULL, NULL);
-	vbList = Tcl_GetObjResult(interp);
-	if (result == TCL_ERROR && pdu.errorStatus == TNM_SNMP_NOSUCHNAME) {
-	    result = TCL_OK;
-	    break;
-	}
-	if (result != TCL_OK) {
-            break;
-        }
-	
-	result = Tcl_ListObjGetElements(interp, vbList,
-					&vbListLen, &vbListElems);
-	if (result != TCL_OK) {
-	    break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchFill --
+ *
+ *	This procedure starts as many operations as the window and
+ *	the rate of a benchmark run allow. The operations are taken
+ *	from the mix in a fixed order so that runs are reproducible.
+ *	Every generator runs the complete mix in turn.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Requests are sent and a timer may be created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BenchFill(Bench *benchPtr)
+{
+    BenchOp *opPtr;
+    Tcl_Time now;
+    double elapsed = 0;
+    int n, op, limit = benchPtr->count;
+
+    if (benchPtr->code != TCL_OK) {
+	return;
+    }
+
+    if (benchPtr->rate > 0) {
+	Tcl_GetTime(&now);
+	elapsed = (now.sec - benchPtr->start.sec) * 1000.0
+	    + (now.usec - benchPtr->start.usec) / 1000.0;
+	n = (int) (elapsed * benchPtr->rate / 1000.0) + 1;
+	if (n < limit) {
+	    limit = n;
 	}
+    }
 
-	if (vbListLen < oidListLen) {
-	    Tcl_SetResult(interp, "response with wrong # of varbinds",
-			  TCL_STATIC);
-	    result = TCL_ERROR;
+    while (benchPtr->started < limit 
+	   && benchPtr->active < benchPtr->window) {
+	n = benchPtr->started++;
+	for (op = 0, n %= benchPtr->weight; n >= benchPtr->mix[op]; op++) {
+	    n -= benchPtr->mix[op];
+	}
+	opPtr = (BenchOp *) ckalloc(sizeof(BenchOp));
+	opPtr->benchPtr = benchPtr;
+	opPtr->op = op;
+	opPtr->session = benchPtr->sessions[((benchPtr->started - 1) 
+		 / benchPtr->weight) % benchPtr->numSessions];
+	switch (op) {
+	case benchGet:
+	    opPtr->type = ASN1_SNMP_GET;
+	    break;
+	case benchGetBulk:
+	    opPtr->type = (opPtr->session->version == TNM_SNMPv1)
+		? ASN1_SNMP_GETNEXT : ASN1_SNMP_GETBULK;
+	    break;
+	case benchSet:
+	    opPtr->type = ASN1_SNMP_SET;
 	    break;
 	}
-	if (vbListLen % oidListLen) {
-	    /*
-	     * This case is legal according to RFC 1905 when an agent
-	     * truncates the varbind list due to message size
-	     * restrictions.  We handle this case by ignoring the
-	     * trailing varbinds. Otherwise our walk would get out of
-	     * sync. 
-	     */
-	    vbListLen -= vbListLen % oidListLen;
-	    if (warpLimit > 0) {
-		numRepeaters -= warpFactor;
-		warpLimit = numRepeaters;
-	    }
+	benchPtr->active++;
+	BenchSend(opPtr, Tcl_DStringValue(&benchPtr->vbl[op]));
+	if (benchPtr->code != TCL_OK) {
+	    return;
 	}
+    }
 
-	Tcl_IncrRefCount(vbList);
-	for (j = 0; j < vbListLen / oidListLen; j++) {
+    if (benchPtr->rate > 0 && ! benchPtr->timer
+	&& benchPtr->started < benchPtr->count
+	&& benchPtr->active < benchPtr->window) {
+	n = (int) (benchPtr->started * 1000.0 / benchPtr->rate - elapsed);
+	benchPtr->timer = Tcl_CreateTimerHandler(n > 0 ? n : 1, 
+				 BenchTimerProc, (ClientData) benchPtr);
+    }
+}
 
-	    Tcl_Obj *newList;
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchSend --
+ *
+ *	This procedure sends the next request of a benchmark
+ *	operation.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The operation is released and the error is saved in the
+ *	benchmark record if the request can not be sent.
+ *
+ *----------------------------------------------------------------------
+ */
 
-	    newList = WalkCheck(oidListLen, oidListElems, oidListLen,
-			vbListElems + (j * oidListLen));
-	    if (! newList) {
-		Tcl_DecrRefCount(vbList);
-		goto loopDone;
-	    }
+static void
+BenchSend(BenchOp *opPtr, const char *vbl)
+{
+    Bench *benchPtr = opPtr->benchPtr;
+    TnmSnmpPdu pdu;
+    int code;
 
-	    PduFree(&pdu);
-	    Tcl_DStringAppend(&pdu.varbind, 
-			      Tcl_GetStringFromObj(newList, NULL), -1);
+    PduInit(&pdu, opPtr->session, opPtr->type);
+    if (opPtr->type == ASN1_SNMP_GETBULK) {
+	pdu.errorStatus = 0;
+	pdu.errorIndex = benchPtr->maxReps;
+    }
+    Tcl_DStringAppend(&pdu.varbind, vbl, -1);
+    Tcl_GetTime(&opPtr->sent);
+    code = TnmSnmpEncode(benchPtr->interp, opPtr->session, &pdu, 
+			 BenchProc, (ClientData) opPtr);
+    PduFree(&pdu);
 
-	    if (Tcl_ObjSetVar2(interp, varName, (Tcl_Obj *) NULL,
-			       newList, TCL_LEAVE_ERR_MSG) == NULL) {
-		result = TCL_ERROR;
-		Tcl_DecrRefCount(vbList);
-		Tcl_DecrRefCount(newList);
-		goto loopDone;
-	    }
+    if (code != TCL_OK) {
+	benchPtr->code = code;
+	benchPtr->errorPtr = Tcl_GetObjResult(benchPtr->interp);
+	Tcl_IncrRefCount(benchPtr->errorPtr);
+	benchPtr->active--;
+	ckfree((char *) opPtr);
+	return;
+    }
+    benchPtr->requests++;
+}
 
-	    result = Tcl_EvalObj(interp, tclCmd);
-	    if (result != TCL_OK) {
-		if (result == TCL_CONTINUE) {
-		    result = TCL_OK;
-		} else if (result == TCL_BREAK) {
-		    result = TCL_OK;
-		    Tcl_DecrRefCount(vbList);
-		    goto loopDone;
-		} else if (result == TCL_ERROR) {
-		    char msg[100];
-		    sprintf(msg, "\n    (\"%s walk\" body line %d)",
-			    Tcl_GetCommandName(interp, session->token),
-			    Tcl_GetErrorLine(interp));
-		    Tcl_AddErrorInfo(interp, msg);
-		    Tcl_DecrRefCount(vbList);
-		    goto loopDone;
-		} else {
-		    Tcl_DecrRefCount(vbList);
-		    goto loopDone;
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchProc --
+ *
+ *	This procedure is called once a benchmark request completes.
+ *	It records the round trip time and continues a getbulk walk
+ *	until the walk leaves the system group.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	New requests may be sent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BenchProc(TnmSnmp *session, TnmSnmpPdu *pdu, ClientData clientData)
+{
+    BenchOp *opPtr = (BenchOp *) clientData;
+    Bench *benchPtr = opPtr->benchPtr;
+    Tcl_Time now;
+
+    if (! TnmSnmpSessionValid(session)) {
+	benchPtr->active--;
+	ckfree((char *) opPtr);
+	return;
+    }
+
+    Tcl_GetTime(&now);
+    if (benchPtr->numSamples == benchPtr->maxSamples) {
+	benchPtr->maxSamples *= 2;
+	benchPtr->samples = (double *) ckrealloc((char *) benchPtr->samples,
+				 benchPtr->maxSamples * sizeof(double));
+    }
+    benchPtr->samples[benchPtr->numSamples++] = 
+	(now.sec - opPtr->sent.sec) * 1000000.0 
+	+ (now.usec - opPtr->sent.usec);
+
+    if (pdu->errorStatus == TNM_SNMP_NORESPONSE) {
+	benchPtr->timeouts++;
+    } else {
+	benchPtr->responses++;
+	if (pdu->errorStatus != TNM_SNMP_NOERROR) {
+	    benchPtr->errors++;
+	} else if (opPtr->op == benchGetBulk) {
+	    Tcl_Size argc, vbc;
+	    Tcl_Obj *vbList, **argv, **vbv;
+	    int more = 0;
+	    Tcl_DString ds;
+
+	    Tcl_DStringInit(&ds);
+	    vbList = TnmSnmpPduVarbinds(pdu);
+	    Tcl_IncrRefCount(vbList);
+	    if (Tcl_ListObjGetElements(NULL, vbList, &argc, &argv) == TCL_OK) {
+		if (argc > 0 && Tcl_ListObjGetElements(NULL, argv[argc-1], 
+					      &vbc, &vbv) == TCL_OK) {
+		    more = (vbc > 1 
+			    && strncmp(Tcl_GetString(vbv[0]),
+				       "1.3.6.1.2.1.1.", 14) == 0
+			    && TnmGetTableKey(tnmSnmpExceptionTable, 
+					      Tcl_GetString(vbv[1])) < 0);
+		    if (more) {
+			Tcl_DStringAppendElement(&ds, Tcl_GetString(vbv[0]));
+		    }
 		}
 	    }
+	    Tcl_DecrRefCount(vbList);
+	    if (more) {
+		BenchSend(opPtr, Tcl_DStringValue(&ds));
+		Tcl_DStringFree(&ds);
+		return;
+	    }
+	    Tcl_DStringFree(&ds);
 	}
-	Tcl_DecrRefCount(vbList);
     }
 
-  loopDone:
-    PduFree(&pdu);
-    if (result == TCL_OK) {
-	Tcl_ResetResult(interp);
-    }
-    return result;
+    benchPtr->active--;
+    ckfree((char *) opPtr);
+    BenchFill(benchPtr);
 }
-
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchTimerProc --
+ *
+ *	This procedure is called by the timer which paces a benchmark
+ *	run with a rate.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	New operations may be started.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+BenchTimerProc(ClientData clientData)
+{
+    Bench *benchPtr = (Bench *) clientData;
+
+    benchPtr->timer = NULL;
+    BenchFill(benchPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BenchCompare --
+ *
+ *	This procedure compares two round trip times for qsort().
+ *
+ * Results:
+ *	The usual qsort() result.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BenchCompare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -3053,6 +6276,7 @@ Table(Tcl_Interp *interp, TnmSnmp *session, char *table, char *arrayName)
     pdu->errorIndex  = 0;    
     pdu->trapOID     = NULL;
     Tcl_DStringInit(&pdu->varbind);
+    pdu->vbList = NULL;
     Tcl_DStringInit(&varList);
 
     /*
@@ -3221,6 +6445,7 @@ Scalars(Tcl_Interp *interp, TnmSnmp *session, char *group, char *arrayName)
     pdu->errorIndex  = 0;    
     pdu->trapOID     = NULL;
     Tcl_DStringInit(&pdu->varbind);
+    pdu->vbList = NULL;
     Tcl_DStringInit(&varList);
     Tcl_DStringInit(&result);
 
@@ -3281,6 +6506,7 @@ Scalars(Tcl_Interp *interp, TnmSnmp *session, char *group, char *arrayName)
 	pdu->errorStatus = TNM_SNMP_NOERROR;
 	pdu->errorIndex  = 0;    
 	Tcl_DStringInit(&pdu->varbind);
+	pdu->vbList = NULL;
 	Tcl_DStringAppend(&pdu->varbind, largv[i], -1);
 
 	code = TnmSnmpEncode(interp, session, pdu, NULL, NULL);
@@ -21,6 +21,8 @@
 #include "tnmMib.h"
 #include "tnmMD5.h"
 #include "tnmSHA.h"
+#include "tnmSHA2.h"
+#include "tnmAES.h"
 
 /*
  * The table of known SNMP security levels.
@@ -31,58 +33,184 @@ TnmTable tnmSnmpSecurityLevelTable[] =
     { TNM_SNMP_AUTH_NONE | TNM_SNMP_PRIV_NONE,	"noAuth/noPriv" },
     { TNM_SNMP_AUTH_MD5  | TNM_SNMP_PRIV_NONE,	"md5/noPriv" },
     { TNM_SNMP_AUTH_MD5  | TNM_SNMP_PRIV_DES,	"md5/des" },
+    { TNM_SNMP_AUTH_MD5  | TNM_SNMP_PRIV_AES,	"md5/aes" },
+    { TNM_SNMP_AUTH_MD5  | TNM_SNMP_PRIV_AES192,	"md5/aes192" },
+    { TNM_SNMP_AUTH_MD5  | TNM_SNMP_PRIV_AES256,	"md5/aes256" },
     { TNM_SNMP_AUTH_SHA  | TNM_SNMP_PRIV_NONE,	"sha/noPriv" },
     { TNM_SNMP_AUTH_SHA  | TNM_SNMP_PRIV_DES,	"sha/des" },
+    { TNM_SNMP_AUTH_SHA  | TNM_SNMP_PRIV_AES,	"sha/aes" },
+    { TNM_SNMP_AUTH_SHA  | TNM_SNMP_PRIV_AES192,	"sha/aes192" },
+    { TNM_SNMP_AUTH_SHA  | TNM_SNMP_PRIV_AES256,	"sha/aes256" },
+    { TNM_SNMP_AUTH_SHA224 | TNM_SNMP_PRIV_NONE,	"sha224/noPriv" },
+    { TNM_SNMP_AUTH_SHA224 | TNM_SNMP_PRIV_AES,	"sha224/aes" },
+    { TNM_SNMP_AUTH_SHA224 | TNM_SNMP_PRIV_AES192,	"sha224/aes192" },
+    { TNM_SNMP_AUTH_SHA224 | TNM_SNMP_PRIV_AES256,	"sha224/aes256" },
+    { TNM_SNMP_AUTH_SHA256 | TNM_SNMP_PRIV_NONE,	"sha256/noPriv" },
+    { TNM_SNMP_AUTH_SHA256 | TNM_SNMP_PRIV_AES,	"sha256/aes" },
+    { TNM_SNMP_AUTH_SHA256 | TNM_SNMP_PRIV_AES192,	"sha256/aes192" },
+    { TNM_SNMP_AUTH_SHA256 | TNM_SNMP_PRIV_AES256,	"sha256/aes256" },
+    { TNM_SNMP_AUTH_SHA384 | TNM_SNMP_PRIV_NONE,	"sha384/noPriv" },
+    { TNM_SNMP_AUTH_SHA384 | TNM_SNMP_PRIV_AES,	"sha384/aes" },
+    { TNM_SNMP_AUTH_SHA384 | TNM_SNMP_PRIV_AES192,	"sha384/aes192" },
+    { TNM_SNMP_AUTH_SHA384 | TNM_SNMP_PRIV_AES256,	"sha384/aes256" },
+    { TNM_SNMP_AUTH_SHA512 | TNM_SNMP_PRIV_NONE,	"sha512/noPriv" },
+    { TNM_SNMP_AUTH_SHA512 | TNM_SNMP_PRIV_AES,	"sha512/aes" },
+    { TNM_SNMP_AUTH_SHA512 | TNM_SNMP_PRIV_AES192,	"sha512/aes192" },
+    { TNM_SNMP_AUTH_SHA512 | TNM_SNMP_PRIV_AES256,	"sha512/aes256" },
     { 0, NULL }
 };
 
 /*
- * The following structures and procedures are used to keep a list of
- * keys that were computed with the SNMPv3 password to key algorithm.
- * This cache is needed so that identical sessions don't suffer from
- * repeated slow computations of authentication keys.
+ * The following table describes the hash functions of the supported
+ * authentication protocols. The localized keys are as long as the
+ * digest while the HMAC is truncated to macLength bytes (RFC 3414
+ * and RFC 7860).
  */
 
-typedef struct KeyCache {
-    Tcl_Obj *password;
-    Tcl_Obj *engineID;
-    Tcl_Obj *key;
-    int algorithm;
-    struct KeyCache *nextPtr;
-} KeyCache;
+typedef struct UsmHash {
+    int algorithm;		/* The authentication algorithm. */
+    int keyLength;		/* The length of the digest and the keys. */
+    int macLength;		/* The length of the truncated HMAC. */
+    int blockSize;		/* The block size of the hash function. */
+} UsmHash;
+
+static UsmHash usmHashTable[] = {
+    { TNM_SNMP_AUTH_MD5,	16, 12,  64 },
+    { TNM_SNMP_AUTH_SHA,	20, 12,  64 },
+    { TNM_SNMP_AUTH_SHA224,	28, 16,  64 },
+    { TNM_SNMP_AUTH_SHA256,	32, 24,  64 },
+    { TNM_SNMP_AUTH_SHA384,	48, 32, 128 },
+    { TNM_SNMP_AUTH_SHA512,	64, 48, 128 },
+    { 0, 0, 0, 0 }
+};
+
+#define USM_MAX_KEY	64
+#define USM_MAX_BLOCK	128
+
+typedef union HashCtx {
+    MD5_CTX md5;
+    SHA_CTX sha;
+    SHA256_CTX sha256;
+    SHA512_CTX sha512;
+} HashCtx;
+
+/*
+ * The following hash table keeps the keys that were computed with
+ * the SNMPv3 password to key algorithm before localization. The key
+ * of the hash table is the algorithm followed by the password. This
+ * cache is needed so that sessions using the same password don't
+ * suffer from repeated slow computations of authentication keys. The
+ * localization of the cached key for an engine ID is cheap.
+ */
+
+static Tcl_HashTable keyTable;
+static int keyTableInitialized = 0;
+
+/*
+ * The following structure is used to remember the engine ID, the
+ * engine boots and the engine time discovered for an agent address.
+ * New sessions talking to a known agent take these values from the
+ * cache instead of doing the discovery again. The engine time is
+ * extrapolated using the local time when the entry was updated.
+ */
+
+typedef struct EngineCache {
+    Tcl_Obj *engineID;		/* The engine ID of the agent. */
+    int engineBoots;		/* The number of boots of the agent. */
+    int engineTime;		/* The engine time of the agent... */
+    time_t stamp;		/* ...at this local time. */
+} EngineCache;
+
+static Tcl_HashTable engineTable;
+static int engineTableInitialized = 0;
+
+/*
+ * The following structure keeps the keyed inner and outer hash
+ * contexts of the HMAC computation (RFC 2104) for the localized
+ * authentication key of a session. Every authenticated message
+ * starts from a copy of these contexts which saves hashing the
+ * padded key twice per message. The contexts are recomputed when
+ * the key or the algorithm of the session changes.
+ */
+
+typedef struct HmacCache {
+    int algorithm;		/* The authentication algorithm. */
+    u_char key[USM_MAX_KEY];	/* The localized key. */
+    HashCtx inner;		/* The context after hashing key ^ ipad. */
+    HashCtx outer;		/* The context after hashing key ^ opad. */
+} HmacCache;
+
+/*
+ * The following structure keeps the expanded AES key schedule for
+ * the localized privacy key of a session so that the key expansion
+ * is only done once and not for every encrypted or decrypted message.
+ * The key schedule is recomputed when the key of the session changes.
+ */
+
+typedef struct AesCache {
+    int keyLength;		/* The AES key length (16, 24 or 32). */
+    u_char key[32];		/* The AES key. */
+    AES_CTX ctx;		/* The expanded key schedule. */
+} AesCache;
+
+/*
+ * The 64 bit integer used as the salt for the AES initialization
+ * vector (RFC 3826 section 3.1.2.1).
+ */
+
+static Tcl_WideUInt privSalt = 0;
 
 /*
  * Forward declarations for procedures defined later in this file:
  */
 
+static UsmHash*
+HashLookup	(int algorithm);
+
+static void
+HashInit	(int algorithm, HashCtx *ctx);
+
+static void
+HashUpdate	(int algorithm, HashCtx *ctx,
+				     u_char *data, int length);
 static void
-MD5PassWord2Key	(u_char *pwBytes, int pwLength,
-			     u_char *engineBytes, int engineLength,
-			     u_char *key);
+HashFinal	(int algorithm, HashCtx *ctx, u_char *digest);
+
 static void
-SHAPassWord2Key	(u_char *pwBytes, int pwLength,
-			     u_char *engineBytes, int engineLength,
-			     u_char *key);
+PassWord2Key	(int algorithm, u_char *pwBytes, int pwLength,
+				     u_char *key);
+
 static void
 ComputeKey	(Tcl_Obj **objPtrPtr, Tcl_Obj *password,
 			     Tcl_Obj *engineID, int algorithm);
+static char*
+EngineKey	(struct sockaddr_in *addr, char *buffer);
+
+static HmacCache*
+HmacLookup	(TnmSnmp *session, int algorithm);
+
 static void
-MD5AuthOutMsg	(char *authKey, u_char *msg, int msgLen,
-			     u_char *msgAuthenticationParameters);
+HmacDigest	(UsmHash *hashPtr, HmacCache *hmacPtr,
+			     u_char *msg, int msgLen, u_char *digest);
+
+static void
+ExtendKey	(Tcl_Obj **objPtrPtr, int algorithm, int keyLength);
+
+static AES_CTX*
+AesLookup	(TnmSnmp *session, int algorithm);
 
 
 /*
  *----------------------------------------------------------------------
  *
- * MD5PassWord2Key --
+ * HashLookup --
  *
- *	This procedure converts a password into a key by using
- *	the `Password to Key Algorithm' as defined in RFC 2274.
- *	The code is a slightly modified version of the source
- *	code in appendix A.2.1 of RFC 2274.
+ *	This procedure locates the description of the hash function
+ *	used by an authentication algorithm.
  *
  * Results:
- *	The key is written to the argument key.
+ *	A pointer to the UsmHash structure or NULL if the algorithm
+ *	is unknown.
  *
  * Side effects:
  *	None.
@@ -90,42 +218,147 @@ MD5AuthOutMsg	(char *authKey, u_char *msg, int msgLen,
  *----------------------------------------------------------------------
  */
 
-static void
-MD5PassWord2Key(u_char *pwBytes, int pwLength, u_char *engineBytes, int engineLength, u_char *key)
+static UsmHash*
+HashLookup(int algorithm)
 {
-    MD5_CTX MD;
-    u_char *cp, buffer[64];
-    int i, index = 0, count = 0;
-
-    TnmMD5Init(&MD);
-    while (count < 1048576) {
-	cp = buffer;
-	for(i = 0; i < 64; i++) {
-	    *cp++ = pwBytes[index++ % pwLength];
+    UsmHash *hashPtr;
+
+    for (hashPtr = usmHashTable; hashPtr->algorithm; hashPtr++) {
+	if (hashPtr->algorithm == algorithm) {
+	    return hashPtr;
 	}
-	TnmMD5Update(&MD, buffer, 64);
-	count += 64;
     }
-    TnmMD5Final(key, &MD);
+    return NULL;
+}
 
-    memcpy(buffer, key, 16);
-    memcpy(buffer + 16, engineBytes, (size_t) engineLength);
-    memcpy(buffer + 16 + engineLength, key, 16);
-    
-    TnmMD5Init(&MD);
-    TnmMD5Update(&MD, buffer, 16 + engineLength + 16);
-    TnmMD5Final(key, &MD);
+/*
+ *----------------------------------------------------------------------
+ *
+ * HashInit, HashUpdate, HashFinal --
+ *
+ *	These procedures dispatch to the hash function of an
+ *	authentication algorithm. HashFinal() writes as many bytes
+ *	as the keyLength of the algorithm to digest.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The hash context is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HashInit(int algorithm, HashCtx *ctx)
+{
+    switch (algorithm) {
+    case TNM_SNMP_AUTH_MD5:
+	TnmMD5Init(&ctx->md5);
+	break;
+    case TNM_SNMP_AUTH_SHA:
+	TnmSHAInit(&ctx->sha);
+	break;
+    case TNM_SNMP_AUTH_SHA224:
+	TnmSHA224Init(&ctx->sha256);
+	break;
+    case TNM_SNMP_AUTH_SHA256:
+	TnmSHA256Init(&ctx->sha256);
+	break;
+    case TNM_SNMP_AUTH_SHA384:
+	TnmSHA384Init(&ctx->sha512);
+	break;
+    case TNM_SNMP_AUTH_SHA512:
+	TnmSHA512Init(&ctx->sha512);
+	break;
+    default:
+	Tcl_Panic("unknown authentication algorithm");
+    }
 }
-
+
+static void
+HashUpdate(int algorithm, HashCtx *ctx, u_char *data, int length)
+{
+    switch (algorithm) {
+    case TNM_SNMP_AUTH_MD5:
+	TnmMD5Update(&ctx->md5, data, (unsigned int) length);
+	break;
+    case TNM_SNMP_AUTH_SHA:
+	TnmSHAUpdate(&ctx->sha, data, length);
+	break;
+    case TNM_SNMP_AUTH_SHA224:
+    case TNM_SNMP_AUTH_SHA256:
+	TnmSHA256Update(&ctx->sha256, data, length);
+	break;
+    case TNM_SNMP_AUTH_SHA384:
+    case TNM_SNMP_AUTH_SHA512:
+	TnmSHA512Update(&ctx->sha512, data, length);
+	break;
+    }
+}
+
+static void
+HashFinal(int algorithm, HashCtx *ctx, u_char *digest)
+{
+    switch (algorithm) {
+    case TNM_SNMP_AUTH_MD5:
+	TnmMD5Final(digest, &ctx->md5);
+	break;
+    case TNM_SNMP_AUTH_SHA:
+	TnmSHAFinal(digest, &ctx->sha);
+	break;
+    case TNM_SNMP_AUTH_SHA224:
+	TnmSHA224Final(digest, &ctx->sha256);
+	break;
+    case TNM_SNMP_AUTH_SHA256:
+	TnmSHA256Final(digest, &ctx->sha256);
+	break;
+    case TNM_SNMP_AUTH_SHA384:
+	TnmSHA384Final(digest, &ctx->sha512);
+	break;
+    case TNM_SNMP_AUTH_SHA512:
+	TnmSHA512Final(digest, &ctx->sha512);
+	break;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpAuthLength --
+ *
+ *	This procedure returns the length of the msgAuthenticationParameters
+ *	used by an authentication algorithm.
+ *
+ * Results:
+ *	The length of the truncated HMAC or 0 if the algorithm is
+ *	unknown.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpAuthLength(int algorithm)
+{
+    UsmHash *hashPtr = HashLookup(algorithm);
+
+    return hashPtr ? hashPtr->macLength : 0;
+}
+
 /*
  *----------------------------------------------------------------------
  *
- * SHAPassWord2Key --
+ * PassWord2Key --
  *
  *	This procedure converts a password into a key by using
- *	the `Password to Key Algorithm' as defined in RFC 2274.
- *	The code is a slightly modified version of the source
- *	code in appendix A.2.2 of RFC 2274.
+ *	the `Password to Key Algorithm' as defined in RFC 2274
+ *	appendix A.2 and RFC 7860 section 9.3. The password is
+ *	repeated in a buffer once so that the 1 MB of input can
+ *	be hashed in large chunks. The key still needs to be
+ *	localized for a given engine ID.
  *
  * Results:
  *	The key is written to the argument key.
@@ -136,47 +369,46 @@ MD5PassWord2Key(u_char *pwBytes, int pwLength, u_char *engineBytes, int engineLe
  *----------------------------------------------------------------------
  */
 
+#define PW_CHUNK	1024
+#define PW_COUNT	1048576
+
 static void
-SHAPassWord2Key(u_char *pwBytes, int pwLength, u_char *engineBytes, int engineLength, u_char *key)
+PassWord2Key(int algorithm, u_char *pwBytes, int pwLength, u_char *key)
 {
-    SHA_CTX SH;
-    u_char *cp, buffer[72];
-    int i, index = 0, count = 0;
-
-    TnmSHAInit(&SH);
-    while (count < 1048576) {
-	cp = buffer;
-	for(i = 0; i < 64; i++) {
-	    *cp++ = pwBytes[index++ % pwLength];
-	}
-	TnmSHAUpdate(&SH, buffer, 64);
-	count += 64;
+    HashCtx ctx;
+    u_char *buffer;
+    int i, index, count;
+
+    buffer = (u_char *) ckalloc((unsigned) (pwLength + PW_CHUNK));
+    for (i = 0; i < pwLength + PW_CHUNK; i++) {
+	buffer[i] = pwBytes[i % pwLength];
     }
-    TnmSHAFinal(key, &SH);
-    
-    memcpy(buffer, key, 20);
-    memcpy(buffer + 20, engineBytes, (size_t) engineLength);
-    memcpy(buffer + 20 + engineLength, key, 20);
-    
-    TnmSHAInit(&SH);
-    TnmSHAUpdate(&SH, buffer, 20 + engineLength + 20);
-    TnmSHAFinal(key, &SH);
+
+    HashInit(algorithm, &ctx);
+    for (count = 0, index = 0; count < PW_COUNT; count += PW_CHUNK) {
+	HashUpdate(algorithm, &ctx, buffer + index, PW_CHUNK);
+	index = (index + PW_CHUNK) % pwLength;
+    }
+    HashFinal(algorithm, &ctx, key);
+    ckfree((char *) buffer);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
  * ComputeKey --
  *
  *	This procedure computes keys by applying the password to
- *	key transformation. A cache of previously computed keys
- *	is maintained in order to save some computations.
+ *	key transformation and localizing the result for the given
+ *	engine ID. A cache of previously computed keys is maintained
+ *	in order to save the expensive part of the computation.
  *
  * Results:
- *	A pointer to the key or NULL if not found.
+ *	None. The localized key is left in objPtrPtr or NULL if no
+ *	key could be computed.
  *
  * Side effects:
- *	None.
+ *	The key cache is updated.
  *
  *----------------------------------------------------------------------
  */
@@ -184,11 +416,15 @@ SHAPassWord2Key(u_char *pwBytes, int pwLength, u_char *engineBytes, int engineLe
 static void
 ComputeKey(Tcl_Obj **objPtrPtr, Tcl_Obj *password, Tcl_Obj *engineID, int algorithm)
 {
-    unsigned char *pwBytes, *engineBytes, *bytes;
-    Tcl_Size pwLength, engineLength, length;
-    KeyCache *elemPtr;
-    static KeyCache *keyList = NULL;
-    unsigned char buffer[256];	/* must be large enough to hold keys */
+    unsigned char *pwBytes, *engineBytes, *key;
+    Tcl_Size pwLength, engineLength;
+    Tcl_HashEntry *entryPtr;
+    Tcl_DString ds;
+    UsmHash *hashPtr;
+    HashCtx ctx;
+    int isNew, keyLength;
+    char buf[20];
+    unsigned char buffer[USM_MAX_KEY];
 
     if (*objPtrPtr) {
 	Tcl_DecrRefCount(*objPtrPtr);
@@ -198,67 +434,58 @@ ComputeKey(Tcl_Obj **objPtrPtr, Tcl_Obj *password, Tcl_Obj *engineID, int algori
     pwBytes = (unsigned char *) Tcl_GetStringFromObj(password, &pwLength);
     engineBytes = (unsigned char *) TnmGetOctetStringFromObj(NULL, engineID, &engineLength);
 
-    if (! pwBytes || ! engineBytes || engineLength == 0 || pwLength == 0) {
+    if (! pwBytes || ! engineBytes || engineLength == 0 || pwLength == 0
+	|| engineLength > 32) {
 	return;
     }
-    
-    /*
-     * Check whether the key is already in our cache. We have
-     * to check that the password and the engineID  matches as
-     * well as the algorithm.
-     */
-
-    for (elemPtr = keyList; elemPtr; elemPtr = elemPtr->nextPtr) {
-	if (elemPtr->algorithm != algorithm) continue;
 
-	bytes = (unsigned char *) Tcl_GetStringFromObj(elemPtr->password, &length);
-	if (length != pwLength) continue;
-	if (memcmp(pwBytes, bytes, (size_t) length) != 0) continue;
-	
-	bytes = (unsigned char *) Tcl_GetStringFromObj(elemPtr->engineID, &length);
-	if (length != engineLength) continue;
-	if (memcmp(engineBytes, bytes, (size_t) length) != 0) continue;
-
-	*objPtrPtr = elemPtr->key;
-	Tcl_IncrRefCount(*objPtrPtr);
+    hashPtr = HashLookup(algorithm);
+    if (! hashPtr) {
+	Tcl_Panic("unknown algorithm for password to key conversion");
+	return;
     }
+    keyLength = hashPtr->keyLength;
 
+    if (! keyTableInitialized) {
+	Tcl_InitHashTable(&keyTable, TCL_STRING_KEYS);
+	keyTableInitialized = 1;
+    }
+    
     /*
-     * Compute a new key as described in the appendix of RFC 2274.
+     * Check whether the key for this password and algorithm is
+     * already in our cache. Compute a new key as described in the
+     * appendix of RFC 2274 otherwise.
      */
 
-    switch (algorithm) {
-    case TNM_SNMP_AUTH_MD5:
-        MD5PassWord2Key(pwBytes, pwLength, engineBytes, engineLength, buffer);
-	*objPtrPtr = TnmNewOctetStringObj((char *)buffer, 16);
-	Tcl_IncrRefCount(*objPtrPtr);
-	break;
-    case TNM_SNMP_AUTH_SHA:
-	SHAPassWord2Key(pwBytes, pwLength, engineBytes, engineLength, buffer);
-	*objPtrPtr = TnmNewOctetStringObj((char *)buffer, 20);
-	Tcl_IncrRefCount(*objPtrPtr);
-	break;
-    default:
-	Tcl_Panic("unknown algorithm for password to key conversion");
+    Tcl_DStringInit(&ds);
+    sprintf(buf, "%d ", algorithm);
+    Tcl_DStringAppend(&ds, buf, -1);
+    Tcl_DStringAppend(&ds, (char *) pwBytes, pwLength);
+    entryPtr = Tcl_CreateHashEntry(&keyTable, Tcl_DStringValue(&ds), &isNew);
+    Tcl_DStringFree(&ds);
+
+    if (isNew) {
+	key = (unsigned char *) ckalloc(keyLength);
+	PassWord2Key(algorithm, pwBytes, (int) pwLength, key);
+	Tcl_SetHashValue(entryPtr, (ClientData) key);
     }
+    key = (unsigned char *) Tcl_GetHashValue(entryPtr);
 
     /*
-     * Finally, create a new cache entry to save the result for the
-     * future.
+     * Localize the key for the engine ID as described in section
+     * 2.6 of RFC 2274.
      */
 
-    elemPtr = (KeyCache *) ckalloc(sizeof(KeyCache));
-    elemPtr->algorithm = algorithm;
-    elemPtr->password = password;
-    Tcl_IncrRefCount(elemPtr->password);
-    elemPtr->engineID = engineID;
-    Tcl_IncrRefCount(elemPtr->engineID);
-    elemPtr->key = *objPtrPtr;
-    Tcl_IncrRefCount(elemPtr->key);
-    elemPtr->nextPtr = keyList;
-    keyList = elemPtr;
+    HashInit(algorithm, &ctx);
+    HashUpdate(algorithm, &ctx, key, keyLength);
+    HashUpdate(algorithm, &ctx, engineBytes, (int) engineLength);
+    HashUpdate(algorithm, &ctx, key, keyLength);
+    HashFinal(algorithm, &ctx, buffer);
+
+    *objPtrPtr = TnmNewOctetStringObj((char *) buffer, keyLength);
+    Tcl_IncrRefCount(*objPtrPtr);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
@@ -281,26 +508,366 @@ TnmSnmpComputeKeys(TnmSnmp *session)
 {
     int authProto, privProto;
 
+    /*
+     * Generator sessions which do not know the engine ID of the
+     * agent yet take it from the engine cache.
+     */
+
+    if (session->type == TNM_SNMP_GENERATOR) {
+	TnmSnmpEngineLookup(session);
+    }
+
     authProto = (session->securityLevel & TNM_SNMP_AUTH_MASK);
     privProto = (session->securityLevel & TNM_SNMP_PRIV_MASK);
 
-    if (authProto != TNM_SNMP_AUTH_NONE) {
+    if (authProto != TNM_SNMP_AUTH_NONE && session->authPassWord) {
 	ComputeKey(&session->usmAuthKey, session->authPassWord,
 		   session->engineID, authProto);
-	if (privProto != TNM_SNMP_PRIV_NONE) {
-	    ComputeKey(&session->usmPrivKey, session->privPassWord,
-		       session->engineID, authProto);
+    }
+    if (authProto != TNM_SNMP_AUTH_NONE && privProto != TNM_SNMP_PRIV_NONE
+	&& session->privPassWord) {
+	ComputeKey(&session->usmPrivKey, session->privPassWord,
+		   session->engineID, authProto);
+	if (privProto == TNM_SNMP_PRIV_AES192) {
+	    ExtendKey(&session->usmPrivKey, authProto, 24);
+	} else if (privProto == TNM_SNMP_PRIV_AES256) {
+	    ExtendKey(&session->usmPrivKey, authProto, 32);
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExtendKey --
+ *
+ *	This procedure extends a localized key which is too short for
+ *	AES-192 or AES-256. The key is extended by appending the hash
+ *	of the key computed so far until it is long enough, as defined
+ *	in draft-blumenthal-aes-usm-04, section 3.1.2.1.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The key in objPtrPtr is replaced by the extended key.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExtendKey(Tcl_Obj **objPtrPtr, int algorithm, int keyLength)
+{
+    u_char *keyBytes, buffer[64], digest[USM_MAX_KEY];
+    Tcl_Size length;
+    UsmHash *hashPtr = HashLookup(algorithm);
+    HashCtx ctx;
+    int n;
+
+    if (! *objPtrPtr) {
+	return;
+    }
+
+    keyBytes = (u_char *) TnmGetOctetStringFromObj(NULL, *objPtrPtr, &length);
+    if (! keyBytes || ! hashPtr || length >= keyLength) {
+	return;
+    }
+    memcpy(buffer, keyBytes, (size_t) length);
+
+    while (length < keyLength) {
+	HashInit(algorithm, &ctx);
+	HashUpdate(algorithm, &ctx, buffer, (int) length);
+	HashFinal(algorithm, &ctx, digest);
+	n = hashPtr->keyLength;
+	if (n > keyLength - length) {
+	    n = keyLength - (int) length;
 	}
+	memcpy(buffer + length, digest, (size_t) n);
+	length += n;
     }
+
+    Tcl_DecrRefCount(*objPtrPtr);
+    *objPtrPtr = TnmNewOctetStringObj((char *) buffer, keyLength);
+    Tcl_IncrRefCount(*objPtrPtr);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * EngineKey --
+ *
+ *	This procedure builds the key used to locate an agent in the
+ *	engine cache.
+ *
+ * Results:
+ *	A pointer to the key which is written to buffer.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char*
+EngineKey(struct sockaddr_in *addr, char *buffer)
+{
+    sprintf(buffer, "%s:%u", inet_ntoa(addr->sin_addr),
+	    (unsigned) ntohs(addr->sin_port));
+    return buffer;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpEngineUpdate --
+ *
+ *	This procedure saves the engine ID, the engine boots and the
+ *	engine time of the agent at the given address in the engine
+ *	cache. An empty engine ID removes the agent from the cache.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The engine cache is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpEngineUpdate(struct sockaddr_in *addr, char *engineID, int engineIDLength, int engineBoots, int engineTime)
+{
+    Tcl_HashEntry *entryPtr;
+    EngineCache *ecPtr;
+    char buffer[40];
+    int isNew;
+
+    if (! engineTableInitialized) {
+	Tcl_InitHashTable(&engineTable, TCL_STRING_KEYS);
+	engineTableInitialized = 1;
+    }
+
+    if (! engineID || engineIDLength == 0) {
+	entryPtr = Tcl_FindHashEntry(&engineTable, EngineKey(addr, buffer));
+	if (entryPtr) {
+	    ecPtr = (EngineCache *) Tcl_GetHashValue(entryPtr);
+	    Tcl_DecrRefCount(ecPtr->engineID);
+	    ckfree((char *) ecPtr);
+	    Tcl_DeleteHashEntry(entryPtr);
+	}
+	return;
+    }
+
+    entryPtr = Tcl_CreateHashEntry(&engineTable, EngineKey(addr, buffer),
+				   &isNew);
+    if (isNew) {
+	ecPtr = (EngineCache *) ckalloc(sizeof(EngineCache));
+	Tcl_SetHashValue(entryPtr, (ClientData) ecPtr);
+    } else {
+	ecPtr = (EngineCache *) Tcl_GetHashValue(entryPtr);
+	Tcl_DecrRefCount(ecPtr->engineID);
+    }
+    ecPtr->engineID = TnmNewOctetStringObj(engineID, engineIDLength);
+    Tcl_IncrRefCount(ecPtr->engineID);
+    ecPtr->engineBoots = engineBoots;
+    ecPtr->engineTime = engineTime;
+    ecPtr->stamp = time((time_t *) NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpEngineLookup --
+ *
+ *	This procedure initializes the engine ID, the engine boots
+ *	and the engine time of a session from the engine cache if
+ *	the session does not have an engine ID yet.
+ *
+ * Results:
+ *	1 if the session was initialized from the cache, 0 otherwise.
+ *
+ * Side effects:
+ *	The engine parameters of the session may be modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpEngineLookup(TnmSnmp *session)
+{
+    Tcl_HashEntry *entryPtr;
+    EngineCache *ecPtr;
+    Tcl_Size length;
+    char buffer[40];
+
+    if (! engineTableInitialized) {
+	return 0;
+    }
+    if (TnmGetOctetStringFromObj(NULL, session->engineID, &length) 
+	&& length > 0) {
+	return 0;
+    }
+
+    entryPtr = Tcl_FindHashEntry(&engineTable, 
+				 EngineKey(&session->maddr, buffer));
+    if (! entryPtr) {
+	return 0;
+    }
+    ecPtr = (EngineCache *) Tcl_GetHashValue(entryPtr);
+
+    Tcl_DecrRefCount(session->engineID);
+    session->engineID = Tcl_DuplicateObj(ecPtr->engineID);
+    Tcl_IncrRefCount(session->engineID);
+    session->engineBoots = ecPtr->engineBoots;
+    session->engineTime = ecPtr->engineTime 
+	+ (int) (time((time_t *) NULL) - ecPtr->stamp);
+    return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpEngineGet --
+ *
+ *	This procedure returns the contents of the engine cache as a
+ *	Tcl list. Every element is a list containing the address, the
+ *	port, the engine ID, the engine boots and the engine time.
+ *
+ * Results:
+ *	A pointer to a new Tcl list object.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj*
+TnmSnmpEngineGet(void)
+{
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    EngineCache *ecPtr;
+    Tcl_Obj *listPtr, *elemPtr;
+    char *key, *port;
+    time_t now = time((time_t *) NULL);
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    if (! engineTableInitialized) {
+	return listPtr;
+    }
+
+    for (entryPtr = Tcl_FirstHashEntry(&engineTable, &search);
+	 entryPtr; entryPtr = Tcl_NextHashEntry(&search)) {
+	ecPtr = (EngineCache *) Tcl_GetHashValue(entryPtr);
+	key = Tcl_GetHashKey(&engineTable, entryPtr);
+	port = strchr(key, ':');
+	elemPtr = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewStringObj(key, port - key));
+	Tcl_ListObjAppendElement(NULL, elemPtr, 
+				 Tcl_NewStringObj(port + 1, -1));
+	Tcl_ListObjAppendElement(NULL, elemPtr, ecPtr->engineID);
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewIntObj(ecPtr->engineBoots));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+		 Tcl_NewIntObj(ecPtr->engineTime + (int) (now - ecPtr->stamp)));
+	Tcl_ListObjAppendElement(NULL, listPtr, elemPtr);
+    }
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpEngineSet --
+ *
+ *	This procedure loads the engine cache from a Tcl list in the
+ *	format returned by TnmSnmpEngineGet(). An empty list clears
+ *	the engine cache.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	The engine cache is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpEngineSet(Tcl_Interp *interp, Tcl_Obj *listPtr)
+{
+    Tcl_Size i, listc, elemc, engineLength;
+    Tcl_Obj **listv, **elemv;
+    struct sockaddr_in addr;
+    int port, engineBoots, engineTime;
+    char *engineID;
+
+    if (Tcl_ListObjGetElements(interp, listPtr, &listc, &listv) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    /*
+     * Check all elements before we touch the cache.
+     */
+
+    for (i = 0; i < listc; i++) {
+	if (Tcl_ListObjGetElements(interp, listv[i], 
+				   &elemc, &elemv) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (elemc != 5) {
+	    Tcl_AppendResult(interp, "invalid engine cache entry \"",
+			     Tcl_GetString(listv[i]), "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	if (TnmSetIPAddress(interp, Tcl_GetString(elemv[0]), &addr) != TCL_OK
+	    || TnmGetIntRangeFromObj(interp, elemv[1], 0, 65535,
+				     &port) != TCL_OK
+	    || ! TnmGetOctetStringFromObj(interp, elemv[2], &engineLength)
+	    || TnmGetUnsignedFromObj(interp, elemv[3], &engineBoots) != TCL_OK
+	    || TnmGetUnsignedFromObj(interp, elemv[4], &engineTime) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+    }
+
+    if (listc == 0 && engineTableInitialized) {
+	Tcl_HashEntry *entryPtr;
+	Tcl_HashSearch search;
+	EngineCache *ecPtr;
+
+	for (entryPtr = Tcl_FirstHashEntry(&engineTable, &search);
+	     entryPtr; entryPtr = Tcl_NextHashEntry(&search)) {
+	    ecPtr = (EngineCache *) Tcl_GetHashValue(entryPtr);
+	    Tcl_DecrRefCount(ecPtr->engineID);
+	    ckfree((char *) ecPtr);
+	}
+	Tcl_DeleteHashTable(&engineTable);
+	engineTableInitialized = 0;
+    }
+
+    for (i = 0; i < listc; i++) {
+	(void) Tcl_ListObjGetElements(NULL, listv[i], &elemc, &elemv);
+	(void) TnmSetIPAddress(NULL, Tcl_GetString(elemv[0]), &addr);
+	(void) TnmGetIntRangeFromObj(NULL, elemv[1], 0, 65535, &port);
+	engineID = TnmGetOctetStringFromObj(NULL, elemv[2], &engineLength);
+	(void) TnmGetUnsignedFromObj(NULL, elemv[3], &engineBoots);
+	(void) TnmGetUnsignedFromObj(NULL, elemv[4], &engineTime);
+	addr.sin_port = htons((unsigned short) port);
+	TnmSnmpEngineUpdate(&addr, engineID, (int) engineLength,
+			    engineBoots, engineTime);
+    }
+    return TCL_OK;
+}
+
 /*
  *----------------------------------------------------------------------
  *
  * TnmSnmpLocalizeKey --
  *
  *	This procedure computes a localized key from a given key and
- *	engineID, either using MD5 or SHA.
+ *	engineID using the hash function of the algorithm.
  *
  * Results:
  *	The localized key is returned in localAuthKey.
@@ -316,92 +883,403 @@ TnmSnmpLocalizeKey(int algorithm, Tcl_Obj *authKey, Tcl_Obj *engineID, Tcl_Obj *
 {
     unsigned char *engineBytes, *authKeyBytes;
     Tcl_Size engineLength, authKeyLength;
-    int localAuthKeyLength = 20;
-    unsigned char localAuthKeyBytes[20]; /* must be big enough for MD5 and SHA */
+    UsmHash *hashPtr;
+    HashCtx ctx;
+    unsigned char localAuthKeyBytes[USM_MAX_KEY];
 
     authKeyBytes = (unsigned char *) Tcl_GetStringFromObj(authKey, &authKeyLength);
     engineBytes = (unsigned char *) Tcl_GetStringFromObj(engineID, &engineLength);
 
+    hashPtr = HashLookup(algorithm);
+    if (! hashPtr) {
+	Tcl_Panic("unknown algorithm for key localization");
+	return;
+    }
+
     /*
      * Localize a key as described in section 2.6 of RFC 2274.
      */
 
-    switch (algorithm) {
-    case TNM_SNMP_AUTH_MD5: {
-	MD5_CTX MD;
-	TnmMD5Init(&MD);
-	TnmMD5Update(&MD, authKeyBytes, authKeyLength);
-	TnmMD5Update(&MD, engineBytes, engineLength);
-	TnmMD5Update(&MD, authKeyBytes, authKeyLength);
-	Tcl_SetObjLength(localAuthKey, 16);
-	TnmMD5Final(localAuthKeyBytes, &MD);
-	break;
-    }
-    case TNM_SNMP_AUTH_SHA: {
-	SHA_CTX SH;
-	TnmSHAInit(&SH);
-	TnmSHAUpdate(&SH, authKeyBytes, authKeyLength);
-	TnmSHAUpdate(&SH, engineBytes, engineLength);
-	TnmSHAUpdate(&SH, authKeyBytes, authKeyLength);
-	TnmSHAFinal(localAuthKeyBytes, &SH);
-	break;
-    }
-    default:
-	Tcl_Panic("unknown algorithm for key localization");
-    }
+    HashInit(algorithm, &ctx);
+    HashUpdate(algorithm, &ctx, authKeyBytes, (int) authKeyLength);
+    HashUpdate(algorithm, &ctx, engineBytes, (int) engineLength);
+    HashUpdate(algorithm, &ctx, authKeyBytes, (int) authKeyLength);
+    HashFinal(algorithm, &ctx, localAuthKeyBytes);
 
-    Tcl_SetStringObj(localAuthKey, (char *) localAuthKeyBytes, localAuthKeyLength);
+    Tcl_SetStringObj(localAuthKey, (char *) localAuthKeyBytes,
+		     hashPtr->keyLength);
 }
 
-static void
-MD5AuthOutMsg(char *authKey, u_char *msg, int msgLen, u_char *msgAuthenticationParameters)
+/*
+ *----------------------------------------------------------------------
+ *
+ * HmacLookup --
+ *
+ *	This procedure locates the precomputed HMAC contexts for the
+ *	localized authentication key of a session. The contexts are
+ *	computed if the session has none yet or if they were computed
+ *	for another key or algorithm.
+ *
+ * Results:
+ *	A pointer to the HMAC contexts or NULL if the key does not
+ *	match the algorithm.
+ *
+ * Side effects:
+ *	The HMAC contexts of the session are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HmacCache*
+HmacLookup(TnmSnmp *session, int algorithm)
 {
-    MD5_CTX MD;
-    unsigned char extendedAuthKey[64];
-    unsigned char digest[16];
+    HmacCache *hmacPtr;
+    UsmHash *hashPtr;
+    u_char *keyBytes, pad[USM_MAX_BLOCK];
+    Tcl_Size keyLength;
     int i;
 
-    memset(msgAuthenticationParameters, 0, 12);
-    memcpy(extendedAuthKey, authKey, 16);
+    hashPtr = HashLookup(algorithm);
+    if (! hashPtr || ! session->usmAuthKey) {
+	return NULL;
+    }
+    keyBytes = (u_char *) TnmGetOctetStringFromObj(NULL, session->usmAuthKey,
+						   &keyLength);
+    if (! keyBytes || keyLength != hashPtr->keyLength) {
+	return NULL;
+    }
 
-    for (i = 1; i < 64; i++) {
-	extendedAuthKey[i] = extendedAuthKey[i] ^ 0x36;
+    hmacPtr = (HmacCache *) session->usmAuthCtx;
+    if (hmacPtr && hmacPtr->algorithm == algorithm
+	&& memcmp(hmacPtr->key, keyBytes, (size_t) keyLength) == 0) {
+	return hmacPtr;
     }
-    
-    TnmMD5Init(&MD);
-    TnmMD5Update(&MD, extendedAuthKey, 64);
-    TnmMD5Update(&MD, msg, msgLen);
-    TnmMD5Final(digest, &MD);
 
-    for (i = 0; i < 64; i++) {
-	extendedAuthKey[i] = extendedAuthKey[i] ^ 0x5c;
+    if (! hmacPtr) {
+	hmacPtr = (HmacCache *) ckalloc(sizeof(HmacCache));
+	session->usmAuthCtx = (ClientData) hmacPtr;
+    }
+    hmacPtr->algorithm = algorithm;
+    memcpy(hmacPtr->key, keyBytes, (size_t) keyLength);
+
+    memset(pad, 0x36, (size_t) hashPtr->blockSize);
+    for (i = 0; i < keyLength; i++) {
+	pad[i] ^= keyBytes[i];
+    }
+    HashInit(algorithm, &hmacPtr->inner);
+    HashUpdate(algorithm, &hmacPtr->inner, pad, hashPtr->blockSize);
+
+    memset(pad, 0x5c, (size_t) hashPtr->blockSize);
+    for (i = 0; i < keyLength; i++) {
+	pad[i] ^= keyBytes[i];
     }
+    HashInit(algorithm, &hmacPtr->outer);
+    HashUpdate(algorithm, &hmacPtr->outer, pad, hashPtr->blockSize);
+    return hmacPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HmacDigest --
+ *
+ *	This procedure computes the truncated HMAC digest of a message
+ *	as described in section 6.3 and 7.3 of RFC 3414 and in section
+ *	4 of RFC 7860, starting from the precomputed contexts of the key.
+ *
+ * Results:
+ *	The macLength bytes of the digest are written to digest.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    TnmMD5Init(&MD);
-    TnmMD5Update(&MD, extendedAuthKey, 64);
-    TnmMD5Update(&MD, digest, 16);
-    TnmMD5Final(digest, &MD);
+static void
+HmacDigest(UsmHash *hashPtr, HmacCache *hmacPtr, u_char *msg, int msgLen, u_char *digest)
+{
+    HashCtx ctx;
+    u_char buffer[USM_MAX_KEY];
 
-    memcpy(msgAuthenticationParameters, digest, 12);
+    ctx = hmacPtr->inner;
+    HashUpdate(hashPtr->algorithm, &ctx, msg, msgLen);
+    HashFinal(hashPtr->algorithm, &ctx, buffer);
+    ctx = hmacPtr->outer;
+    HashUpdate(hashPtr->algorithm, &ctx, buffer, hashPtr->keyLength);
+    HashFinal(hashPtr->algorithm, &ctx, buffer);
+
+    memcpy(digest, buffer, (size_t) hashPtr->macLength);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpAuthOutMsg --
+ *
+ *	This procedure authenticates an outgoing SNMPv3 message with
+ *	the authentication key of the session. The
+ *	msgAuthenticationParameters must point to the authentication
+ *	parameters inside of the message, which are as long as
+ *	returned by TnmSnmpAuthLength().
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The digest is written into the message. The authentication
+ *	parameters are left zero if the key is unusable.
+ *
+ *----------------------------------------------------------------------
+ */
+
 void
-TnmSnmpAuthOutMsg(int algorithm, Tcl_Obj *authKey, u_char *msg, int msgLen, u_char *msgAuthenticationParameters)
+TnmSnmpAuthOutMsg(TnmSnmp *session, int algorithm, u_char *msg, int msgLen, u_char *msgAuthenticationParameters)
 {
-    char *keyBytes;
-    Tcl_Size keyLen;
+    HmacCache *hmacPtr;
+    UsmHash *hashPtr;
 
-    keyBytes = Tcl_GetStringFromObj(authKey, &keyLen);
+    hashPtr = HashLookup(algorithm);
+    if (! hashPtr) {
+	return;
+    }
+    memset(msgAuthenticationParameters, 0, (size_t) hashPtr->macLength);
+    hmacPtr = HmacLookup(session, algorithm);
+    if (! hmacPtr) {
+	return;
+    }
+    HmacDigest(hashPtr, hmacPtr, msg, msgLen, msgAuthenticationParameters);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpAuthInMsg --
+ *
+ *	This procedure verifies the digest of an incoming SNMPv3
+ *	message with the authentication key of the session. The
+ *	msgAuthenticationParameters must point to the
+ *	authentication parameters inside of the message, which are
+ *	as long as returned by TnmSnmpAuthLength().
+ *
+ * Results:
+ *	1 if the digest is valid and 0 otherwise.
+ *
+ * Side effects:
+ *	None. The message is restored before returning.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpAuthInMsg(TnmSnmp *session, int algorithm, u_char *msg, int msgLen, u_char *msgAuthenticationParameters)
+{
+    HmacCache *hmacPtr;
+    UsmHash *hashPtr;
+    u_char received[USM_MAX_KEY], digest[USM_MAX_KEY];
+    size_t macLength;
+
+    hashPtr = HashLookup(algorithm);
+    hmacPtr = HmacLookup(session, algorithm);
+    if (! hashPtr || ! hmacPtr) {
+	return 0;
+    }
+    macLength = (size_t) hashPtr->macLength;
+    memcpy(received, msgAuthenticationParameters, macLength);
+    memset(msgAuthenticationParameters, 0, macLength);
+    HmacDigest(hashPtr, hmacPtr, msg, msgLen, digest);
+    memcpy(msgAuthenticationParameters, received, macLength);
+    return (memcmp(received, digest, macLength) == 0);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AesLookup --
+ *
+ *	This procedure locates the expanded AES key schedule for the
+ *	localized privacy key of a session. The key schedule is
+ *	computed if the session has none yet or if it was computed
+ *	for another key.
+ *
+ * Results:
+ *	A pointer to the AES context or NULL if the key is too short
+ *	for the privacy protocol.
+ *
+ * Side effects:
+ *	The AES key schedule of the session is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static AES_CTX*
+AesLookup(TnmSnmp *session, int algorithm)
+{
+    AesCache *aesPtr;
+    u_char *keyBytes;
+    Tcl_Size length;
+    int keyLength;
 
     switch (algorithm) {
-    case TNM_SNMP_AUTH_MD5:
-	if (keyLen != 16) {
-	    Tcl_Panic("illegal length of the MD5 authentication key");
-	}
-	MD5AuthOutMsg(keyBytes, msg, msgLen, msgAuthenticationParameters);
+    case TNM_SNMP_PRIV_AES:
+	keyLength = 16;
+	break;
+    case TNM_SNMP_PRIV_AES192:
+	keyLength = 24;
+	break;
+    case TNM_SNMP_PRIV_AES256:
+	keyLength = 32;
 	break;
     default:
-        Tcl_Panic("unknown authentication algorithm");
+	return NULL;
+    }
+
+    if (! session->usmPrivKey) {
+	return NULL;
+    }
+    keyBytes = (u_char *) TnmGetOctetStringFromObj(NULL, session->usmPrivKey,
+						   &length);
+    if (! keyBytes || length < keyLength) {
+	return NULL;
+    }
+
+    aesPtr = (AesCache *) session->usmPrivCtx;
+    if (aesPtr && aesPtr->keyLength == keyLength
+	&& memcmp(aesPtr->key, keyBytes, (size_t) keyLength) == 0) {
+	return &aesPtr->ctx;
+    }
+
+    if (! aesPtr) {
+	aesPtr = (AesCache *) ckalloc(sizeof(AesCache));
+	session->usmPrivCtx = (ClientData) aesPtr;
+    }
+    aesPtr->keyLength = keyLength;
+    memcpy(aesPtr->key, keyBytes, (size_t) keyLength);
+    TnmAESInit(&aesPtr->ctx, aesPtr->key, keyLength);
+    return &aesPtr->ctx;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpPrivSalt --
+ *
+ *	This procedure returns the next 8 byte salt used to build
+ *	the AES initialization vector. The salt is a 64 bit counter
+ *	which starts at a pseudo random value.
+ *
+ * Results:
+ *	The salt is written to salt.
+ *
+ * Side effects:
+ *	The salt counter is incremented.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpPrivSalt(u_char *salt)
+{
+    int i;
+
+    if (privSalt == 0) {
+	Tcl_Time now;
+	Tcl_GetTime(&now);
+	privSalt = ((Tcl_WideUInt) now.sec << 32)
+	    ^ ((Tcl_WideUInt) now.usec << 12) ^ (Tcl_WideUInt) getpid();
+    }
+    privSalt++;
+
+    for (i = 0; i < 8; i++) {
+	salt[i] = (u_char) (privSalt >> (56 - 8 * i));
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpPrivOutMsg --
+ *
+ *	This procedure encrypts the serialized scoped PDU of an
+ *	outgoing SNMPv3 message in place with the privacy key of the
+ *	session using AES in CFB128 mode (RFC 3826). The initialization vector is the concatenation
+ *	of the engine boots, the engine time and the 8 byte salt.
+ *
+ * Results:
+ *	1 on success and 0 if the privacy key is unusable.
+ *
+ * Side effects:
+ *	The data is encrypted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpPrivOutMsg(TnmSnmp *session, int algorithm, int engineBoots, int engineTime, u_char *salt, u_char *data, int length)
+{
+    AES_CTX *ctxPtr;
+    u_char iv[AES_BLOCKSIZE];
+
+    ctxPtr = AesLookup(session, algorithm);
+    if (! ctxPtr) {
+	return 0;
+    }
+
+    iv[0] = (engineBoots >> 24) & 0xff;
+    iv[1] = (engineBoots >> 16) & 0xff;
+    iv[2] = (engineBoots >> 8) & 0xff;
+    iv[3] = engineBoots & 0xff;
+    iv[4] = (engineTime >> 24) & 0xff;
+    iv[5] = (engineTime >> 16) & 0xff;
+    iv[6] = (engineTime >> 8) & 0xff;
+    iv[7] = engineTime & 0xff;
+    memcpy(iv + 8, salt, 8);
+
+    TnmAESCfbEncrypt(ctxPtr, iv, data, data, length);
+    return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpPrivInMsg --
+ *
+ *	This procedure decrypts the encrypted scoped PDU of an
+ *	incoming SNMPv3 message in place with the privacy key of the
+ *	session. The engine boots and engine
+ *	time are the values found in the security parameters of the
+ *	message.
+ *
+ * Results:
+ *	1 on success and 0 if the privacy key is unusable.
+ *
+ * Side effects:
+ *	The data is decrypted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpPrivInMsg(TnmSnmp *session, int algorithm, int engineBoots, int engineTime, u_char *salt, u_char *data, int length)
+{
+    AES_CTX *ctxPtr;
+    u_char iv[AES_BLOCKSIZE];
+
+    ctxPtr = AesLookup(session, algorithm);
+    if (! ctxPtr) {
+	return 0;
+    }
+
+    iv[0] = (engineBoots >> 24) & 0xff;
+    iv[1] = (engineBoots >> 16) & 0xff;
+    iv[2] = (engineBoots >> 8) & 0xff;
+    iv[3] = engineBoots & 0xff;
+    iv[4] = (engineTime >> 24) & 0xff;
+    iv[5] = (engineTime >> 16) & 0xff;
+    iv[6] = (engineTime >> 8) & 0xff;
+    iv[7] = engineTime & 0xff;
+    memcpy(iv + 8, salt, 8);
+
+    TnmAESCfbDecrypt(ctxPtr, iv, data, data, length);
+    return 1;
+}
@@ -31,10 +31,35 @@
 extern int hexdump;
 
 /*
- * The queue of active and waiting asynchronous requests.
+ * The queue of active and waiting asynchronous requests. The
+ * requests are also indexed by their request id. Requests which
+ * share a request id are chained in the idNextPtr list.
  */
 
 static TnmSnmpRequest *queueHead = NULL;
+static TnmSnmpRequest *queueTail = NULL;
+static int queueActive = 0;
+static int queueWaiting = 0;
+static Tcl_HashTable requestTable;
+
+/*
+ * The table of all sessions indexed by the session handle.
+ */
+
+static Tcl_HashTable sessionTable;
+static int initialized = 0;
+
+/*
+ * The latency histograms of all destinations, indexed by the
+ * address and the port number of the agent.
+ */
+
+typedef struct LatencyKey {
+    int addr;
+    int port;
+} LatencyKey;
+
+static Tcl_HashTable *latencyTable = NULL;
 
 /*
  * The following tables are used to map SNMP version numbers,
@@ -162,6 +187,33 @@ SessionDestroyProc	(void *memPtr);
 static void
 RequestDestroyProc	(void *memPtr);
 
+static void
+InitTables		(void);
+
+static void
+RequestLink		(TnmSnmpRequest *request);
+
+static int
+RequestUnlink		(TnmSnmpRequest *request);
+
+static int
+HistIndex		(u_int value);
+
+static u_int
+HistValue		(int index);
+
+static void
+HistRecord		(TnmSnmpHist *histPtr, u_int value);
+
+static Tcl_Obj*
+HistGet			(TnmSnmpHist *histPtr);
+
+static void
+LatencyRecord		(TnmSnmpLatency *latPtr, int what, u_int value);
+
+static Tcl_Obj*
+LatencyGet		(TnmSnmpLatency *latPtr);
+
 #ifdef TNM_SNMPv2U
 static int
 FindAuthKey		(TnmSnmp *session);
@@ -213,6 +265,12 @@ SessionDestroyProc(void *memPtr)
     if (session->usmPrivKey) {
 	Tcl_DecrRefCount(session->usmPrivKey);
     }
+    if (session->usmAuthCtx) {
+	ckfree((char *) session->usmAuthCtx);
+    }
+    if (session->usmPrivCtx) {
+	ckfree((char *) session->usmPrivCtx);
+    }
     if (session->authPassWord) {
 	Tcl_DecrRefCount(session->authPassWord);
     }
@@ -222,6 +280,9 @@ SessionDestroyProc(void *memPtr)
     if (session->tagList) {
 	Tcl_DecrRefCount(session->tagList);
     }
+    if (session->proxy) {
+	Tcl_DecrRefCount(session->proxy);
+    }
     
     while (session->bindPtr) {
 	TnmSnmpBinding *bindPtr = session->bindPtr;	
@@ -237,6 +298,11 @@ SessionDestroyProc(void *memPtr)
     }
     if (session->type == TNM_SNMP_RESPONDER) {
 	TnmSnmpResponderClose(session);
+	TnmSnmpAgentCacheFlush(session);
+	TnmSnmpSimFree(session);
+    }
+    if (session->latencyPtr) {
+	ckfree((char *) session->latencyPtr);
     }
     
     ckfree((char *) session);
@@ -562,6 +628,35 @@ TnmSnmpUsecGetAgentID(TnmSnmp *session)
 
 #endif
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpPduVarbinds --
+ *
+ *	This procedure returns the varbind list of a PDU as a Tcl
+ *	list. Decoded PDUs carry the list object built by the decoder.
+ *	Otherwise, a new object is created from the varbind string.
+ *
+ * Results:
+ *	A pointer to the varbind list object. The caller must manage
+ *	the reference count since the object may be new.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj*
+TnmSnmpPduVarbinds(TnmSnmpPdu *pdu)
+{
+    if (pdu->vbList) {
+	return pdu->vbList;
+    }
+    return Tcl_NewStringObj(Tcl_DStringValue(&pdu->varbind),
+			    Tcl_DStringLength(&pdu->varbind));
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -614,7 +709,11 @@ TnmSnmpEvalCallback(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, char
 	    }
 	    break;
 	  case 'V':
-	    Tcl_DStringAppend(&tclCmd, Tcl_DStringValue(&pdu->varbind), -1);
+	    if (pdu->vbList) {
+		Tcl_DStringAppend(&tclCmd, Tcl_GetString(pdu->vbList), -1);
+	    } else {
+		Tcl_DStringAppend(&tclCmd, Tcl_DStringValue(&pdu->varbind), -1);
+	    }
 	    break;
 	  case 'E':
 	    name = TnmGetTableValue(tnmSnmpErrorTable, (unsigned) pdu->errorStatus);
@@ -711,6 +810,81 @@ TnmSnmpEvalCallback(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, char
     return code;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpEvalCommand --
+ *
+ *	This procedure evaluates a Tcl command prefix. The session
+ *	name, the request id, the error status, the error index and
+ *	the varbind list are appended as separate arguments. This
+ *	avoids the % substitution and the compilation of a script
+ *	for every response.
+ *
+ * Results:
+ *	A standard Tcl result.
+ *
+ * Side effects:
+ *	Tcl commands are evaluated which can have all kind of effects.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpEvalCommand(Tcl_Interp *interp, TnmSnmp *session, TnmSnmpPdu *pdu, Tcl_Obj *cmdPrefix)
+{
+    Tcl_Obj **objv, **prefixv;
+    Tcl_Size i, objc, prefixc;
+    const char *name = NULL;
+    int code;
+
+    Tcl_IncrRefCount(cmdPrefix);
+    code = Tcl_ListObjGetElements(interp, cmdPrefix, &prefixc, &prefixv);
+    if (code != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (snmp callback)");
+	Tcl_BackgroundError(interp);
+	Tcl_DecrRefCount(cmdPrefix);
+	return code;
+    }
+
+    objc = prefixc + 5;
+    objv = (Tcl_Obj **) ckalloc(sizeof(Tcl_Obj *) * objc);
+    for (i = 0; i < prefixc; i++) {
+	objv[i] = prefixv[i];
+    }
+
+    if (session && session->interp && session->token) {
+	name = Tcl_GetCommandName(session->interp, session->token);
+    }
+    objv[i++] = Tcl_NewStringObj(name ? name : "", -1);
+    objv[i++] = Tcl_NewIntObj(pdu->requestId);
+    name = TnmGetTableValue(tnmSnmpErrorTable, (unsigned) pdu->errorStatus);
+    objv[i++] = Tcl_NewStringObj(name ? name : "unknown", -1);
+    objv[i++] = Tcl_NewIntObj(pdu->errorIndex - 1);
+    objv[i++] = TnmSnmpPduVarbinds(pdu);
+    for (i = 0; i < objc; i++) {
+	Tcl_IncrRefCount(objv[i]);
+    }
+
+    Tcl_AllowExceptions(interp);
+    code = Tcl_EvalObjv(interp, objc, objv, TCL_EVAL_GLOBAL);
+
+    for (i = 0; i < objc; i++) {
+	Tcl_DecrRefCount(objv[i]);
+    }
+    ckfree((char *) objv);
+    Tcl_DecrRefCount(cmdPrefix);
+
+    if (code == TCL_ERROR) {
+	char *errorMsg = ckstrdup(Tcl_GetStringResult(interp));
+	Tcl_AddErrorInfo(interp, "\n    (snmp callback)");
+	Tcl_BackgroundError(interp);
+	Tcl_SetResult(interp, errorMsg, TCL_DYNAMIC);
+    }
+
+    return code;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -773,7 +947,7 @@ TnmSnmpDumpPDU(Tcl_Interp *interp, TnmSnmpPdu *pdu)
 
         Tcl_Size i, argc;
 	int code;
-	const char **argv;
+	Tcl_Obj *vbList, **argv;
 	char *name, *status;
 	char buffer[80];
 	Tcl_DString dst;
@@ -806,17 +980,18 @@ TnmSnmpDumpPDU(Tcl_Interp *interp, TnmSnmpPdu *pdu)
 
 	Tcl_DStringAppend(&dst, buffer, -1);
 
-	code = Tcl_SplitList(interp, Tcl_DStringValue(&pdu->varbind), 
-			     &argc, &argv);
+	vbList = TnmSnmpPduVarbinds(pdu);
+	Tcl_IncrRefCount(vbList);
+	code = Tcl_ListObjGetElements(interp, vbList, &argc, &argv);
 	if (code == TCL_OK) {
 	    for (i = 0; i < argc; i++) {
 		sprintf(buffer, "%4d.\t", i+1);
 		Tcl_DStringAppend(&dst, buffer, -1);
-		Tcl_DStringAppend(&dst, argv[i], -1);
+		Tcl_DStringAppend(&dst, Tcl_GetString(argv[i]), -1);
 		Tcl_DStringAppend(&dst, "\n", -1);
 	    }
-	    ckfree((char *) argv);
 	}
+	Tcl_DecrRefCount(vbList);
 	Tcl_ResetResult(interp);
 
 	channel = Tcl_GetStdChannel(TCL_STDOUT);
@@ -940,6 +1115,9 @@ TnmSnmpCreateSession(Tcl_Interp *interp, char type)
     session->timeout = TNM_SNMP_TIMEOUT;
     session->window  = TNM_SNMP_WINDOW;
     session->delay   = TNM_SNMP_DELAY;
+    session->coalesce = TNM_SNMP_COALESCE;
+    session->cacheSize = TNM_SNMP_CACHESIZE;
+    session->rateLimit = TNM_SNMP_RATELIMIT;
     session->tagList = Tcl_NewListObj(0, NULL);
     Tcl_IncrRefCount(session->tagList);
 
@@ -955,13 +1133,16 @@ TnmSnmpCreateSession(Tcl_Interp *interp, char type)
  * TnmSnmpDeleteSession --
  *
  *	This procedure frees the memory allocated by a TnmSnmp
- *	and all it's associated structures.
+ *	and all it's associated structures. The callbacks of the
+ *	requests still queued for the session are called with a
+ *	noResponse error so that they can release their state. The
+ *	session is no longer valid at this time.
  *
  * Results:
  *	None.
  *
  * Side effects:
- *	None.
+ *	Request callbacks are invoked.
  *
  *----------------------------------------------------------------------
  */
@@ -969,22 +1150,54 @@ TnmSnmpCreateSession(Tcl_Interp *interp, char type)
 void
 TnmSnmpDeleteSession(TnmSnmp *session)
 {
-    TnmSnmpRequest **rPtrPtr;
+    TnmSnmpRequest *rPtr, *nextPtr, *cancelList = NULL;
+    TnmSnmpPdu pdu;
 
     if (! session) return;
 
-    rPtrPtr = &queueHead;
-    while (*rPtrPtr) {
-	if ((*rPtrPtr)->session == session) {
-	    TnmSnmpRequest *request = *rPtrPtr;
-	    *rPtrPtr = (*rPtrPtr)->nextPtr;
-	    if (request->timer) {
-	        Tcl_DeleteTimerHandler(request->timer);
+    /*
+     * Sessions without queued requests are the common case and
+     * do not need a scan of the queue. The requests are collected
+     * first since the callbacks may modify the queue.
+     */
+
+    for (rPtr = queueHead; rPtr && (session->active || session->waiting);
+	 rPtr = nextPtr) {
+	nextPtr = rPtr->nextPtr;
+	if (rPtr->session == session) {
+	    if (rPtr->sends) {
+		session->active--;
+	    } else {
+		session->waiting--;
 	    }
-	    Tcl_EventuallyFree((ClientData) request, (Tcl_FreeProc *) RequestDestroyProc);
-	} else {
-	    rPtrPtr = &(*rPtrPtr)->nextPtr;
+	    RequestUnlink(rPtr);
+	    if (rPtr->timer) {
+	        Tcl_DeleteTimerHandler(rPtr->timer);
+		rPtr->timer = NULL;
+	    }
+	    rPtr->nextPtr = cancelList;
+	    cancelList = rPtr;
+	}
+    }
+
+    /*
+     * Call the callbacks with an empty pdu as done by the timeout
+     * handler. Note, the requests are no longer linked.
+     */
+
+    while (cancelList) {
+	rPtr = cancelList;
+	cancelList = rPtr->nextPtr;
+	rPtr->nextPtr = NULL;
+	if (rPtr->proc) {
+	    memset((char *) &pdu, 0, sizeof(TnmSnmpPdu));
+	    pdu.requestId = rPtr->id;
+	    pdu.errorStatus = TNM_SNMP_NORESPONSE;
+	    Tcl_DStringInit(&pdu.varbind);
+	    (rPtr->proc) (session, &pdu, rPtr->clientData);
+	    Tcl_DStringFree(&pdu.varbind);
 	}
+	Tcl_EventuallyFree((ClientData) rPtr, (Tcl_FreeProc *) RequestDestroyProc);
     }
 
     Tcl_EventuallyFree((ClientData) session, (Tcl_FreeProc *) SessionDestroyProc);
@@ -1054,191 +1267,172 @@ TnmSnmpCreateRequest(int id, u_char *packet, int packetlen, TnmSnmpRequestProc *
 TnmSnmpRequest*
 TnmSnmpFindRequest(int id)
 {
-    TnmSnmpRequest *rPtr;
+    Tcl_HashEntry *entryPtr;
 
-    for (rPtr = queueHead; rPtr; rPtr = rPtr->nextPtr) {
-        if (rPtr->id == id) break;
+    if (! initialized) {
+	return NULL;
     }
-    return rPtr;
+    entryPtr = Tcl_FindHashEntry(&requestTable, (char *) (size_t) id);
+    return entryPtr ? (TnmSnmpRequest *) Tcl_GetHashValue(entryPtr) : NULL;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * TnmSnmpQueueRequest --
+ * InitTables --
  *
- *	This procedure queues a request into the wait queue or checks 
- *	if queued requests should be activated. The queue is processed
- *	in FIFO order with the following constraints:
+ *	This procedure initializes the tables used to index sessions
+ *	and requests.
  *
- *	1. The number of active requests per session is smaller than
- *	   the window size of this session.
+ * Results:
+ *	None.
  *
- *	2. The total number of active requests is smaller than the
- *	   window size of this session.
+ * Side effects:
+ *	The hash tables are initialized.
  *
- *	The second rule makes sure that you can't flood a network by 
- *	e.g. creating thousand sessions all with a small window size
- *	sending one request. If the parameter which specifies the
- *	new request is NULL, only queue processing will take place.
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitTables(void)
+{
+    if (! initialized) {
+	Tcl_InitHashTable(&requestTable, TCL_ONE_WORD_KEYS);
+	Tcl_InitHashTable(&sessionTable, TCL_ONE_WORD_KEYS);
+	initialized = 1;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RequestLink --
+ *
+ *	This procedure appends a request to the queue and adds it to
+ *	the request index.
  *
  * Results:
- *	The number of requests queued for this SNMP session.
+ *	None.
  *
  * Side effects:
- *	None.
+ *	The queue counters are updated.
  *
  *----------------------------------------------------------------------
  */
 
-int
-TnmSnmpQueueRequest(TnmSnmp *session, TnmSnmpRequest *request)
+static void
+RequestLink(TnmSnmpRequest *request)
 {
-    int waiting = 0, active = 0;
-    TnmSnmpRequest *rPtr, *lastPtr = NULL;
-
-    /*
-     * Walk through the queue and count active and waiting requests.
-     * Keep a pointer to the last request in the queue.
-     */
-
-    for (rPtr = queueHead; rPtr; rPtr = rPtr->nextPtr) {
-	if (rPtr->sends) {
-	    active++;
-	} else {
-	    waiting++;
-	}
-	if (request) {
-	    lastPtr = rPtr;
-	}
+    Tcl_HashEntry *entryPtr;
+    int isNew;
+
+    InitTables();
+    request->nextPtr = NULL;
+    request->prevPtr = queueTail;
+    if (queueTail) {
+	queueTail->nextPtr = request;
+    } else {
+	queueHead = request;
     }
-
-    /*
-     * Append the new request (if we have one).
-     */
-
-    if (request) {
-	request->session = session;
-	session->waiting++;
-	waiting++;
-	if (! queueHead) {
-	    queueHead = request;
-	} else {
-	    lastPtr->nextPtr = request;
-	}
+    queueTail = request;
+    if (request->sends) {
+	queueActive++;
+    } else {
+	queueWaiting++;
     }
 
-    /*
-     * Try to activate new requests if there are some waiting and
-     * if the total number of active requests is smaller than the
-     * window of the current session.
-     */
-
-    for (rPtr = queueHead; rPtr && waiting; rPtr = rPtr->nextPtr) {
-        if (session->window && active >= session->window) break;
-	if (! rPtr->sends && (rPtr->session->active < rPtr->session->window 
-			      || rPtr->session->window == 0)) {
-	    TnmSnmpTimeoutProc((ClientData) rPtr);
-	    active++;
-	    waiting--;
-	    rPtr->session->active++;
-	    rPtr->session->waiting--;
+    entryPtr = Tcl_CreateHashEntry(&requestTable,
+				   (char *) (size_t) request->id, &isNew);
+    request->idNextPtr = NULL;
+    if (isNew) {
+	Tcl_SetHashValue(entryPtr, (ClientData) request);
+    } else {
+	TnmSnmpRequest *rPtr = (TnmSnmpRequest *) Tcl_GetHashValue(entryPtr);
+	while (rPtr->idNextPtr) {
+	    rPtr = rPtr->idNextPtr;
 	}
+	rPtr->idNextPtr = request;
     }
-
-    return (session->active + session->waiting);
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * TnmSnmpDeleteRequest --
+ * RequestUnlink --
  *
- *	This procedure deletes a request from the list of known 
- *	requests. This will also free all resources and event
- *	handlers for this request.
+ *	This procedure removes a request from the queue and from the
+ *	request index.
  *
  * Results:
- *	None.
+ *	1 if the request was found in the queue, 0 otherwise.
  *
  * Side effects:
- *	None.
+ *	The queue counters are updated and the TCP connection used
+ *	by the request is released.
  *
  *----------------------------------------------------------------------
  */
 
-void
-TnmSnmpDeleteRequest(TnmSnmpRequest *request)
+static int
+RequestUnlink(TnmSnmpRequest *request)
 {
-    TnmSnmpRequest *rPtr, **rPtrPtr;
-    TnmSnmp *session;
-
-    /*
-     * Check whether the request still exists. It may have been
-     * removed because the session for this request has been 
-     * destroyed during callback processing.
-     */
+    Tcl_HashEntry *entryPtr;
+    TnmSnmpRequest *rPtr;
 
-    for (rPtr = queueHead; rPtr; rPtr = rPtr->nextPtr) {
-	if (rPtr == request) break;
+    if (! initialized) {
+	return 0;
     }
-    if (! rPtr) return;
-    
-    /* 
-     * Check whether the session is still in the session list.
-     * We sometimes get called when the session has already been
-     * destroyed as a side effect of evaluating callbacks.
-     */
-    
-    for (session = tnmSnmpList; session; session = session->nextPtr) {
-	if (session == request->session) break;
+    entryPtr = Tcl_FindHashEntry(&requestTable, (char *) (size_t) request->id);
+    if (! entryPtr) {
+	return 0;
     }
-
-    if (session) {
-	if (request->sends) {
-	    session->active--;
+    rPtr = (TnmSnmpRequest *) Tcl_GetHashValue(entryPtr);
+    if (rPtr == request) {
+	if (request->idNextPtr) {
+	    Tcl_SetHashValue(entryPtr, (ClientData) request->idNextPtr);
 	} else {
-	    session->waiting--;
+	    Tcl_DeleteHashEntry(entryPtr);
+	}
+    } else {
+	while (rPtr && rPtr->idNextPtr != request) {
+	    rPtr = rPtr->idNextPtr;
 	}
+	if (! rPtr) {
+	    return 0;
+	}
+	rPtr->idNextPtr = request->idNextPtr;
     }
-    
-    /*
-     * Remove the request from the list of outstanding requests.
-     * and free the resources allocated for this request.
-     */
 
-    rPtrPtr = &queueHead;
-    while (*rPtrPtr && *rPtrPtr != request) {
-	rPtrPtr = &(*rPtrPtr)->nextPtr;
+    if (request->prevPtr) {
+	request->prevPtr->nextPtr = request->nextPtr;
+    } else {
+	queueHead = request->nextPtr;
     }
-    if (*rPtrPtr) {
-	*rPtrPtr = request->nextPtr;
-	if (request->timer) {
-	    Tcl_DeleteTimerHandler(request->timer);
-	    request->timer = NULL;
-	}
-	Tcl_EventuallyFree((ClientData) request, (Tcl_FreeProc *) RequestDestroyProc);
+    if (request->nextPtr) {
+	request->nextPtr->prevPtr = request->prevPtr;
+    } else {
+	queueTail = request->prevPtr;
     }
-
-    /*
-     * Update the request queue. This will activate async requests
-     * that have been queued because of the window size.
-     */
-     
-    if (session) {
-	TnmSnmpQueueRequest(session, NULL);
+    request->nextPtr = request->prevPtr = request->idNextPtr = NULL;
+    if (request->sends) {
+	queueActive--;
+    } else {
+	queueWaiting--;
     }
+    TnmSnmpReleaseConn(request);
+    return 1;
 }
-
+
 /*
  *----------------------------------------------------------------------
  *
- * TnmSnmpGetRequestId --
+ * TnmSnmpQueueLength --
  *
- *	This procedure generates an unused request identifier.
+ *	This procedure returns the number of active and waiting
+ *	requests of all sessions.
  *
  * Results:
- *	The request identifier.
+ *	The number of requests in the queue.
  *
  * Side effects:
  *	None.
@@ -1247,19 +1441,844 @@ TnmSnmpDeleteRequest(TnmSnmpRequest *request)
  */
 
 int
-TnmSnmpGetRequestId()
+TnmSnmpQueueLength(void)
 {
-    int id;
-    TnmSnmpRequest *rPtr = queueHead;
+    return queueActive + queueWaiting;
+}
 
-    do {
-	id = rand();
-	for (rPtr = queueHead; rPtr && rPtr->id != id; rPtr = rPtr->nextPtr) {
-	    /* empty body */
-	}
-    } while (rPtr);
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpRegisterSession --
+ *
+ *	This procedure adds a session to the list and to the index
+ *	of all sessions.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    return id;
+void
+TnmSnmpRegisterSession(TnmSnmp *session)
+{
+    int isNew;
+
+    InitTables();
+    session->prevPtr = NULL;
+    session->nextPtr = tnmSnmpList;
+    if (tnmSnmpList) {
+	tnmSnmpList->prevPtr = session;
+    }
+    tnmSnmpList = session;
+    (void) Tcl_CreateHashEntry(&sessionTable, (char *) session, &isNew);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpUnregisterSession --
+ *
+ *	This procedure removes a session from the list and from the
+ *	index of all sessions.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpUnregisterSession(TnmSnmp *session)
+{
+    Tcl_HashEntry *entryPtr;
+
+    if (! initialized) {
+	return;
+    }
+    entryPtr = Tcl_FindHashEntry(&sessionTable, (char *) session);
+    if (! entryPtr) {
+	return;
+    }
+    Tcl_DeleteHashEntry(entryPtr);
+    if (session->prevPtr) {
+	session->prevPtr->nextPtr = session->nextPtr;
+    } else {
+	tnmSnmpList = session->nextPtr;
+    }
+    if (session->nextPtr) {
+	session->nextPtr->prevPtr = session->prevPtr;
+    }
+    session->nextPtr = session->prevPtr = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpSessionValid --
+ *
+ *	This procedure checks whether a session handle refers to a
+ *	session which has not been destroyed yet.
+ *
+ * Results:
+ *	1 if the session exists, 0 otherwise.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpSessionValid(TnmSnmp *session)
+{
+    return initialized && session
+	&& Tcl_FindHashEntry(&sessionTable, (char *) session) != NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpFindSession --
+ *
+ *	This procedure locates a session by the name of its command
+ *	through the command table of the interpreter.
+ *
+ * Results:
+ *	A pointer to the session or NULL if there is no session
+ *	with this name in the interpreter.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+TnmSnmp*
+TnmSnmpFindSession(Tcl_Interp *interp, const char *name)
+{
+    Tcl_CmdInfo info;
+    TnmSnmp *session;
+
+    if (! Tcl_GetCommandInfo(interp, name, &info)) {
+	return NULL;
+    }
+    session = (TnmSnmp *) info.objClientData;
+    if (! TnmSnmpSessionValid(session) || session->interp != interp) {
+	return NULL;
+    }
+    return session;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpQueueRequest --
+ *
+ *	This procedure queues a request into the wait queue or checks 
+ *	if queued requests should be activated. The queue is processed
+ *	in FIFO order with the following constraints:
+ *
+ *	1. The number of active requests per session is smaller than
+ *	   the window size of this session.
+ *
+ *	2. The total number of active requests is smaller than the
+ *	   window size of this session.
+ *
+ *	The second rule makes sure that you can't flood a network by 
+ *	e.g. creating thousand sessions all with a small window size
+ *	sending one request. If the parameter which specifies the
+ *	new request is NULL, only queue processing will take place.
+ *
+ * Results:
+ *	The number of requests queued for this SNMP session.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpQueueRequest(TnmSnmp *session, TnmSnmpRequest *request)
+{
+    TnmSnmpRequest *rPtr;
+
+    /*
+     * Append the new request (if we have one).
+     */
+
+    if (request) {
+	request->session = session;
+	Tcl_GetTime(&request->queued);
+	session->waiting++;
+	RequestLink(request);
+    }
+
+    /*
+     * Try to activate new requests if there are some waiting and
+     * if the total number of active requests is smaller than the
+     * window of the current session.
+     */
+
+    for (rPtr = queueHead; rPtr && queueWaiting; rPtr = rPtr->nextPtr) {
+        if (session->window && queueActive >= session->window) break;
+	if (! rPtr->sends && (rPtr->session->active < rPtr->session->window 
+			      || rPtr->session->window == 0)) {
+	    TnmSnmpTimeoutProc((ClientData) rPtr);
+	    queueActive++;
+	    queueWaiting--;
+	    rPtr->session->active++;
+	    rPtr->session->waiting--;
+	}
+    }
+
+    return (session->active + session->waiting);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpDeleteRequest --
+ *
+ *	This procedure deletes a request from the list of known 
+ *	requests. This will also free all resources and event
+ *	handlers for this request.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpDeleteRequest(TnmSnmpRequest *request)
+{
+    TnmSnmp *session;
+
+    /*
+     * Remove the request from the list of outstanding requests.
+     * It may have been removed already because the session for 
+     * this request has been destroyed during callback processing.
+     */
+
+    if (! RequestUnlink(request)) return;
+    
+    /* 
+     * Check whether the session still exists. We sometimes get 
+     * called when the session has already been destroyed as a 
+     * side effect of evaluating callbacks.
+     */
+    
+    session = TnmSnmpSessionValid(request->session) ? request->session : NULL;
+
+    if (session) {
+	if (request->sends) {
+	    session->active--;
+	} else {
+	    session->waiting--;
+	}
+	session->completed++;
+	if (session->discoverId == request->id) {
+	    session->discoverId = 0;
+	}
+    }
+    
+    /*
+     * Free the resources allocated for this request.
+     */
+
+    if (request->timer) {
+	Tcl_DeleteTimerHandler(request->timer);
+	request->timer = NULL;
+    }
+    Tcl_EventuallyFree((ClientData) request, (Tcl_FreeProc *) RequestDestroyProc);
+
+    /*
+     * Update the request queue. This will activate async requests
+     * that have been queued because of the window size.
+     */
+     
+    if (session) {
+	TnmSnmpQueueRequest(session, NULL);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpExpireRequests --
+ *
+ *	This procedure is called when a TCP connection fails. The
+ *	requests sent over the connection will never be answered and
+ *	are therefore expired at once instead of waiting for their
+ *	timeout.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The timer handlers of the requests are rescheduled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpExpireRequests(struct TcpConn *connPtr)
+{
+    TnmSnmpRequest *rPtr;
+
+    for (rPtr = queueHead; rPtr && queueActive; rPtr = rPtr->nextPtr) {
+	if (rPtr->connPtr == connPtr && rPtr->sends) {
+	    if (rPtr->timer) {
+		Tcl_DeleteTimerHandler(rPtr->timer);
+	    }
+	    rPtr->timer = Tcl_CreateTimerHandler(0, TnmSnmpTimeoutProc,
+						 (ClientData) rPtr);
+	}
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpGetRequestId --
+ *
+ *	This procedure generates an unused request identifier.
+ *
+ * Results:
+ *	The request identifier.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+TnmSnmpGetRequestId()
+{
+    int id;
+
+    do {
+	id = rand();
+    } while (TnmSnmpFindRequest(id));
+
+    return id;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpQueueGet --
+ *
+ *	This procedure describes the state of the request queue. The
+ *	result contains the total number of active and waiting requests,
+ *	the number of pending retransmission timers and the counters of
+ *	every session whose name matches the pattern (if not NULL).
+ *
+ * Results:
+ *	A list of names and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj*
+TnmSnmpQueueGet(Tcl_Interp *interp, const char *pattern)
+{
+    TnmSnmpRequest *rPtr;
+    TnmSnmp *session;
+    Tcl_Obj *listPtr, *sessPtr, *elemPtr;
+    const char *name;
+    int active = 0, waiting = 0, timers = 0;
+
+    for (rPtr = queueHead; rPtr; rPtr = rPtr->nextPtr) {
+	if (rPtr->sends) {
+	    active++;
+	} else {
+	    waiting++;
+	}
+	if (rPtr->timer) {
+	    timers++;
+	}
+    }
+
+    sessPtr = Tcl_NewListObj(0, NULL);
+    for (session = tnmSnmpList; session; session = session->nextPtr) {
+	if (session->interp != interp) continue;
+	name = Tcl_GetCommandName(interp, session->token);
+	if (pattern && ! Tcl_StringMatch(name, pattern)) continue;
+	elemPtr = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewStringObj("active", -1));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewIntObj(session->active));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewStringObj("waiting", -1));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewIntObj(session->waiting));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewStringObj("retransmits", -1));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewWideIntObj(session->retransmits));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewStringObj("rateDrops", -1));
+	Tcl_ListObjAppendElement(NULL, elemPtr,
+				 Tcl_NewWideIntObj(session->rateDrops));
+	Tcl_ListObjAppendElement(NULL, sessPtr, Tcl_NewStringObj(name, -1));
+	Tcl_ListObjAppendElement(NULL, sessPtr, elemPtr);
+    }
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("active", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewIntObj(active));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("waiting", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewIntObj(waiting));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("timers", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewIntObj(timers));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("sessions", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, sessPtr);
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpElapsed --
+ *
+ *	This procedure computes the time elapsed since a given
+ *	start time.
+ *
+ * Results:
+ *	The elapsed time in microseconds or 0 if the clock went
+ *	backwards.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+u_int
+TnmSnmpElapsed(Tcl_Time *start)
+{
+    Tcl_Time now;
+    Tcl_WideInt us;
+
+    Tcl_GetTime(&now);
+    us = (Tcl_WideInt) (now.sec - start->sec) * 1000000
+	+ (now.usec - start->usec);
+    if (us < 0) {
+	return 0;
+    }
+    return (us > TNM_SNMP_HIST_MAX) ? TNM_SNMP_HIST_MAX : (u_int) us;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistIndex --
+ *
+ *	This procedure maps a value to the index of the histogram
+ *	bucket that counts the value.
+ *
+ * Results:
+ *	The bucket index.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HistIndex(u_int value)
+{
+    int e = 3;
+
+    if (value > TNM_SNMP_HIST_MAX) {
+	value = TNM_SNMP_HIST_MAX;
+    }
+    if (value < 8) {
+	return (int) value;
+    }
+    while (value >> (e + 1)) {
+	e++;
+    }
+    return 8 + (e - 3) * 8 + (int) ((value >> (e - 3)) & 7);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistValue --
+ *
+ *	This procedure computes the largest value counted by a
+ *	histogram bucket.
+ *
+ * Results:
+ *	The upper bound of the bucket.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static u_int
+HistValue(int index)
+{
+    int e, m;
+
+    if (index < 8) {
+	return (u_int) index;
+    }
+    e = (index - 8) / 8 + 3;
+    m = (index - 8) % 8;
+    return (((u_int) (8 + m + 1)) << (e - 3)) - 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistRecord --
+ *
+ *	This procedure adds a value to a histogram.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The histogram is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HistRecord(TnmSnmpHist *histPtr, u_int value)
+{
+    if (value > TNM_SNMP_HIST_MAX) {
+	value = TNM_SNMP_HIST_MAX;
+    }
+    if (histPtr->count == 0 || value < histPtr->min) {
+	histPtr->min = value;
+    }
+    if (value > histPtr->max) {
+	histPtr->max = value;
+    }
+    histPtr->count++;
+    histPtr->sum += value;
+    histPtr->buckets[HistIndex(value)]++;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistGet --
+ *
+ *	This procedure summarizes a histogram. The percentiles are
+ *	the upper bounds of the buckets, limited to the largest
+ *	value recorded.
+ *
+ * Results:
+ *	A list of names and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+HistGet(TnmSnmpHist *histPtr)
+{
+    static const char *names[] = { "p50", "p90", "p99", NULL };
+    static const int permille[] = { 500, 900, 990 };
+    Tcl_Obj *listPtr;
+    Tcl_WideUInt seen = 0, rank;
+    u_int value;
+    int i, p = 0;
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("count", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr,
+			     Tcl_NewWideIntObj(histPtr->count));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("min", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr,
+			     Tcl_NewWideIntObj(histPtr->min));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("mean", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewWideIntObj(
+	histPtr->count ? (Tcl_WideInt) (histPtr->sum / histPtr->count) : 0));
+
+    for (i = 0; i < TNM_SNMP_HIST_BUCKETS && names[p]; i++) {
+	seen += histPtr->buckets[i];
+	while (names[p] && seen > 0) {
+	    rank = ((Tcl_WideUInt) histPtr->count * permille[p] + 999) / 1000;
+	    if (seen < rank) break;
+	    value = HistValue(i) < histPtr->max ? HistValue(i) : histPtr->max;
+	    Tcl_ListObjAppendElement(NULL, listPtr,
+				     Tcl_NewStringObj(names[p], -1));
+	    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewWideIntObj(value));
+	    p++;
+	}
+    }
+    for (; names[p]; p++) {
+	Tcl_ListObjAppendElement(NULL, listPtr,
+				 Tcl_NewStringObj(names[p], -1));
+	Tcl_ListObjAppendElement(NULL, listPtr,
+				 Tcl_NewWideIntObj(histPtr->max));
+    }
+
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("max", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr,
+			     Tcl_NewWideIntObj(histPtr->max));
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyRecord --
+ *
+ *	This procedure adds a measurement to a latency structure.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The latency structure is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LatencyRecord(TnmSnmpLatency *latPtr, int what, u_int value)
+{
+    switch (what) {
+    case TNM_SNMP_LATENCY_RTT:
+	HistRecord(&latPtr->rtt, value);
+	break;
+    case TNM_SNMP_LATENCY_WAIT:
+	HistRecord(&latPtr->wait, value);
+	break;
+    case TNM_SNMP_LATENCY_TIMEOUT:
+	latPtr->timeouts++;
+	/* fall through */
+    case TNM_SNMP_LATENCY_RETRY:
+	if (value >= TNM_SNMP_RETRY_BUCKETS) {
+	    value = TNM_SNMP_RETRY_BUCKETS - 1;
+	}
+	latPtr->retries[value]++;
+	break;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LatencyGet --
+ *
+ *	This procedure converts a latency structure into a list of
+ *	names and values. The retries element lists the number of
+ *	requests for every observed number of retransmissions.
+ *
+ * Results:
+ *	A list of names and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj*
+LatencyGet(TnmSnmpLatency *latPtr)
+{
+    Tcl_Obj *listPtr, *retryPtr;
+    int i;
+
+    retryPtr = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < TNM_SNMP_RETRY_BUCKETS; i++) {
+	if (latPtr->retries[i]) {
+	    Tcl_ListObjAppendElement(NULL, retryPtr, Tcl_NewIntObj(i));
+	    Tcl_ListObjAppendElement(NULL, retryPtr,
+				     Tcl_NewWideIntObj(latPtr->retries[i]));
+	}
+    }
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("rtt", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, HistGet(&latPtr->rtt));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("wait", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, HistGet(&latPtr->wait));
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("retries", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr, retryPtr);
+    Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj("timeouts", -1));
+    Tcl_ListObjAppendElement(NULL, listPtr,
+			     Tcl_NewWideIntObj(latPtr->timeouts));
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpLatencyRecord --
+ *
+ *	This procedure records a response time, a queue wait time, 
+ *	the number of retransmissions of a request or a timeout in
+ *	the histograms of the session and of the destination address
+ *	of the session.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Latency structures are created when needed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpLatencyRecord(TnmSnmp *session, int what, u_int value)
+{
+    Tcl_HashEntry *entryPtr;
+    TnmSnmpLatency *latPtr;
+    LatencyKey key;
+    int isNew;
+
+    if (! session->latencyPtr) {
+	session->latencyPtr = (TnmSnmpLatency *)
+	    ckalloc(sizeof(TnmSnmpLatency));
+	memset((char *) session->latencyPtr, 0, sizeof(TnmSnmpLatency));
+    }
+    LatencyRecord(session->latencyPtr, what, value);
+
+    if (! latencyTable) {
+	latencyTable = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+	Tcl_InitHashTable(latencyTable, sizeof(LatencyKey) / sizeof(int));
+    }
+    memset((char *) &key, 0, sizeof(key));
+    key.addr = (int) session->maddr.sin_addr.s_addr;
+    key.port = session->maddr.sin_port;
+    entryPtr = Tcl_CreateHashEntry(latencyTable, (char *) &key, &isNew);
+    if (isNew) {
+	latPtr = (TnmSnmpLatency *) ckalloc(sizeof(TnmSnmpLatency));
+	memset((char *) latPtr, 0, sizeof(TnmSnmpLatency));
+	Tcl_SetHashValue(entryPtr, (ClientData) latPtr);
+    } else {
+	latPtr = (TnmSnmpLatency *) Tcl_GetHashValue(entryPtr);
+    }
+    LatencyRecord(latPtr, what, value);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpLatencyGet --
+ *
+ *	This procedure returns the latency histograms of a session or,
+ *	if session is NULL, of all destinations. The destinations are
+ *	identified by their address and port number.
+ *
+ * Results:
+ *	A list of names and values.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Tcl_Obj*
+TnmSnmpLatencyGet(TnmSnmp *session)
+{
+    TnmSnmpLatency empty;
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+    Tcl_Obj *listPtr;
+    LatencyKey *keyPtr;
+    struct in_addr addr;
+    char buf[40];
+
+    if (session) {
+	if (session->latencyPtr) {
+	    return LatencyGet(session->latencyPtr);
+	}
+	memset((char *) &empty, 0, sizeof(empty));
+	return LatencyGet(&empty);
+    }
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    if (! latencyTable) {
+	return listPtr;
+    }
+    for (entryPtr = Tcl_FirstHashEntry(latencyTable, &search);
+	 entryPtr; entryPtr = Tcl_NextHashEntry(&search)) {
+	keyPtr = (LatencyKey *) Tcl_GetHashKey(latencyTable, entryPtr);
+	addr.s_addr = (unsigned) keyPtr->addr;
+	sprintf(buf, "%s:%u", inet_ntoa(addr),
+		ntohs((unsigned short) keyPtr->port));
+	Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewStringObj(buf, -1));
+	Tcl_ListObjAppendElement(NULL, listPtr, LatencyGet(
+	    (TnmSnmpLatency *) Tcl_GetHashValue(entryPtr)));
+    }
+    return listPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TnmSnmpLatencyReset --
+ *
+ *	This procedure clears the latency histograms of a session or,
+ *	if session is NULL, discards the histograms of all
+ *	destinations.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+TnmSnmpLatencyReset(TnmSnmp *session)
+{
+    Tcl_HashEntry *entryPtr;
+    Tcl_HashSearch search;
+
+    if (session) {
+	if (session->latencyPtr) {
+	    ckfree((char *) session->latencyPtr);
+	    session->latencyPtr = NULL;
+	}
+	return;
+    }
+
+    if (latencyTable) {
+	for (entryPtr = Tcl_FirstHashEntry(latencyTable, &search);
+	     entryPtr; entryPtr = Tcl_NextHashEntry(&search)) {
+	    ckfree((char *) Tcl_GetHashValue(entryPtr));
+	}
+	Tcl_DeleteHashTable(latencyTable);
+	ckfree((char *) latencyTable);
+	latencyTable = NULL;
+    }
 }
 
 /*
@@ -0,0 +1,327 @@
+/*
+ * tnmUsmBench.c --
+ *
+ *	Microbenchmark for the HMAC computation used to authenticate
+ *	SNMPv3 messages (RFC 3414). The program compares the number of
+ *	messages per second if the keyed inner and outer hash contexts
+ *	are set up for every message with the number of messages per
+ *	second if the contexts are computed once and copied for every
+ *	message, as done by tnmSnmpUsm.c. This program is linked with
+ *	tnmMD5.c and tnmSHA.c only and does not need the Tcl library.
+ *	The digests are checked against the RFC 2202 test vectors
+ *	before the timings are taken.
+ *
+ *	Usage: usmbench ?iterations?
+ *
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "tnmInt.h"
+#include "tnmMD5.h"
+#include "tnmSHA.h"
+
+#include <sys/time.h>
+
+#define BENCH_BLOCKSIZE	64
+#define BENCH_MACLENGTH	12
+
+typedef union BenchCtx {
+    MD5_CTX md5;
+    SHA_CTX sha;
+} BenchCtx;
+
+/*
+ * The following structure describes a hash function. The procedures
+ * hide the different argument types of the MD5 and SHA functions.
+ */
+
+typedef struct BenchHash {
+    char *name;			/* The name printed in the report. */
+    int keyLength;		/* The length of the digest and the key. */
+    void (*init) (BenchCtx *ctx);
+    void (*update) (BenchCtx *ctx, u_char *data, int length);
+    void (*final) (BenchCtx *ctx, u_char *digest);
+    char *vector;		/* The RFC 2202 digest of "Hi There". */
+} BenchHash;
+
+/*
+ * The precomputed inner and outer contexts of a key.
+ */
+
+typedef struct BenchHmac {
+    BenchCtx inner;
+    BenchCtx outer;
+} BenchHmac;
+
+/*
+ * Forward declarations for procedures defined later in this file:
+ */
+
+static void
+MD5Init		(BenchCtx *ctx);
+static void
+MD5Update	(BenchCtx *ctx, u_char *data, int length);
+static void
+MD5Final	(BenchCtx *ctx, u_char *digest);
+static void
+SHAInit		(BenchCtx *ctx);
+static void
+SHAUpdate	(BenchCtx *ctx, u_char *data, int length);
+static void
+SHAFinal	(BenchCtx *ctx, u_char *digest);
+
+static void
+HmacSetup	(BenchHash *hashPtr, u_char *key, BenchHmac *hmacPtr);
+static void
+HmacDigest	(BenchHash *hashPtr, BenchHmac *hmacPtr,
+			     u_char *msg, int msgLen, u_char *digest);
+static double
+Now		(void);
+
+static BenchHash benchHashes[] = {
+    { "HMAC-MD5-96", 16, MD5Init, MD5Update, MD5Final,
+      "9294727a3638bb1c13f48ef8158bfc9d" },
+    { "HMAC-SHA-96", 20, SHAInit, SHAUpdate, SHAFinal,
+      "b617318655057264e28bc0b6fb378c8ef146be00" },
+    { NULL, 0, NULL, NULL, NULL, NULL }
+};
+
+/*
+ * The message sizes used by the benchmark: a typical get request,
+ * the minimum maximum message size and a full ethernet frame.
+ */
+
+static int benchSizes[] = { 120, 484, 1400, 0 };
+
+static void
+MD5Init(BenchCtx *ctx)
+{
+    TnmMD5Init(&ctx->md5);
+}
+
+static void
+MD5Update(BenchCtx *ctx, u_char *data, int length)
+{
+    TnmMD5Update(&ctx->md5, data, (unsigned int) length);
+}
+
+static void
+MD5Final(BenchCtx *ctx, u_char *digest)
+{
+    TnmMD5Final(digest, &ctx->md5);
+}
+
+static void
+SHAInit(BenchCtx *ctx)
+{
+    TnmSHAInit(&ctx->sha);
+}
+
+static void
+SHAUpdate(BenchCtx *ctx, u_char *data, int length)
+{
+    TnmSHAUpdate(&ctx->sha, data, length);
+}
+
+static void
+SHAFinal(BenchCtx *ctx, u_char *digest)
+{
+    TnmSHAFinal(digest, &ctx->sha);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HmacSetup --
+ *
+ *	This procedure computes the keyed inner and outer contexts of
+ *	the HMAC (RFC 2104) for a key in the same way as HmacLookup()
+ *	in tnmSnmpUsm.c.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	The contexts are written to hmacPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HmacSetup(BenchHash *hashPtr, u_char *key, BenchHmac *hmacPtr)
+{
+    u_char pad[BENCH_BLOCKSIZE];
+    int i;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (i = 0; i < hashPtr->keyLength; i++) {
+	pad[i] ^= key[i];
+    }
+    hashPtr->init(&hmacPtr->inner);
+    hashPtr->update(&hmacPtr->inner, pad, BENCH_BLOCKSIZE);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (i = 0; i < hashPtr->keyLength; i++) {
+	pad[i] ^= key[i];
+    }
+    hashPtr->init(&hmacPtr->outer);
+    hashPtr->update(&hmacPtr->outer, pad, BENCH_BLOCKSIZE);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HmacDigest --
+ *
+ *	This procedure computes the HMAC of a message starting from
+ *	the precomputed contexts in the same way as HmacDigest() in
+ *	tnmSnmpUsm.c.
+ *
+ * Results:
+ *	The full digest is written to digest.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HmacDigest(BenchHash *hashPtr, BenchHmac *hmacPtr, u_char *msg, int msgLen, u_char *digest)
+{
+    BenchCtx ctx;
+
+    ctx = hmacPtr->inner;
+    hashPtr->update(&ctx, msg, msgLen);
+    hashPtr->final(&ctx, digest);
+    ctx = hmacPtr->outer;
+    hashPtr->update(&ctx, digest, hashPtr->keyLength);
+    hashPtr->final(&ctx, digest);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Now --
+ *
+ *	This procedure returns the current time in microseconds.
+ *
+ * Results:
+ *	The current time.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static double
+Now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * main --
+ *
+ *	This procedure checks the HMAC implementation and times the
+ *	authentication of messages of different sizes.
+ *
+ * Results:
+ *	The exit code is 1 if a test vector failed.
+ *
+ * Side effects:
+ *	The timings are written to stdout.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+main(int argc, char *argv[])
+{
+    BenchHash *hashPtr;
+    BenchHmac hmac;
+    u_char key[BENCH_BLOCKSIZE], msg[1500], digest[BENCH_BLOCKSIZE];
+    u_char mac[BENCH_MACLENGTH];
+    char hex[2 * BENCH_BLOCKSIZE + 1];
+    int i, j, *sizePtr, iterations = 200000, failed = 0;
+    double start, setup, cached;
+
+    if (argc > 2 || (argc == 2 && (iterations = atoi(argv[1])) <= 0)) {
+	fprintf(stderr, "usage: %s ?iterations?\n", argv[0]);
+	return 2;
+    }
+
+    for (i = 0; i < (int) sizeof(msg); i++) {
+	msg[i] = (u_char) (i * 7);
+    }
+
+    printf("%-12s %6s %14s %14s %8s\n",
+	   "algorithm", "bytes", "setup msg/s", "cached msg/s", "speedup");
+
+    for (hashPtr = benchHashes; hashPtr->name; hashPtr++) {
+
+	/*
+	 * Check the implementation against RFC 2202 test case 1.
+	 */
+
+	memset(key, 0x0b, (size_t) hashPtr->keyLength);
+	HmacSetup(hashPtr, key, &hmac);
+	HmacDigest(hashPtr, &hmac, (u_char *) "Hi There", 8, digest);
+	for (i = 0; i < hashPtr->keyLength; i++) {
+	    sprintf(hex + 2 * i, "%02x", digest[i]);
+	}
+	if (strcmp(hex, hashPtr->vector) != 0) {
+	    printf("%-12s FAILED\n", hashPtr->name);
+	    failed++;
+	    continue;
+	}
+
+	for (i = 0; i < hashPtr->keyLength; i++) {
+	    key[i] = (u_char) (0xa5 ^ i);
+	}
+
+	for (sizePtr = benchSizes; *sizePtr; sizePtr++) {
+
+	    /*
+	     * The contexts are set up for every message, as done
+	     * without the cache.
+	     */
+
+	    start = Now();
+	    for (j = 0; j < iterations; j++) {
+		HmacSetup(hashPtr, key, &hmac);
+		HmacDigest(hashPtr, &hmac, msg, *sizePtr, digest);
+		memcpy(mac, digest, BENCH_MACLENGTH);
+	    }
+	    setup = iterations * 1000000.0 / (Now() - start);
+
+	    /*
+	     * The contexts are set up once and copied for every message.
+	     */
+
+	    HmacSetup(hashPtr, key, &hmac);
+	    start = Now();
+	    for (j = 0; j < iterations; j++) {
+		HmacDigest(hashPtr, &hmac, msg, *sizePtr, digest);
+		memcpy(mac, digest, BENCH_MACLENGTH);
+	    }
+	    cached = iterations * 1000000.0 / (Now() - start);
+
+	    printf("%-12s %6d %14.0f %14.0f %7.2fx\n", hashPtr->name,
+		   *sizePtr, setup, cached, cached / setup);
+	}
+    }
+
+    return failed ? 1 : 0;
+}
@@ -162,7 +162,16 @@ TnmInitPath(Tcl_Interp *interp)
 {
     const char *path, *version;
 
-    path = FindPathRelativeToExe(interp, "tnm", TNM_VERSION);
+    /*
+     * The TNM_LIBRARY environment variable overrides the default
+     * location, which allows programs that embed Tnm outside of the
+     * installation tree (e.g. the snmpfuzz target) to find init.tcl.
+     */
+
+    path = getenv("TNM_LIBRARY");
+    if (! path) {
+	path = FindPathRelativeToExe(interp, "tnm", TNM_VERSION);
+    }
     Tcl_SetVar2(interp, "tnm", "library", path ? path : "", TCL_GLOBAL_ONLY);
 
     /*
@@ -223,11 +232,14 @@ TnmInitDns(Tcl_Interp *interp)
      */
 
     strcpy(domain, res->defdname);
-    p = domain + strlen(domain) - 1;
-    while ((*p == '.' || isspace(*p)) && p > domain) {
-	*p-- = '\0';
+    p = domain + strlen(domain);
+    while (p > domain && (p[-1] == '.' || isspace((unsigned char) p[-1]))) {
+	*--p = '\0';
     }
     Tcl_SetVar2(interp, "tnm", "domain", domain, TCL_GLOBAL_ONLY);
+
+    res_nclose(res);
+    free(res);
 }
 
 /*
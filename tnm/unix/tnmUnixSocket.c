@@ -54,6 +54,51 @@ TnmSocketRecvFrom(int s, unsigned char *buf, size_t len, int flags, struct socka
     return (n < 0) ? TNM_SOCKET_ERROR : n;
 }
 
+int
+TnmSocketConnect(int s, struct sockaddr *name, socklen_t namelen)
+{
+    int e = connect(s, name, namelen);
+    return (e < 0) ? TNM_SOCKET_ERROR : 0;
+}
+
+int
+TnmSocketSend(int s, unsigned char *buf, size_t len, int flags)
+{
+    int n = send(s, buf, len, flags);
+    return (n < 0) ? TNM_SOCKET_ERROR : n;
+}
+
+int
+TnmSocketRecv(int s, unsigned char *buf, size_t len, int flags)
+{
+    int n = recv(s, buf, len, flags);
+    return (n < 0) ? TNM_SOCKET_ERROR : n;
+}
+
+int
+TnmSocketSetNonBlocking(int s)
+{
+#ifdef O_NONBLOCK
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+	return TNM_SOCKET_ERROR;
+    }
+#endif
+    return 0;
+}
+
+int
+TnmSocketError(int s)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char *) &error, &len) < 0) {
+	return errno;
+    }
+    return error;
+}
+
 int TnmSocketClose(int s)
 {
     int e = close(s);
@@ -32,6 +32,14 @@
 			case WSAEFAULT: errno = EFAULT; break;
 			case WSAEINVAL: errno = EINVAL; break;
 			case WSAEMFILE: errno = EMFILE; break;
+			case WSAEINPROGRESS: errno = EINPROGRESS; break;
+			case WSAECONNREFUSED: errno = ECONNREFUSED; break;
+			case WSAECONNRESET: errno = ECONNRESET; break;
+			case WSAECONNABORTED: errno = ECONNABORTED; break;
+			case WSAENOTCONN: errno = ENOTCONN; break;
+			case WSAETIMEDOUT: errno = ETIMEDOUT; break;
+			case WSAENETUNREACH: errno = ENETUNREACH; break;
+			case WSAEHOSTUNREACH: errno = EHOSTUNREACH; break;
 			default: errno = EIO; break;
 		}
 	}
@@ -116,6 +124,75 @@ TnmSocketRecvFrom(int s, unsigned char *buf, size_t len, int flags, struct socka
     return (n == SOCKET_ERROR) ? TNM_SOCKET_ERROR : n;
 }
 
+int
+TnmSocketConnect(int s, struct sockaddr *name, socklen_t namelen)
+{
+    int e = connect(s, name, (int)namelen);
+
+    /*
+     * A non-blocking connect reports WSAEWOULDBLOCK while the
+     * connection is in progress. We map this to EINPROGRESS so
+     * that callers can check errno like on UNIX systems.
+     */
+
+    if (e == SOCKET_ERROR) {
+	if (WSAGetLastError() == WSAEWOULDBLOCK) {
+	    errno = EINPROGRESS;
+	} else {
+	    TclWinConvertWSAError(WSAGetLastError());
+	}
+    }
+    return (e == SOCKET_ERROR) ? TNM_SOCKET_ERROR : 0;
+}
+
+int
+TnmSocketSend(int s, unsigned char *buf, size_t len, int flags)
+{
+    int n = send(s, (char *)buf, (int)len, flags);
+    if (n == SOCKET_ERROR) {
+	TclWinConvertWSAError(WSAGetLastError());
+    }
+    return (n == SOCKET_ERROR) ? TNM_SOCKET_ERROR : n;
+}
+
+int
+TnmSocketRecv(int s, unsigned char *buf, size_t len, int flags)
+{
+    int n = recv(s, (char *)buf, (int)len, flags);
+    if (n == SOCKET_ERROR) {
+	TclWinConvertWSAError(WSAGetLastError());
+    }
+    return (n == SOCKET_ERROR) ? TNM_SOCKET_ERROR : n;
+}
+
+int
+TnmSocketSetNonBlocking(int s)
+{
+    u_long on = 1;
+    int e = ioctlsocket(s, FIONBIO, &on);
+    if (e == SOCKET_ERROR) {
+	TclWinConvertWSAError(WSAGetLastError());
+    }
+    return (e == SOCKET_ERROR) ? TNM_SOCKET_ERROR : 0;
+}
+
+int
+TnmSocketError(int s)
+{
+    int error = 0;
+    int len = sizeof(error);
+
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char *) &error, &len)
+	== SOCKET_ERROR) {
+	error = WSAGetLastError();
+    }
+    if (error) {
+	TclWinConvertWSAError((DWORD) error);
+	return errno;
+    }
+    return 0;
+}
+
 int TnmSocketClose(int s)
 {
     int e = closesocket(s);
@@ -130,6 +207,22 @@ TnmCreateSocketHandler(int sock, int mask, TnmSocketProc *proc, ClientData clien
 {
     SocketHandler *shPtr;
 
+    /*
+     * Calling this procedure again for the same socket changes the
+     * event mask, like Tcl_CreateFileHandler() does on UNIX systems.
+     */
+
+    for (shPtr = socketHandlerList; shPtr; shPtr = shPtr->nextPtr) {
+	if (shPtr->sd == sock) {
+	    Tcl_DeleteChannelHandler(shPtr->channel, shPtr->proc,
+				     shPtr->clientData);
+	    shPtr->proc = proc;
+	    shPtr->clientData = clientData;
+	    Tcl_CreateChannelHandler(shPtr->channel, mask, proc, clientData);
+	    return;
+	}
+    }
+
     shPtr = (SocketHandler *) ckalloc(sizeof(SocketHandler));
     shPtr->sd = sock;
     shPtr->channel = Tcl_MakeTcpClientChannel((ClientData) sock);